@@ -1,13 +1,7 @@
-#include "../../../include/jcpu_vm.h"
-
-jcpu::vm::jcpu_vm_if *jcpu_vm_ptr;
+#include "../../../src/jcpu_vm.h"
 
 extern "C"{
-void set_jcpu_vm_ptr(jcpu::vm::jcpu_vm_if *ptr){
-    jcpu_vm_ptr = ptr;
-}
-
-void jcpu_vm_dump_regs(){
-    jcpu_vm_ptr->dump_regs();
+void jcpu_vm_dump_regs(jcpu::vm::cpu_state_header *state){
+    state->vm->dump_regs();
 }
 }
@@ -1,25 +1,20 @@
 #include <stdint.h>
 #include "../../../include/jcpu.h"
-
-
-jcpu::jcpu_ext_if *mem_access_if;
+#include "../../../src/jcpu_cpu_state.h"
 
 
 extern "C" {
-void set_mem_access_if(jcpu::jcpu_ext_if *ifs){
-    mem_access_if = ifs;
-}
-uint64_t helper_mem_read(uint64_t addr, unsigned int length){
-    return mem_access_if->mem_read(addr, length);
+uint64_t helper_mem_read(jcpu::vm::cpu_state_header *state, uint64_t addr, unsigned int length){
+    return state->ext_ifs->mem_read(addr, length);
 }
-void helper_mem_write(uint64_t addr, unsigned int length, uint64_t val){
-    mem_access_if->mem_write(addr, length, val);
+void helper_mem_write(jcpu::vm::cpu_state_header *state, uint64_t addr, unsigned int length, uint64_t val){
+    state->ext_ifs->mem_write(addr, length, val);
 }
-uint64_t helper_mem_read_debug(uint64_t addr, unsigned int length){
-    return mem_access_if->mem_read_dbg(addr, length);
+uint64_t helper_mem_read_debug(jcpu::vm::cpu_state_header *state, uint64_t addr, unsigned int length){
+    return state->ext_ifs->mem_read_dbg(addr, length);
 }
-void helper_mem_write_debug(uint64_t addr, unsigned int length, uint64_t val){
-    mem_access_if->mem_write_dbg(addr, length, val);
+void helper_mem_write_debug(jcpu::vm::cpu_state_header *state, uint64_t addr, unsigned int length, uint64_t val){
+    state->ext_ifs->mem_write_dbg(addr, length, val);
 }
 
 }
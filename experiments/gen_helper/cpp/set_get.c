@@ -1,14 +1,22 @@
-unsigned int regs[3];
+struct cpu_state_header{
+    void *ext_ifs;
+    void *vm;
+    void *tracer;
+};
 
-unsigned int get_reg(unsigned short idx){
-    const unsigned int *const ptr = &regs[0] + idx;
+struct cpu_state{
+    struct cpu_state_header hdr;
+    unsigned int regs[3];
+};
+
+unsigned int get_reg(struct cpu_state *state, unsigned short idx){
+    const unsigned int *const ptr = &state->regs[0] + idx;
     const unsigned int val = *ptr;
     return val;
 }
 
-void set_reg(unsigned short idx, unsigned int val){
-    unsigned int *const ptr = &regs[0] + idx;
+void set_reg(struct cpu_state *state, unsigned short idx, unsigned int val){
+    unsigned int *const ptr = &state->regs[0] + idx;
     *ptr = val;
     return ;
 }
-
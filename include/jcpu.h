@@ -1,8 +1,10 @@
 #ifndef JCPU_H
 #define JCPU_H
 #include <stdint.h>
+#include <stddef.h>
 namespace jcpu{
 
+class sparse_memory;
 
 class jcpu_ext_if{
     public:
@@ -10,6 +12,15 @@ class jcpu_ext_if{
     virtual void mem_write(uint64_t, unsigned int, uint64_t) = 0;
     virtual uint64_t mem_read_dbg(uint64_t, unsigned int) = 0;
     virtual void mem_write_dbg(uint64_t, unsigned int, uint64_t) = 0;
+    //Used by gdbserver for large transfers. The default implementations access byte by byte.
+    virtual void mem_read_block_dbg(uint64_t, void *, size_t);
+    virtual void mem_write_block_dbg(uint64_t, const void *, size_t);
+    //Host address of the byte at the guest address if it is plain RAM, otherwise NULL (the default).
+    //Atomic instructions on such memory run as host atomics, so they stay atomic between parallel cores.
+    virtual uint8_t *get_dmi_ptr(uint64_t);
+    //Same as get_dmi_ptr() but only for reads, so it must not allocate RAM or save it for snapshots.
+    //It may return NULL for RAM never written. The default calls get_dmi_ptr().
+    virtual const uint8_t *get_dmi_read_ptr(uint64_t);
 };
 
 
@@ -17,6 +28,13 @@ class jcpu{
     protected:
     jcpu();
     jcpu_ext_if *ext_ifs;
+    sparse_memory *ram;
+    unsigned int num_cores;
+    uint64_t sync_quantum;
+    unsigned int num_translators;
+    uint64_t timer_frequency;
+    uint64_t htif_tohost, htif_fromhost; //0 if there is no HTIF
+    uint64_t reset_pc; //~0 for the default of the target
     public:
     enum run_option_e{
         RUN_OPTION_NORMAL, RUN_OPTION_WATI_GDB
@@ -24,9 +42,40 @@ class jcpu{
     virtual ~jcpu(){}
     virtual void interrupt(int, bool) = 0;
     virtual void reset(bool) = 0;
-    virtual void run(run_option_e) = 0;
+    //Returns the exit code when the guest exits through a simulator hook, such as l.nop 1 of OpenRISC.
+    virtual int run(run_option_e) = 0;
+    //Loads the statically linked Linux program argv[0] and runs it in user mode until it exits, then returns its exit code.
+    //System calls are done by the host, and the guest memory is accessed through jcpu_ext_if. Only RISC-V supports it.
+    virtual int run_user(int argc, const char *const *argv, const char *const *envp);
     void set_ext_interface(jcpu_ext_if *);
+    void set_ram(sparse_memory *); //guest RAM captured by snapshot()
+    //Must be called before run(). Each core runs on its own host thread,
+    //and the cores wait for each other every sync_quantum instructions.
+    //Memory shared by the cores must be sparse_memory::set_thread_safe().
+    void set_num_cores(unsigned int);
+    void set_sync_quantum(uint64_t);
+    //Must be called before run(). Threads which translate the blocks statically reachable
+    //from the translated ones ahead of execution. Memory must be thread safe as above.
+    void set_num_translators(unsigned int);
+    //Must be called before run(). Frequency of the RISC-V mtime in Hz, derived from the host time.
+    //0 (the default) advances mtime by one per instruction, which is deterministic. With several harts,
+    //mtime is shared by them and advances by the sync quantum when all of them reach its end.
+    void set_timer_frequency(uint64_t);
+    //Must be called before run(). Addresses of tohost and fromhost of the HTIF which riscv-tests and their benchmarks use.
+    //Stores to tohost are handled by the host without jcpu_ext_if: (code << 1) | 1 exits and run() returns the code,
+    //and other values point to a system call of the proxy kernel. Only RISC-V supports it.
+    void set_htif(uint64_t tohost, uint64_t fromhost);
+    //Must be called before run(). The pc the cores start from, such as the entry of the ELF. Only RISC-V supports it.
+    void set_reset_pc(uint64_t);
     virtual uint64_t get_total_insn_count()const = 0;
+    //Capture/restore registers, interrupt state, instruction count and RAM.
+    //If called from jcpu_ext_if while running, they take effect at the end of the current block.
+    virtual void snapshot() = 0;
+    virtual void restore() = 0;
+    //Write every guest load and store to a file. See tools/mem_trace for the format.
+    //Blocks translated before start_mem_trace() are discarded, so tracing costs nothing while it is off.
+    virtual void start_mem_trace(const char *file_name) = 0;
+    virtual void stop_mem_trace() = 0; //can be called from jcpu_ext_if while running
     static jcpu * create(const char *, const char *);
     static void initialize();
     
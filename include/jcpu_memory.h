@@ -0,0 +1,74 @@
+#ifndef JCPU_MEMORY_H
+#define JCPU_MEMORY_H
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+namespace jcpu{
+
+//Guest physical memory for the whole 64bit address space.
+//Host pages are allocated on first write and found through a multi-level table,
+//so memory usage is proportional to the pages actually touched.
+//Values are stored in little endian.
+//snapshot() makes the memory copy-on-write: the first write to a page after snapshot() or restore()
+//saves the page, and restore() copies back only the pages written since then.
+//After set_thread_safe(), read()/write() can be called from several threads at once.
+//Pages given to mark_code() hold translated code. The first write to such a page through get_page(), which every write
+//and every DMI pointer for writes goes through, unmarks it and calls the code write hook with the page address.
+class sparse_memory{
+    public:
+    static const unsigned int page_bits = 12;
+    static const uint64_t page_size = static_cast<uint64_t>(1) << page_bits;
+    typedef void (*code_write_hook_t)(void *arg, uint64_t page_addr);
+    private:
+    static const unsigned int level_bits = 13;
+    static const unsigned int num_levels = (64 - page_bits) / level_bits;
+    static const size_t num_entries = static_cast<size_t>(1) << level_bits;
+    struct page_entry{
+        uint8_t data[page_size];
+        uint8_t *backup;
+        unsigned int backup_gen;
+        uint64_t dirty_epoch;
+        uint8_t code; //set by mark_code(), cleared by the first write after it
+    };
+    void **root;
+    uint64_t last_read_page_num, last_write_page_num;
+    page_entry *last_read_page, *last_write_page;
+    size_t num_pages;
+    bool thread_safe;
+    unsigned int snapshot_gen;
+    uint64_t epoch;
+    std::vector<uint64_t> dirty_pages;
+    code_write_hook_t code_write_hook;
+    void *code_write_arg;
+    page_entry *walk(uint64_t page_num, bool alloc);
+    void check_code(page_entry *page, uint64_t page_num){
+        if(__atomic_load_n(&page->code, __ATOMIC_RELAXED) && __atomic_exchange_n(&page->code, 0, __ATOMIC_ACQ_REL) && code_write_hook){
+            (*code_write_hook)(code_write_arg, page_num << page_bits);
+        }
+    }
+    void free_table(void **, unsigned int);
+    sparse_memory(const sparse_memory &);
+    sparse_memory & operator = (const sparse_memory &);
+    public:
+    sparse_memory();
+    ~sparse_memory();
+    uint8_t *get_page(uint64_t addr); //allocates the page if it is not touched yet
+    const uint8_t *find_page(uint64_t addr); //returns NULL if the page is not touched yet
+    uint64_t read(uint64_t addr, unsigned int len);
+    void write(uint64_t addr, unsigned int len, uint64_t val);
+    void read_block(uint64_t addr, void *dst, size_t len);
+    void write_block(uint64_t addr, const void *src, size_t len);
+    void fill(uint64_t addr, uint8_t val, size_t len);
+    size_t get_num_pages()const{return num_pages;}
+    void set_thread_safe(); //disables the last page caches and allocates pages atomically
+    void set_code_write_hook(code_write_hook_t hook, void *arg){code_write_hook = hook; code_write_arg = arg;}
+    void mark_code(uint64_t addr, size_t len); //allocates the pages, as code read from an untouched page is zero
+    void clear();
+    void snapshot();
+    void restore(std::vector<uint64_t> &restored_pages); //returns start addresses of restored pages
+};
+
+
+}
+
+#endif
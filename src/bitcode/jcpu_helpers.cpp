@@ -0,0 +1,62 @@
+//Compiled to LLVM bitcode, not to an object, and linked into the module of each VM by link_helpers().
+//Calls to these functions are inlined into translated blocks, so keep them small and free of static data.
+#include <stdint.h>
+#include "jcpu.h"
+#include "jcpu_cpu_state.h"
+
+namespace {
+
+//Only the layout of cpu_state<> is used here. Any index in 16 bits is within the array.
+template<typename T>
+struct any_arch{
+    typedef T target_ulong;
+    enum{NUM_REGS = 0x10000};
+};
+
+template<typename T>
+T get_reg(void *state, uint16_t idx){
+    return static_cast<jcpu::vm::cpu_state<any_arch<T> > *>(state)->regs[idx];
+}
+
+template<typename T>
+void set_reg(void *state, uint16_t idx, T val){
+    static_cast<jcpu::vm::cpu_state<any_arch<T> > *>(state)->regs[idx] = val;
+}
+
+jcpu::vm::cpu_state_header *header(void *state){
+    return static_cast<jcpu::vm::cpu_state_header *>(state);
+}
+
+} //end of unnamed namespace
+
+extern "C" {
+uint32_t get_reg32(void *state, uint16_t idx){
+    return get_reg<uint32_t>(state, idx);
+}
+void set_reg32(void *state, uint16_t idx, uint32_t val){
+    set_reg<uint32_t>(state, idx, val);
+}
+uint64_t get_reg64(void *state, uint16_t idx){
+    return get_reg<uint64_t>(state, idx);
+}
+void set_reg64(void *state, uint16_t idx, uint64_t val){
+    set_reg<uint64_t>(state, idx, val);
+}
+
+uint64_t helper_mem_read(void *state, uint64_t addr, unsigned int length){
+    return header(state)->ext_ifs->mem_read(addr, length);
+}
+void helper_mem_write(void *state, uint64_t addr, unsigned int length, uint64_t val){
+    header(state)->ext_ifs->mem_write(addr, length, val);
+}
+uint64_t helper_mem_read_debug(void *state, uint64_t addr, unsigned int length){
+    return header(state)->ext_ifs->mem_read_dbg(addr, length);
+}
+void helper_mem_write_debug(void *state, uint64_t addr, unsigned int length, uint64_t val){
+    header(state)->ext_ifs->mem_write_dbg(addr, length, val);
+}
+
+void jcpu_vm_dump_regs(void *state){
+    header(state)->vm->dump_regs();
+}
+}
@@ -57,6 +57,7 @@ class gdb_rcv_msg{
     const unsigned char & operator [] (unsigned int idx)const;
     bool start_with(const char *str, unsigned int offset = 0)const;
     std::vector<std::string> split()const;
+    unsigned int parse_mem_header(uint64_t &addr, unsigned int &len)const;
 };
 
 gdb_rcv_msg::gdb_rcv_msg(std::istream &is){
@@ -149,6 +150,28 @@ std::vector<std::string> gdb_rcv_msg::split()const{
     return ret;
 }
 
+//parses "<cmd><addr>,<len>[:...]" and returns the offset of the data following ':'
+unsigned int gdb_rcv_msg::parse_mem_header(uint64_t &addr, unsigned int &len)const{
+    std::string header;
+    unsigned int i = 1;
+    for(; i < msg.size() && msg[i] != ':'; ++i){
+        header += msg[i];
+    }
+    const std::string::size_type comma = header.find(',');
+    jcpu_assert(comma != std::string::npos);
+    addr = std::strtoull(header.c_str(), JCPU_NULLPTR, 16);
+    len = std::strtoul(header.c_str() + comma + 1, JCPU_NULLPTR, 16);
+    return i + 1;
+}
+
+int hex_to_int(unsigned char c){
+    if('0' <= c && c <= '9') return c - '0';
+    if('A' <= c && c <= 'F') return c - 'A' + 10;
+    if('a' <= c && c <= 'f') return c - 'a' + 10;
+    jcpu_assert(!"Not a hex digit");
+    return 0;
+}
+
 #ifdef JCPU_GDBSERVER_DEBUG
 std::ostream & operator << (std::ostream &os, const gdb_rcv_msg &msg){
     for(unsigned int i = 0, len = msg.get_msg_size(); i < len; ++i){
@@ -192,7 +215,7 @@ void gdb_server::impl::wait_and_run(gdb_target_if &tgt, unsigned int port_num){
 #endif
             gdb_send_msg smsg;
             if(msg.start_with("qSupported")){
-                smsg << "PacketSize=ff";
+                smsg << "PacketSize=4000";
             }
             else if(msg.start_with("qC")){
                 smsg << "QC1";
@@ -240,16 +263,38 @@ void gdb_server::impl::wait_and_run(gdb_target_if &tgt, unsigned int port_num){
 #endif
             }
             else if(msg.start_with("m")){ //mem read
-                const std::vector<std::string> toks = msg.split();
-                jcpu_assert(toks.size() >= 2);
-                const uint64_t addr = std::strtoll(toks[0].c_str() + 1, JCPU_NULLPTR, 16);
-                const unsigned int len = std::strtol(toks[1].c_str(), JCPU_NULLPTR, 16);
-                std::stringstream ss;
+                uint64_t addr;
+                unsigned int len;
+                msg.parse_mem_header(addr, len);
+                std::vector<unsigned char> data(len);
+                if(len > 0) tgt.read_mem_block_dbg(addr, &data[0], len);
+                static const char hex_digits[] = "0123456789abcdef";
+                std::string str(len * 2, '0');
                 for(unsigned int i = 0; i < len; ++i){
-                    const unsigned int v = tgt.read_mem_dbg(addr + i, 1);
-                    ss << std::hex << std::setw(2) << std::setfill('0') << v;
+                    str[i * 2] = hex_digits[data[i] >> 4];
+                    str[i * 2 + 1] = hex_digits[data[i] & 0x0F];
                 }
-                smsg << ss.str().c_str();
+                smsg << str.c_str();
+            }
+            else if(msg.start_with("M")){ //mem write in hex
+                uint64_t addr;
+                unsigned int len;
+                const unsigned int offset = msg.parse_mem_header(addr, len);
+                jcpu_assert(offset + len * 2 <= msg.get_msg_size());
+                std::vector<unsigned char> data(len);
+                for(unsigned int i = 0; i < len; ++i){
+                    data[i] = (hex_to_int(msg[offset + i * 2]) << 4) | hex_to_int(msg[offset + i * 2 + 1]);
+                }
+                if(len > 0) tgt.write_mem_block_dbg(addr, &data[0], len);
+                smsg << "OK";
+            }
+            else if(msg.start_with("X")){ //mem write in binary, escaped characters are already decoded
+                uint64_t addr;
+                unsigned int len;
+                const unsigned int offset = msg.parse_mem_header(addr, len);
+                jcpu_assert(offset + len <= msg.get_msg_size());
+                if(len > 0) tgt.write_mem_block_dbg(addr, &msg[offset], len);
+                smsg << "OK";
             }
             else if(msg.start_with("Z") || msg.start_with("z")){//set or unset breakpoints
                 const std::vector<std::string> toks = msg.split();
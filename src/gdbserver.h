@@ -1,6 +1,7 @@
 #ifndef JCPU_GDBSERVER_H
 #define JCPU_GDBSERVER_H
 #include <stdint.h>
+#include <stddef.h>
 #include <vector>
 namespace jcpu{
 namespace gdb{
@@ -14,6 +15,8 @@ class gdb_target_if{
     virtual run_state_e run_continue(bool) = 0;
     virtual uint64_t read_mem_dbg(uint64_t, unsigned int) = 0;
     virtual void write_mem_dbg(uint64_t, unsigned int, uint64_t) = 0;
+    virtual void read_mem_block_dbg(uint64_t, void *, size_t) = 0;
+    virtual void write_mem_block_dbg(uint64_t, const void *, size_t) = 0;
     virtual void set_unset_break_point(bool, uint64_t) = 0;
     virtual ~gdb_target_if(){}
 };
@@ -6,14 +6,73 @@
 
 namespace jcpu{
 
+void jcpu_ext_if::mem_read_block_dbg(uint64_t addr, void *dst, size_t len){
+    uint8_t *const p = static_cast<uint8_t *>(dst);
+    for(size_t i = 0; i < len; ++i){
+        p[i] = mem_read_dbg(addr + i, 1);
+    }
+}
 
-jcpu::jcpu() : ext_ifs(JCPU_NULLPTR){}
+void jcpu_ext_if::mem_write_block_dbg(uint64_t addr, const void *src, size_t len){
+    const uint8_t *const p = static_cast<const uint8_t *>(src);
+    for(size_t i = 0; i < len; ++i){
+        mem_write_dbg(addr + i, 1, p[i]);
+    }
+}
+
+uint8_t *jcpu_ext_if::get_dmi_ptr(uint64_t){
+    return JCPU_NULLPTR;
+}
+
+const uint8_t *jcpu_ext_if::get_dmi_read_ptr(uint64_t addr){
+    return get_dmi_ptr(addr);
+}
+
+jcpu::jcpu() : ext_ifs(JCPU_NULLPTR), ram(JCPU_NULLPTR), num_cores(1), sync_quantum(10000), num_translators(0), timer_frequency(0),
+    htif_tohost(0), htif_fromhost(0), reset_pc(~static_cast<uint64_t>(0)){}
 
 void jcpu::set_ext_interface(jcpu_ext_if *ifs){
     assert(!ext_ifs);
     ext_ifs = ifs;
 }
 
+void jcpu::set_ram(sparse_memory *mem){
+    assert(!ram);
+    ram = mem;
+}
+
+void jcpu::set_num_cores(unsigned int n){
+    assert(n > 0);
+    num_cores = n;
+}
+
+void jcpu::set_sync_quantum(uint64_t n){
+    assert(n > 0);
+    sync_quantum = n;
+}
+
+void jcpu::set_num_translators(unsigned int n){
+    num_translators = n;
+}
+
+void jcpu::set_timer_frequency(uint64_t hz){
+    timer_frequency = hz;
+}
+
+void jcpu::set_htif(uint64_t tohost, uint64_t fromhost){
+    htif_tohost = tohost;
+    htif_fromhost = fromhost;
+}
+
+void jcpu::set_reset_pc(uint64_t pc){
+    reset_pc = pc;
+}
+
+
+int jcpu::run_user(int, const char *const *, const char *const *){
+    jcpu_assert(!"User mode is not supported");
+    return -1;
+}
 
 jcpu * jcpu::create(const char*arch_, const char *model){
     const std::string arch(arch_);
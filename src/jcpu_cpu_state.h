@@ -0,0 +1,36 @@
+#ifndef JCPU_CPU_STATE_H
+#define JCPU_CPU_STATE_H
+#include <stdint.h>
+
+namespace jcpu{
+class jcpu_ext_if;
+namespace vm{
+class mem_tracer;
+
+class jcpu_vm_if{
+    public:
+    virtual uint64_t get_cur_disas_virt_pc()const = 0;
+    virtual void dump_regs()const = 0;
+    virtual ~jcpu_vm_if(){}
+};
+
+//Fields used by the helper functions in src/bitcode, which are compiled with this header.
+struct cpu_state_header{
+    jcpu_ext_if *ext_ifs;
+    jcpu_vm_if *vm;
+    mem_tracer *tracer;
+    uint64_t pending_irqs; //set by any host thread with __atomic builtins, the meaning of bits is up to the target
+};
+
+//Everything a translated block reads and writes.
+//Blocks receive a pointer to this as their argument, so they do not depend on the instance which translated them.
+template<typename ARCH>
+struct cpu_state{
+    cpu_state_header hdr;
+    typename ARCH::target_ulong regs[ARCH::NUM_REGS];
+};
+
+} //end of namespace vm
+} //end of namespace jcpu
+
+#endif
@@ -0,0 +1,48 @@
+#include "jcpu_decoder.h"
+#include "jcpu_memory.h"
+
+namespace jcpu{
+namespace vm{
+
+decoded_cache::decoded_cache(unsigned int slot_bits) : slot_bits(slot_bits), last_page_num(~static_cast<uint64_t>(0)), last_page(JCPU_NULLPTR){
+    jcpu_assert(slot_bits < sparse_memory::page_bits);
+}
+
+decoded_cache::~decoded_cache(){
+    clear();
+}
+
+decoded_insn &decoded_cache::get(uint64_t addr){
+    const uint64_t page_num = addr >> sparse_memory::page_bits;
+    if(page_num != last_page_num){
+        decoded_insn *&page = pages[page_num];
+        if(!page) page = new decoded_insn[sparse_memory::page_size >> slot_bits];
+        last_page_num = page_num;
+        last_page = page;
+    }
+    return last_page[(addr & (sparse_memory::page_size - 1)) >> slot_bits];
+}
+
+void decoded_cache::invalidate(uint64_t from, uint64_t to){
+    if(from >= to) return;
+    const uint64_t first = from >> sparse_memory::page_bits, last = (to - 1) >> sparse_memory::page_bits;
+    std::map<uint64_t, decoded_insn *>::iterator it = pages.lower_bound(first);
+    while(it != pages.end() && it->first <= last){
+        delete [] it->second;
+        pages.erase(it++);
+    }
+    last_page_num = ~static_cast<uint64_t>(0);
+    last_page = JCPU_NULLPTR;
+}
+
+void decoded_cache::clear(){
+    for(std::map<uint64_t, decoded_insn *>::const_iterator it = pages.begin(), it_end = pages.end(); it != it_end; ++it){
+        delete [] it->second;
+    }
+    pages.clear();
+    last_page_num = ~static_cast<uint64_t>(0);
+    last_page = JCPU_NULLPTR;
+}
+
+} //end of namespace vm
+} //end of namespace jcpu
@@ -0,0 +1,93 @@
+#ifndef JCPU_DECODER_H
+#define JCPU_DECODER_H
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <map>
+#include "jcpu_internal.h"
+
+namespace jcpu{
+namespace vm{
+
+//Decoded form of an instruction, kept by decoded_cache so that retranslation does not fetch and decode again.
+struct decoded_insn{
+    static const uint16_t not_decoded = 0xFFFF;
+    static const uint16_t illegal = 0xFFFE; //not in the instruction table
+    enum flow_e{
+        FLOW_NONE, //continues to the next instruction
+        FLOW_BRANCH, //to pc + imm or to the next instruction
+        FLOW_JUMP, //to pc + imm
+        FLOW_INDIRECT, //to a register
+        FLOW_SYSTEM //may trap, change the privilege or drop the translated code, so nothing after it is translated ahead
+    };
+    uint32_t raw; //compressed instructions are expanded
+    uint16_t id; //index in the instruction table
+    uint8_t len; //in bytes
+    uint8_t flow; //flow_e
+    uint8_t rd, rs1, rs2, rs3; //register fields, filled by the operand extractor of the entry
+    int64_t imm; //sign extended unless the format says otherwise, the offset for branches and jumps
+    decoded_insn() : raw(0), id(not_decoded), len(0), flow(FLOW_NONE), rd(0), rs1(0), rs2(0), rs3(0), imm(0){}
+    bool is_decoded()const{return id != not_decoded;}
+};
+
+//An entry of the instruction tables, which the targets make from their .def files.
+//An instruction is this one if (insn & mask) == match. operands extracts the fields of its format into a decoded_insn.
+template<typename HANDLER>
+struct insn_desc{
+    const char *name;
+    uint32_t mask, match;
+    HANDLER handler;
+    void (*operands)(uint32_t insn, decoded_insn &d);
+    decoded_insn::flow_e flow;
+};
+
+//Finds the entry of an instruction. Entries are bucketed by the key field, which is usually the major opcode,
+//and searched in the order of the table within a bucket, so an entry must come before the ones it overlaps.
+template<typename HANDLER>
+class insn_decoder{
+    typedef insn_desc<HANDLER> desc_type;
+    const unsigned int key_bit;
+    const uint32_t key_mask;
+    std::vector<std::vector<const desc_type *> > buckets;
+    public:
+    template<size_t N>
+    insn_decoder(const desc_type (&table)[N], unsigned int key_bit, unsigned int key_width) :
+        key_bit(key_bit), key_mask((static_cast<uint32_t>(1) << key_width) - 1), buckets(key_mask + 1)
+    {
+        for(uint32_t key = 0; key <= key_mask; ++key){
+            for(size_t i = 0; i < N; ++i){
+                const uint32_t field_mask = table[i].mask & (key_mask << key_bit);
+                if(((key << key_bit) & field_mask) == (table[i].match & field_mask)) buckets[key].push_back(&table[i]);
+            }
+        }
+    }
+    //NULL if the instruction is not in the table
+    const desc_type *decode(uint32_t insn)const{
+        const std::vector<const desc_type *> &bucket = buckets[(insn >> key_bit) & key_mask];
+        for(size_t i = 0; i < bucket.size(); ++i){
+            if((insn & bucket[i]->mask) == bucket[i]->match) return bucket[i];
+        }
+        return JCPU_NULLPTR;
+    }
+};
+
+//Decoded instructions by the guest physical page. A VM owns one and drops pages when bb_manager::invalidate() reports that their code changed.
+class decoded_cache{
+    const unsigned int slot_bits; //log2 of the instruction alignment
+    std::map<uint64_t, decoded_insn *> pages;
+    uint64_t last_page_num;
+    decoded_insn *last_page;
+    decoded_cache(const decoded_cache &);
+    decoded_cache & operator = (const decoded_cache &);
+    public:
+    explicit decoded_cache(unsigned int slot_bits);
+    ~decoded_cache();
+    decoded_insn &get(uint64_t addr); //not decoded yet if the page was not seen
+    void invalidate(uint64_t from, uint64_t to); //drops the pages which overlap [from, to)
+    void clear();
+};
+
+} //end of namespace vm
+} //end of namespace jcpu
+
+#endif
@@ -0,0 +1,49 @@
+#include "jcpu_epoch.h"
+#include "jcpu_internal.h"
+
+namespace jcpu{
+namespace vm{
+
+epoch_reclaimer::epoch_reclaimer() : global_epoch(0), num_readers(0){
+    for(unsigned int i = 0; i < max_readers; ++i){
+        announced[i] = ~static_cast<uint64_t>(0);
+    }
+}
+
+epoch_reclaimer::~epoch_reclaimer(){
+    for(std::vector<retired_obj>::const_iterator it = retired.begin(), it_end = retired.end(); it != it_end; ++it){
+        (*it->deleter)(it->obj);
+    }
+}
+
+unsigned int epoch_reclaimer::add_reader(){
+    jcpu_assert(num_readers < max_readers);
+    return num_readers++;
+}
+
+void epoch_reclaimer::retire(deleter_t deleter, void *obj){
+    retired_obj r;
+    r.epoch = __atomic_fetch_add(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    r.deleter = deleter;
+    r.obj = obj;
+    retired.push_back(r);
+}
+
+void epoch_reclaimer::reclaim(){
+    if(retired.empty()) return;
+    uint64_t oldest = ~static_cast<uint64_t>(0);
+    for(unsigned int i = 0; i < num_readers; ++i){
+        const uint64_t e = __atomic_load_n(&announced[i], __ATOMIC_SEQ_CST);
+        if(e < oldest) oldest = e;
+    }
+    //an object retired at epoch e is unreachable for readers which announced e + 1 or later
+    std::vector<retired_obj>::iterator keep = retired.begin();
+    for(std::vector<retired_obj>::iterator it = retired.begin(), it_end = retired.end(); it != it_end; ++it){
+        if(it->epoch < oldest) (*it->deleter)(it->obj);
+        else *keep++ = *it;
+    }
+    retired.erase(keep, retired.end());
+}
+
+} //end of namespace vm
+} //end of namespace jcpu
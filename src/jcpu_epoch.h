@@ -0,0 +1,46 @@
+#ifndef JCPU_EPOCH_H
+#define JCPU_EPOCH_H
+#include <stdint.h>
+#include <vector>
+
+namespace jcpu{
+namespace vm{
+
+//Quiescent state based reclamation.
+//Readers call quiescent() at points where they hold no pointer to shared objects,
+//and an object retired by the writer is deleted after every reader has passed such a point.
+//retire() and reclaim() must be serialised by the caller.
+class epoch_reclaimer{
+    public:
+    static const unsigned int max_readers = 64;
+    typedef void (*deleter_t)(void *);
+    private:
+    struct retired_obj{
+        uint64_t epoch;
+        deleter_t deleter;
+        void *obj;
+    };
+    uint64_t global_epoch;
+    uint64_t announced[max_readers]; //~0 while the reader is offline
+    unsigned int num_readers;
+    std::vector<retired_obj> retired;
+    epoch_reclaimer(const epoch_reclaimer &);
+    epoch_reclaimer & operator = (const epoch_reclaimer &);
+    public:
+    epoch_reclaimer();
+    ~epoch_reclaimer(); //deletes all retired objects
+    unsigned int add_reader();
+    void quiescent(unsigned int id){
+        __atomic_store_n(&announced[id], __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    }
+    void offline(unsigned int id){//the reader holds nothing until the next quiescent()
+        __atomic_store_n(&announced[id], ~static_cast<uint64_t>(0), __ATOMIC_SEQ_CST);
+    }
+    void retire(deleter_t, void *); //the object must be unreachable for new readers already
+    void reclaim();
+};
+
+} //end of namespace vm
+} //end of namespace jcpu
+
+#endif
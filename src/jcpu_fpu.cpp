@@ -0,0 +1,278 @@
+#include <fenv.h>
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "jcpu_fpu.h"
+#include "jcpu_internal.h"
+
+namespace jcpu{
+namespace vm{
+
+namespace {
+
+template<typename F> struct fp_traits;
+
+//wide_t has at least two more bits of precision, for RMM
+template<> struct fp_traits<float>{
+    typedef uint32_t bits_t;
+    typedef double other_t;
+    typedef double wide_t;
+    static const uint32_t sign_mask = 0x80000000U;
+    static const uint32_t inf = 0x7F800000U;
+    static const uint32_t quiet_bit = 0x00400000U;
+    static const uint32_t canonical_nan = 0x7FC00000U;
+    static const int digits = FLT_MANT_DIG;
+    static float min_normal(){return FLT_MIN;}
+    static float sqrt(float v){return ::sqrtf(v);}
+    static float fma(float a, float b, float c){return ::fmaf(a, b, c);}
+    static float next(float v, float to){return ::nextafterf(v, to);}
+    static wide_t wide_sqrt(wide_t v){return ::sqrt(v);}
+    static wide_t wide_fma(wide_t a, wide_t b, wide_t c){return ::fma(a, b, c);}
+};
+
+template<> struct fp_traits<double>{
+    typedef uint64_t bits_t;
+    typedef float other_t;
+    typedef long double wide_t;
+    static const uint64_t sign_mask = 0x8000000000000000ULL;
+    static const uint64_t inf = 0x7FF0000000000000ULL;
+    static const uint64_t quiet_bit = 0x0008000000000000ULL;
+    static const uint64_t canonical_nan = 0x7FF8000000000000ULL;
+    static const int digits = DBL_MANT_DIG;
+    static double min_normal(){return DBL_MIN;}
+    static double sqrt(double v){return ::sqrt(v);}
+    static double fma(double a, double b, double c){return ::fma(a, b, c);}
+    static double next(double v, double to){return ::nextafter(v, to);}
+    static wide_t wide_sqrt(wide_t v){return ::sqrtl(v);}
+    static wide_t wide_fma(wide_t a, wide_t b, wide_t c){return ::fmal(a, b, c);}
+};
+
+template<typename F>
+F from_bits(uint64_t v){
+    const typename fp_traits<F>::bits_t b = static_cast<typename fp_traits<F>::bits_t>(v);
+    F f;
+    memcpy(&f, &b, sizeof(f));
+    return f;
+}
+
+template<typename F>
+typename fp_traits<F>::bits_t to_bits(F f){
+    typename fp_traits<F>::bits_t b;
+    memcpy(&b, &f, sizeof(b));
+    return b;
+}
+
+//Classified by bits because comparing a signaling NaN raises the invalid flag on the host
+template<typename F>
+bool is_nan(F f){
+    return (to_bits(f) & ~fp_traits<F>::sign_mask) > fp_traits<F>::inf;
+}
+
+template<typename F>
+bool is_snan(F f){
+    return is_nan(f) && !(to_bits(f) & fp_traits<F>::quiet_bit);
+}
+
+int host_round(uint32_t rm){
+    switch(rm){
+        case FP_RM_RTZ: return FE_TOWARDZERO;
+        case FP_RM_RDN: return FE_DOWNWARD;
+        case FP_RM_RUP: return FE_UPWARD;
+        default: return FE_TONEAREST; //the host has no RMM, which is made by rmm_op()
+    }
+}
+
+uint32_t host_flags(){
+    const int e = fetestexcept(FE_ALL_EXCEPT);
+    return ((e & FE_INEXACT) ? FP_FLAG_NX : 0) | ((e & FE_UNDERFLOW) ? FP_FLAG_UF : 0) | ((e & FE_OVERFLOW) ? FP_FLAG_OF : 0) |
+        ((e & FE_DIVBYZERO) ? FP_FLAG_DZ : 0) | ((e & FE_INVALID) ? FP_FLAG_NV : 0);
+}
+
+template<typename F>
+uint64_t rounded_result(F r, uint32_t &raised){
+    raised |= host_flags();
+    return is_nan(r) ? fp_traits<F>::canonical_nan : to_bits(r);
+}
+
+//Rounds w to F with ties away from zero. w must be rounded to odd, then it is a tie only if the exact value is.
+//Underflow is detected after rounding as RISC-V does.
+template<typename F, typename W>
+F round_away(W w, bool inexact, uint32_t &raised){
+    typedef fp_traits<F> traits;
+    const int saved = fegetround();
+    fesetround(FE_TOWARDZERO);
+    const volatile F t = static_cast<F>(w);
+    fesetround(saved);
+    F r = t;
+    if(static_cast<W>(t) != w){
+        inexact = true;
+        const F away = traits::next(t, w < 0 ? -static_cast<F>(INFINITY) : static_cast<F>(INFINITY));
+        //the values are exact in W
+        const W step = isinf(away) ? static_cast<W>(t) - static_cast<W>(traits::next(t, 0)) : static_cast<W>(away) - static_cast<W>(t);
+        const W mid = static_cast<W>(t) + step / 2;
+        if(fabsl(w) >= fabsl(mid)) r = away;
+    }
+    if(!inexact) return r;
+    raised |= FP_FLAG_NX;
+    if(isinf(r) && !isinf(w)) raised |= FP_FLAG_OF;
+    const W tiny_limit = static_cast<W>(traits::min_normal()) * (1 - ldexpl(1, -(traits::digits + 1))); //rounded to min_normal with an unbounded exponent
+    if(fabs(r) < traits::min_normal() || fabsl(w) < tiny_limit) raised |= FP_FLAG_UF;
+    return r;
+}
+
+//The operation is done in the wider type toward zero, then the last bit is set if it is inexact, which is called rounding to odd.
+template<typename F>
+uint64_t rmm_op(uint32_t op, F a, F b, F c, uint64_t a_bits, uint32_t &raised){
+    typedef fp_traits<F> traits;
+    typedef typename traits::wide_t W;
+    fesetround(FE_TOWARDZERO);
+    feclearexcept(FE_ALL_EXCEPT);
+    volatile W w = 0;
+    switch(op){
+        case FP_ADD: w = static_cast<W>(a) + static_cast<W>(b); break;
+        case FP_SUB: w = static_cast<W>(a) - static_cast<W>(b); break;
+        case FP_MUL: w = static_cast<W>(a) * static_cast<W>(b); break;
+        case FP_DIV: w = static_cast<W>(a) / static_cast<W>(b); break;
+        case FP_SQRT: w = traits::wide_sqrt(a); break;
+        case FP_MADD: w = traits::wide_fma(a, b, c); break;
+        case FP_MSUB: w = traits::wide_fma(a, b, -c); break;
+        case FP_NMSUB: w = traits::wide_fma(-a, b, c); break;
+        case FP_NMADD: w = traits::wide_fma(-a, b, -c); break;
+        case FP_FROM_I32: w = static_cast<W>(static_cast<int32_t>(a_bits)); break;
+        case FP_FROM_U32: w = static_cast<W>(static_cast<uint32_t>(a_bits)); break;
+        case FP_FROM_I64: w = static_cast<W>(static_cast<int64_t>(a_bits)); break;
+        case FP_FROM_U64: w = static_cast<W>(a_bits); break;
+        default: jcpu_assert(!"Not rounded by rmm_op()");
+    }
+    const uint32_t wide_flags = host_flags();
+    raised |= wide_flags & (FP_FLAG_NV | FP_FLAG_DZ);
+    W v = w;
+    if(isnan(v)) return traits::canonical_nan;
+    const bool inexact = (wide_flags & FP_FLAG_NX) != 0;
+    if(inexact){
+        uint64_t low; //the lowest bits of the significand on little endian hosts
+        memcpy(&low, &v, sizeof(low));
+        low |= 1;
+        memcpy(&v, &low, sizeof(low));
+    }
+    return to_bits(round_away<F, W>(v, inexact, raised));
+}
+
+//flags of the conversion are made here, because out of range conversion is undefined in C++
+template<typename F>
+uint64_t to_int(F x, unsigned int width, bool is_signed, uint32_t rm, uint32_t &raised){
+    const double d = x; //exact for float
+    const double r = rm == FP_RM_RMM ? ::round(d) : ::nearbyint(d);
+    const double lo = is_signed ? -::ldexp(1.0, width - 1) : 0.0;
+    const double hi = ::ldexp(1.0, is_signed ? width - 1 : width);
+    uint64_t v;
+    if(is_nan(x) || r >= hi){
+        raised |= FP_FLAG_NV;
+        v = is_signed ? (~static_cast<uint64_t>(0) >> (65 - width)) : (~static_cast<uint64_t>(0) >> (64 - width));
+    }
+    else if(r < lo){
+        raised |= FP_FLAG_NV;
+        v = is_signed ? ~static_cast<uint64_t>(0) << (width - 1) : 0;
+    }
+    else{
+        if(r != d) raised |= FP_FLAG_NX;
+        v = is_signed ? static_cast<uint64_t>(static_cast<int64_t>(r)) : static_cast<uint64_t>(r);
+    }
+    if(width == 32) v = static_cast<uint64_t>(static_cast<int64_t>(static_cast<int32_t>(v)));
+    return v;
+}
+
+template<typename F>
+uint64_t exact_op(uint32_t op, uint64_t a_bits, uint64_t b_bits, uint64_t c_bits, uint32_t rm, uint32_t &raised){
+    typedef fp_traits<F> traits;
+    typedef typename traits::other_t other_t;
+    //volatile so that the operations are not moved across fesetround()
+    volatile F a = from_bits<F>(a_bits), b = from_bits<F>(b_bits), c = from_bits<F>(c_bits);
+    if(rm == FP_RM_RMM){
+        switch(op){
+            case FP_ADD: case FP_SUB: case FP_MUL: case FP_DIV: case FP_SQRT:
+            case FP_MADD: case FP_MSUB: case FP_NMSUB: case FP_NMADD:
+            case FP_FROM_I32: case FP_FROM_U32: case FP_FROM_I64: case FP_FROM_U64:
+                return rmm_op<F>(op, a, b, c, a_bits, raised);
+            case FP_TO_OTHER:
+                if(sizeof(other_t) > sizeof(F)) break; //exact
+                if(is_nan<F>(a)){
+                    if(is_snan<F>(a)) raised |= FP_FLAG_NV;
+                    return fp_traits<other_t>::canonical_nan;
+                }
+                return to_bits(round_away<other_t, F>(a, false, raised)); //F has more than two extra bits
+            default:
+                break;
+        }
+    }
+    switch(op){
+        case FP_ADD: return rounded_result<F>(a + b, raised);
+        case FP_SUB: return rounded_result<F>(a - b, raised);
+        case FP_MUL: return rounded_result<F>(a * b, raised);
+        case FP_DIV: return rounded_result<F>(a / b, raised);
+        case FP_SQRT: return rounded_result<F>(traits::sqrt(a), raised);
+        case FP_MADD: return rounded_result<F>(traits::fma(a, b, c), raised);
+        case FP_MSUB: return rounded_result<F>(traits::fma(a, b, -c), raised);
+        case FP_NMSUB: return rounded_result<F>(traits::fma(-a, b, c), raised);
+        case FP_NMADD: return rounded_result<F>(traits::fma(-a, b, -c), raised);
+        case FP_MIN:
+        case FP_MAX:
+            {
+                const typename traits::bits_t x = to_bits<F>(a), y = to_bits<F>(b);
+                if(is_snan<F>(a) || is_snan<F>(b)) raised |= FP_FLAG_NV;
+                if(is_nan<F>(a) && is_nan<F>(b)) return traits::canonical_nan;
+                if(is_nan<F>(a)) return y;
+                if(is_nan<F>(b)) return x;
+                if(a == b) return op == FP_MIN ? (x | y) : (x & y); //-0.0 is less than +0.0
+                return ((a < b) == (op == FP_MIN)) ? x : y;
+            }
+        case FP_EQ:
+        case FP_LT:
+        case FP_LE:
+            if(is_nan<F>(a) || is_nan<F>(b)){
+                if(op != FP_EQ || is_snan<F>(a) || is_snan<F>(b)) raised |= FP_FLAG_NV;
+                return 0;
+            }
+            return op == FP_EQ ? a == b : op == FP_LT ? a < b : a <= b;
+        case FP_TO_I32: return to_int<F>(a, 32, true, rm, raised);
+        case FP_TO_U32: return to_int<F>(a, 32, false, rm, raised);
+        case FP_TO_I64: return to_int<F>(a, 64, true, rm, raised);
+        case FP_TO_U64: return to_int<F>(a, 64, false, rm, raised);
+        //the integer is in a_bits
+        case FP_FROM_I32: return rounded_result<F>(static_cast<F>(static_cast<int32_t>(a_bits)), raised);
+        case FP_FROM_U32: return rounded_result<F>(static_cast<F>(static_cast<uint32_t>(a_bits)), raised);
+        case FP_FROM_I64: return rounded_result<F>(static_cast<F>(static_cast<int64_t>(a_bits)), raised);
+        case FP_FROM_U64: return rounded_result<F>(static_cast<F>(a_bits), raised);
+        case FP_TO_OTHER: return rounded_result<other_t>(static_cast<other_t>(a), raised);
+        default:
+            jcpu_assert(!"Unknown floating point operation");
+    }
+    return 0;
+}
+
+} //end of unnamed namespace
+
+extern "C" uint64_t jcpu_fp_exact(uint32_t op, uint32_t is_double, uint64_t a, uint64_t b, uint64_t c, uint32_t rm, uint32_t *flags){
+    fenv_t env;
+    feholdexcept(&env); //saves the rounding mode and the flags of the host, and clears the flags
+    fesetround(host_round(rm));
+    uint32_t raised = 0;
+    const uint64_t result = is_double ? exact_op<double>(op, a, b, c, rm, raised) : exact_op<float>(op, a, b, c, rm, raised);
+    fesetenv(&env);
+    *flags |= raised;
+    return result;
+}
+
+extern "C" void jcpu_fp_clear_host_flags(){
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+extern "C" uint32_t jcpu_fp_host_flags(uint64_t){
+    const uint32_t flags = host_flags();
+    feclearexcept(FE_ALL_EXCEPT);
+    return flags;
+}
+
+} //end of namespace vm
+} //end of namespace jcpu
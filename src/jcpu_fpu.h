@@ -0,0 +1,34 @@
+#ifndef JCPU_FPU_H
+#define JCPU_FPU_H
+#include <stdint.h>
+
+namespace jcpu{
+namespace vm{
+
+//Operations of jcpu_fp_exact(). The semantics are those of RISC-V F and D.
+enum fp_op_e{
+    FP_ADD, FP_SUB, FP_MUL, FP_DIV, FP_SQRT, FP_MIN, FP_MAX,
+    FP_MADD, FP_MSUB, FP_NMSUB, FP_NMADD, //a * b + c, a * b - c, -(a * b) + c, -(a * b) - c
+    FP_EQ, FP_LT, FP_LE, //1 or 0
+    FP_TO_I32, FP_TO_U32, FP_TO_I64, FP_TO_U64, //saturated, 32 bit results are sign extended
+    FP_FROM_I32, FP_FROM_U32, FP_FROM_I64, FP_FROM_U64,
+    FP_TO_OTHER //double to single, or single to double
+};
+
+enum fp_rm_e{FP_RM_RNE, FP_RM_RTZ, FP_RM_RDN, FP_RM_RUP, FP_RM_RMM};
+enum fp_flag_e{FP_FLAG_NX = 1, FP_FLAG_UF = 2, FP_FLAG_OF = 4, FP_FLAG_DZ = 8, FP_FLAG_NV = 16};
+
+//Called from translated code when the rounding mode is not the one of the host instruction, or the operation would be folded when translated.
+//Operands and the result are raw bits of float (is_double == 0) or double. NaN results are the canonical NaN.
+//Exception flags raised by the operation are ORed into *flags.
+extern "C" uint64_t jcpu_fp_exact(uint32_t op, uint32_t is_double, uint64_t a, uint64_t b, uint64_t c, uint32_t rm, uint32_t *flags);
+//Operations run by host instructions raise the sticky exception flags of the host (MXCSR on x86).
+//Translated code clears them before such operations and reads them afterwards. keep is ignored,
+//it is made from the results of the operations so that they are neither removed nor moved after the call.
+extern "C" void jcpu_fp_clear_host_flags();
+extern "C" uint32_t jcpu_fp_host_flags(uint64_t keep); //fp_flag_e raised since jcpu_fp_clear_host_flags(), and clears them
+
+} //end of namespace vm
+} //end of namespace jcpu
+
+#endif
@@ -12,11 +12,13 @@
 #include <llvm/Instructions.h> //LoadInst
 #include <llvm/IRBuilder.h>
 #include <llvm/Module.h>
+#include <llvm/Intrinsics.h>
 #elif 3 <= LLVM_VERSION_MINOR && LLVM_VERSION_MINOR <= 8 //3.3, 3.4, 3.5, 3.6, 3.7, 3.8
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Instructions.h> //LoadInst
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
+#include <llvm/IR/Intrinsics.h>
 #else
 #error "Not supported LLVM version"
 #endif
@@ -31,6 +33,14 @@
 #else
 #include <llvm/IR/LegacyPassManager.h> //PassManager
 #endif
+#include <llvm/Bitcode/ReaderWriter.h> //parseBitcodeFile
+#if LLVM_VERSION_MINOR <= 4
+#include <llvm/Linker.h>
+#else
+#include <llvm/Linker/Linker.h>
+#endif
+#include <llvm/Transforms/Utils/Cloning.h> //InlineFunction
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/PrettyStackTrace.h>
 #include <llvm/Support/Signals.h>
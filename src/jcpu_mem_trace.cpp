@@ -0,0 +1,94 @@
+#include <sched.h>
+#include <unistd.h>
+#include <vector>
+
+#include "jcpu_mem_trace.h"
+#include "jcpu_cpu_state.h"
+#include "jcpu_internal.h"
+
+namespace jcpu{
+namespace vm{
+
+mem_tracer::mem_tracer(const char *file_name, const uint64_t &icount) :
+    ring(new mem_trace_record[ring_size]), head(0), tail(0), stop_req(0), active(false),
+    icount(icount), fp(std::fopen(file_name, "wb"))
+{
+    if(!fp){
+        std::cerr << "Failed to open " << file_name << std::endl;
+        jcpu_assert(fp);
+    }
+    std::fwrite(mem_trace_codec::get_magic(), 1, mem_trace_codec::magic_len, fp);
+    const int result = pthread_create(&writer, JCPU_NULLPTR, &mem_tracer::writer_main, this);
+    jcpu_assert(result == 0);
+    active = true;
+}
+
+mem_tracer::~mem_tracer(){
+    stop();
+    delete [] ring;
+}
+
+void mem_tracer::record(uint64_t addr, uint64_t val, uint64_t pc, uint32_t info){
+    if(!active) return;
+    const size_t h = head;
+    while(h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= ring_size){//full
+        sched_yield();
+    }
+    mem_trace_record &r = ring[h & (ring_size - 1)];
+    r.addr = addr;
+    r.val = val;
+    r.pc = pc;
+    r.icount = icount + (info >> 5);
+    r.len = info & 0xF;
+    r.is_write = (info & 0x10) != 0;
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+}
+
+void mem_tracer::stop(){
+    if(!active) return;
+    active = false;
+    __atomic_store_n(&stop_req, 1, __ATOMIC_RELEASE);
+    pthread_join(writer, JCPU_NULLPTR);
+    std::fclose(fp);
+    fp = JCPU_NULLPTR;
+}
+
+void *mem_tracer::writer_main(void *arg){
+    static_cast<mem_tracer *>(arg)->write_loop();
+    return JCPU_NULLPTR;
+}
+
+void mem_tracer::write_loop(){
+    mem_trace_codec codec;
+    std::vector<uint8_t> buf(ring_size * mem_trace_codec::max_record_size / 8);
+    uint8_t *p = &buf[0];
+    uint8_t *const buf_end = &buf[0] + buf.size() - mem_trace_codec::max_record_size;
+    size_t t = tail;
+    for(;;){
+        const bool stopping = __atomic_load_n(&stop_req, __ATOMIC_ACQUIRE) != 0;
+        const size_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+        if(h == t){
+            if(stopping) break;
+            usleep(100);
+            continue;
+        }
+        for(; t != h; ++t){
+            p = codec.encode(ring[t & (ring_size - 1)], p);
+            if(p >= buf_end){
+                std::fwrite(&buf[0], 1, p - &buf[0], fp);
+                p = &buf[0];
+            }
+        }
+        __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+    }
+    std::fwrite(&buf[0], 1, p - &buf[0], fp);
+    std::fflush(fp);
+}
+
+extern "C" void jcpu_mem_trace_hook(void *state, uint64_t addr, uint64_t val, uint64_t pc, uint32_t info){
+    mem_tracer *const tracer = static_cast<cpu_state_header *>(state)->tracer;
+    if(tracer) tracer->record(addr, val, pc, info);
+}
+
+} //end of namespace vm
+} //end of namespace jcpu
@@ -0,0 +1,112 @@
+#ifndef JCPU_MEM_TRACE_H
+#define JCPU_MEM_TRACE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <cstdio>
+#include <pthread.h>
+
+namespace jcpu{
+namespace vm{
+
+struct mem_trace_record{
+    uint64_t addr, val, pc, icount;
+    unsigned int len; //1, 2, 4 or 8
+    bool is_write;
+};
+
+//Trace file is "JCPUMTR1" followed by records.
+//A record is a flag byte (bit0-1:log2(len), bit2:is_write) followed by varints of
+//zigzag(addr - prev addr), zigzag(pc - prev pc), icount - prev icount and val.
+class mem_trace_codec{
+    mem_trace_record prev;
+    static uint8_t *put_varint(uint8_t *p, uint64_t v){
+        while(v >= 0x80){
+            *p++ = static_cast<uint8_t>(v) | 0x80;
+            v >>= 7;
+        }
+        *p++ = static_cast<uint8_t>(v);
+        return p;
+    }
+    static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end, uint64_t &v){
+        v = 0;
+        for(unsigned int shift = 0; p < end && shift < 64; shift += 7){
+            const uint8_t b = *p++;
+            v |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if(!(b & 0x80)) return p;
+        }
+        return NULL;
+    }
+    static uint64_t zigzag(uint64_t d){return (d << 1) ^ -(d >> 63);}
+    static uint64_t unzigzag(uint64_t z){return (z >> 1) ^ -(z & 1);}
+    public:
+    static const size_t magic_len = 8;
+    static const size_t max_record_size = 1 + 4 * 10;
+    static const char *get_magic(){return "JCPUMTR1";}
+    mem_trace_codec(){
+        prev.addr = prev.val = prev.pc = prev.icount = 0;
+        prev.len = 0;
+        prev.is_write = false;
+    }
+    uint8_t *encode(const mem_trace_record &r, uint8_t *p){
+        const unsigned int len_log2 = r.len == 8 ? 3 : r.len == 4 ? 2 : r.len == 2 ? 1 : 0;
+        *p++ = static_cast<uint8_t>(len_log2 | (r.is_write ? 4 : 0));
+        p = put_varint(p, zigzag(r.addr - prev.addr));
+        p = put_varint(p, zigzag(r.pc - prev.pc));
+        p = put_varint(p, r.icount - prev.icount);
+        p = put_varint(p, r.val);
+        prev = r;
+        return p;
+    }
+    //returns NULL if [p, end) does not hold a whole record
+    const uint8_t *decode(const uint8_t *p, const uint8_t *end, mem_trace_record &r){
+        if(p >= end) return NULL;
+        const uint8_t flags = *p++;
+        uint64_t addr_d, pc_d, icount_d;
+        if(!(p = get_varint(p, end, addr_d))) return NULL;
+        if(!(p = get_varint(p, end, pc_d))) return NULL;
+        if(!(p = get_varint(p, end, icount_d))) return NULL;
+        if(!(p = get_varint(p, end, r.val))) return NULL;
+        r.len = 1U << (flags & 3);
+        r.is_write = (flags & 4) != 0;
+        r.addr = prev.addr + unzigzag(addr_d);
+        r.pc = prev.pc + unzigzag(pc_d);
+        r.icount = prev.icount + icount_d;
+        prev = r;
+        return p;
+    }
+};
+
+//Records are pushed by the cpu thread into a single producer single consumer ring buffer,
+//and a writer thread encodes them into the file.
+class mem_tracer{
+    static const size_t ring_size = 1 << 16;
+    mem_trace_record *const ring;
+    size_t head, tail;
+    int stop_req;
+    bool active;
+    const uint64_t &icount;
+    std::FILE *fp;
+    pthread_t writer;
+    static void *writer_main(void *);
+    void write_loop();
+    mem_tracer(const mem_tracer &);
+    mem_tracer & operator = (const mem_tracer &);
+    public:
+    mem_tracer(const char *file_name, const uint64_t &icount);
+    ~mem_tracer();
+    void record(uint64_t addr, uint64_t val, uint64_t pc, uint32_t info);
+    void stop(); //flushes all records and closes the file
+    bool is_active()const{return active;}
+    //info passed from the translated code
+    static uint32_t make_info(unsigned int len, bool is_write, unsigned int insn_offset){
+        return (insn_offset << 5) | (is_write ? 0x10 : 0) | len;
+    }
+};
+
+//called from translated code with the cpu_state of the running instance
+extern "C" void jcpu_mem_trace_hook(void *state, uint64_t addr, uint64_t val, uint64_t pc, uint32_t info);
+
+} //end of namespace vm
+} //end of namespace jcpu
+
+#endif
@@ -0,0 +1,222 @@
+#include <cstring>
+#include <algorithm>
+#include "jcpu_memory.h"
+#include "jcpu_internal.h"
+
+namespace jcpu{
+
+sparse_memory::sparse_memory() :
+    root(new void *[num_entries]()),
+    last_read_page_num(0), last_write_page_num(0),
+    last_read_page(JCPU_NULLPTR), last_write_page(JCPU_NULLPTR),
+    num_pages(0), thread_safe(false), snapshot_gen(0), epoch(1),
+    code_write_hook(JCPU_NULLPTR), code_write_arg(JCPU_NULLPTR)
+{
+}
+
+sparse_memory::~sparse_memory(){
+    free_table(root, 0);
+}
+
+void sparse_memory::free_table(void **table, unsigned int level){
+    for(size_t i = 0; i < num_entries; ++i){
+        if(!table[i]) continue;
+        if(level == num_levels - 1){
+            page_entry *const page = static_cast<page_entry *>(table[i]);
+            delete [] page->backup;
+            delete page;
+        }
+        else{
+            free_table(static_cast<void **>(table[i]), level + 1);
+        }
+    }
+    delete [] table;
+}
+
+sparse_memory::page_entry *sparse_memory::walk(uint64_t page_num, bool alloc){
+    void **table = root;
+    for(unsigned int level = 0; level < num_levels; ++level){
+        const unsigned int shift = (num_levels - 1 - level) * level_bits;
+        void *&entry = table[(page_num >> shift) & (num_entries - 1)];
+        const bool is_leaf = level == num_levels - 1;
+        if(!entry){
+            if(!alloc) return JCPU_NULLPTR;
+            if(thread_safe){//another thread may allocate the same entry
+                if(is_leaf){
+                    page_entry *const page = new page_entry();
+                    if(__sync_bool_compare_and_swap(&entry, static_cast<void *>(JCPU_NULLPTR), static_cast<void *>(page))) __sync_fetch_and_add(&num_pages, 1);
+                    else delete page;
+                }
+                else{
+                    void **const t = new void *[num_entries]();
+                    if(!__sync_bool_compare_and_swap(&entry, static_cast<void *>(JCPU_NULLPTR), static_cast<void *>(t))) delete [] t;
+                }
+            }
+            else if(is_leaf){
+                entry = new page_entry();
+                ++num_pages;
+            }
+            else{
+                entry = new void *[num_entries]();
+            }
+        }
+        if(is_leaf){
+            return static_cast<page_entry *>(entry);
+        }
+        table = static_cast<void **>(entry);
+    }
+    jcpu_assert(!"Never comes here");
+    return JCPU_NULLPTR;
+}
+
+uint8_t *sparse_memory::get_page(uint64_t addr){
+    const uint64_t page_num = addr >> page_bits;
+    if(thread_safe){
+        page_entry *const page = walk(page_num, true);
+        check_code(page, page_num);
+        return page->data;
+    }
+    if(last_write_page && last_write_page_num == page_num){
+        check_code(last_write_page, page_num);
+        return last_write_page->data;
+    }
+    page_entry *const page = walk(page_num, true);
+    check_code(page, page_num);
+    if(snapshot_gen != 0 && page->dirty_epoch != epoch){//first write since snapshot() or restore()
+        if(page->backup_gen != snapshot_gen){
+            if(!page->backup) page->backup = new uint8_t[page_size];
+            std::memcpy(page->backup, page->data, page_size);
+            page->backup_gen = snapshot_gen;
+        }
+        page->dirty_epoch = epoch;
+        dirty_pages.push_back(page_num);
+    }
+    last_write_page_num = page_num;
+    last_write_page = page;
+    return page->data;
+}
+
+const uint8_t *sparse_memory::find_page(uint64_t addr){
+    const uint64_t page_num = addr >> page_bits;
+    if(thread_safe){
+        const page_entry *const page = walk(page_num, false);
+        return page ? page->data : JCPU_NULLPTR;
+    }
+    if(!last_read_page || last_read_page_num != page_num){
+        page_entry *const page = walk(page_num, false);
+        if(!page) return JCPU_NULLPTR;
+        last_read_page_num = page_num;
+        last_read_page = page;
+    }
+    return last_read_page->data;
+}
+
+uint64_t sparse_memory::read(uint64_t addr, unsigned int len){
+    jcpu_assert(len <= sizeof(uint64_t));
+    uint64_t v = 0;
+    const uint64_t offset = addr & (page_size - 1);
+    if(offset + len <= page_size){
+        const uint8_t *const page = find_page(addr);
+        if(page) std::memcpy(&v, page + offset, len);
+    }
+    else{
+        read_block(addr, &v, len);
+    }
+    return v;
+}
+
+void sparse_memory::write(uint64_t addr, unsigned int len, uint64_t val){
+    jcpu_assert(len <= sizeof(uint64_t));
+    const uint64_t offset = addr & (page_size - 1);
+    if(offset + len <= page_size){
+        std::memcpy(get_page(addr) + offset, &val, len);
+    }
+    else{
+        write_block(addr, &val, len);
+    }
+}
+
+void sparse_memory::read_block(uint64_t addr, void *dst_, size_t len){
+    uint8_t *dst = static_cast<uint8_t *>(dst_);
+    while(len > 0){
+        const uint64_t offset = addr & (page_size - 1);
+        const size_t chunk = std::min<uint64_t>(len, page_size - offset);
+        const uint8_t *const page = find_page(addr);
+        if(page) std::memcpy(dst, page + offset, chunk);
+        else std::memset(dst, 0, chunk);
+        addr += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+void sparse_memory::write_block(uint64_t addr, const void *src_, size_t len){
+    const uint8_t *src = static_cast<const uint8_t *>(src_);
+    while(len > 0){
+        const uint64_t offset = addr & (page_size - 1);
+        const size_t chunk = std::min<uint64_t>(len, page_size - offset);
+        std::memcpy(get_page(addr) + offset, src, chunk);
+        addr += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+}
+
+void sparse_memory::fill(uint64_t addr, uint8_t val, size_t len){
+    while(len > 0){
+        const uint64_t offset = addr & (page_size - 1);
+        const size_t chunk = std::min<uint64_t>(len, page_size - offset);
+        if(val != 0 || find_page(addr)){//untouched pages are zero already
+            std::memset(get_page(addr) + offset, val, chunk);
+        }
+        addr += chunk;
+        len -= chunk;
+    }
+}
+
+void sparse_memory::mark_code(uint64_t addr, size_t len){
+    const uint64_t last = (addr + len - 1) >> page_bits;
+    for(uint64_t page_num = addr >> page_bits; page_num <= last; ++page_num){
+        __atomic_store_n(&walk(page_num, true)->code, 1, __ATOMIC_RELEASE);
+    }
+}
+
+void sparse_memory::clear(){
+    free_table(root, 0);
+    root = new void *[num_entries]();
+    last_read_page = JCPU_NULLPTR;
+    last_write_page = JCPU_NULLPTR;
+    num_pages = 0;
+    snapshot_gen = 0;
+    dirty_pages.clear();
+}
+
+void sparse_memory::set_thread_safe(){
+    thread_safe = true;
+    last_read_page = JCPU_NULLPTR;
+    last_write_page = JCPU_NULLPTR;
+}
+
+void sparse_memory::snapshot(){
+    jcpu_assert(!thread_safe);
+    ++snapshot_gen;
+    ++epoch;
+    dirty_pages.clear();
+    last_write_page = JCPU_NULLPTR;
+}
+
+void sparse_memory::restore(std::vector<uint64_t> &restored_pages){
+    jcpu_assert(snapshot_gen != 0);
+    restored_pages.clear();
+    restored_pages.reserve(dirty_pages.size());
+    for(std::vector<uint64_t>::const_iterator it = dirty_pages.begin(), it_end = dirty_pages.end(); it != it_end; ++it){
+        page_entry *const page = walk(*it, false);
+        std::memcpy(page->data, page->backup, page_size);
+        restored_pages.push_back(*it << page_bits);
+    }
+    ++epoch;
+    dirty_pages.clear();
+    last_write_page = JCPU_NULLPTR;
+}
+
+} //end of namespace jcpu
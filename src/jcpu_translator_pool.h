@@ -0,0 +1,142 @@
+#ifndef JCPU_TRANSLATOR_POOL_H
+#define JCPU_TRANSLATOR_POOL_H
+#include <stdint.h>
+#include <vector>
+#include <deque>
+#include <set>
+#include <pthread.h>
+#include <sched.h>
+
+#include "jcpu_internal.h"
+
+namespace jcpu{
+namespace vm{
+
+//Translates blocks ahead of execution on worker threads.
+//Each worker owns a VM which is used only as a translation context (LLVMContext, module, builder and translation_job).
+//Its blocks go into the translation cache shared with the harts.
+//A start address is queued to the worker which found it, and idle workers steal from the others.
+//VM must provide translate_ahead(uint64_t pc, std::vector<uint64_t> &successors).
+template<typename VM>
+class translator_pool{
+    struct worker{
+        translator_pool *pool;
+        VM *vm;
+        std::deque<uint64_t> queue; //the owner pops the back, thieves pop the front
+        pthread_mutex_t mutex;
+        pthread_t thread;
+    };
+    std::vector<worker *> workers;
+    std::set<uint64_t> seen; //an address is queued only once
+    size_t num_queued;
+    size_t next_worker;
+    bool stop_req;
+    pthread_mutex_t mutex; //for seen, num_queued, next_worker and stop_req
+    pthread_cond_t cond;
+    translator_pool(const translator_pool &);
+    translator_pool & operator = (const translator_pool &);
+
+    static void *thread_main(void *arg){
+        worker *const w = static_cast<worker *>(arg);
+        w->pool->worker_loop(*w);
+        return JCPU_NULLPTR;
+    }
+    static bool pop(worker &w, bool own, uint64_t &pc){
+        pthread_mutex_lock(&w.mutex);
+        const bool found = !w.queue.empty();
+        if(found && own){
+            pc = w.queue.back();
+            w.queue.pop_back();
+        }
+        else if(found){
+            pc = w.queue.front();
+            w.queue.pop_front();
+        }
+        pthread_mutex_unlock(&w.mutex);
+        return found;
+    }
+    bool take(worker &w, uint64_t &pc){
+        if(pop(w, true, pc)) return true;
+        for(size_t i = 0; i < workers.size(); ++i){
+            if(workers[i] != &w && pop(*workers[i], false, pc)) return true;
+        }
+        return false;
+    }
+    void push(const std::vector<uint64_t> &pcs, worker *w){
+        std::vector<uint64_t> fresh;
+        pthread_mutex_lock(&mutex);
+        for(std::vector<uint64_t>::const_iterator it = pcs.begin(), it_end = pcs.end(); it != it_end; ++it){
+            if(seen.insert(*it).second) fresh.push_back(*it);
+        }
+        if(!w) w = workers[next_worker++ % workers.size()];
+        num_queued += fresh.size(); //counted before queued, so a waiting worker may spin briefly
+        pthread_mutex_unlock(&mutex);
+        if(fresh.empty()) return;
+        pthread_mutex_lock(&w->mutex);
+        w->queue.insert(w->queue.end(), fresh.begin(), fresh.end());
+        pthread_mutex_unlock(&w->mutex);
+        pthread_cond_broadcast(&cond);
+    }
+    void worker_loop(worker &w){
+        std::vector<uint64_t> successors;
+        for(;;){
+            uint64_t pc;
+            if(take(w, pc)){
+                pthread_mutex_lock(&mutex);
+                --num_queued;
+                const bool stopping = stop_req;
+                pthread_mutex_unlock(&mutex);
+                if(stopping) break;
+                successors.clear();
+                w.vm->translate_ahead(pc, successors);
+                push(successors, &w);
+                continue;
+            }
+            pthread_mutex_lock(&mutex);
+            while(!stop_req && num_queued == 0){
+                pthread_cond_wait(&cond, &mutex);
+            }
+            const bool stopping = stop_req;
+            pthread_mutex_unlock(&mutex);
+            if(stopping) break;
+            sched_yield();
+        }
+    }
+    public:
+    explicit translator_pool(const std::vector<VM *> &vms) : num_queued(0), next_worker(0), stop_req(false){
+        jcpu_assert(!vms.empty());
+        pthread_mutex_init(&mutex, JCPU_NULLPTR);
+        pthread_cond_init(&cond, JCPU_NULLPTR);
+        for(size_t i = 0; i < vms.size(); ++i){
+            worker *const w = new worker();
+            w->pool = this;
+            w->vm = vms[i];
+            pthread_mutex_init(&w->mutex, JCPU_NULLPTR);
+            workers.push_back(w);
+        }
+        for(size_t i = 0; i < workers.size(); ++i){
+            const int result = pthread_create(&workers[i]->thread, JCPU_NULLPTR, &translator_pool::thread_main, workers[i]);
+            jcpu_assert(result == 0);
+        }
+    }
+    ~translator_pool(){//unfinished jobs are dropped
+        pthread_mutex_lock(&mutex);
+        stop_req = true;
+        pthread_mutex_unlock(&mutex);
+        pthread_cond_broadcast(&cond);
+        for(size_t i = 0; i < workers.size(); ++i){
+            pthread_join(workers[i]->thread, JCPU_NULLPTR);
+            pthread_mutex_destroy(&workers[i]->mutex);
+            delete workers[i];
+        }
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&mutex);
+    }
+    //called by the harts with the successors of the blocks they translated
+    void submit(const std::vector<uint64_t> &pcs){push(pcs, JCPU_NULLPTR);}
+};
+
+} //end of namespace vm
+} //end of namespace jcpu
+
+#endif
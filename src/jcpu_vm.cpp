@@ -2,6 +2,7 @@
 #include <map>
 #include <iostream>
 #include <iomanip>
+#include <cstring>
 
 
 #include "jcpu_vm.h"
@@ -38,6 +39,14 @@ llvm::Type * ir_builder_wrapper::getInt64Ty()const{
     return builder->getInt64Ty();
 }
 
+llvm::Type * ir_builder_wrapper::getFloatTy()const{
+    return builder->getFloatTy();
+}
+
+llvm::Type * ir_builder_wrapper::getDoubleTy()const{
+    return builder->getDoubleTy();
+}
+
 void ir_builder_wrapper::SetInsertPoint(llvm::BasicBlock *bb)const{
     builder->SetInsertPoint(bb);
 }
@@ -129,6 +138,17 @@ llvm::CallInst *ir_builder_wrapper::CreateCall3(llvm::Function *func, llvm::Valu
     }
 }
 
+llvm::CallInst *ir_builder_wrapper::CreateCall(llvm::Function *func, const std::vector<llvm::Value *> &args, const char *nm)const{
+    if(func->getReturnType()->isVoidTy()){
+        return builder->CreateCall(func, args);
+    }
+    else{
+        std::string str(nm);
+        set_pc_str(str);
+        return builder->CreateCall(func, args, str.c_str());
+    }
+}
+
 llvm::Value *ir_builder_wrapper::CreateSelect(llvm::Value *cond, llvm::Value *t_value, llvm::Value *f_value, const char *nm)const{
     std::string str(nm);
     set_pc_str(str);
@@ -153,6 +173,22 @@ llvm::Value * ir_builder_wrapper::CreateTrunc(llvm::Value *v, llvm::Type *t, con
     return builder->CreateTrunc(v, t, str.c_str());
 }
 
+#define BUILDER_CAST(func_name) \
+    llvm::Value * ir_builder_wrapper::Create##func_name (llvm::Value *v, llvm::Type *t, const char *nm)const{ \
+        std::string str(nm); \
+        set_pc_str(str); \
+        return builder->Create##func_name(v, t, str.c_str()); \
+    }
+
+BUILDER_CAST(BitCast)
+BUILDER_CAST(FPToSI)
+BUILDER_CAST(FPToUI)
+BUILDER_CAST(SIToFP)
+BUILDER_CAST(UIToFP)
+BUILDER_CAST(FPExt)
+BUILDER_CAST(FPTrunc)
+BUILDER_CAST(PtrToInt)
+
 #define BUILDER_CREATE2(func_name) \
     llvm::Value * ir_builder_wrapper::Create##func_name (llvm::Value *arg0, llvm::Value *arg1, const char *nm)const{ \
         std::string str(nm); \
@@ -166,6 +202,8 @@ BUILDER_CREATE2(Sub)
 BUILDER_CREATE2(Mul)
 BUILDER_CREATE2(UDiv)
 BUILDER_CREATE2(SDiv)
+BUILDER_CREATE2(SRem)
+BUILDER_CREATE2(URem)
 BUILDER_CREATE2(Or)
 BUILDER_CREATE2(And)
 BUILDER_CREATE2(Xor)
@@ -182,6 +220,22 @@ BUILDER_CREATE2(ICmpSLE)
 BUILDER_CREATE2(ICmpSLT)
 BUILDER_CREATE2(ICmpSGE)
 BUILDER_CREATE2(ICmpSGT)
+BUILDER_CREATE2(FAdd)
+BUILDER_CREATE2(FSub)
+BUILDER_CREATE2(FMul)
+BUILDER_CREATE2(FDiv)
+BUILDER_CREATE2(FCmpOEQ)
+BUILDER_CREATE2(FCmpOLT)
+BUILDER_CREATE2(FCmpOLE)
+BUILDER_CREATE2(FCmpOGE)
+BUILDER_CREATE2(FCmpOGT)
+BUILDER_CREATE2(FCmpUNO)
+
+llvm::Value * ir_builder_wrapper::CreateFNeg(llvm::Value *v, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreateFNeg(v, str.c_str());
+}
 
 #define BUILDER_CREATE2I(func_name) \
     llvm::Value * ir_builder_wrapper::Create##func_name (llvm::Value *v, unsigned int i, const char *nm)const{ \
@@ -195,6 +249,142 @@ BUILDER_CREATE2I(LShr)
 BUILDER_CREATE2I(AShr)
 BUILDER_CREATE2I(And)
 
+llvm::BranchInst *ir_builder_wrapper::CreateBr(llvm::BasicBlock *dest)const{
+    return builder->CreateBr(dest);
+}
+
+llvm::BranchInst *ir_builder_wrapper::CreateCondBr(llvm::Value *cond, llvm::BasicBlock *t, llvm::BasicBlock *f)const{
+    return builder->CreateCondBr(cond, t, f);
+}
+
+llvm::PHINode *ir_builder_wrapper::CreatePHI(llvm::Type *t, unsigned int num_incoming, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreatePHI(t, num_incoming, str.c_str());
+}
+
+llvm::Value *ir_builder_wrapper::CreatePointerCast(llvm::Value *v, llvm::Type *t, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreatePointerCast(v, t, str.c_str());
+}
+
+llvm::Value *ir_builder_wrapper::CreateInsertElement(llvm::Value *vec, llvm::Value *elem, llvm::Value *idx, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreateInsertElement(vec, elem, idx, str.c_str());
+}
+
+llvm::Value *ir_builder_wrapper::CreateExtractElement(llvm::Value *vec, llvm::Value *idx, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreateExtractElement(vec, idx, str.c_str());
+}
+
+llvm::Value *ir_builder_wrapper::CreateShuffleVector(llvm::Value *v0, llvm::Value *v1, llvm::Value *mask, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreateShuffleVector(v0, v1, mask, str.c_str());
+}
+
+llvm::Value *ir_builder_wrapper::CreateAtomicRMW(llvm::AtomicRMWInst::BinOp op, llvm::Value *ptr, llvm::Value *val)const{
+    return builder->CreateAtomicRMW(op, ptr, val, llvm::SequentiallyConsistent);
+}
+
+llvm::Value *ir_builder_wrapper::CreateAtomicCmpXchg(llvm::Value *ptr, llvm::Value *cmp, llvm::Value *new_val)const{
+#if JCPU_LLVM_VERSION_LT(3, 5)
+    return builder->CreateAtomicCmpXchg(ptr, cmp, new_val, llvm::SequentiallyConsistent);
+#else //returns {old value, success}
+    llvm::Value *const pair = builder->CreateAtomicCmpXchg(ptr, cmp, new_val, llvm::SequentiallyConsistent, llvm::SequentiallyConsistent);
+    return builder->CreateExtractValue(pair, 0);
+#endif
+}
+
+void ir_builder_wrapper::CreateFence()const{
+    builder->CreateFence(llvm::SequentiallyConsistent);
+}
+
+llvm::Value *ir_builder_wrapper::CreateLoad(llvm::Value *ptr, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    return builder->CreateLoad(ptr, str.c_str());
+}
+
+void ir_builder_wrapper::CreateStore(llvm::Value *val, llvm::Value *ptr)const{
+    builder->CreateStore(val, ptr);
+}
+
+llvm::Value *ir_builder_wrapper::CreateUnalignedLoad(llvm::Value *ptr, const char *nm)const{
+    std::string str(nm);
+    set_pc_str(str);
+    llvm::LoadInst *const load = builder->CreateLoad(ptr, str.c_str());
+    load->setAlignment(1);
+    return load;
+}
+
+void ir_builder_wrapper::CreateUnalignedStore(llvm::Value *val, llvm::Value *ptr)const{
+    builder->CreateStore(val, ptr)->setAlignment(1);
+}
+
+extern "C" uint8_t *jcpu_dmi_ptr(void *state, uint64_t addr){
+    return static_cast<cpu_state_header *>(state)->ext_ifs->get_dmi_ptr(addr);
+}
+
+extern "C" const uint8_t *jcpu_dmi_read_ptr(void *state, uint64_t addr){
+    return static_cast<cpu_state_header *>(state)->ext_ifs->get_dmi_read_ptr(addr);
+}
+
+extern "C" uint64_t jcpu_amo_slow(void *state, uint64_t addr, uint32_t len, uint32_t op, uint64_t val){
+    jcpu_ext_if *const ext_ifs = static_cast<cpu_state_header *>(state)->ext_ifs;
+    const uint64_t old = ext_ifs->mem_read(addr, len);
+    const unsigned int shift = 64 - len * 8;
+    const int64_t s_old = static_cast<int64_t>(old << shift) >> shift;
+    const int64_t s_val = static_cast<int64_t>(val << shift) >> shift;
+    const uint64_t u_old = (old << shift) >> shift;
+    const uint64_t u_val = (val << shift) >> shift;
+    uint64_t result = 0;
+    switch(op){
+        case llvm::AtomicRMWInst::Xchg: result = val; break;
+        case llvm::AtomicRMWInst::Add: result = old + val; break;
+        case llvm::AtomicRMWInst::And: result = old & val; break;
+        case llvm::AtomicRMWInst::Or: result = old | val; break;
+        case llvm::AtomicRMWInst::Xor: result = old ^ val; break;
+        case llvm::AtomicRMWInst::Max: result = s_old > s_val ? old : val; break;
+        case llvm::AtomicRMWInst::Min: result = s_old < s_val ? old : val; break;
+        case llvm::AtomicRMWInst::UMax: result = u_old > u_val ? old : val; break;
+        case llvm::AtomicRMWInst::UMin: result = u_old < u_val ? old : val; break;
+        default: jcpu_assert(!"Not supported operation");
+    }
+    ext_ifs->mem_write(addr, len, result);
+    return old;
+}
+
+extern "C" uint64_t jcpu_cmpxchg_slow(void *state, uint64_t addr, uint32_t len, uint64_t expected, uint64_t desired){
+    jcpu_ext_if *const ext_ifs = static_cast<cpu_state_header *>(state)->ext_ifs;
+    const uint64_t old = ext_ifs->mem_read(addr, len);
+    if(old == expected) ext_ifs->mem_write(addr, len, desired);
+    return old;
+}
+
+extern "C" void jcpu_vector_load_slow(void *state, uint64_t addr, uint64_t stride, uint32_t len, uint64_t num, uint8_t *buf, uint64_t pc, uint32_t trace_info){
+    jcpu_ext_if *const ext_ifs = static_cast<cpu_state_header *>(state)->ext_ifs;
+    for(uint64_t i = 0; i < num; ++i){
+        const uint64_t val = ext_ifs->mem_read(addr + i * stride, len);
+        if(trace_info) jcpu_mem_trace_hook(state, addr + i * stride, val, pc, trace_info);
+        memcpy(buf + i * len, &val, len); //the host is little endian as well as the guests with vectors
+    }
+}
+
+extern "C" void jcpu_vector_store_slow(void *state, uint64_t addr, uint64_t stride, uint32_t len, uint64_t num, const uint8_t *buf, uint64_t pc, uint32_t trace_info){
+    jcpu_ext_if *const ext_ifs = static_cast<cpu_state_header *>(state)->ext_ifs;
+    for(uint64_t i = 0; i < num; ++i){
+        uint64_t val = 0;
+        memcpy(&val, buf + i * len, len);
+        if(trace_info) jcpu_mem_trace_hook(state, addr + i * stride, val, pc, trace_info);
+        ext_ifs->mem_write(addr + i * stride, len, val);
+    }
+}
+
 
 } //end of namespace vm
 } //end of namespace jcpu
@@ -2,13 +2,23 @@
 #define JCPU_VM_H
 
 #include <stdint.h>
+#include <cmath>
 #include <vector>
+#include <map>
 #include <utility>
 #include <stack>
+#include <deque>
 #include <sstream>
+#include <pthread.h>
 
 #include "jcpu_llvm_headers.h"
 #include "jcpu.h"
+#include "jcpu_memory.h"
+#include "jcpu_mem_trace.h"
+#include "jcpu_epoch.h"
+#include "jcpu_fpu.h"
+#include "jcpu_decoder.h"
+#include "jcpu_cpu_state.h"
 #include "jcpu_internal.h"
 #include "gdbserver.h"
 
@@ -22,9 +32,18 @@ enum jcpu_vm_arch_e{
     JCPU_ARCH_ARM
 };
 
-void make_set_get(llvm::Module *, llvm::GlobalVariable *, unsigned int, unsigned int);
-void make_mem_access(llvm::Module *, unsigned int);
-void make_debug_func(llvm::Module *, unsigned int);
+void link_helpers(llvm::Module *); //links the helper functions compiled from src/bitcode
+
+//Called from translated code for atomic instructions.
+//The slow ones access the memory through jcpu_ext_if when jcpu_dmi_ptr() returns NULL.
+extern "C" uint8_t *jcpu_dmi_ptr(void *state, uint64_t addr);
+extern "C" const uint8_t *jcpu_dmi_read_ptr(void *state, uint64_t addr); //for loads, which do not allocate RAM
+extern "C" uint64_t jcpu_amo_slow(void *state, uint64_t addr, uint32_t len, uint32_t op, uint64_t val);
+extern "C" uint64_t jcpu_cmpxchg_slow(void *state, uint64_t addr, uint32_t len, uint64_t expected, uint64_t desired);
+//Called from translated code for vector loads and stores which are not on contiguous host memory.
+//num elements of len bytes are copied between the guest addresses and buf. Each element is traced if trace_info is not 0.
+extern "C" void jcpu_vector_load_slow(void *state, uint64_t addr, uint64_t stride, uint32_t len, uint64_t num, uint8_t *buf, uint64_t pc, uint32_t trace_info);
+extern "C" void jcpu_vector_store_slow(void *state, uint64_t addr, uint64_t stride, uint32_t len, uint64_t num, const uint8_t *buf, uint64_t pc, uint32_t trace_info);
 
 template<typename ARCH>
 class general_reg_cache{
@@ -35,6 +54,7 @@ class general_reg_cache{
     }
     public:
     general_reg_cache(){clear();}
+    void discard(){clear();}
     llvm::Value * set(typename ARCH::reg_e r, llvm::Value *v, bool dirty){
         jcpu_assert(static_cast<unsigned int>(r) < num_regs);
         regs[r].second |= dirty;
@@ -46,8 +66,10 @@ class general_reg_cache{
         return regs[r].first;
     }
     template<typename F>
-    void flush_and_clear(const F &f){
-        for(size_t i = 0; i < num_regs; ++i){
+    void flush_and_clear(const F &f){flush_and_clear(f, 0, num_regs);}
+    template<typename F>
+    void flush_and_clear(const F &f, size_t from, size_t to){
+        for(size_t i = from; i < to; ++i){
             if(regs[i].second){//dirty
                 f(static_cast<typename ARCH::reg_e>(i), regs[i].first);
             }
@@ -57,14 +79,28 @@ class general_reg_cache{
 
 };
 
-
-class jcpu_vm_if{
-    public:
-    virtual uint64_t get_cur_disas_virt_pc()const = 0;
-    virtual void dump_regs()const = 0;
-    virtual ~jcpu_vm_if(){}
+//State of the block being translated.
+template<typename ARCH>
+struct translation_job{
+    typedef typename ARCH::virt_addr_t virt_addr_t;
+    typedef typename ARCH::phys_addr_t phys_addr_t;
+    general_reg_cache<ARCH> reg_cache;
+    std::stack<std::pair<virt_addr_t, phys_addr_t> > processing_pc;
+    unsigned int insn_offset; //index of the instruction being translated in the current block
+    bool speculative; //translating ahead of execution, so invalid code throws speculation_failed
+    std::vector<uint64_t> successors; //start addresses of blocks statically reachable from this one
+    translation_job() : insn_offset(0), speculative(false){}
+    void discard(){
+        reg_cache.discard();
+        while(!processing_pc.empty()) processing_pc.pop();
+        insn_offset = 0;
+        successors.clear();
+    }
 };
 
+//Thrown instead of aborting when a speculative translation meets code which is not supported.
+struct speculation_failed{};
+
 template<typename T, typename ARCH, int TAG>
 class primitive_type_holder{
     T v;
@@ -80,7 +116,7 @@ class primitive_type_holder{
 template<typename ARCH>
 class basic_block{
     typedef typename ARCH::phys_addr_t phys_addr_t;
-    typedef typename ARCH::target_ulong (*basic_block_func_t)();
+    typedef typename ARCH::target_ulong (*basic_block_func_t)(cpu_state<ARCH> *);
 
     const phys_addr_t start_phys_addr, end_phys_addr;
     const llvm::Function *const func;
@@ -93,40 +129,242 @@ class basic_block{
         func_ptr(reinterpret_cast<basic_block_func_t>(ee->getPointerToFunction(f))),
         num_insn(insn)
     {}
-    typename ARCH::virt_addr_t exec()const{return static_cast<typename ARCH::virt_addr_t>((*func_ptr)());}
+    typename ARCH::virt_addr_t exec(cpu_state<ARCH> &state)const{return static_cast<typename ARCH::virt_addr_t>((*func_ptr)(&state));}
     unsigned int get_icount()const{return num_insn;}
     phys_addr_t get_start_addr()const{return start_phys_addr;}
     phys_addr_t get_end_addr()const{return end_phys_addr;}
 };
 
+class scoped_lock{
+    pthread_mutex_t *const mutex;
+    scoped_lock(const scoped_lock &);
+    scoped_lock & operator = (const scoped_lock &);
+    public:
+    explicit scoped_lock(pthread_mutex_t *m) : mutex(m){if(mutex) pthread_mutex_lock(mutex);}
+    ~scoped_lock(){if(mutex) pthread_mutex_unlock(mutex);}
+};
+
+//Shared by all harts after set_shared().
+//find() takes no lock. Insertion and removal are serialised by the mutex, and removed blocks are
+//deleted once every hart has called quiescent() or offline() since then.
 template<typename ARCH>
 class bb_manager{
     typedef typename ARCH::phys_addr_t phys_addr_t;
+    typedef typename ARCH::target_ulong target_ulong;
     typedef basic_block<ARCH> bb_type;
+    struct lookup_table{//open addressing, grown by copying
+        const size_t mask;
+        size_t used; //including tombstones
+        bb_type **const slots;
+        explicit lookup_table(size_t n) : mask(n - 1), used(0), slots(new bb_type *[n]()){}
+        ~lookup_table(){delete [] slots;}
+    };
     std::map<phys_addr_t, bb_type *> bb_by_start;
     std::multimap<phys_addr_t, bb_type *> bb_by_end;
+    target_ulong max_bb_size;
+    lookup_table *table;
+    epoch_reclaimer reclaimer;
+    mutable pthread_mutex_t mutex;
+    bool shared;
+    static const size_t max_recent_invalidations = 64;
+    std::deque<std::pair<target_ulong, target_ulong> > recent_invalidations; //the last ranges given to invalidate()
+    uint64_t num_invalidations;
+    std::vector<uint64_t> written_code_pages; //reported by sparse_memory while blocks may be running, invalidated by invalidate_written()
+    uint32_t has_written_code;
+    pthread_mutex_t *lock()const{return shared ? &mutex : JCPU_NULLPTR;}
+    bb_manager(const bb_manager &);
+    bb_manager & operator = (const bb_manager &);
+    static bb_type *tombstone(){return reinterpret_cast<bb_type *>(1);}
+    static size_t hash(phys_addr_t p){return static_cast<size_t>((static_cast<uint64_t>(static_cast<target_ulong>(p)) >> 1) * 0x9E3779B97F4A7C15ULL >> 24);}
+    static void delete_bb(void *p){delete static_cast<bb_type *>(p);}
+    static void delete_table(void *p){delete static_cast<lookup_table *>(p);}
+    void dispose(epoch_reclaimer::deleter_t deleter, void *p){
+        if(shared) reclaimer.retire(deleter, p);
+        else (*deleter)(p); //the only reader is the caller
+    }
+    static void table_insert(lookup_table *t, bb_type *bb){
+        for(size_t i = hash(bb->get_start_addr()) & t->mask; ; i = (i + 1) & t->mask){
+            bb_type *const s = t->slots[i];
+            if(!s || s == tombstone()){
+                if(!s) ++t->used;
+                __atomic_store_n(&t->slots[i], bb, __ATOMIC_RELEASE);
+                return;
+            }
+        }
+    }
+    void table_erase(const bb_type *bb){
+        for(size_t i = hash(bb->get_start_addr()) & table->mask; ; i = (i + 1) & table->mask){
+            if(table->slots[i] == bb){
+                __atomic_store_n(&table->slots[i], tombstone(), __ATOMIC_RELEASE);
+                return;
+            }
+            jcpu_assert(table->slots[i]);
+        }
+    }
+    void publish_table(size_t min_size){
+        size_t n = 1024;
+        while(n < min_size * 4) n *= 2;
+        lookup_table *const t = new lookup_table(n);
+        for(typename std::map<phys_addr_t, bb_type *>::const_iterator it = bb_by_start.begin(), it_end = bb_by_start.end(); it != it_end; ++it){
+            table_insert(t, it->second);
+        }
+        lookup_table *const old = table;
+        __atomic_store_n(&table, t, __ATOMIC_RELEASE);
+        if(old) dispose(&delete_table, old);
+    }
+    void remove(typename std::map<phys_addr_t, bb_type *>::iterator it){
+        bb_type *const bb = it->second;
+        typedef typename std::multimap<phys_addr_t, bb_type *>::iterator end_it_t;
+        const std::pair<end_it_t, end_it_t> range = bb_by_end.equal_range(bb->get_end_addr());
+        for(end_it_t i = range.first; i != range.second; ++i){
+            if(i->second == bb){
+                bb_by_end.erase(i);
+                break;
+            }
+        }
+        table_erase(bb);
+        bb_by_start.erase(it);
+        dispose(&delete_bb, bb);
+    }
+    void remove_range(phys_addr_t from, phys_addr_t to){//removes blocks which have an instruction in [from, to)
+        const target_ulong from_raw = from, to_raw = to;
+        const target_ulong search_from = from_raw > max_bb_size + 8 ? from_raw - max_bb_size - 8 : 0;
+        typename std::map<phys_addr_t, bb_type *>::iterator it = bb_by_start.lower_bound(phys_addr_t(search_from));
+        while(it != bb_by_start.end() && static_cast<target_ulong>(it->first) < to_raw){
+            const target_ulong last_insn = it->second->get_end_addr();
+            if(last_insn + 8 > from_raw){//the last instruction may have a delay slot
+                remove(it++);
+            }
+            else{
+                ++it;
+            }
+        }
+    }
+    void remove_all(){
+        std::map<phys_addr_t, bb_type *> old;
+        old.swap(bb_by_start);
+        bb_by_end.clear();
+        max_bb_size = 0;
+        publish_table(0); //readers stop finding the blocks before they are retired
+        for(typename std::map<phys_addr_t, bb_type *>::const_iterator it = old.begin(), it_end = old.end(); it != it_end; ++it){
+            dispose(&delete_bb, it->second);
+        }
+        if(shared) reclaimer.reclaim();
+    }
+    void invalidate_range(phys_addr_t from, phys_addr_t to){
+        recent_invalidations.push_back(std::make_pair(static_cast<target_ulong>(from), static_cast<target_ulong>(to)));
+        if(recent_invalidations.size() > max_recent_invalidations) recent_invalidations.pop_front();
+        __atomic_store_n(&num_invalidations, num_invalidations + 1, __ATOMIC_RELEASE);
+        remove_range(from, to);
+    }
     public:
-    void add(bb_type *bb){
+    bb_manager() : max_bb_size(0), table(JCPU_NULLPTR), shared(false), num_invalidations(0), has_written_code(0){
+        pthread_mutex_init(&mutex, JCPU_NULLPTR);
+        publish_table(0);
+    }
+    ~bb_manager(){
+        clear();
+        delete table;
+        pthread_mutex_destroy(&mutex);
+    }
+    void set_shared(){shared = true;}
+    unsigned int add_reader(){
+        const scoped_lock l(lock());
+        return reclaimer.add_reader();
+    }
+    //Called by each hart between blocks, and when it stops running blocks.
+    void quiescent(unsigned int reader_id){if(shared) reclaimer.quiescent(reader_id);}
+    void offline(unsigned int reader_id){if(shared) reclaimer.offline(reader_id);}
+    //returns the block already registered if another hart translated the same address first
+    const bb_type *add(bb_type *bb){
+        const scoped_lock l(lock());
         typename std::map<phys_addr_t, bb_type *>::const_iterator i = bb_by_start.find(bb->get_start_addr());
-        if(i != bb_by_start.end()){abort();}
+        if(i != bb_by_start.end()){
+            jcpu_assert(shared);
+            delete bb;
+            return i->second;
+        }
         bb_by_start[bb->get_start_addr()] = bb;
         bb_by_end.insert(std::make_pair(bb->get_end_addr(), bb));
+        const target_ulong size = static_cast<target_ulong>(bb->get_end_addr()) - static_cast<target_ulong>(bb->get_start_addr());
+        if(size > max_bb_size) max_bb_size = size;
+        if((table->used + 1) * 2 > table->mask + 1){
+            publish_table(bb_by_start.size());
+        }
+        else{
+            table_insert(table, bb);
+        }
+        if(shared) reclaimer.reclaim();
+        return bb;
+    }
+    const bb_type *find(phys_addr_t p)const{//returns NULL if not translated yet
+        const lookup_table *const t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+        for(size_t i = hash(p) & t->mask; ; i = (i + 1) & t->mask){
+            const bb_type *const bb = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+            if(!bb) return JCPU_NULLPTR;
+            if(bb != tombstone() && bb->get_start_addr() == p) return bb;
+        }
     }
     bool exists_by_start_addr(phys_addr_t p)const{
-        typename std::map<phys_addr_t, bb_type *>::const_iterator i = bb_by_start.find(p);
-        return i != bb_by_start.end();
+        return find(p) != JCPU_NULLPTR;
     }
     const bb_type * find_by_start_addr(phys_addr_t p)const{
-        typename std::map<phys_addr_t, bb_type *>::const_iterator i = bb_by_start.find(p);
-        return i->second;
+        return find(p);
     }
     int exists_by_end_addr(phys_addr_t p)const{
+        const scoped_lock l(lock());
         return bb_by_end.count(p);
     }
-    void invalidate(phys_addr_t from, phys_addr_t to){
-        //FIXME invalide bb only in range
-        bb_by_start.clear();
-        bb_by_end.clear();
+    void remove_blocks(phys_addr_t from, phys_addr_t to){//removes blocks which have an instruction in [from, to), the code itself is not changed
+        const scoped_lock l(lock());
+        remove_range(from, to);
+        if(shared) reclaimer.reclaim();
+    }
+    void invalidate(phys_addr_t from, phys_addr_t to){//the code in [from, to) is changed, so its decoded instructions are also dropped
+        const scoped_lock l(lock());
+        invalidate_range(from, to);
+        if(shared) reclaimer.reclaim();
+    }
+    //sparse_memory::code_write_hook_t. The writer may be in the middle of a block, which must not be deleted under it.
+    static void code_written(void *self, uint64_t page_addr){
+        bb_manager *const m = static_cast<bb_manager *>(self);
+        const scoped_lock l(&m->mutex); //the hook may be called by any hart, even before set_shared()
+        m->written_code_pages.push_back(page_addr);
+        __atomic_store_n(&m->has_written_code, 1, __ATOMIC_RELEASE);
+    }
+    //Called by the harts between blocks, and after the memory is written while no block runs
+    void invalidate_written(){
+        if(!__atomic_load_n(&has_written_code, __ATOMIC_ACQUIRE)) return;
+        std::vector<uint64_t> pages;
+        {
+            const scoped_lock l(&mutex);
+            pages.swap(written_code_pages);
+            __atomic_store_n(&has_written_code, 0, __ATOMIC_RELEASE);
+        }
+        const scoped_lock l(lock());
+        for(std::vector<uint64_t>::const_iterator it = pages.begin(), it_end = pages.end(); it != it_end; ++it){
+            invalidate_range(phys_addr_t(*it), phys_addr_t(*it + sparse_memory::page_size));
+        }
+        if(shared) reclaimer.reclaim();
+    }
+    //For the caches of decoded instructions, which are per hart. Appends the ranges given to invalidate() after its first seq calls
+    //and returns the number of the calls so far. all is set instead if some of the ranges are no longer kept.
+    uint64_t get_num_invalidations()const{return __atomic_load_n(&num_invalidations, __ATOMIC_ACQUIRE);}
+    uint64_t get_invalidations_since(uint64_t seq, std::vector<std::pair<target_ulong, target_ulong> > &ranges, bool &all)const{
+        const scoped_lock l(lock());
+        all = num_invalidations - seq > recent_invalidations.size();
+        if(!all) ranges.insert(ranges.end(), recent_invalidations.end() - (num_invalidations - seq), recent_invalidations.end());
+        return num_invalidations;
+    }
+    void clear(){//keeps the decoded instructions, as the code itself is not changed
+        const scoped_lock l(lock());
+        remove_all();
+    }
+    void invalidate_all(){//the decoded instructions of all harts are dropped as well
+        const scoped_lock l(lock());
+        recent_invalidations.clear(); //so that get_invalidations_since() sets all
+        __atomic_store_n(&num_invalidations, num_invalidations + 1, __ATOMIC_RELEASE);
+        remove_all();
     }
 };
 
@@ -174,21 +412,33 @@ class ir_builder_wrapper{
     llvm::Type *getInt16Ty()const;
     llvm::Type *getInt32Ty()const;
     llvm::Type *getInt64Ty()const;
+    llvm::Type *getFloatTy()const;
+    llvm::Type *getDoubleTy()const;
     void SetInsertPoint(llvm::BasicBlock *)const;
     llvm::ReturnInst *CreateRet(llvm::Value *)const;
     llvm::CallInst *CreateCall(llvm::Function *, const char * = "")const;
     llvm::CallInst *CreateCall(llvm::Function *, llvm::Value *, const char * = "")const;
     llvm::CallInst *CreateCall2(llvm::Function *, llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::CallInst *CreateCall3(llvm::Function *, llvm::Value *, llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::CallInst *CreateCall(llvm::Function *, const std::vector<llvm::Value *> &, const char * = "")const;
     llvm::Value *CreateSelect(llvm::Value *, llvm::Value *, llvm::Value *, const char *)const;
     llvm::Value *CreateZExt(llvm::Value *, llvm::Type *, const char * = "")const;
     llvm::Value *CreateSExt(llvm::Value *, llvm::Type *, const char * = "")const;
     llvm::Value *CreateTrunc(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateBitCast(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateFPToSI(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateFPToUI(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateSIToFP(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateUIToFP(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateFPExt(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateFPTrunc(llvm::Value *, llvm::Type *, const char * = "")const;
     llvm::Value *CreateAdd(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateSub(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateMul(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateSDiv(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateUDiv(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateSRem(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateURem(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateOr(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateAnd(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateXor(llvm::Value *, llvm::Value *, const char * = "")const;
@@ -205,10 +455,36 @@ class ir_builder_wrapper{
     llvm::Value *CreateICmpSLT(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateICmpSGE(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateICmpSGT(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFAdd(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFSub(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFMul(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFDiv(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFNeg(llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFCmpOEQ(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFCmpOLT(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFCmpOLE(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFCmpOGE(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFCmpOGT(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateFCmpUNO(llvm::Value *, llvm::Value *, const char * = "")const;
     llvm::Value *CreateShl(llvm::Value *, unsigned int, const char * = "")const;
     llvm::Value *CreateLShr(llvm::Value *, unsigned int, const char * = "")const;
     llvm::Value *CreateAShr(llvm::Value *, unsigned int, const char * = "")const;
     llvm::Value *CreateAnd(llvm::Value *, unsigned int, const char * = "")const;
+    llvm::BranchInst *CreateBr(llvm::BasicBlock *)const;
+    llvm::BranchInst *CreateCondBr(llvm::Value *, llvm::BasicBlock *, llvm::BasicBlock *)const;
+    llvm::PHINode *CreatePHI(llvm::Type *, unsigned int, const char * = "")const;
+    llvm::Value *CreatePointerCast(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreatePtrToInt(llvm::Value *, llvm::Type *, const char * = "")const;
+    llvm::Value *CreateInsertElement(llvm::Value *, llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateExtractElement(llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateShuffleVector(llvm::Value *, llvm::Value *, llvm::Value *, const char * = "")const;
+    llvm::Value *CreateAtomicRMW(llvm::AtomicRMWInst::BinOp, llvm::Value *, llvm::Value *)const; //sequentially consistent
+    llvm::Value *CreateAtomicCmpXchg(llvm::Value *, llvm::Value *, llvm::Value *)const; //returns the old value
+    void CreateFence()const;
+    llvm::Value *CreateLoad(llvm::Value *, const char * = "")const;
+    void CreateStore(llvm::Value *, llvm::Value *)const;
+    llvm::Value *CreateUnalignedLoad(llvm::Value *, const char * = "")const; //for host pointers to guest memory
+    void CreateUnalignedStore(llvm::Value *, llvm::Value *)const;
 
 };
 
@@ -231,16 +507,37 @@ class jcpu_vm_base : public ::jcpu::vm::jcpu_vm_if, public ::jcpu::gdb::gdb_targ
     llvm::ExecutionEngine *ee;
     llvm::Function *cur_func;
     llvm::BasicBlock *cur_bb;
-    mutable general_reg_cache<ARCH> reg_cache;
-    target_ulong (*get_reg_func)(uint16_t);
-    void (*set_reg_func)(uint16_t, target_ulong);
-    bb_manager<ARCH> bb_man;
+    llvm::Value *cur_state; //argument of cur_func
+    mutable translation_job<ARCH> job;
+    cpu_state<ARCH> state;
+    target_ulong get_reg_func(uint16_t r)const{return state.regs[r];}
+    void set_reg_func(uint16_t r, target_ulong val){state.regs[r] = val;}
+    bb_manager<ARCH> own_bb_man;
+    bb_manager<ARCH> &bb_man; //own_bb_man, or the one shared with the other harts
+    const unsigned int bb_reader_id;
     bp_manager<ARCH> bp_man;
-    std::stack<std::pair<virt_addr_t, phys_addr_t> > processing_pc;
     int mem_region;
     uint64_t total_icount;
+    uint64_t icount_limit; //run() returns when total_icount reaches this
+    sparse_memory *const ram;
+    enum request_e{REQ_SNAPSHOT = 1, REQ_RESTORE = 2, REQ_MEM_TRACE_OFF = 4, REQ_EXIT = 8, REQ_FLUSH_CODE = 16};
+    bool running;
+    unsigned int pending_requests;
+    bool exited; //by the guest, run() returns after the current block and does not run it any more
+    int exit_code;
+    struct snapshot_data{
+        bool valid;
+        std::vector<target_ulong> regs;
+        uint64_t total_icount;
+        snapshot_data() : valid(false), total_icount(0){}
+    } snap;
+    mem_tracer *tracer; //memory accesses are traced only by blocks translated while this is set
+    bool parallel; //harts run on several host threads, so fences are needed
+    decoded_cache decoded;
+    uint64_t decoded_invalidations; //bb_man.get_num_invalidations() when decoded was last synchronized
 
     llvm::Type *get_reg_type()const;
+    llvm::Function *create_bb_func(const char *name);
     llvm::Value *gen_get_reg(reg_e r, const char *nm = "")const;
     void gen_set_reg(reg_e r, llvm::Value *val)const;
     llvm::ConstantInt * gen_const(target_ulong val)const;
@@ -248,18 +545,52 @@ class jcpu_vm_base : public ::jcpu::vm::jcpu_vm_if, public ::jcpu::gdb::gdb_targ
     llvm::Value *gen_cond_code(llvm::Value *cond, llvm::Value *t, llvm::Value *f, const char *mn = "")const;//cond must be 1 or 0
     llvm::CallInst * gen_sw(llvm::Value *addr, unsigned int, llvm::Value *val)const;
     llvm::Value * gen_lw(llvm::Value *addr, unsigned int, const char *mn = "")const;
+    void gen_mem_trace(llvm::Value *addr, unsigned int, llvm::Value *val, bool is_write)const;
+    llvm::Function *declare_host_func(const char *name, llvm::Type *ret, const std::vector<llvm::Type *> &args, void *func);
+    llvm::Value *gen_entry_alloca(llvm::Type *, const char *); //stack slot which does not grow in loops
+    void gen_flush_regs(reg_e from, reg_e to); //writes back cached registers in [from, to) before host functions access them
+    llvm::Value *gen_dmi_ptr(llvm::Value *addr64, bool is_write);
+    //Atomic on the host when jcpu_ext_if::get_dmi_ptr() gives the memory. They return the old value.
+    llvm::Value *gen_atomic_rmw(llvm::AtomicRMWInst::BinOp, llvm::Value *addr, unsigned int, llvm::Value *val);
+    llvm::Value *gen_atomic_cmpxchg(llvm::Value *addr, unsigned int, llvm::Value *expected, llvm::Value *desired);
+    void gen_fence()const;
+    //Calls jcpu_fp_exact(). rm is i32, and *flags is set to the i32 exception flags raised by the operation.
+    llvm::Value *gen_fp_exact(fp_op_e, bool is_double, llvm::Value *a, llvm::Value *b, llvm::Value *c, llvm::Value *rm, llvm::Value **flags);
+    //Floating point values are handled as i64. Single values are in the lower 32 bits.
+    llvm::Value *gen_to_fp(llvm::Value *, bool is_double);
+    llvm::Value *gen_from_fp(llvm::Value *, bool is_double, const char *);
+    //By host instructions, which raise the host flags. The rounding mode is RNE, or RTZ for FP_TO_*.
+    //*invalid is set to i1 which is true if the invalid flag should be raised but the host does not, or NULL if it never happens.
+    llvm::Value *gen_fp_native(fp_op_e, bool is_double, llvm::Value *a, llvm::Value *b, llvm::Value *c, llvm::Value **invalid = JCPU_NULLPTR);
+    void gen_fp_clear_host_flags(); //calls jcpu_fp_clear_host_flags()
+    llvm::Value *gen_fp_host_flags(llvm::Value *keep); //calls jcpu_fp_host_flags() and returns i32
+    //vl elements of the vector type are accessed. stride is NULL for unit stride accesses, which use the host memory directly if possible.
+    //Elements of the loaded value at vl and after are undefined.
+    llvm::Value *gen_vector_load(llvm::Value *addr, llvm::Value *stride, llvm::Type *, llvm::Value *vl);
+    void gen_vector_store(llvm::Value *addr, llvm::Value *stride, llvm::Value *val, llvm::Value *vl);
 
     //gdb_target_if
     virtual unsigned int get_reg_width()const JCPU_OVERRIDE;
     virtual run_state_e run_continue(bool is_step) JCPU_OVERRIDE;
     virtual uint64_t read_mem_dbg(uint64_t virt_addr, unsigned int len) JCPU_OVERRIDE;
     virtual void write_mem_dbg(uint64_t virt_addr, unsigned int len, uint64_t val) JCPU_OVERRIDE;
+    virtual void read_mem_block_dbg(uint64_t virt_addr, void *dst, size_t len) JCPU_OVERRIDE;
+    virtual void write_mem_block_dbg(uint64_t virt_addr, const void *src, size_t len) JCPU_OVERRIDE;
     virtual void set_unset_break_point(bool set, uint64_t virt_addr) JCPU_OVERRIDE;
     virtual void start_func(phys_addr_t) = 0;
     llvm::Function *end_func();
+    void inline_helpers(llvm::Function *); //inlines calls to the functions linked by link_helpers()
+    void abort_func(); //discards the block being translated
     virtual run_state_e run() = 0;
     virtual run_state_e step_exec() = 0;
     phys_addr_t code_v2p(virt_addr_t pc){return static_cast<phys_addr_t>(pc);} //FIXME implement MMU
+    decoded_insn &get_decoded(phys_addr_t pc); //the slot of pc in decoded, after dropping the pages invalidated since the last call
+    void mark_code(phys_addr_t pc, unsigned int len){if(ram) ram->mark_code(static_cast<target_ulong>(pc), len);} //writes to the pages invalidate the blocks
+    virtual void take_snapshot();
+    virtual void restore_snapshot();
+    void service_requests();
+    void request_exit(int code){exit_code = code; exited = true; pending_requests |= REQ_EXIT;}
+    void request_code_flush(){pending_requests |= REQ_FLUSH_CODE;} //drops the blocks and the decoded instructions of all harts after the current block
     template<typename FUNC_PTR>
     FUNC_PTR get_func_ptr(const char *func_name)
     {
@@ -271,11 +602,21 @@ class jcpu_vm_base : public ::jcpu::vm::jcpu_vm_if, public ::jcpu::gdb::gdb_targ
 #endif
         return func;
     }
-    explicit jcpu_vm_base(jcpu_ext_if &);
+    jcpu_vm_base(jcpu_ext_if &, sparse_memory *, bb_manager<ARCH> * = JCPU_NULLPTR);
     public:
+    ~jcpu_vm_base();
     void dump_ir()const;
+    void snapshot();
+    void restore();
+    void start_mem_trace(const char *);
+    void stop_mem_trace();
     uint64_t get_total_insn_count()const{return total_icount;}
-    virtual uint64_t get_cur_disas_virt_pc()const JCPU_OVERRIDE{return processing_pc.empty() ? -1 : processing_pc.top().first;}
+    void set_icount_limit(uint64_t limit){icount_limit = limit;}
+    bool has_exited()const{return exited;}
+    int get_exit_code()const{return exit_code;}
+    bb_manager<ARCH> &get_bb_manager(){return bb_man;}
+    void set_parallel(){parallel = true;}
+    virtual uint64_t get_cur_disas_virt_pc()const JCPU_OVERRIDE{return job.processing_pc.empty() ? -1 : job.processing_pc.top().first;}
 };
 
 template<typename ARCH>
@@ -288,6 +629,19 @@ llvm::Type *jcpu_vm_base<ARCH>::get_reg_type()const{
         jcpu_assert(!"Not supported yet");
 }
 
+template<typename ARCH>
+llvm::Function *jcpu_vm_base<ARCH>::create_bb_func(const char *name){
+    std::vector<llvm::Type*> args;
+    args.push_back(llvm::Type::getInt8PtrTy(*context));
+    llvm::FunctionType *const func_type = llvm::FunctionType::get(get_reg_type(), args, false);
+    llvm::Function *const func = llvm::Function::Create(func_type, llvm::GlobalValue::ExternalLinkage, name, mod);
+    func->setCallingConv(llvm::CallingConv::C);
+    cur_state = &*func->arg_begin();
+    cur_state->setName("state");
+    job.successors.clear();
+    return func;
+}
+
 template<typename ARCH>
 llvm::ConstantInt *jcpu_vm_base<ARCH>::reg_index(reg_e r)const{
     return llvm::ConstantInt::get(*context, llvm::APInt(16, r));
@@ -295,12 +649,12 @@ llvm::ConstantInt *jcpu_vm_base<ARCH>::reg_index(reg_e r)const{
 
 template<typename ARCH>
 llvm::CallInst *jcpu_vm_base<ARCH>::gen_get_reg(llvm::Value *reg, const char *mn)const{
-    return builder->CreateCall(mod->getFunction("get_reg"), reg, mn);
+    return builder->CreateCall2(mod->getFunction(ARCH::reg_bit_width == 32 ? "get_reg32" : "get_reg64"), cur_state, reg, mn);
 }
 
 template<typename ARCH>
 llvm::CallInst *jcpu_vm_base<ARCH>::gen_set_reg(llvm::Value *reg, llvm::Value *val)const{
-    return builder->CreateCall2(mod->getFunction("set_reg"), builder->CreateTrunc(reg, builder->getInt16Ty()), val);
+    return builder->CreateCall3(mod->getFunction(ARCH::reg_bit_width == 32 ? "set_reg32" : "set_reg64"), cur_state, builder->CreateTrunc(reg, builder->getInt16Ty()), val);
 }
 
 template<typename ARCH>
@@ -314,20 +668,20 @@ struct jcpu_vm_base<ARCH>::set_reg_functor{
 
 template<typename ARCH>
 llvm::Value *jcpu_vm_base<ARCH>::gen_get_reg(reg_e r, const char *nm)const{
-    llvm::Value *const latest = reg_cache.get(r);
+    llvm::Value *const latest = job.reg_cache.get(r);
     if(latest){
         return latest;
     }
     else{
         std::stringstream ss;
         ss << nm << "_reg" << r;
-        return reg_cache.set(r, gen_get_reg(reg_index(r), ss.str().c_str()), false);
+        return job.reg_cache.set(r, gen_get_reg(reg_index(r), ss.str().c_str()), false);
     }
 }
 
 template<typename ARCH>
 void jcpu_vm_base<ARCH>::gen_set_reg(reg_e r, llvm::Value *val)const{
-    reg_cache.set(r, val, true); 
+    job.reg_cache.set(r, val, true); 
 }
 
 template<typename ARCH>
@@ -337,7 +691,7 @@ llvm::ConstantInt * jcpu_vm_base<ARCH>::gen_const(target_ulong val)const{
 
 template<typename ARCH>
 llvm::ConstantInt * jcpu_vm_base<ARCH>::gen_get_pc()const{
-    return gen_const(processing_pc.top().first);
+    return gen_const(job.processing_pc.top().first);
 }
 
 template<typename ARCH>
@@ -352,21 +706,26 @@ template<typename ARCH>
 llvm::CallInst * jcpu_vm_base<ARCH>::gen_sw(llvm::Value *addr, unsigned int len, llvm::Value *val)const{
     jcpu_assert(len == 1 || len == 2 || len == 4 || len == 8);
     llvm::Value *const len_llvm = llvm::ConstantInt::get(*context, llvm::APInt(sizeof(unsigned int)*8, len));
-    return builder->CreateCall3(
-            mod->getFunction("helper_mem_write"),
-            builder->CreateZExt(addr, builder->getInt64Ty()), 
-            len_llvm,
-            builder->CreateZExt(val, builder->getInt64Ty())
-            );
+    std::vector<llvm::Value *> args;
+    args.reserve(4);
+    args.push_back(cur_state);
+    args.push_back(builder->CreateZExt(addr, builder->getInt64Ty()));
+    args.push_back(len_llvm);
+    args.push_back(builder->CreateZExt(val, builder->getInt64Ty()));
+    llvm::CallInst *const cinst = builder->CreateCall(mod->getFunction("helper_mem_write"), args);
+    if(tracer) gen_mem_trace(addr, len, val, true);
+    return cinst;
 }
 
 template<typename ARCH>
 llvm::Value * jcpu_vm_base<ARCH>::gen_lw(llvm::Value *addr, unsigned int len, const char *mn)const{
     jcpu_assert(len == 1 || len == 2 || len == 4 || len == 8);
     llvm::Value *const len_llvm = llvm::ConstantInt::get(*context, llvm::APInt(sizeof(unsigned int)*8, len));
-    llvm::CallInst *const cinst = builder->CreateCall2(mod->getFunction("helper_mem_read"),
+    llvm::CallInst *const cinst = builder->CreateCall3(mod->getFunction("helper_mem_read"),
+            cur_state,
             builder->CreateZExt(addr, builder->getInt64Ty()),
             len_llvm, mn);
+    if(tracer) gen_mem_trace(addr, len, cinst, false);
     switch(len){
         case 1: return builder->CreateTrunc(cinst, builder->getInt8Ty());
         case 2: return builder->CreateTrunc(cinst, builder->getInt16Ty());
@@ -378,6 +737,406 @@ llvm::Value * jcpu_vm_base<ARCH>::gen_lw(llvm::Value *addr, unsigned int len, co
 }
 
 
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::gen_mem_trace(llvm::Value *addr, unsigned int len, llvm::Value *val, bool is_write)const{
+    std::vector<llvm::Value *> args;
+    args.reserve(5);
+    args.push_back(cur_state);
+    args.push_back(builder->CreateZExt(addr, builder->getInt64Ty()));
+    args.push_back(builder->CreateZExt(val, builder->getInt64Ty()));
+    args.push_back(llvm::ConstantInt::get(builder->getInt64Ty(), job.processing_pc.top().first));
+    args.push_back(llvm::ConstantInt::get(builder->getInt32Ty(), mem_tracer::make_info(len, is_write, job.insn_offset)));
+    builder->CreateCall(mod->getFunction("jcpu_mem_trace_hook"), args);
+}
+
+template<typename ARCH>
+llvm::Function *jcpu_vm_base<ARCH>::declare_host_func(const char *name, llvm::Type *ret, const std::vector<llvm::Type *> &args, void *func){
+    if(llvm::Function *const f = mod->getFunction(name)) return f;
+    llvm::Function *const f = llvm::Function::Create(llvm::FunctionType::get(ret, args, false), llvm::GlobalValue::ExternalLinkage, name, mod);
+    ee->addGlobalMapping(f, func);
+    return f;
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_entry_alloca(llvm::Type *type, const char *nm){
+    llvm::BasicBlock &entry = cur_func->getEntryBlock();
+    return llvm::IRBuilder<>(&entry, entry.begin()).CreateAlloca(type, JCPU_NULLPTR, nm);
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::gen_flush_regs(reg_e from, reg_e to){
+    job.reg_cache.flush_and_clear(set_reg_functor(this), from, to);
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_dmi_ptr(llvm::Value *addr64, bool is_write){
+    llvm::Type *const i8_ptr_type = llvm::PointerType::getUnqual(builder->getInt8Ty());
+    std::vector<llvm::Type *> dmi_args;
+    dmi_args.push_back(i8_ptr_type);
+    dmi_args.push_back(builder->getInt64Ty());
+    llvm::Function *const func = is_write ?
+        declare_host_func("jcpu_dmi_ptr", i8_ptr_type, dmi_args, reinterpret_cast<void *>(&jcpu_dmi_ptr)) :
+        declare_host_func("jcpu_dmi_read_ptr", i8_ptr_type, dmi_args, reinterpret_cast<void *>(&jcpu_dmi_read_ptr));
+    return builder->CreateCall2(func, cur_state, addr64, "dmi");
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_atomic_rmw(llvm::AtomicRMWInst::BinOp op, llvm::Value *addr, unsigned int len, llvm::Value *val){
+    using namespace llvm;
+    jcpu_assert(len == 4 || len == 8);
+    Type *const int_type = IntegerType::get(*context, len * 8);
+    Type *const i8_ptr_type = PointerType::getUnqual(builder->getInt8Ty());
+    Value *const addr64 = builder->CreateZExt(addr, builder->getInt64Ty());
+    Value *const val_n = builder->CreateTrunc(val, int_type);
+    Value *const host = gen_dmi_ptr(addr64, true);
+    BasicBlock *const fast = BasicBlock::Create(*context, "amo_dmi", cur_func);
+    BasicBlock *const slow = BasicBlock::Create(*context, "amo_io", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "amo_end", cur_func);
+    builder->CreateCondBr(builder->CreateICmpNE(host, ConstantPointerNull::get(cast<PointerType>(i8_ptr_type))), fast, slow);
+
+    builder->SetInsertPoint(fast);
+    Value *const fast_old = builder->CreateAtomicRMW(op, builder->CreatePointerCast(host, PointerType::getUnqual(int_type)), val_n);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(slow);
+    std::vector<Type *> slow_types;
+    slow_types.push_back(i8_ptr_type);
+    slow_types.push_back(builder->getInt64Ty());
+    slow_types.push_back(builder->getInt32Ty());
+    slow_types.push_back(builder->getInt32Ty());
+    slow_types.push_back(builder->getInt64Ty());
+    std::vector<Value *> slow_args;
+    slow_args.push_back(cur_state);
+    slow_args.push_back(addr64);
+    slow_args.push_back(ConstantInt::get(builder->getInt32Ty(), len));
+    slow_args.push_back(ConstantInt::get(builder->getInt32Ty(), op));
+    slow_args.push_back(builder->CreateZExt(val_n, builder->getInt64Ty()));
+    Value *const slow_old = builder->CreateTrunc(builder->CreateCall(declare_host_func("jcpu_amo_slow", builder->getInt64Ty(), slow_types,
+                    reinterpret_cast<void *>(&jcpu_amo_slow)), slow_args, "amo"), int_type);
+    builder->CreateBr(join);
+
+    //values cached in job.reg_cache are made before the branch, so they still dominate
+    builder->SetInsertPoint(join);
+    cur_bb = join;
+    PHINode *const old = builder->CreatePHI(int_type, 2, "amo");
+    old->addIncoming(fast_old, fast);
+    old->addIncoming(slow_old, slow);
+    if(tracer) gen_mem_trace(addr, len, old, false);
+    return old;
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_atomic_cmpxchg(llvm::Value *addr, unsigned int len, llvm::Value *expected, llvm::Value *desired){
+    using namespace llvm;
+    jcpu_assert(len == 4 || len == 8);
+    Type *const int_type = IntegerType::get(*context, len * 8);
+    Type *const i8_ptr_type = PointerType::getUnqual(builder->getInt8Ty());
+    Value *const addr64 = builder->CreateZExt(addr, builder->getInt64Ty());
+    Value *const expected_n = builder->CreateTrunc(expected, int_type);
+    Value *const desired_n = builder->CreateTrunc(desired, int_type);
+    Value *const host = gen_dmi_ptr(addr64, true);
+    BasicBlock *const fast = BasicBlock::Create(*context, "cas_dmi", cur_func);
+    BasicBlock *const slow = BasicBlock::Create(*context, "cas_io", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "cas_end", cur_func);
+    builder->CreateCondBr(builder->CreateICmpNE(host, ConstantPointerNull::get(cast<PointerType>(i8_ptr_type))), fast, slow);
+
+    builder->SetInsertPoint(fast);
+    Value *const fast_old = builder->CreateAtomicCmpXchg(builder->CreatePointerCast(host, PointerType::getUnqual(int_type)), expected_n, desired_n);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(slow);
+    std::vector<Type *> slow_types;
+    slow_types.push_back(i8_ptr_type);
+    slow_types.push_back(builder->getInt64Ty());
+    slow_types.push_back(builder->getInt32Ty());
+    slow_types.push_back(builder->getInt64Ty());
+    slow_types.push_back(builder->getInt64Ty());
+    std::vector<Value *> slow_args;
+    slow_args.push_back(cur_state);
+    slow_args.push_back(addr64);
+    slow_args.push_back(ConstantInt::get(builder->getInt32Ty(), len));
+    slow_args.push_back(builder->CreateZExt(expected_n, builder->getInt64Ty()));
+    slow_args.push_back(builder->CreateZExt(desired_n, builder->getInt64Ty()));
+    Value *const slow_old = builder->CreateTrunc(builder->CreateCall(declare_host_func("jcpu_cmpxchg_slow", builder->getInt64Ty(), slow_types,
+                    reinterpret_cast<void *>(&jcpu_cmpxchg_slow)), slow_args, "cas"), int_type);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(join);
+    cur_bb = join;
+    PHINode *const old = builder->CreatePHI(int_type, 2, "cas");
+    old->addIncoming(fast_old, fast);
+    old->addIncoming(slow_old, slow);
+    if(tracer) gen_mem_trace(addr, len, old, false);
+    return old;
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::gen_fence()const{
+    if(parallel) builder->CreateFence(); //one hart observes its own accesses in order anyway
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_fp_exact(fp_op_e op, bool is_double, llvm::Value *a, llvm::Value *b, llvm::Value *c, llvm::Value *rm, llvm::Value **flags){
+    using namespace llvm;
+    Type *const i32_type = builder->getInt32Ty();
+    Type *const i64_type = builder->getInt64Ty();
+    Value *const flags_slot = gen_entry_alloca(i32_type, "fflags"); //the flags are returned through it
+    builder->CreateStore(ConstantInt::get(i32_type, 0), flags_slot);
+    std::vector<Type *> types;
+    types.push_back(i32_type);
+    types.push_back(i32_type);
+    types.push_back(i64_type);
+    types.push_back(i64_type);
+    types.push_back(i64_type);
+    types.push_back(i32_type);
+    types.push_back(PointerType::getUnqual(i32_type));
+    std::vector<Value *> args;
+    args.push_back(ConstantInt::get(i32_type, op));
+    args.push_back(ConstantInt::get(i32_type, is_double));
+    args.push_back(a ? builder->CreateZExt(a, i64_type) : ConstantInt::get(i64_type, 0));
+    args.push_back(b ? builder->CreateZExt(b, i64_type) : ConstantInt::get(i64_type, 0));
+    args.push_back(c ? builder->CreateZExt(c, i64_type) : ConstantInt::get(i64_type, 0));
+    args.push_back(rm);
+    args.push_back(flags_slot);
+    Value *const result = builder->CreateCall(declare_host_func("jcpu_fp_exact", i64_type, types, reinterpret_cast<void *>(&jcpu_fp_exact)), args, "fp_exact");
+    *flags = builder->CreateLoad(flags_slot, "fflags");
+    return result;
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_to_fp(llvm::Value *val, bool is_double){
+    if(is_double) return builder->CreateBitCast(val, builder->getDoubleTy());
+    return builder->CreateBitCast(builder->CreateTrunc(val, builder->getInt32Ty()), builder->getFloatTy());
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_from_fp(llvm::Value *val, bool is_double, const char *mn){
+    llvm::Value *const bits = is_double ? builder->CreateBitCast(val, builder->getInt64Ty(), mn) :
+        builder->CreateZExt(builder->CreateBitCast(val, builder->getInt32Ty(), mn), builder->getInt64Ty(), mn);
+    //NaN results are the canonical NaN, while the host propagates NaN operands
+    llvm::Value *const is_nan = builder->CreateFCmpUNO(val, val, mn);
+    return builder->CreateSelect(is_nan, llvm::ConstantInt::get(builder->getInt64Ty(), is_double ? 0x7FF8000000000000ULL : 0x7FC00000), bits, mn);
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_fp_native(fp_op_e op, bool is_double, llvm::Value *a, llvm::Value *b, llvm::Value *c, llvm::Value **invalid){
+    using namespace llvm;
+    static const char *const mn = "fp_native";
+    Type *const fp_type = is_double ? builder->getDoubleTy() : builder->getFloatTy();
+    Value *const x = gen_to_fp(a, is_double);
+    if(invalid) *invalid = JCPU_NULLPTR;
+    switch(op){
+        case FP_ADD: return gen_from_fp(builder->CreateFAdd(x, gen_to_fp(b, is_double), mn), is_double, mn);
+        case FP_SUB: return gen_from_fp(builder->CreateFSub(x, gen_to_fp(b, is_double), mn), is_double, mn);
+        case FP_MUL: return gen_from_fp(builder->CreateFMul(x, gen_to_fp(b, is_double), mn), is_double, mn);
+        case FP_DIV: return gen_from_fp(builder->CreateFDiv(x, gen_to_fp(b, is_double), mn), is_double, mn);
+        case FP_SQRT:
+            return gen_from_fp(builder->CreateCall(Intrinsic::getDeclaration(mod, Intrinsic::sqrt, fp_type), x, mn), is_double, mn);
+        case FP_MADD:
+        case FP_MSUB:
+        case FP_NMSUB:
+        case FP_NMADD:
+            {
+                Value *const y = gen_to_fp(b, is_double);
+                Value *const z = gen_to_fp(c, is_double);
+                const bool neg_product = op == FP_NMSUB || op == FP_NMADD;
+                const bool neg_addend = op == FP_MSUB || op == FP_NMADD;
+                Value *const fma = builder->CreateCall3(Intrinsic::getDeclaration(mod, Intrinsic::fma, fp_type),
+                        neg_product ? builder->CreateFNeg(x, mn) : x, y, neg_addend ? builder->CreateFNeg(z, mn) : z, mn);
+                return gen_from_fp(fma, is_double, mn);
+            }
+        case FP_MIN:
+        case FP_MAX:
+            {//a NaN operand is ignored, and -0.0 is less than +0.0
+                Value *const y = gen_to_fp(b, is_double);
+                const bool is_min = op == FP_MIN;
+                Value *const x_nan = builder->CreateFCmpUNO(x, x, mn);
+                Value *const y_nan = builder->CreateFCmpUNO(y, y, mn);
+                //compared without NaN, as the host may raise the invalid flag for a quiet NaN, while only a signaling one raises it
+                Value *const zero = ConstantFP::get(fp_type, 0.0);
+                Value *const xo = builder->CreateSelect(x_nan, zero, x, mn);
+                Value *const yo = builder->CreateSelect(y_nan, zero, y, mn);
+                Value *const less = builder->CreateFCmpOLT(xo, yo, mn);
+                Value *r = is_min ? builder->CreateSelect(less, a, b, mn) : builder->CreateSelect(less, b, a, mn);
+                r = builder->CreateSelect(builder->CreateFCmpOEQ(xo, yo, mn), is_min ? builder->CreateOr(a, b, mn) : builder->CreateAnd(a, b, mn), r, mn);
+                r = builder->CreateSelect(x_nan, b, r, mn);
+                r = builder->CreateSelect(y_nan, a, r, mn);
+                return gen_from_fp(gen_to_fp(r, is_double), is_double, mn); //both are NaN
+            }
+        case FP_EQ: return builder->CreateZExt(builder->CreateFCmpOEQ(x, gen_to_fp(b, is_double), mn), builder->getInt64Ty(), mn);
+        case FP_LT:
+        case FP_LE:
+            {//invalid for a quiet NaN too, which the host may not raise
+                Value *const y = gen_to_fp(b, is_double);
+                if(invalid) *invalid = builder->CreateFCmpUNO(x, y, mn);
+                return builder->CreateZExt(op == FP_LT ? builder->CreateFCmpOLT(x, y, mn) : builder->CreateFCmpOLE(x, y, mn), builder->getInt64Ty(), mn);
+            }
+        case FP_TO_I32:
+        case FP_TO_U32:
+        case FP_TO_I64:
+        case FP_TO_U64:
+            {//saturated, as out of range values are undefined in LLVM
+                const unsigned int width = (op == FP_TO_I32 || op == FP_TO_U32) ? 32 : 64;
+                const bool is_signed = op == FP_TO_I32 || op == FP_TO_I64;
+                Type *const int_type = IntegerType::get(*context, width);
+                const double hi = is_signed ? std::ldexp(1.0, width - 1) : std::ldexp(1.0, width);
+                Value *const in_range = builder->CreateAnd(
+                        is_signed ? builder->CreateFCmpOGE(x, ConstantFP::get(fp_type, -hi), mn) : builder->CreateFCmpOGT(x, ConstantFP::get(fp_type, -1.0), mn),
+                        builder->CreateFCmpOLT(x, ConstantFP::get(fp_type, hi), mn), mn);
+                Value *const safe = builder->CreateSelect(in_range, x, ConstantFP::get(fp_type, 0.0), mn);
+                Value *const conv = is_signed ? builder->CreateFPToSI(safe, int_type, mn) : builder->CreateFPToUI(safe, int_type, mn);
+                const uint64_t all_ones = ~static_cast<uint64_t>(0) >> (64 - width);
+                Value *const min = ConstantInt::get(int_type, is_signed ? (all_ones >> 1) + 1 : 0);
+                Value *const max = ConstantInt::get(int_type, is_signed ? all_ones >> 1 : all_ones);
+                Value *const sat = builder->CreateSelect(builder->CreateFCmpOLT(x, ConstantFP::get(fp_type, 0.0), mn), min, max, mn); //NaN is max
+                if(invalid) *invalid = builder->CreateXor(in_range, ConstantInt::getTrue(*context), mn); //the host converts only values in range
+                return builder->CreateSExt(builder->CreateSelect(in_range, conv, sat, mn), builder->getInt64Ty(), mn);
+            }
+        case FP_FROM_I32: return gen_from_fp(builder->CreateSIToFP(builder->CreateTrunc(a, builder->getInt32Ty(), mn), fp_type, mn), is_double, mn);
+        case FP_FROM_U32: return gen_from_fp(builder->CreateUIToFP(builder->CreateTrunc(a, builder->getInt32Ty(), mn), fp_type, mn), is_double, mn);
+        case FP_FROM_I64: return gen_from_fp(builder->CreateSIToFP(a, fp_type, mn), is_double, mn);
+        case FP_FROM_U64: return gen_from_fp(builder->CreateUIToFP(a, fp_type, mn), is_double, mn);
+        case FP_TO_OTHER:
+            return is_double ? gen_from_fp(builder->CreateFPTrunc(x, builder->getFloatTy(), mn), false, mn) :
+                gen_from_fp(builder->CreateFPExt(x, builder->getDoubleTy(), mn), true, mn);
+        default:
+            jcpu_assert(!"Never comes here");
+    }
+    return JCPU_NULLPTR;
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::gen_fp_clear_host_flags(){
+    builder->CreateCall(declare_host_func("jcpu_fp_clear_host_flags", llvm::Type::getVoidTy(*context), std::vector<llvm::Type *>(),
+                reinterpret_cast<void *>(&jcpu_fp_clear_host_flags)));
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_fp_host_flags(llvm::Value *keep){
+    std::vector<llvm::Type *> types;
+    types.push_back(builder->getInt64Ty());
+    return builder->CreateCall(declare_host_func("jcpu_fp_host_flags", builder->getInt32Ty(), types,
+                reinterpret_cast<void *>(&jcpu_fp_host_flags)), keep, "fp_flags");
+}
+
+template<typename ARCH>
+llvm::Value *jcpu_vm_base<ARCH>::gen_vector_load(llvm::Value *addr, llvm::Value *stride, llvm::Type *type, llvm::Value *vl){
+    using namespace llvm;
+    VectorType *const vec_type = cast<VectorType>(type);
+    const unsigned int len = vec_type->getElementType()->getPrimitiveSizeInBits() / 8;
+    const unsigned int num = vec_type->getNumElements();
+    Type *const i8_ptr_type = PointerType::getUnqual(builder->getInt8Ty());
+    Value *const addr64 = builder->CreateZExt(addr, builder->getInt64Ty());
+    BasicBlock *const slow = BasicBlock::Create(*context, "vload_io", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "vload_end", cur_func);
+    BasicBlock *fast = JCPU_NULLPTR;
+    Value *fast_val = JCPU_NULLPTR;
+    if(!stride && !tracer){//the whole vector is loaded at once if it is on contiguous host memory
+        Value *const host = gen_dmi_ptr(addr64, false);
+        Value *const host_last = gen_dmi_ptr(builder->CreateAdd(addr64, ConstantInt::get(builder->getInt64Ty(), num * len - 1), "vload"), false);
+        Value *const distance = builder->CreateSub(builder->CreatePtrToInt(host_last, builder->getInt64Ty(), "vload"),
+                builder->CreatePtrToInt(host, builder->getInt64Ty(), "vload"), "vload");
+        Value *const contiguous = builder->CreateAnd(builder->CreateICmpNE(host, ConstantPointerNull::get(cast<PointerType>(i8_ptr_type)), "vload"),
+                builder->CreateICmpEQ(distance, ConstantInt::get(builder->getInt64Ty(), num * len - 1), "vload"), "vload");
+        fast = BasicBlock::Create(*context, "vload_dmi", cur_func);
+        builder->CreateCondBr(contiguous, fast, slow);
+        builder->SetInsertPoint(fast);
+        fast_val = builder->CreateUnalignedLoad(builder->CreatePointerCast(host, PointerType::getUnqual(vec_type)), "vload");
+        builder->CreateBr(join);
+    }
+    else{
+        builder->CreateBr(slow);
+    }
+
+    builder->SetInsertPoint(slow);
+    Value *const buf = gen_entry_alloca(vec_type, "vbuf");
+    std::vector<Type *> types;
+    types.push_back(i8_ptr_type);
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt64Ty());
+    types.push_back(i8_ptr_type);
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt32Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(addr64);
+    args.push_back(stride ? builder->CreateZExt(stride, builder->getInt64Ty()) : ConstantInt::get(builder->getInt64Ty(), len));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), len));
+    args.push_back(builder->CreateZExt(vl, builder->getInt64Ty()));
+    args.push_back(builder->CreatePointerCast(buf, i8_ptr_type));
+    args.push_back(ConstantInt::get(builder->getInt64Ty(), job.processing_pc.top().first));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), tracer ? mem_tracer::make_info(len, false, job.insn_offset) : 0));
+    builder->CreateCall(declare_host_func("jcpu_vector_load_slow", Type::getVoidTy(*context), types, reinterpret_cast<void *>(&jcpu_vector_load_slow)), args);
+    Value *const slow_val = builder->CreateLoad(buf, "vload");
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(join);
+    cur_bb = join;
+    PHINode *const val = builder->CreatePHI(vec_type, 2, "vload");
+    if(fast) val->addIncoming(fast_val, fast);
+    val->addIncoming(slow_val, slow);
+    return val;
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::gen_vector_store(llvm::Value *addr, llvm::Value *stride, llvm::Value *val, llvm::Value *vl){
+    using namespace llvm;
+    VectorType *const vec_type = cast<VectorType>(val->getType());
+    const unsigned int len = vec_type->getElementType()->getPrimitiveSizeInBits() / 8;
+    const unsigned int num = vec_type->getNumElements();
+    Type *const i8_ptr_type = PointerType::getUnqual(builder->getInt8Ty());
+    Value *const addr64 = builder->CreateZExt(addr, builder->getInt64Ty());
+    Value *const vl64 = builder->CreateZExt(vl, builder->getInt64Ty());
+    BasicBlock *const slow = BasicBlock::Create(*context, "vstore_io", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "vstore_end", cur_func);
+    if(!stride && !tracer){//only whole vectors are stored at once, as bytes after vl must not be written
+        Value *const host = gen_dmi_ptr(addr64, true);
+        Value *const host_last = gen_dmi_ptr(builder->CreateAdd(addr64, ConstantInt::get(builder->getInt64Ty(), num * len - 1), "vstore"), true);
+        Value *const distance = builder->CreateSub(builder->CreatePtrToInt(host_last, builder->getInt64Ty(), "vstore"),
+                builder->CreatePtrToInt(host, builder->getInt64Ty(), "vstore"), "vstore");
+        Value *const contiguous = builder->CreateAnd(builder->CreateICmpNE(host, ConstantPointerNull::get(cast<PointerType>(i8_ptr_type)), "vstore"),
+                builder->CreateICmpEQ(distance, ConstantInt::get(builder->getInt64Ty(), num * len - 1), "vstore"), "vstore");
+        Value *const whole = builder->CreateICmpEQ(vl64, ConstantInt::get(builder->getInt64Ty(), num), "vstore");
+        BasicBlock *const fast = BasicBlock::Create(*context, "vstore_dmi", cur_func);
+        builder->CreateCondBr(builder->CreateAnd(contiguous, whole, "vstore"), fast, slow);
+        builder->SetInsertPoint(fast);
+        builder->CreateUnalignedStore(val, builder->CreatePointerCast(host, PointerType::getUnqual(vec_type)));
+        builder->CreateBr(join);
+    }
+    else{
+        builder->CreateBr(slow);
+    }
+
+    builder->SetInsertPoint(slow);
+    Value *const buf = gen_entry_alloca(vec_type, "vbuf");
+    builder->CreateStore(val, buf);
+    std::vector<Type *> types;
+    types.push_back(i8_ptr_type);
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt64Ty());
+    types.push_back(i8_ptr_type);
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt32Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(addr64);
+    args.push_back(stride ? builder->CreateZExt(stride, builder->getInt64Ty()) : ConstantInt::get(builder->getInt64Ty(), len));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), len));
+    args.push_back(vl64);
+    args.push_back(builder->CreatePointerCast(buf, i8_ptr_type));
+    args.push_back(ConstantInt::get(builder->getInt64Ty(), job.processing_pc.top().first));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), tracer ? mem_tracer::make_info(len, true, job.insn_offset) : 0));
+    builder->CreateCall(declare_host_func("jcpu_vector_store_slow", Type::getVoidTy(*context), types, reinterpret_cast<void *>(&jcpu_vector_store_slow)), args);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(join);
+    cur_bb = join;
+}
+
     //gdb_target_if
 template<typename ARCH>
 unsigned int jcpu_vm_base<ARCH>::get_reg_width()const {
@@ -402,6 +1161,18 @@ uint64_t jcpu_vm_base<ARCH>::read_mem_dbg(uint64_t virt_addr, unsigned int len)
 template<typename ARCH>
 void jcpu_vm_base<ARCH>::write_mem_dbg(uint64_t virt_addr, unsigned int len, uint64_t val) {
     ext_ifs.mem_write_dbg(virt_addr, len, val);
+    if(!running) bb_man.invalidate_written(); //otherwise after the current block
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::read_mem_block_dbg(uint64_t virt_addr, void *dst, size_t len) {
+    ext_ifs.mem_read_block_dbg(virt_addr, dst, len);
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::write_mem_block_dbg(uint64_t virt_addr, const void *src, size_t len) {
+    ext_ifs.mem_write_block_dbg(virt_addr, src, len);
+    if(!running) bb_man.invalidate_written();
 }
 
 template<typename ARCH>
@@ -410,34 +1181,161 @@ void jcpu_vm_base<ARCH>::set_unset_break_point(bool set, uint64_t virt_addr) {
     if(set){
         bp_man.add(pc_v);
         const phys_addr_t pc_p = code_v2p(pc_v);
-        bb_man.invalidate(pc_p, pc_p + static_cast<phys_addr_t>(4));
+        bb_man.remove_blocks(pc_p, pc_p + static_cast<phys_addr_t>(4));
     }
     else
         bp_man.remove(pc_v);
 }
 
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::take_snapshot(){
+    snap.regs.resize(ARCH::NUM_REGS);
+    for(unsigned int i = 0; i < ARCH::NUM_REGS; ++i){
+        snap.regs[i] = get_reg_func(i);
+    }
+    snap.total_icount = total_icount;
+    snap.valid = true;
+    if(ram) ram->snapshot();
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::restore_snapshot(){
+    jcpu_assert(snap.valid);
+    for(unsigned int i = 0; i < ARCH::NUM_REGS; ++i){
+        set_reg_func(i, snap.regs[i]);
+    }
+    total_icount = snap.total_icount;
+    if(ram){//translated code survives unless its page was written
+        std::vector<uint64_t> restored_pages;
+        ram->restore(restored_pages);
+        for(std::vector<uint64_t>::const_iterator it = restored_pages.begin(), it_end = restored_pages.end(); it != it_end; ++it){
+            bb_man.invalidate(phys_addr_t(*it), phys_addr_t(*it + sparse_memory::page_size));
+        }
+    }
+}
+
+template<typename ARCH>
+decoded_insn &jcpu_vm_base<ARCH>::get_decoded(phys_addr_t pc){
+    if(bb_man.get_num_invalidations() != decoded_invalidations){
+        std::vector<std::pair<target_ulong, target_ulong> > ranges;
+        bool all;
+        decoded_invalidations = bb_man.get_invalidations_since(decoded_invalidations, ranges, all);
+        if(all) decoded.clear();
+        for(size_t i = 0; i < ranges.size(); ++i){
+            decoded.invalidate(ranges[i].first, ranges[i].second);
+        }
+    }
+    return decoded.get(pc);
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::service_requests(){
+    if(pending_requests & REQ_SNAPSHOT) take_snapshot();
+    if(pending_requests & REQ_RESTORE) restore_snapshot();
+    if(pending_requests & REQ_MEM_TRACE_OFF){
+        bb_man.clear(); //retranslate without trace calls
+        delete tracer;
+        tracer = JCPU_NULLPTR;
+        state.hdr.tracer = JCPU_NULLPTR;
+    }
+    if(pending_requests & REQ_FLUSH_CODE) bb_man.invalidate_all();
+    pending_requests = 0;
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::snapshot(){
+    if(running) pending_requests |= REQ_SNAPSHOT; //registers are consistent only between blocks
+    else take_snapshot();
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::restore(){
+    if(running) pending_requests |= REQ_RESTORE;
+    else restore_snapshot();
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::start_mem_trace(const char *file_name){
+    jcpu_assert(!running);
+    jcpu_assert(!tracer);
+    std::vector<llvm::Type *> args;
+    args.push_back(llvm::PointerType::getUnqual(builder->getInt8Ty()));
+    args.push_back(builder->getInt64Ty());
+    args.push_back(builder->getInt64Ty());
+    args.push_back(builder->getInt64Ty());
+    args.push_back(builder->getInt32Ty());
+    declare_host_func("jcpu_mem_trace_hook", llvm::Type::getVoidTy(*context), args, reinterpret_cast<void *>(&jcpu_mem_trace_hook));
+    tracer = new mem_tracer(file_name, total_icount);
+    state.hdr.tracer = tracer;
+    bb_man.clear(); //retranslate with trace calls
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::stop_mem_trace(){
+    if(!tracer) return;
+    tracer->stop(); //traced blocks can still run until the end of the current block, but record nothing
+    pending_requests |= REQ_MEM_TRACE_OFF;
+    if(!running) service_requests();
+}
+
 template<typename ARCH>
 llvm::Function *jcpu_vm_base<ARCH>::end_func(){
-    reg_cache.flush_and_clear(set_reg_functor(this));
+    job.reg_cache.flush_and_clear(set_reg_functor(this));
     llvm::Value *const pc = gen_get_reg(reg_index(ARCH::REG_PNEXT_PC), "epilogue");
     gen_set_reg(gen_const(ARCH::REG_PC), pc);
 #if defined(JCPU_VM_DEBUG) && JCPU_VM_DEBUG > 1
-    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"));
+    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"), cur_state);
 #endif
     builder->CreateRet(pc);
+    inline_helpers(cur_func);
+    job.insn_offset = 0;
     llvm::Function *const ret = cur_func;
     cur_func = JCPU_NULLPTR;
     cur_bb = JCPU_NULLPTR;
+    cur_state = JCPU_NULLPTR;
     return ret;
 }
 
 template<typename ARCH>
-jcpu_vm_base<ARCH>::jcpu_vm_base(jcpu_ext_if &ifs) : ext_ifs(ifs), cur_func(JCPU_NULLPTR), cur_bb(JCPU_NULLPTR)
+void jcpu_vm_base<ARCH>::inline_helpers(llvm::Function *func){
+    //Functions with a body in the module are the helpers, host functions and blocks are declarations or not called directly.
+    //Repeated because an inlined helper may call another.
+    for(bool inlined = true; inlined; ){
+        std::vector<llvm::CallInst *> calls;
+        for(llvm::Function::iterator bb = func->begin(); bb != func->end(); ++bb){
+            for(llvm::BasicBlock::iterator it = bb->begin(); it != bb->end(); ++it){
+                llvm::CallInst *const call = llvm::dyn_cast<llvm::CallInst>(&*it);
+                if(!call) continue;
+                const llvm::Function *const callee = call->getCalledFunction();
+                if(callee && !callee->isDeclaration() && !callee->isIntrinsic()) calls.push_back(call);
+            }
+        }
+        inlined = false;
+        for(size_t i = 0; i < calls.size(); ++i){
+            llvm::InlineFunctionInfo info;
+            inlined |= llvm::InlineFunction(calls[i], info);
+        }
+    }
+}
+
+template<typename ARCH>
+void jcpu_vm_base<ARCH>::abort_func(){
+    cur_func->eraseFromParent();
+    job.discard();
+    cur_func = JCPU_NULLPTR;
+    cur_bb = JCPU_NULLPTR;
+    cur_state = JCPU_NULLPTR;
+}
+
+template<typename ARCH>
+jcpu_vm_base<ARCH>::jcpu_vm_base(jcpu_ext_if &ifs, sparse_memory *ram, bb_manager<ARCH> *shared_bb_man) : ext_ifs(ifs), cur_func(JCPU_NULLPTR), cur_bb(JCPU_NULLPTR), cur_state(JCPU_NULLPTR),
+    bb_man(shared_bb_man ? *shared_bb_man : own_bb_man), bb_reader_id(bb_man.add_reader()), icount_limit(~static_cast<uint64_t>(0)), ram(ram), running(false), pending_requests(0), exited(false), exit_code(0), tracer(JCPU_NULLPTR), parallel(false),
+    decoded(ARCH::insn_align_bits), decoded_invalidations(bb_man.get_num_invalidations())
 {
 
-    context = &llvm::getGlobalContext();
+    context = new llvm::LLVMContext();
     builder = new ir_builder_wrapper(*this, *context);
-    mod = new llvm::Module("openrisc module", *context);
+    mod = new llvm::Module("jcpu module", *context);
 #if (LLVM_VERSION_MAJOR == 3 && LLVM_VERSION_MINOR <= 5)
     llvm::EngineBuilder ebuilder(mod);
 #else //>=3.6
@@ -450,6 +1348,21 @@ jcpu_vm_base<ARCH>::jcpu_vm_base(jcpu_ext_if &ifs) : ext_ifs(ifs), cur_func(JCPU
     ee = ebuilder.create();
     mem_region = 0;
     total_icount = 0;
+
+    state.hdr.ext_ifs = &ext_ifs;
+    state.hdr.vm = this;
+    state.hdr.tracer = JCPU_NULLPTR;
+    state.hdr.pending_irqs = 0;
+    for(unsigned int i = 0; i < ARCH::NUM_REGS; ++i){
+        state.regs[i] = 0;
+    }
+    if(ram) ram->set_code_write_hook(&bb_manager<ARCH>::code_written, &bb_man); //the same for all harts sharing bb_man
+    link_helpers(mod);
+}
+
+template<typename ARCH>
+jcpu_vm_base<ARCH>::~jcpu_vm_base(){
+    delete tracer;
 }
 
 template<typename ARCH>
@@ -1,11 +1,16 @@
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <map>
+#include <string>
 
 #include "jcpu_llvm_headers.h"
 #include "jcpu_vm.h"
+#include "jcpu_decoder.h"
 #include "gdbserver.h"
 #include "jcpu_openrisc.h"
+#include "clx/timer.h"
 
 //#define JCPU_OPENRISC_DEBUG 3
 
@@ -25,6 +30,56 @@ inline T bit_sub(T v){
     return (v >> bit) & ((T(1) << width) - 1);
 }
 
+template<unsigned int width, typename T>
+inline T sign_extend(T v){
+    const T sign = T(1) << (width - 1);
+    return (v ^ sign) - sign;
+}
+
+//Operand extractors named by the format column of jcpu_openrisc_insn.def
+void operands_R(uint32_t insn, jcpu::vm::decoded_insn &d){
+    d.rd = bit_sub<21, 5>(insn);
+    d.rs1 = bit_sub<16, 5>(insn);
+    d.rs2 = bit_sub<11, 5>(insn);
+}
+
+void operands_I(uint32_t insn, jcpu::vm::decoded_insn &d){
+    operands_R(insn, d);
+    d.imm = sign_extend<16>(static_cast<int64_t>(bit_sub<0, 16>(insn)));
+}
+
+void operands_K(uint32_t insn, jcpu::vm::decoded_insn &d){
+    operands_R(insn, d);
+    d.imm = bit_sub<0, 16>(insn);
+}
+
+void operands_SI(uint32_t insn, jcpu::vm::decoded_insn &d){//the upper 5 bits are where rD is
+    operands_R(insn, d);
+    d.imm = sign_extend<16>(static_cast<int64_t>((bit_sub<21, 5>(insn) << 11) | bit_sub<0, 11>(insn)));
+}
+
+void operands_SK(uint32_t insn, jcpu::vm::decoded_insn &d){
+    operands_R(insn, d);
+    d.imm = (bit_sub<21, 5>(insn) << 11) | bit_sub<0, 11>(insn);
+}
+
+void operands_L(uint32_t insn, jcpu::vm::decoded_insn &d){
+    operands_R(insn, d);
+    d.imm = bit_sub<0, 5>(insn);
+}
+
+void operands_N(uint32_t insn, jcpu::vm::decoded_insn &d){//in words
+    d.imm = sign_extend<26>(static_cast<int64_t>(bit_sub<0, 26>(insn))) * 4;
+}
+
+//One for each row of jcpu_openrisc_insn.def in the same order, so it is also the index in openrisc_vm::insn_table
+enum insn_op_e{
+#define OPENRISC_INSN(name, mask, match, handler, op, format, flow) op,
+#include "jcpu_openrisc_insn.def"
+#undef OPENRISC_INSN
+    NUM_INSN_OPS
+};
+
 
 
 } //end of unnamed namespace
@@ -35,6 +90,7 @@ namespace openrisc{
 struct openrisc_arch{
     typedef uint32_t target_ulong;
     const static unsigned int reg_bit_width = 32;
+    const static unsigned int insn_align_bits = 2;
     typedef vm::primitive_type_holder<target_ulong, openrisc_arch, 0> virt_addr_t;
     typedef vm::primitive_type_holder<target_ulong, openrisc_arch, 1> phys_addr_t;
     enum reg_e{
@@ -46,7 +102,23 @@ struct openrisc_arch{
         REG_GR20, REG_GR21, REG_GR22, REG_GR23,
         REG_GR24, REG_GR25, REG_GR26, REG_GR27,
         REG_GR28, REG_GR29, REG_GR30, REG_GR31,
-        REG_PC, REG_SR, REG_CPUCFGR, REG_EPCR0, REG_PNEXT_PC, NUM_REGS
+        REG_PC, REG_SR, REG_CPUCFGR, REG_EPCR0, REG_PNEXT_PC, REG_FPCSR,
+        REG_EEAR0, REG_ESR0, REG_PICMR, REG_TTMR, REG_TTCR,
+        NUM_REGS
+    };
+    enum spr_e{//group << 11 | index
+        SPR_VR = 0x0000, SPR_UPR = 0x0001, SPR_CPUCFGR = 0x0002, SPR_SR = 0x0011, SPR_FPCSR = 0x0014,
+        SPR_EPCR0 = 0x0020, SPR_EEAR0 = 0x0030, SPR_ESR0 = 0x0040, SPR_GPR0 = 0x0400,
+        SPR_ICBIR = 0x2002,
+        SPR_PCCR0 = 0x3800, SPR_PCMR0 = 0x3808,
+        SPR_PICMR = 0x4800, SPR_PICSR = 0x4802,
+        SPR_TTMR = 0x5000, SPR_TTCR = 0x5001
+    };
+    enum pcmr_bit_e{
+        PCMR_CP = 0
+    };
+    enum upr_bit_e{
+        UPR_UP = 0, UPR_ICP = 2, UPR_PCUP = 7, UPR_PICP = 8, UPR_TTP = 10
     };
 
     enum sr_flag_e{
@@ -54,8 +126,24 @@ struct openrisc_arch{
         SR_CE, SR_F, SR_CY, SR_OV, SR_OVE, SR_DSX, SR_EPH, SR_FO, 
         SR_SUMRA
     };
+    enum fpcsr_flag_e{
+        FPCSR_FPEE = 0x1, FPCSR_RM = 0x6, FPCSR_RM_SHIFT = 1,
+        FPCSR_OVF = 0x8, FPCSR_UNF = 0x10, FPCSR_SNF = 0x20, FPCSR_QNF = 0x40,
+        FPCSR_ZF = 0x80, FPCSR_IXF = 0x100, FPCSR_IVF = 0x200, FPCSR_INF = 0x400, FPCSR_DZF = 0x800,
+        FPCSR_EXACT = 0x80000000 //not visible to the guest, set once it reads the flags
+    };
+    enum ttmr_bit_e{
+        TTMR_TP = 0x0FFFFFFF, TTMR_IP = 28, TTMR_IE = 29, TTMR_M_SHIFT = 30
+    };
+    enum ttmr_mode_e{
+        TTMR_M_DISABLED = 0, TTMR_M_RESTART, TTMR_M_SINGLE, TTMR_M_CONTINUOUS
+    };
     enum cpucfgr_bit_e{
-        CPUCFGR_ND = 10
+        CPUCFGR_OB32S = 5, CPUCFGR_OF32S = 7, CPUCFGR_ND = 10
+    };
+    enum nop_e{//K of l.nop K, the simulator hooks of or1ksim. The arguments are in r3 and r4.
+        NOP_NOP = 0, NOP_EXIT = 1, NOP_REPORT = 2, NOP_PRINTF = 3, NOP_PUTC = 4,
+        NOP_CNT_RESET = 5, NOP_GET_TICKS = 6, NOP_TRACE_ON = 8, NOP_TRACE_OFF = 9, NOP_EXIT_SILENT = 0xC
     };
     enum exception_e{
         EXC_RESET = 0, EXC_BUS_ERROR, EXC_DATA_PAGE_FAULT, EXC_INSN_PAGE_FAULT, EXC_TICK_TIMER,
@@ -65,9 +153,9 @@ struct openrisc_arch{
     static const target_ulong exception_vector[];
 };
 
-template<unsigned int bit, typename T>
-inline openrisc_arch::reg_e get_reg_id(T insn) {
-    return static_cast<openrisc_arch::reg_e>(bit_sub<bit, 5>(insn));
+//of a register field of vm::decoded_insn
+inline openrisc_arch::reg_e get_reg_id(unsigned int field){
+    return static_cast<openrisc_arch::reg_e>(field);
 }
 
 const openrisc_arch::target_ulong openrisc_arch::exception_vector[] = {
@@ -78,6 +166,9 @@ typedef openrisc_arch::virt_addr_t virt_addr_t;
 typedef openrisc_arch::phys_addr_t phys_addr_t;
 typedef openrisc_arch::target_ulong target_ulong;
 
+//Bits of cpu_state_header::pending_irqs. The lower 32 bits are the PIC lines, which are PICSR.
+const uint64_t tick_timer_pending = static_cast<uint64_t>(1) << 32; //TTMR[IP]
+
 typedef vm::basic_block<openrisc_arch> basic_block;
 typedef vm::bb_manager<openrisc_arch> bb_manager;
 typedef vm::break_point<openrisc_arch> break_point;
@@ -88,16 +179,55 @@ class openrisc_vm : public vm::jcpu_vm_base<openrisc_arch>{
     virtual void get_reg_value(std::vector<uint64_t> &)const JCPU_OVERRIDE;
     virtual void set_reg_value(unsigned int, uint64_t)JCPU_OVERRIDE;
 
-    bool irq_status;
+    uint64_t snap_pending_irqs;
+    std::map<target_ulong, target_ulong> other_sprs, snap_other_sprs; //MMU, cache and performance counter mode registers
+    uint64_t pccr0_base, snap_pccr0_base; //PCCR0 is the instruction count since this
+    std::vector<target_ulong> icache_invalidations; //written to ICBIR, the blocks are discarded after the current one
+    //TTCR is not incremented per instruction. REG_TTCR holds its value at tt.icount while the timer is counting.
+    struct tick_timer{
+        uint64_t icount; //when REG_TTCR was written
+        uint64_t deadline; //when TTCR[27:0] reaches TTMR[TP] next, ~0 if never
+        bool stopped; //by the match in the single run mode
+    } tt, snap_tt;
+    //region of interest, from l.nop NOP_TRACE_ON or NOP_CNT_RESET to NOP_TRACE_OFF
+    uint64_t roi_icount;
+    clx::timer roi_timer;
 
     llvm::Value *gen_get_reg(openrisc_arch::reg_e, const char * = "")const ;
     void gen_set_reg(openrisc_arch::reg_e, llvm::Value *)const ;
     bool disas_insn(virt_addr_t, int *);
-    bool disas_arith(target_ulong);
-    bool disas_logical(target_ulong);
-    bool disas_compare_immediate(target_ulong);
-    bool disas_compare(target_ulong);
-    bool disas_others(target_ulong, int *);
+    vm::decoded_insn fetch_insn(phys_addr_t); //from the decoded instruction cache, or from the memory
+    //the last argument of the handlers is the depth of disas_insn(), used for the delay slot
+    typedef bool (openrisc_vm::*disas_func_t)(const vm::decoded_insn &, insn_op_e, int *);
+    static const vm::insn_desc<disas_func_t> insn_table[]; //from jcpu_openrisc_insn.def
+    static const vm::insn_decoder<disas_func_t> decoder;
+    bool disas_arith(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_logical(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_compare_immediate(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_compare(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_jump(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_branch(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_movhi(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_rfe(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_load(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_immediate(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_store(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_fp(const vm::decoded_insn &, insn_op_e, int *);
+    bool gen_illegal_insn();
+    bool disas_spr(const vm::decoded_insn &, insn_op_e, int *);
+    bool disas_nop(const vm::decoded_insn &, insn_op_e, int *);
+    bool gen_end_block();
+    static openrisc_arch::reg_e get_spr_reg(target_ulong spr);
+    void invalidate_icache();
+    void update_tick_timer(uint64_t icount);
+    void set_tick_timer(target_ulong ttcr, uint64_t icount);
+    bool tick_timer_counting()const;
+    void set_ttmr(target_ulong);
+    virt_addr_t enter_exception(openrisc_arch::exception_e, target_ulong epcr);
+    virt_addr_t check_interrupts(virt_addr_t pc);
+    std::string read_guest_string(target_ulong addr);
+    std::string format_guest(target_ulong fmt, target_ulong args);
+    llvm::Value *gen_fp_op(vm::fp_op_e, llvm::Value *a, llvm::Value *b = JCPU_NULLPTR, llvm::Value *c = JCPU_NULLPTR);
     llvm::Value *gen_arith_code_with_ovf_check(llvm::Value *, llvm::Value*, llvm::Value * (vm::ir_builder_wrapper::*)(llvm::Value *, llvm::Value *, const char *)const, const char *);
     virtual void start_func(phys_addr_t) JCPU_OVERRIDE;
     void gen_set_sr(sr_flag_e flag, llvm::Value *val, const char *mn = "")const{//val must be 0 or 1
@@ -110,47 +240,44 @@ class openrisc_vm : public vm::jcpu_vm_base<openrisc_arch>{
     }
     const basic_block *disas(virt_addr_t, int, const break_point *);
     virtual run_state_e step_exec() JCPU_OVERRIDE;
+    virtual void take_snapshot() JCPU_OVERRIDE;
+    virtual void restore_snapshot() JCPU_OVERRIDE;
     phys_addr_t code_v2p(virt_addr_t pc){return static_cast<phys_addr_t>(pc);} //FIXME implement MMU
     public:
-    explicit openrisc_vm(jcpu_ext_if &);
+    openrisc_vm(jcpu_ext_if &, sparse_memory *);
     virtual run_state_e run() JCPU_OVERRIDE;
     virtual void dump_regs()const JCPU_OVERRIDE;
     void reset();
     void interrupt(int, bool);
+    //by l.mfspr and l.mtspr which are not translated to register accesses, icount is when the instruction executes
+    target_ulong read_spr(target_ulong spr, uint64_t icount);
+    void write_spr(target_ulong spr, target_ulong val, uint64_t icount);
+    void exec_nop(target_ulong k, uint64_t icount); //by l.nop K, K is one of openrisc_arch::nop_e
 };
 
-openrisc_vm::openrisc_vm(jcpu_ext_if &ifs) : vm::jcpu_vm_base<openrisc_arch>(ifs) 
+openrisc_vm::openrisc_vm(jcpu_ext_if &ifs, sparse_memory *ram) : vm::jcpu_vm_base<openrisc_arch>(ifs, ram), pccr0_base(0), roi_icount(0)
 {
-    const unsigned int address_space = 5;
-    const unsigned int bit = sizeof(target_ulong) * 8;
-    const unsigned int num_regs = openrisc_arch::NUM_REGS;
-    llvm::ArrayType *const ATy = llvm::ArrayType::get(llvm::IntegerType::get(*context, bit), num_regs);
-    std::vector<llvm::Constant*> Initializer;
-    Initializer.reserve(num_regs);
-
-    for(unsigned int i = 0; i < num_regs; ++i){
-        const unsigned int reg_init_val = (i == openrisc_arch::REG_PC || i == openrisc_arch::REG_PNEXT_PC) ? 0x100 : 0;
-        llvm::ConstantInt *const ivc = gen_const(reg_init_val);
-        Initializer.push_back(ivc);
+    for(unsigned int i = 0; i < openrisc_arch::NUM_REGS; ++i){
+        const target_ulong reg_init_val = (i == openrisc_arch::REG_PC || i == openrisc_arch::REG_PNEXT_PC) ? 0x100 : 0;
+        set_reg_func(i, reg_init_val);
     }
+    set_reg_func(openrisc_arch::REG_CPUCFGR, (1U << openrisc_arch::CPUCFGR_OB32S) | (1U << openrisc_arch::CPUCFGR_OF32S));
+}
 
-    llvm::Constant *const init = llvm::ConstantArray::get(ATy, Initializer);
-    llvm::GlobalVariable *const global_regs = new llvm::GlobalVariable(*mod, ATy, true, llvm::GlobalValue::CommonLinkage, init, "regs", 0, llvm::GlobalVariable::NotThreadLocal, address_space);
-    global_regs->setAlignment(bit / 8);
-
-    vm::make_set_get(mod, global_regs, address_space, bit);
-    vm::make_mem_access(mod, address_space);
-    vm::make_debug_func(mod, address_space);
-
-    set_reg_func = reinterpret_cast<void (*)(uint16_t, target_ulong)>(ee->getPointerToFunction(mod->getFunction("set_reg")));
-    get_reg_func = reinterpret_cast<target_ulong (*)(uint16_t)>(ee->getPointerToFunction(mod->getFunction("get_reg")));
-
-    void (*const set_mem_access_if)(jcpu_ext_if *) = reinterpret_cast<void(*)(jcpu_ext_if*)>(ee->getPointerToFunction(mod->getFunction("set_mem_access_if")));
-    set_mem_access_if(&ext_ifs);
-    void (*const set_jcpu_vm_ptr)(jcpu_vm_if *) = reinterpret_cast<void(*)(jcpu_vm_if*)>(ee->getPointerToFunction(mod->getFunction("set_jcpu_vm_ptr")));
-    set_jcpu_vm_ptr(this);
+//insn_offset is the index of the instruction in the block, total_icount is updated after the block
+extern "C" uint32_t jcpu_openrisc_mfspr(void *state, uint32_t spr, uint32_t insn_offset){
+    openrisc_vm *const vm = static_cast<openrisc_vm *>(static_cast<vm::cpu_state_header *>(state)->vm);
+    return vm->read_spr(spr, vm->get_total_insn_count() + insn_offset);
+}
 
+extern "C" void jcpu_openrisc_mtspr(void *state, uint32_t spr, uint32_t val, uint32_t insn_offset){
+    openrisc_vm *const vm = static_cast<openrisc_vm *>(static_cast<vm::cpu_state_header *>(state)->vm);
+    vm->write_spr(spr, val, vm->get_total_insn_count() + insn_offset);
+}
 
+extern "C" void jcpu_openrisc_nop(void *state, uint32_t k, uint32_t insn_offset){
+    openrisc_vm *const vm = static_cast<openrisc_vm *>(static_cast<vm::cpu_state_header *>(state)->vm);
+    vm->exec_nop(k, vm->get_total_insn_count() + insn_offset);
 }
 
 
@@ -184,49 +311,67 @@ bool openrisc_vm::disas_insn(virt_addr_t pc_v, int *const insn_depth){
     struct push_and_pop_pc{
         openrisc_vm &vm;
         push_and_pop_pc(openrisc_vm &vm, virt_addr_t pc_v, phys_addr_t pc_p) : vm(vm){
-            vm.processing_pc.push(std::make_pair(pc_v, pc_p));
+            vm.job.processing_pc.push(std::make_pair(pc_v, pc_p));
         }
         ~push_and_pop_pc(){
-            vm.processing_pc.pop();
+            vm.job.processing_pc.pop();
+            ++vm.job.insn_offset;
         }
     } push_and_pop_pc(*this, pc_v, pc);
-    const target_ulong insn = ext_ifs.mem_read(pc, sizeof(target_ulong));
-    const unsigned int kind = bit_sub<26, 6>(insn);
+    const vm::decoded_insn d = fetch_insn(pc);
+    const vm::insn_desc<disas_func_t> *const desc = d.id == vm::decoded_insn::illegal ? JCPU_NULLPTR : &insn_table[d.id];
 #if defined(JCPU_OPENRISC_DEBUG) && JCPU_OPENRISC_DEBUG > 0
-    std::cout << std::hex << "pc:" << pc << " INSN:" << std::setw(8) << std::setfill('0') << insn << " kind:" << kind << std::endl;
+    std::cout << std::hex << "pc:" << pc << " INSN:" << std::setw(8) << std::setfill('0') << d.raw << " " << (desc ? desc->name : "illegal") << std::endl;
 #endif
 #if defined(JCPU_OPENRISC_DEBUG) && JCPU_OPENRISC_DEBUG > 2
-    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"));
+    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"), cur_state);
 #endif
-    switch(kind){
-        case 0x08: //system
-            jcpu_or_disas_assert(!"Not implemented yet");
-            break;
-        case 0x2E: //logical
-            return disas_logical(insn);
-        case 0x2F: //compare
-            return disas_compare_immediate(insn);
-        case 0x31: //media
-            jcpu_or_disas_assert(!"Not implemented yet");
-            break;
-        case 0x32: //floating point
-            jcpu_or_disas_assert(!"Not implemented yet");
-            break;
-        case 0x38: //arithmetric
-            return disas_arith(insn);
-            break;
-        case 0x39: //compare
-            return disas_compare(insn);
-        default: //others
-            return disas_others(insn, insn_depth);
+    if(!desc){
+        return gen_illegal_insn();
     }
-#if defined(JCPU_OPENRISC_DEBUG) && JCPU_OPENRISC_DEBUG > 2
-    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"));
-#endif
-    jcpu_assert(!"Never comes here");
-    return false;//suppress warning
+    return (this->*desc->handler)(d, static_cast<insn_op_e>(d.id), insn_depth);
 }
 
+vm::decoded_insn openrisc_vm::fetch_insn(phys_addr_t pc){
+    vm::decoded_insn &slot = get_decoded(pc);
+    if(slot.is_decoded()) return slot;
+    vm::decoded_insn d;
+    d.raw = ext_ifs.mem_read(pc, sizeof(target_ulong));
+    d.len = sizeof(target_ulong);
+    const vm::insn_desc<disas_func_t> *const desc = decoder.decode(d.raw);
+    d.id = desc ? static_cast<uint16_t>(desc - insn_table) : vm::decoded_insn::illegal;
+    if(desc){
+        desc->operands(d.raw, d);
+        d.flow = desc->flow;
+    }
+    slot = d;
+    mark_code(pc, d.len);
+    return d;
+}
+
+//The same as enter_exception() in the generated code
+bool openrisc_vm::gen_illegal_insn(){
+    static const char *const mn = "illegal";
+    if(job.processing_pc.size() > 1){//SR[DSX] is not supported
+        jcpu_or_disas_assert(!"Illegal instruction in a delay slot");
+    }
+    llvm::Value *const sr = gen_get_reg(openrisc_arch::REG_SR, mn);
+    const target_ulong drop_mask = ~((1U << openrisc_arch::SR_TEE) | (1U << openrisc_arch::SR_IEE));
+    gen_set_reg(openrisc_arch::REG_EPCR0, gen_get_pc());
+    gen_set_reg(openrisc_arch::REG_ESR0, sr);
+    gen_set_reg(openrisc_arch::REG_SR, builder->CreateAnd(builder->CreateOr(sr, gen_const(1U << openrisc_arch::SR_SM), mn), gen_const(drop_mask), mn));
+    gen_set_reg(openrisc_arch::REG_PNEXT_PC, gen_const(openrisc_arch::exception_vector[openrisc_arch::EXC_ILLEGAL_INSN]));
+    return true;
+}
+
+const vm::insn_desc<openrisc_vm::disas_func_t> openrisc_vm::insn_table[] = {
+#define OPENRISC_INSN(name, mask, match, handler, op, format, flow) {name, mask, match, &openrisc_vm::handler, &operands_##format, vm::decoded_insn::FLOW_##flow},
+#include "jcpu_openrisc_insn.def"
+#undef OPENRISC_INSN
+};
+
+const vm::insn_decoder<openrisc_vm::disas_func_t> openrisc_vm::decoder(openrisc_vm::insn_table, 26, 6); //by the major opcode
+
 const basic_block *openrisc_vm::disas(virt_addr_t start_pc_, int max_insn, const break_point *const bp){
     const phys_addr_t start_pc(start_pc_);
     start_func(start_pc);
@@ -269,441 +414,927 @@ const basic_block *openrisc_vm::disas(virt_addr_t start_pc_, int max_insn, const
     return bb;
 }
 
-bool openrisc_vm::disas_arith(target_ulong insn){
+bool openrisc_vm::disas_arith(const vm::decoded_insn &d, insn_op_e op, int *){
     using namespace llvm;
-    const target_ulong op = bit_sub<0, 4>(insn);
-    const target_ulong op2 = bit_sub<8, 2>(insn);
-    const target_ulong op3 = bit_sub<6, 4>(insn);
-    const openrisc_arch::reg_e rD = get_reg_id<21>(insn);
-    const openrisc_arch::reg_e rA = get_reg_id<16>(insn);
-    const openrisc_arch::reg_e rB = get_reg_id<11>(insn);
-    if(op2 == 0){
-        switch(op){
-            case 0x00://l.add rD = aA + rB, SR[CY] = unsigned overflow(carry), SR[OV] = signed overflow
-                {
-                    Value *const result = gen_arith_code_with_ovf_check(gen_get_reg(rA), gen_get_reg(rB), &vm::ir_builder_wrapper::CreateAdd, "l.add");
-                    gen_set_reg(rD, result);
-                }
-                return false;
-            case 0x01:
-                {
-                    Value *c = builder->CreateAShr(gen_get_reg(openrisc_arch::REG_SR), gen_const(openrisc_arch::SR_CY), "carry");
-                    c = builder->CreateZExt(c, builder->getInt64Ty());
-                    Value *a = builder->CreateSExt(gen_get_reg(rA), builder->getInt64Ty());
-                    a = builder->CreateAdd(c, a);
-                    Value *const result = gen_arith_code_with_ovf_check(a, gen_get_reg(rB), &vm::ir_builder_wrapper::CreateAdd, "l.addc");
-                    gen_set_reg(rD, result);
-                    return false;
-                }
-                return false;
-            case 0x02://l.sub rD = rA - rB, SR[CY] = unsigned overflow(carry), SR[OV] = signed overflow
-                gen_set_reg(rD, builder->CreateSub(gen_get_reg(rA), gen_get_reg(rB), "l.sub"));
-                //FIXME overflow
-                return false;
-            case 0x03: //l.and rD = rA & rB
-                gen_set_reg(rD, builder->CreateAnd(gen_get_reg(rA, "l.and_A"), gen_get_reg(rB, "l.and_B"), "l.and"));
-                return false;
-            case 0x04: //l.or rD = rA | rB
-                gen_set_reg(rD, builder->CreateOr(gen_get_reg(rA, "l.or_A"), gen_get_reg(rB, "l.or_B"), "l.or"));
-                return false;
-            case 0x05: //l.xor rD = rA ^ rB
-                gen_set_reg(rD, builder->CreateXor(gen_get_reg(rA, "l.xor_A"), gen_get_reg(rB, "l.xor_B"), "l.xor"));
-                return false;
-            case 0x08:
-                if(op3 == 0x00){//l.sll rD = rA << rB[4:0]
-                    Value *const rega = gen_get_reg(rA, "l.sll_A");
-                    Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.sll_B"), gen_const(0x1F), "l.sll_B[4:0]");
-                    gen_set_reg(rD, builder->CreateShl(rega, regb, "l.sll"));
-                }
-                else if(op3 == 0x01){//l.srl rD = rA >> rB[4:0]
-                    Value *const rega = gen_get_reg(rA, "l.srl_A");
-                    Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.srl_B"), gen_const(0x1F), "l.srl_B[4:0]");
-                    gen_set_reg(rD, builder->CreateLShr(rega, regb, "l.srl"));
-                }
-                else if(op3 == 0x02){//l.sra rD = rA >> rB[4:0]
-                    Value *const rega = gen_get_reg(rA, "l.sra_A");
-                    Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.sra_B"), gen_const(0x1F), "l.sra_B[4:0]");
-                    gen_set_reg(rD, builder->CreateAShr(rega, regb, "l.sra"));
-                }
-                else if(op3 == 0x03){//l.ror rD = rA >> rB[4:0]
-                    Value *const rega = gen_get_reg(rA, "l.ror_A");
-                    Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.ror_B"), gen_const(0x1F), "l.ror_B[4:0]");
-                    Value *result = builder->CreateLShr(rega, regb, "l.ror");
-                    result = builder->CreateOr(result, builder->CreateShl(rega, builder->CreateSub(gen_const(openrisc_arch::reg_bit_width), regb)));
-                    gen_set_reg(rD, result);
-                }
-                else{
-                    jcpu_or_disas_assert(!"Not implemented yet");
-                }
-                return false;
-            case 0x0C:
-                if(op3 == 0){//l.exths
-                    Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.exths"), builder->getInt16Ty());
-                    gen_set_reg(rD, builder->CreateSExt(rega, get_reg_type(), "l.exths"));
-                }
-                else if(op3 == 1){//l.extbs
-                    Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.extbs"), builder->getInt8Ty());
-                    gen_set_reg(rD, builder->CreateSExt(rega, get_reg_type(), "l.extbs"));
-                }
-                else if(op3 == 2){//l.exthz
-                    Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.exthz"), builder->getInt8Ty());
-                    gen_set_reg(rD, builder->CreateZExt(rega, get_reg_type(), "l.exthz"));
-                }
-                else if(op3 == 3){//l.extbz
-                    Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.extbz"), builder->getInt8Ty());
-                    gen_set_reg(rD, builder->CreateZExt(rega, get_reg_type(), "l.extbz"));
-                }
-                else{
-                    jcpu_or_disas_assert(!"Not implemented yet");
-                }
-                return false;
-            case 0x0D:
-                if(op3 == 0){//l.extws
-                    gen_set_reg(rD, gen_get_reg(rA, "l.extws"));
-                }
-                else if(op3 == 1){//l.extwz
-                    gen_set_reg(rD, gen_get_reg(rA, "l.extwz"));
-                }
-                else{
-                    jcpu_or_disas_assert(!"Not implemented yet");
-                }
-                return false;
-            case 0x0E: //l.cmov
-                {
-                    Value *const flag = builder->CreateTrunc(builder->CreateAShr(gen_get_reg(openrisc_arch::REG_SR), gen_const(openrisc_arch::SR_F)), IntegerType::get(*context, 1));
-                    Value *const val = builder->CreateSelect(flag, gen_get_reg(rA), gen_get_reg(rB), "l.cmov");
-                    gen_set_reg(rD, val);
-                }
-                return false;
-            default:
-                jcpu_or_disas_assert(!"Not implemented yet");
-                break;
-        }
-    }
-    else if(op2 == 3){
-        switch(op){
-            case 0x06: //l.mul rD = rA * rB, SR[OV] = signed overflow
-                {
-                    Value *const result = gen_arith_code_with_ovf_check(gen_get_reg(rA, "l.mul_A"), gen_get_reg(rB, "lmul_B"), &vm::ir_builder_wrapper::CreateMul, "l.mul");
-                    gen_set_reg(rD, result);
-                }
-                return false;
-            case 0x09: //l.div
-                {
-                    Value *const result = gen_arith_code_with_ovf_check(gen_get_reg(rA, "l.div_A"), gen_get_reg(rB, "ldiv_B"), &vm::ir_builder_wrapper::CreateSDiv, "l.div");
-                    gen_set_reg(rD, result);//FIXME if rB==0, set CY
-                }
-                return false;
-            case 0x0A: //l.divu
-                {
-                    Value *const a = builder->CreateZExt(gen_get_reg(rA, "l.divu_A"), builder->getInt64Ty());
-                    Value *const b = builder->CreateZExt(gen_get_reg(rA, "l.divu_B"), builder->getInt64Ty());
-                    Value *const result = gen_arith_code_with_ovf_check(a, b, &vm::ir_builder_wrapper::CreateUDiv, "l.divu");
-                    gen_set_reg(rD, result);//FIXME if rB==0, set CY
-                }
-                return false;
-            case 0x0B: //l.mulu
-                {
-                    Value *const a = builder->CreateZExt(gen_get_reg(rA, "l.mulu_A"), builder->getInt64Ty());
-                    Value *const b = builder->CreateZExt(gen_get_reg(rA, "l.mulu_B"), builder->getInt64Ty());
-                    Value *const result = gen_arith_code_with_ovf_check(a, b, &vm::ir_builder_wrapper::CreateMul, "l.mulu");
-                    gen_set_reg(rD, result);
-                }
-                return false;
-            default:
-                jcpu_or_disas_assert(!"Not implemented yet");
-                break;
-        }
+    const openrisc_arch::reg_e rD = get_reg_id(d.rd);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    const openrisc_arch::reg_e rB = get_reg_id(d.rs2);
+    switch(op){
+        case OP_L_ADD://l.add rD = aA + rB, SR[CY] = unsigned overflow(carry), SR[OV] = signed overflow
+            {
+                Value *const result = gen_arith_code_with_ovf_check(gen_get_reg(rA), gen_get_reg(rB), &vm::ir_builder_wrapper::CreateAdd, "l.add");
+                gen_set_reg(rD, result);
+            }
+            return false;
+        case OP_L_ADDC:
+            {
+                Value *c = builder->CreateAShr(gen_get_reg(openrisc_arch::REG_SR), gen_const(openrisc_arch::SR_CY), "carry");
+                c = builder->CreateZExt(c, builder->getInt64Ty());
+                Value *a = builder->CreateSExt(gen_get_reg(rA), builder->getInt64Ty());
+                a = builder->CreateAdd(c, a);
+                Value *const result = gen_arith_code_with_ovf_check(a, gen_get_reg(rB), &vm::ir_builder_wrapper::CreateAdd, "l.addc");
+                gen_set_reg(rD, result);
+            }
+            return false;
+        case OP_L_SUB://l.sub rD = rA - rB, SR[CY] = unsigned overflow(carry), SR[OV] = signed overflow
+            gen_set_reg(rD, builder->CreateSub(gen_get_reg(rA), gen_get_reg(rB), "l.sub"));
+            //FIXME overflow
+            return false;
+        case OP_L_AND: //l.and rD = rA & rB
+            gen_set_reg(rD, builder->CreateAnd(gen_get_reg(rA, "l.and_A"), gen_get_reg(rB, "l.and_B"), "l.and"));
+            return false;
+        case OP_L_OR: //l.or rD = rA | rB
+            gen_set_reg(rD, builder->CreateOr(gen_get_reg(rA, "l.or_A"), gen_get_reg(rB, "l.or_B"), "l.or"));
+            return false;
+        case OP_L_XOR: //l.xor rD = rA ^ rB
+            gen_set_reg(rD, builder->CreateXor(gen_get_reg(rA, "l.xor_A"), gen_get_reg(rB, "l.xor_B"), "l.xor"));
+            return false;
+        case OP_L_SLL://l.sll rD = rA << rB[4:0]
+            {
+                Value *const rega = gen_get_reg(rA, "l.sll_A");
+                Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.sll_B"), gen_const(0x1F), "l.sll_B[4:0]");
+                gen_set_reg(rD, builder->CreateShl(rega, regb, "l.sll"));
+            }
+            return false;
+        case OP_L_SRL://l.srl rD = rA >> rB[4:0]
+            {
+                Value *const rega = gen_get_reg(rA, "l.srl_A");
+                Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.srl_B"), gen_const(0x1F), "l.srl_B[4:0]");
+                gen_set_reg(rD, builder->CreateLShr(rega, regb, "l.srl"));
+            }
+            return false;
+        case OP_L_SRA://l.sra rD = rA >> rB[4:0]
+            {
+                Value *const rega = gen_get_reg(rA, "l.sra_A");
+                Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.sra_B"), gen_const(0x1F), "l.sra_B[4:0]");
+                gen_set_reg(rD, builder->CreateAShr(rega, regb, "l.sra"));
+            }
+            return false;
+        case OP_L_ROR://l.ror rD = rA >> rB[4:0]
+            {
+                Value *const rega = gen_get_reg(rA, "l.ror_A");
+                Value *const regb = builder->CreateAnd(gen_get_reg(rB, "l.ror_B"), gen_const(0x1F), "l.ror_B[4:0]");
+                Value *result = builder->CreateLShr(rega, regb, "l.ror");
+                result = builder->CreateOr(result, builder->CreateShl(rega, builder->CreateSub(gen_const(openrisc_arch::reg_bit_width), regb)));
+                gen_set_reg(rD, result);
+            }
+            return false;
+        case OP_L_EXTHS:
+            {
+                Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.exths"), builder->getInt16Ty());
+                gen_set_reg(rD, builder->CreateSExt(rega, get_reg_type(), "l.exths"));
+            }
+            return false;
+        case OP_L_EXTBS:
+            {
+                Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.extbs"), builder->getInt8Ty());
+                gen_set_reg(rD, builder->CreateSExt(rega, get_reg_type(), "l.extbs"));
+            }
+            return false;
+        case OP_L_EXTHZ:
+            {
+                Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.exthz"), builder->getInt8Ty());
+                gen_set_reg(rD, builder->CreateZExt(rega, get_reg_type(), "l.exthz"));
+            }
+            return false;
+        case OP_L_EXTBZ:
+            {
+                Value *const rega = builder->CreateTrunc(gen_get_reg(rA, "l.extbz"), builder->getInt8Ty());
+                gen_set_reg(rD, builder->CreateZExt(rega, get_reg_type(), "l.extbz"));
+            }
+            return false;
+        case OP_L_EXTWS:
+            gen_set_reg(rD, gen_get_reg(rA, "l.extws"));
+            return false;
+        case OP_L_EXTWZ:
+            gen_set_reg(rD, gen_get_reg(rA, "l.extwz"));
+            return false;
+        case OP_L_CMOV: //l.cmov
+            {
+                Value *const flag = builder->CreateTrunc(builder->CreateAShr(gen_get_reg(openrisc_arch::REG_SR), gen_const(openrisc_arch::SR_F)), IntegerType::get(*context, 1));
+                Value *const val = builder->CreateSelect(flag, gen_get_reg(rA), gen_get_reg(rB), "l.cmov");
+                gen_set_reg(rD, val);
+            }
+            return false;
+        case OP_L_MUL: //l.mul rD = rA * rB, SR[OV] = signed overflow
+            {
+                Value *const result = gen_arith_code_with_ovf_check(gen_get_reg(rA, "l.mul_A"), gen_get_reg(rB, "lmul_B"), &vm::ir_builder_wrapper::CreateMul, "l.mul");
+                gen_set_reg(rD, result);
+            }
+            return false;
+        case OP_L_DIV: //l.div
+            {
+                Value *const result = gen_arith_code_with_ovf_check(gen_get_reg(rA, "l.div_A"), gen_get_reg(rB, "ldiv_B"), &vm::ir_builder_wrapper::CreateSDiv, "l.div");
+                gen_set_reg(rD, result);//FIXME if rB==0, set CY
+            }
+            return false;
+        case OP_L_DIVU: //l.divu
+            {
+                Value *const a = builder->CreateZExt(gen_get_reg(rA, "l.divu_A"), builder->getInt64Ty());
+                Value *const b = builder->CreateZExt(gen_get_reg(rA, "l.divu_B"), builder->getInt64Ty());
+                Value *const result = gen_arith_code_with_ovf_check(a, b, &vm::ir_builder_wrapper::CreateUDiv, "l.divu");
+                gen_set_reg(rD, result);//FIXME if rB==0, set CY
+            }
+            return false;
+        case OP_L_MULU: //l.mulu
+            {
+                Value *const a = builder->CreateZExt(gen_get_reg(rA, "l.mulu_A"), builder->getInt64Ty());
+                Value *const b = builder->CreateZExt(gen_get_reg(rA, "l.mulu_B"), builder->getInt64Ty());
+                Value *const result = gen_arith_code_with_ovf_check(a, b, &vm::ir_builder_wrapper::CreateMul, "l.mulu");
+                gen_set_reg(rD, result);
+            }
+            return false;
+        default:
+            jcpu_or_disas_assert(!"Never comes here");
+            break;
     }
-    jcpu_or_disas_assert(!"Never comes here");
+    return false;
 }
 
-bool openrisc_vm::disas_logical(target_ulong insn){
+bool openrisc_vm::disas_logical(const vm::decoded_insn &d, insn_op_e op, int *){
     using namespace llvm;
-    const target_ulong op = bit_sub<6, 2>(insn);
-    const openrisc_arch::reg_e rD = get_reg_id<21>(insn);
-    const openrisc_arch::reg_e rA = get_reg_id<16>(insn);
+    const openrisc_arch::reg_e rD = get_reg_id(d.rd);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
 
-    //ConstantInt *const L_64 = ConstantInt::get(*context, APInt(6, bit_sub<0, 6>(insn)));
-    ConstantInt *const L_32 = ConstantInt::get(*context, APInt(openrisc_arch::reg_bit_width, bit_sub<0, 5>(insn)));
+    ConstantInt *const L_32 = gen_const(static_cast<target_ulong>(d.imm));
     switch(op){
-        case 0x0: //l.slli rD = rA << L
+        case OP_L_SLLI: //l.slli rD = rA << L
             gen_set_reg(rD, builder->CreateShl(gen_get_reg(rA, "l.slli"), L_32, "l.slli"));
             return false;
-        case 0x1: //l.srli rD = rA >> L logical
+        case OP_L_SRLI: //l.srli rD = rA >> L logical
             gen_set_reg(rD, builder->CreateLShr(gen_get_reg(rA, "l.srli"), L_32, "l.srli"));
             return false;
-        case 0x2: //l.srai rD = rA >> L arith
+        case OP_L_SRAI: //l.srai rD = rA >> L arith
             gen_set_reg(rD, builder->CreateAShr(gen_get_reg(rA, "l.srai"), L_32, "l.srai"));
             return false;
         default:
-            jcpu_or_disas_assert(!"Not implemented yet");
+            jcpu_or_disas_assert(!"Never comes here");
             break;
     }
-    jcpu_or_disas_assert(!"Never comes here");
+    return false;
 }
 
-bool openrisc_vm::disas_compare_immediate(target_ulong insn){
+bool openrisc_vm::disas_compare_immediate(const vm::decoded_insn &d, insn_op_e op, int *){
     using namespace llvm;
-    const target_ulong op0 = bit_sub<21, 5>(insn);
-    const openrisc_arch::reg_e rA = get_reg_id<16>(insn);
-    ConstantInt *const I16 = ConstantInt::get(*context, APInt(16, bit_sub<0, 16>(insn)));
-    Value *const I16s = builder->CreateSExt(I16, get_reg_type());
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    Value *const I16s = gen_const(static_cast<target_ulong>(d.imm));
 
-    switch(op0){
-        case 0x00: //l.sfeqi SR[F] = rA == sext(I16)
+    switch(op){
+        case OP_L_SFEQI: //l.sfeqi SR[F] = rA == sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpEQ(gen_get_reg(rA), I16s, "l.sfeqi"), "l.sfeqi");
             return false;
-        case 0x01: //l.sfnei SR[F} = rA != sext(I16)
+        case OP_L_SFNEI: //l.sfnei SR[F} = rA != sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpNE(gen_get_reg(rA), I16s, "l.sfnwi"), "l.sfnei");
             return false;
-        case 0x02: //l.sfgtui SR[F] = rA > sext(I16)
+        case OP_L_SFGTUI: //l.sfgtui SR[F] = rA > sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpUGT(gen_get_reg(rA), I16s, "l.sfgtui"), "l.sfgtui");
             return false;
-        case 0x05: //l.sfleui SR[F} = rA <= sext(I16)
+        case OP_L_SFLEUI: //l.sfleui SR[F} = rA <= sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpULE(gen_get_reg(rA), I16s, "l.sfleui"), "l.sfleui");
             return false;
-        case 0x0A: //l.sfgtsi SR[F] = rA > sext(I16)
+        case OP_L_SFGTSI: //l.sfgtsi SR[F] = rA > sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSGT(gen_get_reg(rA), I16s, "l.sfgtsi"), "l.sfgtsi");
             return false;
-        case 0x0B: //l.sfgesi SR[F] = rA >= sext(I16)
+        case OP_L_SFGESI: //l.sfgesi SR[F] = rA >= sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSGE(gen_get_reg(rA), I16s, "l.sfgesi"), "l.sfgesi");
             return false;
-        case 0x0C: //l.sfltsi SR[F] = rA < sext(I16)
+        case OP_L_SFLTSI: //l.sfltsi SR[F] = rA < sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSLT(gen_get_reg(rA), I16s, "l.sfltsi"), "l.sfltsi");
             return false;
-        case 0x0D: //l.sflesi SR[F] = rA <= sext(I16)
+        case OP_L_SFLESI: //l.sflesi SR[F] = rA <= sext(I16)
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSLE(gen_get_reg(rA, "l.sflesi_A"), I16s, "l.sflesi_I"), "l.sflesi");
             return false;
         default:
-            jcpu_or_disas_assert(!"Not implemented yet");
+            jcpu_or_disas_assert(!"Never comes here");
             break;
     }
+    return false;
 }
 
 
-bool openrisc_vm::disas_compare(target_ulong insn){
+bool openrisc_vm::disas_compare(const vm::decoded_insn &d, insn_op_e op, int *){
     using namespace llvm;
-    const target_ulong op0 = bit_sub<21, 5>(insn);
-    const openrisc_arch::reg_e rA = get_reg_id<16>(insn);
-    const openrisc_arch::reg_e rB = get_reg_id<11>(insn);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    const openrisc_arch::reg_e rB = get_reg_id(d.rs2);
 
-    switch(op0){
-        case 0x00: //l.sfeq SR[F] = rA == rB
+    switch(op){
+        case OP_L_SFEQ: //l.sfeq SR[F] = rA == rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpEQ(gen_get_reg(rA, "l.sfeq"), gen_get_reg(rB, "l.sfeq"), "l.sfeq"), "l.sfeq");
             return false;
-        case 0x01: //l.sfne SR[F] <= rA != rB
+        case OP_L_SFNE: //l.sfne SR[F] <= rA != rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpNE(gen_get_reg(rA, "l.sfne"), gen_get_reg(rB, "l.sfne"), "l.sfne"), "l.sfne");
             return false;
-        case 0x02: //l.sfgtu SR[F] <= rA > rB
+        case OP_L_SFGTU: //l.sfgtu SR[F] <= rA > rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpUGT(gen_get_reg(rA, "l.sfgtu_A"), gen_get_reg(rB, "l.sfgtu_B"), "l.sfgtu"), "l.sfgtu_SRF");
             return false;
-        case 0x03: //l.sfgeu SR[F] <= rA >= rB
+        case OP_L_SFGEU: //l.sfgeu SR[F] <= rA >= rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpUGE(gen_get_reg(rA, "l.sfgeu_A"), gen_get_reg(rB, "l.sfgeu_B"), "l.sfgeu"), "l.sfgeu_SRF");
             return false;
-        case 0x04: //l.sfltu SR[F} <= rA < rB
+        case OP_L_SFLTU: //l.sfltu SR[F} <= rA < rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpULT(gen_get_reg(rA, "l.sfltu_A"), gen_get_reg(rB, "l.sfltu_B"), "l.sfltu"), "l.sfltu_SRF");
             return false;
-        case 0x05: //l.sfleu SR[F] <= rA <= rB
+        case OP_L_SFLEU: //l.sfleu SR[F] <= rA <= rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpULE(gen_get_reg(rA, "l.sfleu_A"), gen_get_reg(rB, "l.sfleu_B"), "l.sfleu"), "l.sfleu_SRF");
             return false;
-        case 0x0A: //l.sfgts SR[F] <= rA > rB
+        case OP_L_SFGTS: //l.sfgts SR[F] <= rA > rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSGT(gen_get_reg(rA), gen_get_reg(rB)));
             return false;
-        case 0x0B: //l.sfges SR[F] <= rA >= rB
+        case OP_L_SFGES: //l.sfges SR[F] <= rA >= rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSGE(gen_get_reg(rA), gen_get_reg(rB)));
             return false;
-        case 0x0C: //l.sflts SR[F] <= rA < rB
+        case OP_L_SFLTS: //l.sflts SR[F] <= rA < rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSLT(gen_get_reg(rA, "l.sflts_A"), gen_get_reg(rB, "l.sflts_B"), "l.sflts"), "l.sflts_SRF");
             return false;
-        case 0x0D: //l.sfles SR[F} <= rA <= rB
+        case OP_L_SFLES: //l.sfles SR[F} <= rA <= rB
             gen_set_sr(openrisc_arch::SR_F, builder->CreateICmpSLE(gen_get_reg(rA), gen_get_reg(rB)));
             return false;
         default:
-            jcpu_or_disas_assert(!"Not implemented yet");
+            jcpu_or_disas_assert(!"Never comes here");
             break;
     }
+    return false;
 }
 
-bool openrisc_vm::disas_others(target_ulong insn, int *const insn_depth){
+bool openrisc_vm::disas_jump(const vm::decoded_insn &d, insn_op_e op, int *const insn_depth){
     using namespace llvm;
-    const target_ulong op0 = bit_sub<26, 6>(insn);
-    const target_ulong op1 = bit_sub<24, 2>(insn);
-    const openrisc_arch::reg_e rD = get_reg_id<21>(insn);
-    const openrisc_arch::reg_e rA = get_reg_id<16>(insn);
-    const openrisc_arch::reg_e rB = get_reg_id<11>(insn);
-    //const target_ulong lo6 = bit_sub<5, 6>(insn);
-    //const target_ulong k5 = bit_sub<0, 5>(insn);
-    ConstantInt *const lo16 = ConstantInt::get(*context, APInt(16, bit_sub<0, 16>(insn)));
-    //const target_ulong i5 = bit_sub<21, 5>(insn);
-    ConstantInt *const I11 = ConstantInt::get(*context, APInt(11, bit_sub<0, 11>(insn)));
-    ConstantInt *const n26 = ConstantInt::get(*context, APInt(26, bit_sub<0, 26>(insn)));
-    ConstantInt *const I = ConstantInt::get(*context, APInt(16, (bit_sub<21, 5>(insn) << 11) | bit_sub<0, 11>(insn)));
-#if defined(JCPU_OPENRISC_DEBUG) && JCPU_OPENRISC_DEBUG > 0
-    //std::cerr << "op0:" << std::hex << op0 << " rA:" << bit_sub<21, 5>(insn) << " rB:" << bit_sub<11, 5>(insn) << " rD" << bit_sub<21, 5>(insn) << " lo16:" << bit_sub<0, 16>(insn) << std::endl;
-#endif
-    switch(op0){
-        case 0x00://l.j PC = sext(n26) << 2 + PC
+    const openrisc_arch::reg_e rB = get_reg_id(d.rs2);
+    Value *const pc_offset = gen_const(static_cast<target_ulong>(d.imm)); //sext(n26) << 2
+    switch(op){
+        case OP_L_J://l.j PC = sext(n26) << 2 + PC
             {
                 static const char *const mn = "l.j";
                 ConstantInt *const pc = gen_get_pc();
-                Value *const pc_offset = builder->CreateShl(builder->CreateSExt(n26, get_reg_type(), mn), 2, mn);
                 gen_set_reg(openrisc_arch::REG_PNEXT_PC, builder->CreateAdd(pc, pc_offset, mn));
-                const bool ret = disas_insn(processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
+                const bool ret = disas_insn(job.processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
                 jcpu_or_disas_assert(!ret);
-                return true;
             }
-        case 0x01://l.jal
+            return true;
+        case OP_L_JAL://l.jal
             {
                 ConstantInt *const pc = gen_get_pc();
-                Value *const pc_offset = builder->CreateShl(builder->CreateSExt(n26, get_reg_type()), 2);
                 gen_set_reg(openrisc_arch::REG_PNEXT_PC, builder->CreateAdd(pc, pc_offset));
                 Value *const nd_bit = builder->CreateAnd(builder->CreateLShr(gen_get_reg(openrisc_arch::REG_CPUCFGR), gen_const(openrisc_arch::CPUCFGR_ND)), gen_const(1));
                 gen_set_reg(openrisc_arch::REG_LR, builder->CreateAdd(pc, gen_cond_code(nd_bit, gen_const(4), gen_const(8))));//check spr
-                const bool ret = disas_insn(processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
-                jcpu_or_disas_assert(!ret);
-                return true;
-            }
-        case 0x03: //l.bnf
-        case 0x04: //l.bf
-            {
-                const bool is_bnf = op0 == 0x03;
-                const char *const mn = is_bnf ? "l.bnf" : "l.bf";
-                const virt_addr_t &pc = processing_pc.top().first;
-                Value *const flag = gen_get_reg(openrisc_arch::REG_SR);
-                Value *const shifted_flag = builder->CreateAnd(builder->CreateLShr(flag, openrisc_arch::SR_F), 1, mn);
-                Value *const pc_offset = builder->CreateShl(builder->CreateSExt(lo16, get_reg_type(), mn), 2, mn);
-                Value *not_taken_pc = gen_const(pc + 8);
-                Value *taken_pc = builder->CreateAdd(gen_const(pc), pc_offset, mn);
-                if(is_bnf) std::swap(taken_pc, not_taken_pc);
-                Value *const next_pc = gen_cond_code(shifted_flag, taken_pc, not_taken_pc);
-                gen_set_reg(openrisc_arch::REG_PNEXT_PC, next_pc);
-                gen_set_reg(openrisc_arch::REG_SR, builder->CreateAnd(flag, ~(static_cast<target_ulong>(1) << openrisc_arch::SR_F), mn));
-                const bool ret = disas_insn(pc + static_cast<virt_addr_t>(4), insn_depth); //delay slot
+                const bool ret = disas_insn(job.processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
                 jcpu_or_disas_assert(!ret);
             }
             return true;
-        case 0x05:
-            if(op1 == 1){//l.nop
-                return false;
-            }
-            else{
-                jcpu_or_disas_assert(!"Not implemented yet");
-            }
-            break;
-        case 0x06:
-            if(!bit_sub<16, 1>(insn)){//l.movhi rD = extz(lo16) << 16
-                static const char *const mn = "l.movhi";
-                gen_set_reg(rD, builder->CreateShl(builder->CreateZExt(lo16, get_reg_type(), mn), gen_const(16), mn));
-                return false;
-            }
-            else{
-                jcpu_or_disas_assert(!"Not implemented yet");
-            }
-            break;
-        case 0x09: //l.rfe PC <= PRCR, SR <= ESR
-            {
-                static const char *const mn = "l.rfe";
-                gen_set_reg(openrisc_arch::REG_PNEXT_PC, gen_get_reg(openrisc_arch::REG_EPCR0, mn));
-                gen_set_sr(openrisc_arch::SR_IEE, ConstantInt::get(*context, APInt(32, 0)));
-            }
-            return true;
-        case 0x11: //l.jr PC = rB
+        case OP_L_JR: //l.jr PC = rB
             {
                 static const char *const mn = "l.jr";
                 gen_set_reg(openrisc_arch::REG_PNEXT_PC, gen_get_reg(rB, mn));
-                const bool ret = disas_insn(processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
+                const bool ret = disas_insn(job.processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
                 jcpu_or_disas_assert(!ret);
             }
             return true;
-        case 0x12: //l.jalr PC = rB, LR <= PC + 8
+        case OP_L_JALR: //l.jalr PC = rB, LR <= PC + 8
             {
                 static const char *const mn = "l.jalr";
                 gen_set_reg(openrisc_arch::REG_PNEXT_PC, gen_get_reg(rB, mn));
-                const bool ret = disas_insn(processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
+                const bool ret = disas_insn(job.processing_pc.top().first + static_cast<virt_addr_t>(4), insn_depth); //delay slot
                 jcpu_or_disas_assert(!ret);
-                //gen_set_reg(openrisc_arch::REG_LR, processing_pc.top().first + static_cast<virt_addr_t>(8), insn_depth); //delay slot
+                //gen_set_reg(openrisc_arch::REG_LR, job.processing_pc.top().first + static_cast<virt_addr_t>(8), insn_depth); //delay slot
                 Value *const nd_bit = builder->CreateAnd(builder->CreateLShr(gen_get_reg(openrisc_arch::REG_CPUCFGR), gen_const(openrisc_arch::CPUCFGR_ND)), gen_const(1));
                 gen_set_reg(openrisc_arch::REG_LR, builder->CreateAdd(gen_get_pc(), gen_cond_code(nd_bit, gen_const(4), gen_const(8))));//check spr
             }
             return true;
-        case 0x21: //l.lwz rD = (rA + sext(I))
+        default:
+            jcpu_or_disas_assert(!"Never comes here");
+            break;
+    }
+    return true;
+}
+
+//l.bnf, l.bf
+bool openrisc_vm::disas_branch(const vm::decoded_insn &d, insn_op_e op, int *const insn_depth){
+    using namespace llvm;
+    const bool is_bnf = op == OP_L_BNF;
+    const char *const mn = insn_table[op].name;
+    const virt_addr_t &pc = job.processing_pc.top().first;
+    Value *const flag = gen_get_reg(openrisc_arch::REG_SR);
+    Value *const shifted_flag = builder->CreateAnd(builder->CreateLShr(flag, openrisc_arch::SR_F), 1, mn);
+    Value *const pc_offset = gen_const(static_cast<target_ulong>(d.imm)); //sext(N) << 2
+    Value *not_taken_pc = gen_const(pc + 8);
+    Value *taken_pc = builder->CreateAdd(gen_const(pc), pc_offset, mn);
+    if(is_bnf) std::swap(taken_pc, not_taken_pc);
+    Value *const next_pc = gen_cond_code(shifted_flag, taken_pc, not_taken_pc);
+    gen_set_reg(openrisc_arch::REG_PNEXT_PC, next_pc);
+    gen_set_reg(openrisc_arch::REG_SR, builder->CreateAnd(flag, ~(static_cast<target_ulong>(1) << openrisc_arch::SR_F), mn));
+    const bool ret = disas_insn(pc + static_cast<virt_addr_t>(4), insn_depth); //delay slot
+    jcpu_or_disas_assert(!ret);
+    return true;
+}
+
+//l.movhi rD = extz(K) << 16
+bool openrisc_vm::disas_movhi(const vm::decoded_insn &d, insn_op_e, int *){
+    gen_set_reg(get_reg_id(d.rd), gen_const(static_cast<target_ulong>(d.imm) << 16));
+    return false;
+}
+
+//l.rfe PC <= PRCR, SR <= ESR
+bool openrisc_vm::disas_rfe(const vm::decoded_insn &, insn_op_e, int *){
+    static const char *const mn = "l.rfe";
+    gen_set_reg(openrisc_arch::REG_PNEXT_PC, gen_get_reg(openrisc_arch::REG_EPCR0, mn));
+    gen_set_reg(openrisc_arch::REG_SR, gen_get_reg(openrisc_arch::REG_ESR0, mn));
+    return true;
+}
+
+bool openrisc_vm::disas_load(const vm::decoded_insn &d, insn_op_e op, int *){
+    using namespace llvm;
+    const openrisc_arch::reg_e rD = get_reg_id(d.rd);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    Value *const I = gen_const(static_cast<target_ulong>(d.imm));
+    switch(op){
+        case OP_L_LWZ: //l.lwz rD = (rA + sext(I))
             {
-                Value *const addr = builder->CreateAdd(gen_get_reg(rA), builder->CreateSExt(I11, get_reg_type()));
+                Value *const addr = builder->CreateAdd(gen_get_reg(rA), I);
                 Value *const dat = gen_lw(addr, sizeof(target_ulong));
                 gen_set_reg(rD, dat);
             }
             return false;
-        case 0x23: //l.lbz rD = zext(lb(sext(lo16) + rA))
+        case OP_L_LBZ: //l.lbz rD = zext(lb(sext(I) + rA))
             {
                 static const char *const mn = "l.lbz";
-                Value *const addr = builder->CreateAdd(gen_get_reg(rA, mn), builder->CreateSExt(lo16, get_reg_type(), mn), mn);
+                Value *const addr = builder->CreateAdd(gen_get_reg(rA, mn), I, mn);
                 Value *const dat = gen_lw(addr, 1, mn);
                 gen_set_reg(rD, builder->CreateZExt(dat, get_reg_type(), mn));
             }
             return false;
-        case 0x24: //l.lbs rD = sext(lb(sext(lo16) + rA))
+        case OP_L_LBS: //l.lbs rD = sext(lb(sext(I) + rA))
             {
                 static const char *const mn = "l.lbs";
-                Value *const addr = builder->CreateAdd(gen_get_reg(rA, mn), builder->CreateSExt(lo16, get_reg_type(), mn), mn);
+                Value *const addr = builder->CreateAdd(gen_get_reg(rA, mn), I, mn);
                 Value *const dat = gen_lw(addr, 1, mn);
                 gen_set_reg(rD, builder->CreateSExt(dat, get_reg_type(), mn));
             }
             return false;
-        case 0x27: //l.addi  (set rD (add rA lo16))
-            gen_set_reg(rD, builder->CreateAdd(gen_get_reg(rA), builder->CreateSExt(lo16, get_reg_type())));
+        default:
+            jcpu_or_disas_assert(!"Never comes here");
+            break;
+    }
+    return false;
+}
+
+bool openrisc_vm::disas_immediate(const vm::decoded_insn &d, insn_op_e op, int *){
+    using namespace llvm;
+    const openrisc_arch::reg_e rD = get_reg_id(d.rd);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    Value *const imm = gen_const(static_cast<target_ulong>(d.imm)); //sign or zero extended by the format of the row
+    switch(op){
+        case OP_L_ADDI: //l.addi  (set rD (add rA lo16))
+            gen_set_reg(rD, builder->CreateAdd(gen_get_reg(rA), imm));
             //FIXME CARRY, OVERFLOW
             return false;
-        case 0x29: //l.andi rD = rA & extz(lo16)
-            gen_set_reg(rD, builder->CreateAnd(gen_get_reg(rA, "l.andi"), builder->CreateZExt(lo16, get_reg_type(), "l.andi"), "l.andi"));
+        case OP_L_ANDI: //l.andi rD = rA & extz(lo16)
+            gen_set_reg(rD, builder->CreateAnd(gen_get_reg(rA, "l.andi"), imm, "l.andi"));
             return false;
-        case 0x2A: //l.ori (set rD (or rA (and lo16 65535)))
-            gen_set_reg(rD, builder->CreateOr(gen_get_reg(rA), builder->CreateZExt(lo16, get_reg_type())));
+        case OP_L_ORI: //l.ori (set rD (or rA (and lo16 65535)))
+            gen_set_reg(rD, builder->CreateOr(gen_get_reg(rA), imm));
             return false;
-        case 0x2B: //l.xori (set rD (xor rA sext(lo16 )))
-            gen_set_reg(rD, builder->CreateXor(gen_get_reg(rA), builder->CreateSExt(lo16, get_reg_type())));
+        case OP_L_XORI: //l.xori (set rD (xor rA sext(lo16 )))
+            gen_set_reg(rD, builder->CreateXor(gen_get_reg(rA), imm));
             return false;
-        case 0x2C: //l.muli
+        case OP_L_MULI: //l.muli
             {
-                //Value *const mul = builder->CreateMul(gen_get_reg(rA), builder->CreateSExt(lo16, builder->getInt64Ty()));
-                Value *const mul = builder->CreateMul(gen_get_reg(rA), builder->CreateSExt(lo16, get_reg_type()));
+                Value *const mul = builder->CreateMul(gen_get_reg(rA), imm);
                 gen_set_reg(rD, mul);
                 //FIXME Overflow ? 
             }
             return false;
-        case 0x2D: //l.mfspr
-            std::cerr << "l.mfspr is not implemented yet" << std::endl;
+        default:
+            jcpu_or_disas_assert(!"Never comes here");
+            break;
+    }
+    return false;
+}
+
+//l.sw, l.sb, l.sh (rA + sext(I)) = rB
+bool openrisc_vm::disas_store(const vm::decoded_insn &d, insn_op_e op, int *){
+    using namespace llvm;
+    const char *const mn = insn_table[op].name;
+    const unsigned int len = op == OP_L_SW ? sizeof(target_ulong) : op == OP_L_SH ? 2 : 1;
+    Value *const EA = builder->CreateAdd(gen_get_reg(get_reg_id(d.rs1), mn), gen_const(static_cast<target_ulong>(d.imm)), mn);
+    gen_sw(EA, len, gen_get_reg(get_reg_id(d.rs2), mn));
+    return false;
+}
+
+bool openrisc_vm::disas_fp(const vm::decoded_insn &d, insn_op_e op, int *){
+    using namespace llvm;
+    const openrisc_arch::reg_e rD = get_reg_id(d.rd);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    const openrisc_arch::reg_e rB = get_reg_id(d.rs2);
+    switch(op){
+        case OP_LF_ADD_S: //lf.add.s rD = rA + rB
+            gen_set_reg(rD, gen_fp_op(vm::FP_ADD, gen_get_reg(rA, "lf.add.s"), gen_get_reg(rB, "lf.add.s")));
+            return false;
+        case OP_LF_SUB_S: //lf.sub.s rD = rA - rB
+            gen_set_reg(rD, gen_fp_op(vm::FP_SUB, gen_get_reg(rA, "lf.sub.s"), gen_get_reg(rB, "lf.sub.s")));
+            return false;
+        case OP_LF_MUL_S: //lf.mul.s rD = rA * rB
+            gen_set_reg(rD, gen_fp_op(vm::FP_MUL, gen_get_reg(rA, "lf.mul.s"), gen_get_reg(rB, "lf.mul.s")));
+            return false;
+        case OP_LF_DIV_S: //lf.div.s rD = rA / rB
+            gen_set_reg(rD, gen_fp_op(vm::FP_DIV, gen_get_reg(rA, "lf.div.s"), gen_get_reg(rB, "lf.div.s")));
+            return false;
+        case OP_LF_ITOF_S: //lf.itof.s rD = float(rA)
+            gen_set_reg(rD, gen_fp_op(vm::FP_FROM_I32, gen_get_reg(rA, "lf.itof.s")));
+            return false;
+        case OP_LF_FTOI_S: //lf.ftoi.s rD = int(rA), truncated as the C conversion GCC makes from it
+            gen_set_reg(rD, gen_fp_op(vm::FP_TO_I32, gen_get_reg(rA, "lf.ftoi.s")));
             return false;
-        case 0x30: //l.mtspr
-            std::cerr << "l.mtspr is not implemented yet" << std::endl;
+        case OP_LF_MADD_S: //lf.madd.s rD = rA * rB + rD
+            gen_set_reg(rD, gen_fp_op(vm::FP_MADD, gen_get_reg(rA, "lf.madd.s"), gen_get_reg(rB, "lf.madd.s"), gen_get_reg(rD, "lf.madd.s")));
             return false;
-        case 0x35: //l.sw
+        case OP_LF_SFEQ_S: //lf.sfeq.s SR[F] = rA == rB
+        case OP_LF_SFNE_S: //lf.sfne.s SR[F] = rA != rB
+        case OP_LF_SFGT_S: //lf.sfgt.s SR[F] = rA > rB
+        case OP_LF_SFGE_S: //lf.sfge.s SR[F] = rA >= rB
+        case OP_LF_SFLT_S: //lf.sflt.s SR[F] = rA < rB
+        case OP_LF_SFLE_S: //lf.sfle.s SR[F] = rA <= rB
             {
-                static const char *const mn = "l.sw";
-                Value *const EA = builder->CreateAdd(gen_get_reg(rA, mn), builder->CreateSExt(I, get_reg_type(), mn), mn);
-                gen_sw(EA, sizeof(target_ulong), gen_get_reg(rB, mn));
+                const char *const mn = insn_table[op].name;
+                Value *const a = gen_get_reg(rA, mn);
+                Value *const b = gen_get_reg(rB, mn);
+                Value *result;
+                switch(op){
+                    case OP_LF_SFEQ_S: result = gen_fp_op(vm::FP_EQ, a, b); break;
+                    case OP_LF_SFNE_S: result = builder->CreateXor(gen_fp_op(vm::FP_EQ, a, b), gen_const(1), mn); break; //true if unordered
+                    case OP_LF_SFGT_S: result = gen_fp_op(vm::FP_LT, b, a); break;
+                    case OP_LF_SFGE_S: result = gen_fp_op(vm::FP_LE, b, a); break;
+                    case OP_LF_SFLT_S: result = gen_fp_op(vm::FP_LT, a, b); break;
+                    default: result = gen_fp_op(vm::FP_LE, a, b); break;
+                }
+                gen_set_sr(openrisc_arch::SR_F, builder->CreateTrunc(result, IntegerType::get(*context, 1), mn), mn);
             }
             return false;
-        case 0x36: //l.sb 
-            {
-                static const char *const mn = "l.sb";
-                Value *const EA = builder->CreateAdd(gen_get_reg(rA, mn), builder->CreateSExt(I, get_reg_type(), mn), mn);
-                gen_sw(EA, 1, gen_get_reg(rB, mn));
+        default:
+            jcpu_or_disas_assert(!"Never comes here");
+            break;
+    }
+    return false;
+}
+
+//Operations run natively unless FPCSR selects a rounding mode other than nearest, enables the exceptions or has been read.
+//Otherwise jcpu_fp_exact() is called, which takes the rounding mode into account and sets the flags in FPCSR.
+//Floating point exceptions are not raised even if FPCSR[FPEE] is set.
+llvm::Value *openrisc_vm::gen_fp_op(vm::fp_op_e op, llvm::Value *a, llvm::Value *b, llvm::Value *c){
+    using namespace llvm;
+    static const char *const mn = "lf";
+    const bool is_compare = op == vm::FP_EQ || op == vm::FP_LT || op == vm::FP_LE;
+    const bool rm_independent = is_compare || op == vm::FP_TO_I32;
+    Type *const i64_type = builder->getInt64Ty();
+    Value *const a64 = builder->CreateZExt(a, i64_type, mn);
+    Value *const b64 = b ? builder->CreateZExt(b, i64_type, mn) : JCPU_NULLPTR;
+    Value *const c64 = c ? builder->CreateZExt(c, i64_type, mn) : JCPU_NULLPTR;
+    Value *const fpcsr = gen_get_reg(openrisc_arch::REG_FPCSR, mn);
+    const target_ulong fast_mask = openrisc_arch::FPCSR_FPEE | openrisc_arch::FPCSR_EXACT | (rm_independent ? 0 : openrisc_arch::FPCSR_RM);
+    BasicBlock *const fast = BasicBlock::Create(*context, "lf_native", cur_func);
+    BasicBlock *const slow = BasicBlock::Create(*context, "lf_exact", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "lf_end", cur_func);
+    builder->CreateCondBr(builder->CreateICmpEQ(builder->CreateAnd(fpcsr, gen_const(fast_mask), mn), gen_const(0), mn), fast, slow);
+
+    builder->SetInsertPoint(fast);
+    Value *const fast_result = gen_fp_native(op, false, a64, b64, c64);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(slow);
+    Value *rm;
+    if(rm_independent){
+        rm = ConstantInt::get(builder->getInt32Ty(), op == vm::FP_TO_I32 ? vm::FP_RM_RTZ : vm::FP_RM_RNE);
+    }
+    else{//nearest, zero, +inf and -inf to RNE, RTZ, RUP and RDN
+        Value *const or_rm = builder->CreateLShr(builder->CreateAnd(fpcsr, gen_const(openrisc_arch::FPCSR_RM), mn), gen_const(openrisc_arch::FPCSR_RM_SHIFT), mn);
+        rm = builder->CreateXor(or_rm, builder->CreateLShr(or_rm, gen_const(1), mn), mn);
+    }
+    Value *flags = JCPU_NULLPTR;
+    Value *const slow_result = gen_fp_exact(op, false, a64, b64, c64, rm, &flags);
+    static const target_ulong flag_map[][2] = {
+        {vm::FP_FLAG_NX, openrisc_arch::FPCSR_IXF}, {vm::FP_FLAG_UF, openrisc_arch::FPCSR_UNF}, {vm::FP_FLAG_OF, openrisc_arch::FPCSR_OVF},
+        {vm::FP_FLAG_DZ, openrisc_arch::FPCSR_DZF}, {vm::FP_FLAG_NV, openrisc_arch::FPCSR_IVF}
+    };
+    Value *slow_fpcsr = fpcsr;
+    for(size_t i = 0; i < sizeof(flag_map) / sizeof(flag_map[0]); ++i){
+        Value *const raised = builder->CreateICmpNE(builder->CreateAnd(flags, flag_map[i][0], mn), ConstantInt::get(builder->getInt32Ty(), 0), mn);
+        slow_fpcsr = builder->CreateOr(slow_fpcsr, builder->CreateSelect(raised, gen_const(flag_map[i][1]), gen_const(0), mn), mn);
+    }
+    if(!is_compare && op != vm::FP_TO_I32){//flags by the class of the result, which is never a signaling NaN
+        Value *const abs = builder->CreateAnd(builder->CreateTrunc(slow_result, get_reg_type(), mn), gen_const(0x7FFFFFFF), mn);
+        slow_fpcsr = builder->CreateOr(slow_fpcsr, builder->CreateSelect(builder->CreateICmpEQ(abs, gen_const(0), mn), gen_const(openrisc_arch::FPCSR_ZF), gen_const(0), mn), mn);
+        slow_fpcsr = builder->CreateOr(slow_fpcsr, builder->CreateSelect(builder->CreateICmpEQ(abs, gen_const(0x7F800000), mn), gen_const(openrisc_arch::FPCSR_INF), gen_const(0), mn), mn);
+        slow_fpcsr = builder->CreateOr(slow_fpcsr, builder->CreateSelect(builder->CreateICmpUGT(abs, gen_const(0x7F800000), mn), gen_const(openrisc_arch::FPCSR_QNF), gen_const(0), mn), mn);
+    }
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(join);
+    cur_bb = join;
+    PHINode *const result = builder->CreatePHI(i64_type, 2, mn);
+    result->addIncoming(fast_result, fast);
+    result->addIncoming(slow_result, slow);
+    PHINode *const new_fpcsr = builder->CreatePHI(get_reg_type(), 2, mn);
+    new_fpcsr->addIncoming(fpcsr, fast);
+    new_fpcsr->addIncoming(slow_fpcsr, slow);
+    gen_set_reg(openrisc_arch::REG_FPCSR, new_fpcsr);
+    return builder->CreateTrunc(result, get_reg_type(), mn);
+}
+
+//Accesses with a constant index to the registers in the register file are translated to register accesses.
+//Others call the helpers, and writes through them end the block as they may have side effects.
+bool openrisc_vm::disas_spr(const vm::decoded_insn &d, insn_op_e op, int *){
+    using namespace llvm;
+    const bool is_write = op == OP_L_MTSPR;
+    const char *const mn = insn_table[op].name;
+    const openrisc_arch::reg_e rD = get_reg_id(d.rd);
+    const openrisc_arch::reg_e rA = get_reg_id(d.rs1);
+    const openrisc_arch::reg_e rB = get_reg_id(d.rs2);
+    const target_ulong k = static_cast<target_ulong>(d.imm); //split for l.mtspr
+    if(rA == openrisc_arch::REG_GR00){
+        const openrisc_arch::reg_e reg = get_spr_reg(k);
+        const bool side_effect = k == openrisc_arch::SPR_CPUCFGR || k == openrisc_arch::SPR_PICMR ||
+            k == openrisc_arch::SPR_TTMR || k == openrisc_arch::SPR_TTCR;
+        if(k == openrisc_arch::SPR_FPCSR){
+            Value *const fpcsr = gen_get_reg(openrisc_arch::REG_FPCSR, mn);
+            Value *const exact = gen_const(openrisc_arch::FPCSR_EXACT);
+            if(is_write){
+                Value *const val = builder->CreateAnd(gen_get_reg(rB, mn), gen_const(~static_cast<target_ulong>(openrisc_arch::FPCSR_EXACT)), mn);
+                gen_set_reg(openrisc_arch::REG_FPCSR, builder->CreateOr(val, builder->CreateAnd(fpcsr, exact, mn), mn));
+            }
+            else{//the flags are recorded from now on
+                gen_set_reg(rD, builder->CreateAnd(fpcsr, gen_const(~static_cast<target_ulong>(openrisc_arch::FPCSR_EXACT)), mn));
+                gen_set_reg(openrisc_arch::REG_FPCSR, builder->CreateOr(fpcsr, exact, mn));
             }
             return false;
-        case 0x37: //l.sh
+        }
+        if(!is_write && (k == openrisc_arch::SPR_VR || k == openrisc_arch::SPR_UPR)){
+            gen_set_reg(rD, gen_const(read_spr(k, 0)));
+            return false;
+        }
+        if(!is_write && reg != openrisc_arch::NUM_REGS && k != openrisc_arch::SPR_TTCR){
+            gen_set_reg(rD, gen_get_reg(reg, mn));
+            return false;
+        }
+        if(is_write && reg != openrisc_arch::NUM_REGS && !side_effect){
+            gen_set_reg(reg, gen_get_reg(rB, mn));
+            return k == openrisc_arch::SPR_SR && gen_end_block(); //interrupts may have been enabled
+        }
+    }
+    Value *const spr = builder->CreateOr(gen_get_reg(rA, mn), gen_const(k), mn);
+    Value *const val = is_write ? gen_get_reg(rB, mn) : JCPU_NULLPTR;
+    gen_flush_regs(openrisc_arch::REG_GR00, openrisc_arch::NUM_REGS); //the helpers work on the state
+    Value *const insn_offset = ConstantInt::get(builder->getInt32Ty(), job.insn_offset);
+    std::vector<Type *> types;
+    types.push_back(PointerType::getUnqual(builder->getInt8Ty()));
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt32Ty());
+    if(!is_write){
+        Value *const result = builder->CreateCall3(declare_host_func("jcpu_openrisc_mfspr", builder->getInt32Ty(), types,
+                    reinterpret_cast<void *>(&jcpu_openrisc_mfspr)), cur_state, spr, insn_offset, mn);
+        gen_set_reg(rD, result);
+        return false;
+    }
+    types.push_back(builder->getInt32Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(spr);
+    args.push_back(val);
+    args.push_back(insn_offset);
+    builder->CreateCall(declare_host_func("jcpu_openrisc_mtspr", Type::getVoidTy(*context), types,
+                reinterpret_cast<void *>(&jcpu_openrisc_mtspr)), args);
+    return gen_end_block();
+}
+
+//Ends the block after the current instruction, unless it is in a delay slot where the branch ends the block anyway.
+bool openrisc_vm::gen_end_block(){
+    if(job.processing_pc.size() > 1) return false;
+    gen_set_reg(openrisc_arch::REG_PNEXT_PC, gen_const(job.processing_pc.top().first + static_cast<virt_addr_t>(4)));
+    return true;
+}
+
+//K other than the hooks of openrisc_arch::nop_e is just l.nop
+bool openrisc_vm::disas_nop(const vm::decoded_insn &d, insn_op_e, int *){
+    using namespace llvm;
+    const target_ulong k = static_cast<target_ulong>(d.imm);
+    switch(k){
+        case openrisc_arch::NOP_EXIT:
+        case openrisc_arch::NOP_REPORT:
+        case openrisc_arch::NOP_PRINTF:
+        case openrisc_arch::NOP_PUTC:
+        case openrisc_arch::NOP_CNT_RESET:
+        case openrisc_arch::NOP_GET_TICKS:
+        case openrisc_arch::NOP_TRACE_ON:
+        case openrisc_arch::NOP_TRACE_OFF:
+        case openrisc_arch::NOP_EXIT_SILENT:
+            break;
+        default:
+            return false;
+    }
+    gen_flush_regs(openrisc_arch::REG_GR00, openrisc_arch::NUM_REGS); //the hooks work on the state
+    std::vector<Type *> types;
+    types.push_back(PointerType::getUnqual(builder->getInt8Ty()));
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt32Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(gen_const(k));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), job.insn_offset));
+    builder->CreateCall(declare_host_func("jcpu_openrisc_nop", Type::getVoidTy(*context), types,
+                reinterpret_cast<void *>(&jcpu_openrisc_nop)), args);
+    const bool is_exit = k == openrisc_arch::NOP_EXIT || k == openrisc_arch::NOP_EXIT_SILENT;
+    return is_exit && gen_end_block(); //run() returns after this block
+}
+
+openrisc_arch::reg_e openrisc_vm::get_spr_reg(target_ulong spr){
+    switch(spr){
+        case openrisc_arch::SPR_CPUCFGR: return openrisc_arch::REG_CPUCFGR;
+        case openrisc_arch::SPR_SR: return openrisc_arch::REG_SR;
+        case openrisc_arch::SPR_FPCSR: return openrisc_arch::REG_FPCSR;
+        case openrisc_arch::SPR_EPCR0: return openrisc_arch::REG_EPCR0;
+        case openrisc_arch::SPR_EEAR0: return openrisc_arch::REG_EEAR0;
+        case openrisc_arch::SPR_ESR0: return openrisc_arch::REG_ESR0;
+        case openrisc_arch::SPR_PICMR: return openrisc_arch::REG_PICMR;
+        case openrisc_arch::SPR_TTMR: return openrisc_arch::REG_TTMR;
+        case openrisc_arch::SPR_TTCR: return openrisc_arch::REG_TTCR;
+        default:
+            if(openrisc_arch::SPR_GPR0 <= spr && spr < openrisc_arch::SPR_GPR0 + 32){
+                return static_cast<openrisc_arch::reg_e>(openrisc_arch::REG_GR00 + spr - openrisc_arch::SPR_GPR0);
+            }
+            return openrisc_arch::NUM_REGS;
+    }
+}
+
+target_ulong openrisc_vm::read_spr(target_ulong spr, uint64_t icount){
+    switch(spr){
+        case openrisc_arch::SPR_VR:
+            return 0x12000000; //OR1200
+        case openrisc_arch::SPR_UPR:
+            return (1U << openrisc_arch::UPR_UP) | (1U << openrisc_arch::UPR_ICP) | (1U << openrisc_arch::UPR_PCUP) |
+                (1U << openrisc_arch::UPR_PICP) | (1U << openrisc_arch::UPR_TTP);
+        case openrisc_arch::SPR_FPCSR:
             {
-                static const char *const mn = "l.sh";
-                Value *const EA = builder->CreateAdd(gen_get_reg(rA, mn), builder->CreateSExt(I, get_reg_type(), mn), mn);
-                gen_sw(EA, 2, gen_get_reg(rB, mn));
+                const target_ulong fpcsr = get_reg_func(openrisc_arch::REG_FPCSR);
+                set_reg_func(openrisc_arch::REG_FPCSR, fpcsr | openrisc_arch::FPCSR_EXACT);
+                return fpcsr & ~static_cast<target_ulong>(openrisc_arch::FPCSR_EXACT);
             }
-            return false;
- 
+        case openrisc_arch::SPR_PICSR:
+            return static_cast<target_ulong>(__atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_ACQUIRE));
+        case openrisc_arch::SPR_TTMR:
+        case openrisc_arch::SPR_TTCR:
+            update_tick_timer(icount);
+            if(spr == openrisc_arch::SPR_TTMR) break;
+            return get_reg_func(openrisc_arch::REG_TTCR) + (tick_timer_counting() ? static_cast<target_ulong>(icount - tt.icount) : 0);
+        case openrisc_arch::SPR_PCCR0: //counts the executed instructions whatever PCMR0 selects
+            return static_cast<target_ulong>(icount - pccr0_base);
+        case openrisc_arch::SPR_PCMR0:
+            {
+                const std::map<target_ulong, target_ulong>::const_iterator it = other_sprs.find(spr);
+                return (it == other_sprs.end() ? 0 : it->second) | (1U << openrisc_arch::PCMR_CP); //only counter 0 is present
+            }
+        default:
+            break;
+    }
+    const openrisc_arch::reg_e reg = get_spr_reg(spr);
+    if(reg != openrisc_arch::NUM_REGS) return get_reg_func(reg);
+    const std::map<target_ulong, target_ulong>::const_iterator it = other_sprs.find(spr);
+    return it == other_sprs.end() ? 0 : it->second;
+}
+
+void openrisc_vm::write_spr(target_ulong spr, target_ulong val, uint64_t icount){
+    switch(spr){
+        case openrisc_arch::SPR_VR:
+        case openrisc_arch::SPR_UPR:
+        case openrisc_arch::SPR_CPUCFGR:
+        case openrisc_arch::SPR_GPR0:
+            return; //read only
+        case openrisc_arch::SPR_FPCSR:
+            set_reg_func(openrisc_arch::REG_FPCSR, (val & ~static_cast<target_ulong>(openrisc_arch::FPCSR_EXACT)) |
+                    (get_reg_func(openrisc_arch::REG_FPCSR) & openrisc_arch::FPCSR_EXACT));
+            return;
+        case openrisc_arch::SPR_ICBIR:
+            icache_invalidations.push_back(val);
+            return;
+        case openrisc_arch::SPR_PICSR: //acknowledges the lines written as 1
+            __atomic_fetch_and(&state.hdr.pending_irqs, ~static_cast<uint64_t>(val), __ATOMIC_ACQ_REL);
+            return;
+        case openrisc_arch::SPR_TTMR:
+            {
+                update_tick_timer(icount);
+                const target_ulong ttcr = read_spr(openrisc_arch::SPR_TTCR, icount);
+                set_ttmr(val);
+                tt.stopped = false;
+                set_tick_timer(ttcr, icount);
+            }
+            return;
+        case openrisc_arch::SPR_TTCR:
+            update_tick_timer(icount);
+            set_tick_timer(val, icount);
+            return;
+        case openrisc_arch::SPR_PCCR0:
+            pccr0_base = icount - val;
+            return;
         default:
-            std::cerr << "Insn:" << std::hex << insn << std::endl;
-            jcpu_or_disas_assert(!"Not implemented yet");
             break;
     }
+    const openrisc_arch::reg_e reg = get_spr_reg(spr);
+    if(reg != openrisc_arch::NUM_REGS) set_reg_func(reg, val);
+    else other_sprs[spr] = val;
+}
+
+void openrisc_vm::exec_nop(target_ulong k, uint64_t icount){
+    const target_ulong r3 = get_reg_func(openrisc_arch::REG_GR03);
+    switch(k){
+        case openrisc_arch::NOP_EXIT:
+            std::cerr << "exit(" << std::dec << static_cast<int32_t>(r3) << ") after " << icount << " instructions" << std::endl;
+            request_exit(static_cast<int32_t>(r3));
+            break;
+        case openrisc_arch::NOP_EXIT_SILENT:
+            request_exit(static_cast<int32_t>(r3));
+            break;
+        case openrisc_arch::NOP_REPORT:
+            std::cout << "report(0x" << std::hex << std::setw(8) << std::setfill('0') << r3 << ");" << std::endl;
+            break;
+        case openrisc_arch::NOP_PRINTF:
+            std::cout << format_guest(r3, get_reg_func(openrisc_arch::REG_GR04)) << std::flush;
+            break;
+        case openrisc_arch::NOP_PUTC:
+            std::cout << static_cast<char>(r3) << std::flush;
+            break;
+        case openrisc_arch::NOP_CNT_RESET:
+        case openrisc_arch::NOP_TRACE_ON:
+            roi_icount = icount;
+            roi_timer.restart();
+            break;
+        case openrisc_arch::NOP_GET_TICKS:
+            set_reg_func(openrisc_arch::REG_GR11, static_cast<target_ulong>(icount));
+            set_reg_func(openrisc_arch::REG_GR12, static_cast<target_ulong>(icount >> 32));
+            break;
+        case openrisc_arch::NOP_TRACE_OFF:
+            {
+                const double sec = roi_timer.total_elapsed();
+                const uint64_t num = icount - roi_icount;
+                std::cerr << "roi: " << std::dec << num << " instructions in " << sec << " sec";
+                if(sec > 0) std::cerr << " (" << num / sec / 1e6 << " MIPS)";
+                std::cerr << std::endl;
+            }
+            break;
+        default:
+            jcpu_assert(!"Unknown l.nop hook");
+    }
+}
+
+std::string openrisc_vm::read_guest_string(target_ulong addr){
+    std::string str;
+    for(;;){
+        const char c = static_cast<char>(ext_ifs.mem_read_dbg(addr++, 1));
+        if(!c) break;
+        str += c;
+    }
+    return str;
+}
+
+namespace {
+template<typename T>
+void append_format(std::string &out, const std::string &spec, T val){
+    const int len = std::snprintf(JCPU_NULLPTR, 0, spec.c_str(), val);
+    if(len <= 0) return;
+    std::vector<char> buf(len + 1);
+    std::snprintf(&buf[0], buf.size(), spec.c_str(), val);
+    out.append(&buf[0], len);
+}
+} //end of unnamed namespace
+
+//printf of or1ksim. The arguments are the words from args, and %ll takes two of them.
+std::string openrisc_vm::format_guest(target_ulong fmt, target_ulong args){
+    const std::string f = read_guest_string(fmt);
+    std::string out;
+    for(std::string::size_type i = 0; i < f.size(); ++i){
+        if(f[i] != '%'){
+            out += f[i];
+            continue;
+        }
+        std::string spec("%");
+        while(++i < f.size() && std::strchr("-+ #0123456789.hlzjt", f[i])) spec += f[i];
+        if(i == f.size()) break;
+        const char conv = f[i];
+        if(conv == '%'){
+            out += '%';
+            continue;
+        }
+        const bool is_64 = spec.find("ll") != std::string::npos;
+        uint64_t val = ext_ifs.mem_read_dbg(args, 4);
+        args += 4;
+        if(is_64){
+            val = (val << 32) | ext_ifs.mem_read_dbg(args, 4);
+            args += 4;
+        }
+        spec = spec.substr(0, spec.find_first_of("hlzjt")) + (is_64 ? "ll" : "");
+        switch(conv){
+            case 's':
+                append_format(out, spec + conv, read_guest_string(static_cast<target_ulong>(val)).c_str());
+                break;
+            case 'c':
+                append_format(out, spec + conv, static_cast<int>(static_cast<char>(val)));
+                break;
+            case 'd':
+            case 'i':
+                if(is_64) append_format(out, spec + conv, static_cast<long long>(val));
+                else append_format(out, spec + conv, static_cast<int>(static_cast<int32_t>(val)));
+                break;
+            case 'p':
+                append_format(out, "%#x", static_cast<unsigned int>(val));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                if(is_64) append_format(out, spec + conv, static_cast<unsigned long long>(val));
+                else append_format(out, spec + conv, static_cast<unsigned int>(val));
+                break;
+            default: //floating point is not supported
+                out += spec + conv;
+                break;
+        }
+    }
+    return out;
+}
+
+bool openrisc_vm::tick_timer_counting()const{
+    return (get_reg_func(openrisc_arch::REG_TTMR) >> openrisc_arch::TTMR_M_SHIFT) != openrisc_arch::TTMR_M_DISABLED && !tt.stopped;
+}
+
+//TTCR is ttcr at icount from now on
+void openrisc_vm::set_tick_timer(target_ulong ttcr, uint64_t icount){
+    set_reg_func(openrisc_arch::REG_TTCR, ttcr);
+    tt.icount = icount;
+    if(tick_timer_counting()){
+        const target_ulong tp = get_reg_func(openrisc_arch::REG_TTMR) & openrisc_arch::TTMR_TP;
+        const target_ulong distance = (tp - ttcr) & openrisc_arch::TTMR_TP;
+        tt.deadline = icount + (distance ? distance : openrisc_arch::TTMR_TP + 1);
+    }
+    else{
+        tt.deadline = ~static_cast<uint64_t>(0);
+    }
+}
+
+//Handles the matches until icount. Each one costs a call, not the instructions between them.
+void openrisc_vm::update_tick_timer(uint64_t icount){
+    while(tt.deadline <= icount){
+        const uint64_t when = tt.deadline;
+        const target_ulong ttmr = get_reg_func(openrisc_arch::REG_TTMR);
+        const target_ulong ttcr = get_reg_func(openrisc_arch::REG_TTCR) + static_cast<target_ulong>(when - tt.icount);
+        if(ttmr & (1U << openrisc_arch::TTMR_IE)){
+            set_ttmr(ttmr | (1U << openrisc_arch::TTMR_IP));
+        }
+        switch(ttmr >> openrisc_arch::TTMR_M_SHIFT){
+            case openrisc_arch::TTMR_M_RESTART:
+                set_tick_timer(0, when);
+                break;
+            case openrisc_arch::TTMR_M_SINGLE:
+                tt.stopped = true;
+                set_tick_timer(ttcr, when);
+                break;
+            default:
+                set_tick_timer(ttcr, when);
+                break;
+        }
+    }
+}
+
+//TTMR[IP] is mirrored in pending_irqs so that the dispatcher checks one word
+void openrisc_vm::set_ttmr(target_ulong ttmr){
+    set_reg_func(openrisc_arch::REG_TTMR, ttmr);
+    if(ttmr & (1U << openrisc_arch::TTMR_IP)) __atomic_fetch_or(&state.hdr.pending_irqs, tick_timer_pending, __ATOMIC_ACQ_REL);
+    else __atomic_fetch_and(&state.hdr.pending_irqs, ~tick_timer_pending, __ATOMIC_ACQ_REL);
+}
+
+//Saves the state of the interrupted context and returns the vector
+virt_addr_t openrisc_vm::enter_exception(openrisc_arch::exception_e exc, target_ulong epcr){
+    const target_ulong sr = get_reg_func(openrisc_arch::REG_SR);
+    set_reg_func(openrisc_arch::REG_EPCR0, epcr);
+    set_reg_func(openrisc_arch::REG_ESR0, sr);
+    const target_ulong new_sr = (sr | (1U << openrisc_arch::SR_SM)) & ~((1U << openrisc_arch::SR_TEE) | (1U << openrisc_arch::SR_IEE));
+    set_reg_func(openrisc_arch::REG_SR, new_sr);
+    set_reg_func(openrisc_arch::REG_PNEXT_PC, openrisc_arch::exception_vector[exc]);
+    return virt_addr_t(openrisc_arch::exception_vector[exc]);
+}
+
+//Called at block boundaries when pending_irqs is not 0, pc is where the interrupted context resumes
+virt_addr_t openrisc_vm::check_interrupts(virt_addr_t pc){
+    const uint64_t pending = __atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_ACQUIRE);
+    const target_ulong sr = get_reg_func(openrisc_arch::REG_SR);
+    if((pending & tick_timer_pending) && (sr & (1U << openrisc_arch::SR_TEE))){
+        return enter_exception(openrisc_arch::EXC_TICK_TIMER, pc);
+    }
+    if((pending & get_reg_func(openrisc_arch::REG_PICMR)) && (sr & (1U << openrisc_arch::SR_IEE))){
+        return enter_exception(openrisc_arch::EXC_IRQ, pc);
+    }
+    return pc;
+}
+
+void openrisc_vm::invalidate_icache(){
+    for(size_t i = 0; i < icache_invalidations.size(); ++i){
+        const phys_addr_t line(icache_invalidations[i] & ~static_cast<target_ulong>(15));
+        bb_man.invalidate(line, line + phys_addr_t(16));
+    }
+    icache_invalidations.clear();
 }
 
 llvm::Value * openrisc_vm::gen_arith_code_with_ovf_check(llvm::Value *a, llvm::Value *b, llvm::Value *(vm::ir_builder_wrapper::*func)(llvm::Value *, llvm::Value *,const char *)const, const char *mn){
@@ -727,18 +1358,7 @@ llvm::Value * openrisc_vm::gen_arith_code_with_ovf_check(llvm::Value *a, llvm::V
 void openrisc_vm::start_func(phys_addr_t pc_p){
     char func_name[17];
     std::snprintf(func_name, sizeof(func_name), "%16llx", static_cast<unsigned long long>(pc_p));
-    std::vector<llvm::Type*> mainFuncTyArgs;
-    llvm::FunctionType* const mainFuncTy = llvm::FunctionType::get(
-            /* 戻り値の型 */ get_reg_type(),
-            /* 関数の引数 */ mainFuncTyArgs,
-            /* 可変引数か? */ false
-            );
-    llvm::Function *const func_main = llvm::Function::Create(
-            /* 関数の型 */ mainFuncTy,
-            /* Likage */ llvm::GlobalValue::ExternalLinkage,
-            /* 関数名 */ func_name, mod
-            );
-    func_main->setCallingConv(llvm::CallingConv::C);
+    llvm::Function *const func_main = create_bb_func(func_name);
     llvm::BasicBlock* bb = llvm::BasicBlock::Create(mod->getContext(), "",func_main,0);
     builder->SetInsertPoint(bb);
     cur_func = func_main;
@@ -751,9 +1371,12 @@ void openrisc_vm::start_func(phys_addr_t pc_p){
 
 gdb::gdb_target_if::run_state_e openrisc_vm::run(){
     virt_addr_t pc(get_reg_func(openrisc_arch::REG_PC));
+    running = true;
     for(;;){
+        bb_man.invalidate_written(); //no block of the previous iteration is used after this
         const break_point *const nearest = bp_man.find_nearest(pc);
         if(nearest && nearest->get_pc() == pc){
+            running = false;
             return RUN_STAT_BREAK;
         }
         const phys_addr_t pc_p = code_v2p(pc);
@@ -794,18 +1417,23 @@ std::cerr
     << " R30=" << std::hex << std::setw(8) << std::setfill('0') << get_reg_func(30)
     << " R31=" << std::hex << std::setw(8) << std::setfill('0') << get_reg_func(31) << std::endl;
 #endif
-        pc = bb->exec();
+        pc = bb->exec(state);
 
 #if defined(JCPU_OPENRISC_DEBUG) && JCPU_OPENRISC_DEBUG > 1
         dump_regs();
 #endif
         total_icount += bb->get_icount();
-        const target_ulong sr = get_reg_func(openrisc_arch::REG_SR);
-        if(irq_status && (sr & (1U << openrisc_arch::SR_IEE)) == 0){//jump to exception handler
-            set_reg_func(openrisc_arch::REG_EPCR0, get_reg_func(openrisc_arch::REG_PNEXT_PC));
-            set_reg_func(openrisc_arch::REG_PNEXT_PC, openrisc_arch::exception_vector[openrisc_arch::EXC_IRQ]);
-            set_reg_func(openrisc_arch::REG_SR, sr | (1U << openrisc_arch::SR_IEE));
-            pc = virt_addr_t(openrisc_arch::exception_vector[openrisc_arch::EXC_IRQ]);
+        if(!icache_invalidations.empty()) invalidate_icache();
+        if(tt.deadline <= total_icount) update_tick_timer(total_icount);
+        if(__atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_RELAXED)) pc = check_interrupts(pc);
+        if(pending_requests){
+            set_reg_func(openrisc_arch::REG_PC, pc);
+            service_requests();
+            pc = virt_addr_t(get_reg_func(openrisc_arch::REG_PC));
+            if(exited){
+                running = false;
+                return RUN_STAT_NORMAL;
+            }
         }
     }
     jcpu_assert(!"Never comes here");
@@ -814,24 +1442,21 @@ std::cerr
 
 gdb::gdb_target_if::run_state_e openrisc_vm::step_exec(){
     virt_addr_t pc(get_reg_func(openrisc_arch::REG_PC));
+    bb_man.invalidate_written();
 
-    const target_ulong sr = get_reg_func(openrisc_arch::REG_SR);
-    if(irq_status && (sr & (1U << openrisc_arch::SR_IEE)) == 0){//jump to exception handler
-        set_reg_func(openrisc_arch::REG_EPCR0, pc);
-        set_reg_func(openrisc_arch::REG_PNEXT_PC, openrisc_arch::exception_vector[openrisc_arch::EXC_IRQ]);
-        set_reg_func(openrisc_arch::REG_SR, sr | (1U << openrisc_arch::SR_IEE));
-        pc = virt_addr_t(openrisc_arch::exception_vector[openrisc_arch::EXC_IRQ]);
-    }
+    if(tt.deadline <= total_icount) update_tick_timer(total_icount);
+    if(__atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_RELAXED)) pc = check_interrupts(pc);
     const break_point *const nearest = bp_man.find_nearest(pc);
     if(nearest && nearest->get_pc() == pc) return RUN_STAT_BREAK;
     const phys_addr_t pc_p = code_v2p(pc);
-    bb_man.invalidate(pc_p, pc_p + phys_addr_t(4));
+    bb_man.remove_blocks(pc_p, pc_p + phys_addr_t(4));
     const basic_block *const bb = bb_man.exists_by_start_addr(pc_p) ? bb_man.find_by_start_addr(pc_p) : disas(pc, 1, nearest);
-    pc = bb->exec();
+    pc = bb->exec(state);
 #if defined(JCPU_OPENRISC_DEBUG) && JCPU_OPENRISC_DEBUG > 1
     dump_regs();
 #endif
     total_icount += bb->get_icount();
+    if(!icache_invalidations.empty()) invalidate_icache();
     return RUN_STAT_NORMAL;
 }
 
@@ -855,6 +1480,24 @@ void openrisc_vm::dump_regs()const{
         else if(i == openrisc_arch::REG_EPCR0){
             std::cout << "EPCR0:";
         }
+        else if(i == openrisc_arch::REG_FPCSR){
+            std::cout << "fpcsr:";
+        }
+        else if(i == openrisc_arch::REG_EEAR0){
+            std::cout << "EEAR0:";
+        }
+        else if(i == openrisc_arch::REG_ESR0){
+            std::cout << "ESR0:";
+        }
+        else if(i == openrisc_arch::REG_PICMR){
+            std::cout << "picmr:";
+        }
+        else if(i == openrisc_arch::REG_TTMR){
+            std::cout << "ttmr:";
+        }
+        else if(i == openrisc_arch::REG_TTCR){
+            std::cout << "ttcr:";
+        }
         else{assert(!"Unknown register");}
         std::cout << std::hex << std::setw(8) << std::setfill('0') << get_reg_func(i);
         if((i & 3) != 3) std::cout << "  ";
@@ -863,13 +1506,35 @@ void openrisc_vm::dump_regs()const{
     std::cout << std::endl;
 }
 
+//Can be called from any thread, the interrupt is taken at the end of the current block
 void openrisc_vm::interrupt(int irq_id, bool enable){
-    jcpu_assert(irq_id == 0);
-    irq_status = enable;
+    jcpu_assert(0 <= irq_id && irq_id < 32);
+    const uint64_t bit = static_cast<uint64_t>(1) << irq_id;
+    if(enable) __atomic_fetch_or(&state.hdr.pending_irqs, bit, __ATOMIC_ACQ_REL);
+    else __atomic_fetch_and(&state.hdr.pending_irqs, ~bit, __ATOMIC_ACQ_REL);
 }
 
 void openrisc_vm::reset(){
-    irq_status = false;
+    __atomic_store_n(&state.hdr.pending_irqs, 0, __ATOMIC_RELEASE);
+    set_ttmr(get_reg_func(openrisc_arch::REG_TTMR));
+    tt.stopped = false;
+    set_tick_timer(get_reg_func(openrisc_arch::REG_TTCR), total_icount);
+}
+
+void openrisc_vm::take_snapshot(){
+    vm::jcpu_vm_base<openrisc_arch>::take_snapshot();
+    snap_pending_irqs = __atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_ACQUIRE);
+    snap_other_sprs = other_sprs;
+    snap_pccr0_base = pccr0_base;
+    snap_tt = tt;
+}
+
+void openrisc_vm::restore_snapshot(){
+    vm::jcpu_vm_base<openrisc_arch>::restore_snapshot();
+    __atomic_store_n(&state.hdr.pending_irqs, snap_pending_irqs, __ATOMIC_RELEASE);
+    other_sprs = snap_other_sprs;
+    pccr0_base = snap_pccr0_base;
+    tt = snap_tt;
 }
 
 
@@ -888,11 +1553,17 @@ void openrisc::reset(bool reset_on){
     if(vm) vm->reset();
 }
 
-void openrisc::run(run_option_e opt){
+openrisc_vm &openrisc::get_vm(){
     if(!vm){
-        vm = new openrisc_vm(*ext_ifs);
+        jcpu_assert(num_cores == 1 && num_translators == 0);
+        vm = new openrisc_vm(*ext_ifs, ram);
         vm->reset();
     }
+    return *vm;
+}
+
+int openrisc::run(run_option_e opt){
+    get_vm();
     if(opt == RUN_OPTION_NORMAL){
         vm->run();
     }
@@ -903,12 +1574,29 @@ void openrisc::run(run_option_e opt){
     else{
         jcpu_assert(!"Not supported option");
     }
+    return vm->get_exit_code();
 }
 
 uint64_t openrisc::get_total_insn_count()const{
     return vm->get_total_insn_count();
 }
 
+void openrisc::snapshot(){
+    get_vm().snapshot();
+}
+
+void openrisc::restore(){
+    get_vm().restore();
+}
+
+void openrisc::start_mem_trace(const char *file_name){
+    get_vm().start_mem_trace(file_name);
+}
+
+void openrisc::stop_mem_trace(){
+    if(vm) vm->stop_mem_trace();
+}
+
 
 } //end of namespace openrisc
 } //end of namespace jcpu
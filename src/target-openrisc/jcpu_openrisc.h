@@ -13,13 +13,18 @@ class openrisc_vm;
 
 class openrisc : public jcpu{
     openrisc_vm *vm;
+    openrisc_vm &get_vm();
     public:
     explicit openrisc(const char *);
     ~openrisc();
     virtual void interrupt(int, bool) JCPU_OVERRIDE;
     virtual void reset(bool)JCPU_OVERRIDE;
-    virtual void run(run_option_e)JCPU_OVERRIDE;
+    virtual int run(run_option_e)JCPU_OVERRIDE;
     virtual uint64_t get_total_insn_count()const JCPU_OVERRIDE;
+    virtual void snapshot() JCPU_OVERRIDE;
+    virtual void restore() JCPU_OVERRIDE;
+    virtual void start_mem_trace(const char *) JCPU_OVERRIDE;
+    virtual void stop_mem_trace() JCPU_OVERRIDE;
 };
 
 
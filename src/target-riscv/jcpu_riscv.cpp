@@ -1,11 +1,19 @@
 #include <cstdio>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include <iomanip>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "jcpu_llvm_headers.h"
 #include "jcpu_vm.h"
+#include "jcpu_decoder.h"
 #include "gdbserver.h"
 #include "jcpu_riscv.h"
+#include "jcpu_riscv_user.h"
+#include "clx/timer.h"
 
 //#define JCPU_RISCV_DEBUG 3
 
@@ -17,6 +25,278 @@ inline T bit_sub(T v){
     return (v >> bit) & ((T(1) << width) - 1);
 }
 
+template<unsigned int width, typename T>
+inline T sign_extend(T v){
+    const T sign = T(1) << (width - 1);
+    return (v ^ sign) - sign;
+}
+
+inline uint32_t rvc_reg(uint32_t c, unsigned int bit){//3 bit register field, x8-x15
+    return 8 + ((c >> bit) & 7);
+}
+
+inline uint32_t enc_r(uint32_t opc, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t funct7){
+    return (funct7 << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opc;
+}
+
+inline uint32_t enc_i(uint32_t opc, uint32_t rd, uint32_t funct3, uint32_t rs1, uint32_t imm){
+    return ((imm & 0xFFF) << 20) | (rs1 << 15) | (funct3 << 12) | (rd << 7) | opc;
+}
+
+inline uint32_t enc_s(uint32_t opc, uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t imm){
+    return (((imm >> 5) & 0x7F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) | ((imm & 0x1F) << 7) | opc;
+}
+
+inline uint32_t enc_b(uint32_t funct3, uint32_t rs1, uint32_t rs2, uint32_t imm){
+    return (((imm >> 12) & 1) << 31) | (((imm >> 5) & 0x3F) << 25) | (rs2 << 20) | (rs1 << 15) | (funct3 << 12) |
+        (((imm >> 1) & 0xF) << 8) | (((imm >> 11) & 1) << 7) | 0x63;
+}
+
+inline uint32_t enc_j(uint32_t rd, uint32_t imm){
+    return (((imm >> 20) & 1) << 31) | (((imm >> 1) & 0x3FF) << 21) | (((imm >> 11) & 1) << 20) | (((imm >> 12) & 0xFF) << 12) | (rd << 7) | 0x6F;
+}
+
+//Returns the 32 bit instruction which does the same as the 16 bit one, or 0 if it is not supported.
+uint32_t expand_rvc(uint32_t c){
+    const uint32_t funct3 = bit_sub<13, 3>(c);
+    const uint32_t rd = bit_sub<7, 5>(c); //rd and rs1 of the full register forms
+    const uint32_t rs2 = bit_sub<2, 5>(c);
+    const uint32_t imm6 = sign_extend<6>((bit_sub<12, 1>(c) << 5) | bit_sub<2, 5>(c));
+    const uint32_t shamt = (bit_sub<12, 1>(c) << 5) | bit_sub<2, 5>(c);
+    const uint32_t lw_imm = (bit_sub<10, 3>(c) << 3) | (bit_sub<6, 1>(c) << 2) | (bit_sub<5, 1>(c) << 6);
+    const uint32_t ld_imm = (bit_sub<10, 3>(c) << 3) | (bit_sub<5, 2>(c) << 6);
+    switch((bit_sub<0, 2>(c) << 3) | funct3){//quadrant and funct3 in octal
+        case 000://c.addi4spn
+            {
+                const uint32_t imm = (bit_sub<11, 2>(c) << 4) | (bit_sub<7, 4>(c) << 6) | (bit_sub<6, 1>(c) << 2) | (bit_sub<5, 1>(c) << 3);
+                return imm ? enc_i(0x13, rvc_reg(c, 2), 0, 2, imm) : 0;
+            }
+        case 001://c.fld
+            return enc_i(0x07, rvc_reg(c, 2), 3, rvc_reg(c, 7), ld_imm);
+        case 002://c.lw
+            return enc_i(0x03, rvc_reg(c, 2), 2, rvc_reg(c, 7), lw_imm);
+        case 003://c.ld
+            return enc_i(0x03, rvc_reg(c, 2), 3, rvc_reg(c, 7), ld_imm);
+        case 005://c.fsd
+            return enc_s(0x27, 3, rvc_reg(c, 7), rvc_reg(c, 2), ld_imm);
+        case 006://c.sw
+            return enc_s(0x23, 2, rvc_reg(c, 7), rvc_reg(c, 2), lw_imm);
+        case 007://c.sd
+            return enc_s(0x23, 3, rvc_reg(c, 7), rvc_reg(c, 2), ld_imm);
+        case 010://c.addi, c.nop
+            return enc_i(0x13, rd, 0, rd, imm6);
+        case 011://c.addiw
+            return rd ? enc_i(0x1B, rd, 0, rd, imm6) : 0;
+        case 012://c.li
+            return enc_i(0x13, rd, 0, 0, imm6);
+        case 013:
+            if(rd == 2){//c.addi16sp
+                const uint32_t imm = sign_extend<10>((bit_sub<12, 1>(c) << 9) | (bit_sub<6, 1>(c) << 4) | (bit_sub<5, 1>(c) << 6) |
+                    (bit_sub<3, 2>(c) << 7) | (bit_sub<2, 1>(c) << 5));
+                return imm ? enc_i(0x13, 2, 0, 2, imm) : 0;
+            }
+            else{//c.lui
+                return imm6 ? (((imm6 & 0xFFFFF) << 12) | (rd << 7) | 0x37) : 0;
+            }
+        case 014:
+            {
+                const uint32_t rd_ = rvc_reg(c, 7);
+                switch(bit_sub<10, 2>(c)){
+                    case 0: return enc_i(0x13, rd_, 5, rd_, shamt); //c.srli
+                    case 1: return enc_i(0x13, rd_, 5, rd_, shamt | 0x400); //c.srai
+                    case 2: return enc_i(0x13, rd_, 7, rd_, imm6); //c.andi
+                    default:
+                        {
+                            const uint32_t rs2_ = rvc_reg(c, 2);
+                            switch((bit_sub<12, 1>(c) << 2) | bit_sub<5, 2>(c)){
+                                case 0: return enc_r(0x33, rd_, 0, rd_, rs2_, 0x20); //c.sub
+                                case 1: return enc_r(0x33, rd_, 4, rd_, rs2_, 0); //c.xor
+                                case 2: return enc_r(0x33, rd_, 6, rd_, rs2_, 0); //c.or
+                                case 3: return enc_r(0x33, rd_, 7, rd_, rs2_, 0); //c.and
+                                case 4: return enc_r(0x3B, rd_, 0, rd_, rs2_, 0x20); //c.subw
+                                case 5: return enc_r(0x3B, rd_, 0, rd_, rs2_, 0); //c.addw
+                                default: return 0;
+                            }
+                        }
+                }
+            }
+        case 015://c.j
+            {
+                const uint32_t imm = sign_extend<12>((bit_sub<12, 1>(c) << 11) | (bit_sub<11, 1>(c) << 4) | (bit_sub<9, 2>(c) << 8) |
+                    (bit_sub<8, 1>(c) << 10) | (bit_sub<7, 1>(c) << 6) | (bit_sub<6, 1>(c) << 7) | (bit_sub<3, 3>(c) << 1) | (bit_sub<2, 1>(c) << 5));
+                return enc_j(0, imm);
+            }
+        case 016://c.beqz
+        case 017://c.bnez
+            {
+                const uint32_t imm = sign_extend<9>((bit_sub<12, 1>(c) << 8) | (bit_sub<10, 2>(c) << 3) | (bit_sub<5, 2>(c) << 6) |
+                    (bit_sub<3, 2>(c) << 1) | (bit_sub<2, 1>(c) << 5));
+                return enc_b(funct3 == 6 ? 0 : 1, rvc_reg(c, 7), 0, imm);
+            }
+        case 020://c.slli
+            return enc_i(0x13, rd, 1, rd, shamt);
+        case 021://c.fldsp
+            return enc_i(0x07, rd, 3, 2, (bit_sub<12, 1>(c) << 5) | (bit_sub<5, 2>(c) << 3) | (bit_sub<2, 3>(c) << 6));
+        case 022://c.lwsp
+            return rd ? enc_i(0x03, rd, 2, 2, (bit_sub<12, 1>(c) << 5) | (bit_sub<4, 3>(c) << 2) | (bit_sub<2, 2>(c) << 6)) : 0;
+        case 023://c.ldsp
+            return rd ? enc_i(0x03, rd, 3, 2, (bit_sub<12, 1>(c) << 5) | (bit_sub<5, 2>(c) << 3) | (bit_sub<2, 3>(c) << 6)) : 0;
+        case 024:
+            if(!bit_sub<12, 1>(c)){
+                if(rs2 == 0) return rd ? enc_i(0x67, 0, 0, rd, 0) : 0; //c.jr
+                return enc_r(0x33, rd, 0, 0, rs2, 0); //c.mv
+            }
+            if(rs2 == 0) return rd ? enc_i(0x67, 1, 0, rd, 0) : 0x00100073; //c.jalr, c.ebreak
+            return enc_r(0x33, rd, 0, rd, rs2, 0); //c.add
+        case 025://c.fsdsp
+            return enc_s(0x27, 3, 2, rs2, (bit_sub<10, 3>(c) << 3) | (bit_sub<7, 3>(c) << 6));
+        case 026://c.swsp
+            return enc_s(0x23, 2, 2, rs2, (bit_sub<9, 4>(c) << 2) | (bit_sub<7, 2>(c) << 6));
+        case 027://c.sdsp
+            return enc_s(0x23, 3, 2, rs2, (bit_sub<10, 3>(c) << 3) | (bit_sub<7, 3>(c) << 6));
+        default://reserved
+            return 0;
+    }
+}
+
+//Operand extractors named by the format column of jcpu_riscv_insn.def
+void operands_R(uint32_t insn, jcpu::vm::decoded_insn &d){
+    d.rd = bit_sub<7, 5>(insn);
+    d.rs1 = bit_sub<15, 5>(insn);
+    d.rs2 = bit_sub<20, 5>(insn);
+}
+
+void operands_R4(uint32_t insn, jcpu::vm::decoded_insn &d){
+    operands_R(insn, d);
+    d.rs3 = bit_sub<27, 5>(insn);
+}
+
+void operands_I(uint32_t insn, jcpu::vm::decoded_insn &d){//also the CSR number and the zimm of vsetvli
+    d.rd = bit_sub<7, 5>(insn);
+    d.rs1 = bit_sub<15, 5>(insn);
+    d.imm = sign_extend<12>(static_cast<int64_t>(bit_sub<20, 12>(insn)));
+}
+
+void operands_S(uint32_t insn, jcpu::vm::decoded_insn &d){
+    d.rs1 = bit_sub<15, 5>(insn);
+    d.rs2 = bit_sub<20, 5>(insn);
+    d.imm = sign_extend<12>(static_cast<int64_t>((bit_sub<25, 7>(insn) << 5) | bit_sub<7, 5>(insn)));
+}
+
+void operands_B(uint32_t insn, jcpu::vm::decoded_insn &d){
+    d.rs1 = bit_sub<15, 5>(insn);
+    d.rs2 = bit_sub<20, 5>(insn);
+    d.imm = sign_extend<13>(static_cast<int64_t>((bit_sub<31, 1>(insn) << 12) | (bit_sub<7, 1>(insn) << 11) |
+        (bit_sub<25, 6>(insn) << 5) | (bit_sub<8, 4>(insn) << 1)));
+}
+
+void operands_U(uint32_t insn, jcpu::vm::decoded_insn &d){
+    d.rd = bit_sub<7, 5>(insn);
+    d.imm = static_cast<int32_t>(insn & 0xFFFFF000U);
+}
+
+void operands_J(uint32_t insn, jcpu::vm::decoded_insn &d){
+    d.rd = bit_sub<7, 5>(insn);
+    d.imm = sign_extend<21>(static_cast<int64_t>((bit_sub<31, 1>(insn) << 20) | (bit_sub<12, 8>(insn) << 12) |
+        (bit_sub<20, 1>(insn) << 11) | (bit_sub<21, 10>(insn) << 1)));
+}
+
+void operands_VI(uint32_t insn, jcpu::vm::decoded_insn &d){//OPIVI, the immediate is in the rs1 field
+    operands_R(insn, d);
+    d.imm = sign_extend<5>(static_cast<int64_t>(d.rs1));
+}
+
+//One for each row of jcpu_riscv_insn.def in the same order, so it is also the index in riscv_vm::insn_table
+enum insn_op_e{
+#define RISCV_INSN(name, mask, match, handler, op, format, flow) op,
+#include "jcpu_riscv_insn.def"
+#undef RISCV_INSN
+    NUM_INSN_OPS
+};
+
+//Integer vector operations. The operands are vs2 and vs1, rs1 or the immediate.
+enum vector_op_e{
+    V_ADD, V_SUB, V_RSUB, V_AND, V_OR, V_XOR, V_MV, V_MUL, V_MACC,
+    V_REDSUM, V_REDAND, V_REDOR, V_REDXOR, //vd[0] = vs1[0] op vs2[*]
+    V_MV_X_S, V_MV_S_X
+};
+
+enum vector_src_e{
+    VSRC_V, VSRC_X, VSRC_I //the operand other than vs2 is vs1, rs1 or the immediate
+};
+
+//For the vector arithmetic rows, shared by the translator and jcpu_riscv_vector_exec()
+vector_op_e get_vector_op(insn_op_e op, vector_src_e &src){
+    src = VSRC_V;
+    switch(op){
+        case OP_VADD_VV: return V_ADD;
+        case OP_VSUB_VV: return V_SUB;
+        case OP_VAND_VV: return V_AND;
+        case OP_VOR_VV: return V_OR;
+        case OP_VXOR_VV: return V_XOR;
+        case OP_VMV_V_V: return V_MV;
+        case OP_VMUL_VV: return V_MUL;
+        case OP_VMACC_VV: return V_MACC;
+        case OP_VREDSUM_VS: return V_REDSUM;
+        case OP_VREDAND_VS: return V_REDAND;
+        case OP_VREDOR_VS: return V_REDOR;
+        case OP_VREDXOR_VS: return V_REDXOR;
+        case OP_VMV_X_S: return V_MV_X_S;
+        default: break;
+    }
+    src = VSRC_X;
+    switch(op){
+        case OP_VADD_VX: return V_ADD;
+        case OP_VSUB_VX: return V_SUB;
+        case OP_VRSUB_VX: return V_RSUB;
+        case OP_VAND_VX: return V_AND;
+        case OP_VOR_VX: return V_OR;
+        case OP_VXOR_VX: return V_XOR;
+        case OP_VMV_V_X: return V_MV;
+        case OP_VMUL_VX: return V_MUL;
+        case OP_VMACC_VX: return V_MACC;
+        case OP_VMV_S_X: return V_MV_S_X;
+        default: break;
+    }
+    src = VSRC_I;
+    switch(op){
+        case OP_VADD_VI: return V_ADD;
+        case OP_VRSUB_VI: return V_RSUB;
+        case OP_VAND_VI: return V_AND;
+        case OP_VOR_VI: return V_OR;
+        case OP_VXOR_VI: return V_XOR;
+        case OP_VMV_V_I: return V_MV;
+        default: jcpu_assert(!"Never comes here");
+    }
+    return V_MV;
+}
+
+//For the vector load and store rows. The element width is in bytes.
+void get_vector_mem(insn_op_e op, unsigned int &eew, bool &is_load, bool &is_strided){
+    switch(op){
+        case OP_VLE8_V: eew = 1; is_load = true; is_strided = false; break;
+        case OP_VLSE8_V: eew = 1; is_load = true; is_strided = true; break;
+        case OP_VLE16_V: eew = 2; is_load = true; is_strided = false; break;
+        case OP_VLSE16_V: eew = 2; is_load = true; is_strided = true; break;
+        case OP_VLE32_V: eew = 4; is_load = true; is_strided = false; break;
+        case OP_VLSE32_V: eew = 4; is_load = true; is_strided = true; break;
+        case OP_VLE64_V: eew = 8; is_load = true; is_strided = false; break;
+        case OP_VLSE64_V: eew = 8; is_load = true; is_strided = true; break;
+        case OP_VSE8_V: eew = 1; is_load = false; is_strided = false; break;
+        case OP_VSSE8_V: eew = 1; is_load = false; is_strided = true; break;
+        case OP_VSE16_V: eew = 2; is_load = false; is_strided = false; break;
+        case OP_VSSE16_V: eew = 2; is_load = false; is_strided = true; break;
+        case OP_VSE32_V: eew = 4; is_load = false; is_strided = false; break;
+        case OP_VSSE32_V: eew = 4; is_load = false; is_strided = true; break;
+        case OP_VSE64_V: eew = 8; is_load = false; is_strided = false; break;
+        case OP_VSSE64_V: eew = 8; is_load = false; is_strided = true; break;
+        default: jcpu_assert(!"Never comes here");
+    }
+}
+
+//For invalid or unsupported encodings. Translation ahead of execution may reach data, so it gives up instead of aborting.
+#define riscv_insn_assert(cond) do{if(!(cond)){if(job.speculative) throw ::jcpu::vm::speculation_failed(); jcpu_assert(cond);}} while(false)
+
 
 
 } //end of unnamed namespace
@@ -27,6 +307,8 @@ namespace riscv{
 struct riscv_arch{
     typedef uint64_t target_ulong;
     const static unsigned int reg_bit_width = sizeof(target_ulong) * 8;
+    const static unsigned int insn_align_bits = 1; //C extension
+    const static unsigned int vlen_bits = 128;
     typedef vm::primitive_type_holder<target_ulong, riscv_arch, 0> virt_addr_t;
     typedef vm::primitive_type_holder<target_ulong, riscv_arch, 1> phys_addr_t;
     enum reg_e{
@@ -38,9 +320,45 @@ struct riscv_arch{
         REG_GR20, REG_GR21, REG_GR22, REG_GR23,
         REG_GR24, REG_GR25, REG_GR26, REG_GR27,
         REG_GR28, REG_GR29, REG_GR30, REG_GR31,
-        REG_PC, REG_PNEXT_PC, NUM_REGS
+        REG_PC, REG_PNEXT_PC, REG_MHARTID,
+        REG_RESERVE_ADDR, REG_RESERVE_VAL, //reservation made by lr
+        REG_F00, REG_F01, REG_F02, REG_F03, //single values are NaN boxed
+        REG_F04, REG_F05, REG_F06, REG_F07,
+        REG_F08, REG_F09, REG_F10, REG_F11,
+        REG_F12, REG_F13, REG_F14, REG_F15,
+        REG_F16, REG_F17, REG_F18, REG_F19,
+        REG_F20, REG_F21, REG_F22, REG_F23,
+        REG_F24, REG_F25, REG_F26, REG_F27,
+        REG_F28, REG_F29, REG_F30, REG_F31,
+        REG_FCSR,
+        REG_PRIV, //privilege mode, priv_e
+        REG_MSTATUS, REG_MEDELEG, REG_MIDELEG, REG_MIE, REG_MTVEC, REG_MSCRATCH, REG_MEPC, REG_MCAUSE, REG_MTVAL,
+        REG_STVEC, REG_SSCRATCH, REG_SEPC, REG_SCAUSE, REG_STVAL, //sstatus, sie and sip are views of the machine ones
+        REG_VL, REG_VTYPE,
+        REG_VR, //v0 to v31 follow, vlen_bits / 64 words each
+        NUM_REGS = REG_VR + 32 * (vlen_bits / 64)
     };
-    enum sr_flag_e{};
+    enum sr_flag_e{//fcsr
+        FCSR_FFLAGS = 0x1F, FCSR_FRM = 0xE0, FCSR_FRM_SHIFT = 5
+    };
+    enum priv_e{
+        PRIV_U = 0, PRIV_S = 1, PRIV_M = 3
+    };
+    enum mstatus_bit_e{
+        MSTATUS_SIE = 1, MSTATUS_MIE = 3, MSTATUS_SPIE = 5, MSTATUS_MPIE = 7, MSTATUS_SPP = 8, MSTATUS_MPP_SHIFT = 11,
+        MSTATUS_FS_SHIFT = 13, MSTATUS_SUM = 18, MSTATUS_MXR = 19, MSTATUS_UXL_SHIFT = 32, MSTATUS_SXL_SHIFT = 34
+    };
+    enum irq_bit_e{//bits of mip and mie, mip is cpu_state_header::pending_irqs
+        IRQ_SSI = 1, IRQ_MSI = 3, IRQ_STI = 5, IRQ_MTI = 7, IRQ_SEI = 9, IRQ_MEI = 11
+    };
+    enum exception_e{//mcause and scause of synchronous exceptions
+        EXC_INSN_MISALIGNED = 0, EXC_INSN_ACCESS, EXC_ILLEGAL_INSN, EXC_BREAKPOINT,
+        EXC_LOAD_MISALIGNED, EXC_LOAD_ACCESS, EXC_STORE_MISALIGNED, EXC_STORE_ACCESS,
+        EXC_ECALL_U, EXC_ECALL_S, EXC_ECALL_M = 11
+    };
+    const static target_ulong cause_interrupt = static_cast<target_ulong>(1) << 63;
+    const static target_ulong vtype_vill = static_cast<target_ulong>(1) << 63;
+    const static target_ulong vtype_unknown = ~static_cast<target_ulong>(0); //vtype at translation time is not known
 };
 
 typedef riscv_arch::virt_addr_t virt_addr_t;
@@ -52,79 +370,312 @@ typedef vm::bb_manager<riscv_arch> bb_manager;
 typedef vm::break_point<riscv_arch> break_point;
 typedef vm::bp_manager<riscv_arch> bp_manager;
 
-template<unsigned int bit, typename T>
-inline riscv_arch::reg_e get_reg_id(T v){
-    return static_cast<riscv_arch::reg_e>(bit_sub<bit, 5>(v));
+//of a register field of vm::decoded_insn
+inline riscv_arch::reg_e get_reg_id(unsigned int field){
+    return static_cast<riscv_arch::reg_e>(field);
+}
+
+inline riscv_arch::reg_e get_freg_id(unsigned int field){
+    return static_cast<riscv_arch::reg_e>(riscv_arch::REG_F00 + field);
 }
 
+//vtype written by vsetvli or vsetivli, vill if the requested one is not supported
+inline target_ulong valid_vtype(target_ulong vtype){
+    const bool valid = (vtype >> 8) == 0 && bit_sub<0, 3>(vtype) <= 3 && bit_sub<3, 3>(vtype) <= 3; //LMUL 1 to 8, SEW 8 to 64
+    return valid ? vtype : riscv_arch::vtype_vill;
+}
+
+//number of elements of a register group
+inline unsigned int get_vlmax(target_ulong vtype){
+    return ((riscv_arch::vlen_bits / 8) << bit_sub<0, 3>(vtype)) >> bit_sub<3, 3>(vtype);
+}
+
+extern "C" uint64_t jcpu_riscv_vector_exec(void *state, uint32_t insn, uint32_t insn_op, uint64_t rs1_val, uint64_t rs2_val);
+extern "C" uint64_t jcpu_riscv_system(void *state, uint32_t insn, uint64_t pc, uint32_t insn_len, uint32_t insn_offset);
+extern "C" void jcpu_riscv_htif(void *state, uint64_t val);
+extern "C" void jcpu_riscv_fence_i(void *state);
+
 
 class riscv_vm : public vm::jcpu_vm_base<riscv_arch>{
     //gdb_target_if
     virtual void get_reg_value(std::vector<uint64_t> &)const JCPU_OVERRIDE;
     virtual void set_reg_value(unsigned int, uint64_t)JCPU_OVERRIDE;
 
-    bool irq_status;
+    uint64_t snap_pending_irqs, snap_timer_deadline;
+    unsigned int cur_insn_len; //2 if the instruction being translated is compressed
+    target_ulong cur_vtype; //set by vsetvli and vsetivli in the block being translated, otherwise riscv_arch::vtype_unknown
+    llvm::Value *fp_keep; //results of the native operations whose host flags are not folded into fcsr yet, NULL if there is none
+    vm::translator_pool<riscv_vm> *pool;
+    clint *timer;
+    user_process *process; //user mode if not NULL, then ecall is a Linux system call
+    uint64_t tohost, fromhost; //HTIF, stores to tohost are done by exec_htif() if it is not 0
+    uint64_t timer_deadline; //total_icount when the CLINT updates mtip of this hart next, written by any hart
+    static const unsigned int max_speculative_insn = 1024;
+    typedef bool (riscv_vm::*disas_func_t)(const vm::decoded_insn &, insn_op_e);
+    static const vm::insn_desc<disas_func_t> insn_table[]; //from jcpu_riscv_insn.def
+    static const vm::insn_decoder<disas_func_t> decoder;
 
     llvm::Value *gen_get_reg(riscv_arch::reg_e, const char * = "")const ;
     void gen_set_reg(riscv_arch::reg_e, llvm::Value *)const ;
     bool disas_insn(virt_addr_t, int *);
-    bool disas_insn_load_imm(target_ulong insn);
-    bool disas_insn_integer_imm(target_ulong insn);
-    bool disas_insn_integer_reg(target_ulong insn);
-    bool disas_insn_load(target_ulong insn);
-    bool disas_insn_store(target_ulong insn);
-    bool disas_insn_cond_branch(target_ulong insn);
-    bool disas_insn_jump(target_ulong insn);
-    bool disas_insn_64bit_integer(target_ulong insn);
+    vm::decoded_insn fetch_insn(phys_addr_t); //from the decoded instruction cache, or from the memory
+    void add_successors(const vm::decoded_insn &);
+    uint16_t fetch_parcel(phys_addr_t); //16 bits of an instruction
+    bool disas_insn_load_imm(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_integer_imm(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_integer_reg(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_load(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_store(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_cond_branch(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_jal(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_jalr(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_addiw(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_64bit_integer_reg(const vm::decoded_insn &d, insn_op_e op);
+    llvm::Value *gen_muldiv(insn_op_e op, llvm::Value *, llvm::Value *, const char *);
+    bool disas_insn_system(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_csr(const vm::decoded_insn &d, insn_op_e op);
+    bool gen_system_exec(target_ulong insn); //by jcpu_riscv_system(), ends the block
+    bool disas_insn_atomic(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_fence(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_fence_i(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_fp_load(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_fp_store(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_fp_fma(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_fp(const vm::decoded_insn &d, insn_op_e op);
+    //Single values are NaN boxed in the registers, and in the lower 32 bits of i64 in the generated code.
+    llvm::Value *gen_get_freg(riscv_arch::reg_e, bool is_double, const char * = "");
+    void gen_set_freg(riscv_arch::reg_e, llvm::Value *, bool is_double);
+    llvm::Value *gen_fp_op(vm::fp_op_e, bool is_double, unsigned int rm, llvm::Value *a, llvm::Value *b = JCPU_NULLPTR, llvm::Value *c = JCPU_NULLPTR);
+    void gen_fold_fp_flags(); //ORs the host flags raised by the native operations into fcsr
+    llvm::Value *gen_fclass(llvm::Value *, bool is_double);
+    bool disas_insn_vector(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_vsetvl(const vm::decoded_insn &d, insn_op_e op);
+    bool disas_insn_vector_mem(const vm::decoded_insn &d, insn_op_e op);
+    //Register groups are handled as <N x iSEW>, which needs vtype known at translation time.
+    llvm::Value *gen_get_vreg(unsigned int vreg, unsigned int lmul, unsigned int sew);
+    void gen_set_vreg(unsigned int vreg, unsigned int lmul, llvm::Value *);
+    llvm::Value *gen_vl_mask(unsigned int num); //true for the elements below vl
+    llvm::Value *gen_splat(llvm::Value *, unsigned int num);
+    llvm::Value *gen_vector_op(vector_op_e, llvm::Value *vs2, llvm::Value *op1, llvm::Value *vd);
+    void gen_vector_exec(const vm::decoded_insn &d, insn_op_e op, bool writes_rd); //by jcpu_riscv_vector_exec() when vtype is not known
 
     llvm::Value *gen_arith_code_with_ovf_check(llvm::Value *, llvm::Value*, llvm::Value * (vm::ir_builder_wrapper::*)(llvm::Value *, llvm::Value *, const char *)const, const char *);
     virtual void start_func(phys_addr_t) JCPU_OVERRIDE;
     const basic_block *disas(virt_addr_t, int, const break_point *);
     virtual run_state_e step_exec() JCPU_OVERRIDE;
+    virtual void take_snapshot() JCPU_OVERRIDE;
+    virtual void restore_snapshot() JCPU_OVERRIDE;
     phys_addr_t code_v2p(virt_addr_t pc){return static_cast<phys_addr_t>(pc);} //FIXME implement MMU
     public:
-    explicit riscv_vm(jcpu_ext_if &);
+    riscv_vm(jcpu_ext_if &, sparse_memory *, unsigned int hart_id = 0, bb_manager * = JCPU_NULLPTR);
+    void set_translator_pool(vm::translator_pool<riscv_vm> *p){pool = p;}
+    void set_clint(clint *c){timer = c;}
+    void start_process(user_process *); //from the entry of the process in U mode
+    void set_htif(uint64_t to, uint64_t from){tohost = to; fromhost = from;}
+    void set_pc(target_ulong pc){set_reg_func(riscv_arch::REG_PC, pc); set_reg_func(riscv_arch::REG_PNEXT_PC, pc);}
+    void set_timer_deadline(uint64_t icount){__atomic_store_n(&timer_deadline, icount, __ATOMIC_RELEASE);}
+    void advance_time(uint64_t icount); //after the barrier of the sync quantum
+    unsigned int get_hart_id()const{return static_cast<unsigned int>(get_reg_func(riscv_arch::REG_MHARTID));}
+    void translate_ahead(uint64_t pc, std::vector<uint64_t> &successors);
     virtual run_state_e run() JCPU_OVERRIDE;
     virtual void dump_regs()const JCPU_OVERRIDE;
     void reset();
     void interrupt(int, bool);
+    //Executes an instruction of the privileged architecture and returns the next pc, which is the trap vector if it traps.
+    //Privilege is checked here, so translated blocks do not depend on it.
+    target_ulong exec_system(uint32_t insn, target_ulong pc, unsigned int insn_len, uint64_t icount);
+    target_ulong take_trap(target_ulong cause, target_ulong epc, target_ulong tval); //returns the vector
+    target_ulong exec_syscall(target_ulong next_pc);
+    void exec_htif(uint64_t val);
+    void exec_fence_i(){request_code_flush();}
+    virt_addr_t check_interrupts(virt_addr_t pc);
+    private:
+    bool read_csr(unsigned int csr, uint64_t icount, target_ulong &val)const; //false if it does not exist
+    void write_csr(unsigned int csr, target_ulong val);
 };
 
-riscv_vm::riscv_vm(jcpu_ext_if &ifs) : vm::jcpu_vm_base<riscv_arch>(ifs) 
+//Core local interruptor at the same address as SiFive and the QEMU virt machine.
+//It decorates jcpu_ext_if of the host, and the other accesses go to the host.
+//mtimecmp is turned into the instruction count of the hart when mtip changes next,
+//so the dispatcher compares only total_icount with it. Each hart calls update() for itself on its own thread,
+//and the other threads make it do so by setting its deadline to 0.
+class clint : public jcpu_ext_if{
+    jcpu_ext_if &host;
+    const std::vector<riscv_vm *> &harts;
+    mutable pthread_mutex_t mutex; //for the registers below, accessed by the threads of all harts
+    std::vector<uint32_t> msip;
+    std::vector<uint64_t> mtimecmp;
+    uint64_t mtime_offset; //written by the guest
+    uint64_t vtime; //instructions per hart when there are several harts, advanced at the barrier of the sync quantum
+    const uint64_t frequency; //0 if mtime counts the instructions
+    std::vector<uint32_t> snap_msip;
+    std::vector<uint64_t> snap_mtimecmp;
+    uint64_t snap_mtime;
+    clx::timer host_timer;
+    static const uint64_t host_time_check_interval = 10000; //instructions
+    static const uint64_t base = 0x2000000, size = 0x10000;
+    static const uint64_t msip_offset = 0x0, mtimecmp_offset = 0x4000, mtime_offset_addr = 0xBFF8;
+    static bool is_clint(uint64_t addr){return base <= addr && addr < base + size;}
+    uint64_t get_mtime(uint64_t icount)const; //the caller holds mutex
+    uint64_t get_mtime()const{return get_mtime(harts[0]->get_total_insn_count());}
+    void request_update(unsigned int hart){harts[hart]->set_timer_deadline(0);} //the caller holds mutex
+    uint64_t read_reg(uint64_t offset, unsigned int size);
+    void write_reg(uint64_t offset, unsigned int size, uint64_t val);
+    public:
+    clint(jcpu_ext_if &host, const std::vector<riscv_vm *> &harts, unsigned int num_harts, uint64_t frequency);
+    virtual ~clint(){pthread_mutex_destroy(&mutex);}
+    void set_msip(unsigned int hart, bool);
+    void update(unsigned int hart); //called by the hart when its total_icount reaches its deadline
+    void advance(unsigned int hart, uint64_t icount); //called by each hart after the barrier, all of them have run icount instructions
+    uint64_t read_mtime(uint64_t icount)const; //for the time CSR, icount is the one of the reading hart
+    void take_snapshot();
+    void restore_snapshot(); //after the harts restored their instruction counts, then update() them
+    virtual uint64_t mem_read(uint64_t addr, unsigned int size) JCPU_OVERRIDE{
+        return is_clint(addr) ? read_reg(addr - base, size) : host.mem_read(addr, size);
+    }
+    virtual void mem_write(uint64_t addr, unsigned int size, uint64_t val) JCPU_OVERRIDE{
+        if(is_clint(addr)) write_reg(addr - base, size, val);
+        else host.mem_write(addr, size, val);
+    }
+    virtual uint64_t mem_read_dbg(uint64_t addr, unsigned int size) JCPU_OVERRIDE{
+        return is_clint(addr) ? read_reg(addr - base, size) : host.mem_read_dbg(addr, size);
+    }
+    virtual void mem_write_dbg(uint64_t addr, unsigned int size, uint64_t val) JCPU_OVERRIDE{
+        if(is_clint(addr)) write_reg(addr - base, size, val);
+        else host.mem_write_dbg(addr, size, val);
+    }
+    virtual void mem_read_block_dbg(uint64_t addr, void *dst, size_t len) JCPU_OVERRIDE{
+        host.mem_read_block_dbg(addr, dst, len);
+    }
+    virtual void mem_write_block_dbg(uint64_t addr, const void *src, size_t len) JCPU_OVERRIDE{
+        host.mem_write_block_dbg(addr, src, len);
+    }
+    virtual uint8_t *get_dmi_ptr(uint64_t addr) JCPU_OVERRIDE{
+        return is_clint(addr) ? JCPU_NULLPTR : host.get_dmi_ptr(addr);
+    }
+    virtual const uint8_t *get_dmi_read_ptr(uint64_t addr) JCPU_OVERRIDE{
+        return is_clint(addr) ? JCPU_NULLPTR : host.get_dmi_read_ptr(addr);
+    }
+};
+
+clint::clint(jcpu_ext_if &host, const std::vector<riscv_vm *> &harts, unsigned int num_harts, uint64_t frequency) :
+    host(host), harts(harts), msip(num_harts, 0), mtimecmp(num_harts, ~static_cast<uint64_t>(0)), mtime_offset(0), vtime(0), frequency(frequency),
+    snap_mtime(0)
 {
-    const unsigned int address_space = 5;
-    const unsigned int bit = sizeof(target_ulong) * 8;
-    const unsigned int num_regs = riscv_arch::NUM_REGS;
-    std::vector<llvm::Constant*> Initializer;
-    Initializer.reserve(num_regs);
+    pthread_mutex_init(&mutex, JCPU_NULLPTR);
+}
 
-    for(unsigned int i = 0; i < num_regs; ++i){
-        //FIXME:default value of PC and SP  is hardcoded, need to check spec
-        const unsigned int reg_init_val = (i == riscv_arch::REG_PC || i == riscv_arch::REG_PNEXT_PC) ? 0x10000 : 0;
-        llvm::ConstantInt *const ivc = gen_const(reg_init_val);
-        Initializer.push_back(ivc);
+//The same for all harts. The thread of a single hart is always the caller, and icount is its instruction count.
+uint64_t clint::get_mtime(uint64_t icount)const{
+    if(frequency) return static_cast<uint64_t>(host_timer.total_elapsed() * frequency) + mtime_offset;
+    if(msip.size() == 1) return icount + mtime_offset;
+    return vtime + mtime_offset;
+}
+
+uint64_t clint::read_mtime(uint64_t icount)const{
+    const vm::scoped_lock l(&mutex);
+    return get_mtime(icount);
+}
+
+void clint::take_snapshot(){
+    const vm::scoped_lock l(&mutex);
+    snap_msip = msip;
+    snap_mtimecmp = mtimecmp;
+    snap_mtime = get_mtime();
+}
+
+void clint::restore_snapshot(){
+    const vm::scoped_lock l(&mutex);
+    jcpu_assert(snap_msip.size() == msip.size());
+    msip = snap_msip;
+    mtimecmp = snap_mtimecmp;
+    mtime_offset += snap_mtime - get_mtime(); //mtime goes on from the snapshot
+    for(unsigned int i = 0; i < msip.size(); ++i) harts[i]->interrupt(riscv_arch::IRQ_MSI, msip[i]);
+}
+
+void clint::set_msip(unsigned int hart, bool val){
+    const vm::scoped_lock l(&mutex);
+    jcpu_assert(hart < msip.size());
+    msip[hart] = val;
+    harts[hart]->interrupt(riscv_arch::IRQ_MSI, val);
+}
+
+void clint::update(unsigned int hart){
+    const vm::scoped_lock l(&mutex);
+    riscv_vm &vm = *harts[hart];
+    const uint64_t now = get_mtime();
+    const bool expired = now >= mtimecmp[hart];
+    vm.interrupt(riscv_arch::IRQ_MTI, expired);
+    if(expired || (!frequency && msip.size() > 1)){//until mtimecmp is written, or advance() is called
+        vm.set_timer_deadline(~static_cast<uint64_t>(0));
+    }
+    else{
+        const uint64_t icount = vm.get_total_insn_count();
+        const uint64_t distance = frequency ? host_time_check_interval : mtimecmp[hart] - now;
+        vm.set_timer_deadline(distance > ~icount ? ~static_cast<uint64_t>(0) : icount + distance);
     }
+}
 
-    llvm::ArrayType *const ATy = llvm::ArrayType::get(llvm::IntegerType::get(*context, bit), num_regs);
-    llvm::Constant *const init = llvm::ConstantArray::get(ATy, Initializer);
-#if JCPU_LLVM_VERSION_LT(3,6)
-    llvm::GlobalVariable *const global_regs = new llvm::GlobalVariable(*mod, ATy, true, llvm::GlobalValue::CommonLinkage, init, "regs", 0, llvm::GlobalVariable::NotThreadLocal, address_space);
-#else
-    llvm::GlobalVariable *const global_regs = new llvm::GlobalVariable(*mod, ATy, false, llvm::GlobalValue::InternalLinkage, init, "regs", 0, llvm::GlobalVariable::NotThreadLocal, address_space);
-#endif
-    global_regs->setAlignment(bit / 8);
+void clint::advance(unsigned int hart, uint64_t icount){
+    const vm::scoped_lock l(&mutex);
+    if(frequency || msip.size() == 1) return;
+    if(icount > vtime) vtime = icount; //by the first hart after the barrier
+    request_update(hart);
+}
 
-    vm::make_set_get(mod, global_regs, address_space, bit);
-    vm::make_mem_access(mod, address_space);
-    vm::make_debug_func(mod, address_space);
+uint64_t clint::read_reg(uint64_t offset, unsigned int size){
+    const vm::scoped_lock l(&mutex);
+    uint64_t val = 0;
+    const unsigned int hart = static_cast<unsigned int>((offset - mtimecmp_offset) / 8);
+    if(offset < mtimecmp_offset){
+        const uint64_t idx = (offset - msip_offset) / 4;
+        return idx < msip.size() ? msip[idx] : 0;
+    }
+    else if(hart < mtimecmp.size()){
+        val = mtimecmp[hart];
+    }
+    else if((offset & ~static_cast<uint64_t>(7)) == mtime_offset_addr){
+        val = get_mtime();
+    }
+    return size == 8 ? val : (val >> ((offset & 4) * 8)) & 0xFFFFFFFFU;
+}
 
-    set_reg_func = get_func_ptr<void (*)(uint16_t, target_ulong)>("set_reg");
-    get_reg_func = get_func_ptr<target_ulong (*)(uint16_t)>("get_reg");
+void clint::write_reg(uint64_t offset, unsigned int size, uint64_t val){
+    const vm::scoped_lock l(&mutex);
+    const unsigned int hart = static_cast<unsigned int>((offset - mtimecmp_offset) / 8);
+    const unsigned int shift = size == 8 ? 0 : (offset & 4) * 8;
+    const uint64_t mask = (size == 8 ? ~static_cast<uint64_t>(0) : static_cast<uint64_t>(0xFFFFFFFFU)) << shift;
+    if(offset < mtimecmp_offset){
+        const uint64_t idx = (offset - msip_offset) / 4;
+        if(idx < msip.size()){
+            msip[idx] = val & 1;
+            harts[idx]->interrupt(riscv_arch::IRQ_MSI, val & 1);
+        }
+    }
+    else if(hart < mtimecmp.size()){
+        mtimecmp[hart] = (mtimecmp[hart] & ~mask) | ((val << shift) & mask);
+        request_update(hart);
+    }
+    else if((offset & ~static_cast<uint64_t>(7)) == mtime_offset_addr){
+        const uint64_t mtime = get_mtime();
+        mtime_offset += ((mtime & ~mask) | ((val << shift) & mask)) - mtime;
+        for(unsigned int i = 0; i < mtimecmp.size(); ++i) request_update(i);
+    }
+}
 
-    void (*const set_mem_access_if)(jcpu_ext_if *) = get_func_ptr<void(*)(jcpu_ext_if*)>("set_mem_access_if");
-    set_mem_access_if(&ext_ifs);
-    void (*const set_jcpu_vm_ptr)(jcpu_vm_if *) = get_func_ptr<void(*)(jcpu_vm_if*)>("set_jcpu_vm_ptr");
-    set_jcpu_vm_ptr(this);
+riscv_vm::riscv_vm(jcpu_ext_if &ifs, sparse_memory *ram, unsigned int hart_id, bb_manager *shared_bb_man) :
+    vm::jcpu_vm_base<riscv_arch>(ifs, ram, shared_bb_man), cur_vtype(riscv_arch::vtype_unknown), fp_keep(JCPU_NULLPTR), pool(JCPU_NULLPTR),
+    timer(JCPU_NULLPTR), process(JCPU_NULLPTR), tohost(0), fromhost(0), timer_deadline(~static_cast<uint64_t>(0))
+{
+    for(unsigned int i = 0; i < riscv_arch::NUM_REGS; ++i){
+        //FIXME:default value of PC and SP  is hardcoded, need to check spec
+        const target_ulong reg_init_val = (i == riscv_arch::REG_PC || i == riscv_arch::REG_PNEXT_PC) ? 0x10000 : 0;
+        set_reg_func(i, reg_init_val);
+    }
+    set_reg_func(riscv_arch::REG_MHARTID, hart_id);
+    set_reg_func(riscv_arch::REG_RESERVE_ADDR, ~static_cast<target_ulong>(0));
+    set_reg_func(riscv_arch::REG_PRIV, riscv_arch::PRIV_M);
+    set_reg_func(riscv_arch::REG_MSTATUS, (static_cast<target_ulong>(2) << riscv_arch::MSTATUS_UXL_SHIFT) | (static_cast<target_ulong>(2) << riscv_arch::MSTATUS_SXL_SHIFT));
 }
 
 
@@ -152,152 +703,163 @@ void riscv_vm::gen_set_reg(riscv_arch::reg_e reg, llvm::Value *val)const{
     }
 }
 
+const vm::insn_desc<riscv_vm::disas_func_t> riscv_vm::insn_table[] = {
+#define RISCV_INSN(name, mask, match, handler, op, format, flow) {name, mask, match, &riscv_vm::handler, &operands_##format, vm::decoded_insn::FLOW_##flow},
+#include "jcpu_riscv_insn.def"
+#undef RISCV_INSN
+};
+
+const vm::insn_decoder<riscv_vm::disas_func_t> riscv_vm::decoder(riscv_vm::insn_table, 0, 7); //by the major opcode
+
 bool riscv_vm::disas_insn(virt_addr_t pc_v, int *const insn_depth){
     ++(*insn_depth);
     const phys_addr_t pc = code_v2p(pc_v);
     struct push_and_pop_pc{
         riscv_vm &vm;
         push_and_pop_pc(riscv_vm &vm, virt_addr_t pc_v, phys_addr_t pc_p) : vm(vm){
-            vm.processing_pc.push(std::make_pair(pc_v, pc_p));
+            vm.job.processing_pc.push(std::make_pair(pc_v, pc_p));
         }
         ~push_and_pop_pc(){
-            vm.processing_pc.pop();
+            vm.job.processing_pc.pop();
+            ++vm.job.insn_offset;
         }
     } push_and_pop_pc(*this, pc_v, pc);
-    const target_ulong insn = ext_ifs.mem_read(pc, 4);
-    const unsigned int kind = bit_sub<2, 5>(insn);
+    const vm::decoded_insn d = fetch_insn(pc);
+    const target_ulong insn = d.raw;
+    cur_insn_len = d.len;
+    const vm::insn_desc<disas_func_t> *const desc = d.id == vm::decoded_insn::illegal ? JCPU_NULLPTR : &insn_table[d.id];
 #if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 0
-    std::cout << std::hex << "pc:" << pc << " INSN:" << std::setw(8) << std::setfill('0') << insn << " kind:" << kind << std::endl;
+    std::cout << std::hex << "pc:" << pc << " INSN:" << std::setw(8) << std::setfill('0') << insn << " " << (desc ? desc->name : "illegal") << std::endl;
 #endif
 #if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 2
-    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"));
+    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"), cur_state);
 #endif
+    if(!desc){
+        if(job.speculative) throw vm::speculation_failed();
+        return gen_system_exec(insn); //illegal instruction, compressed ones are not expanded
+    }
+    const bool done = (this->*desc->handler)(d, static_cast<insn_op_e>(d.id));
+    add_successors(d);
+    return done;
+}
 
-    switch(kind) {
-        case 0x0D://LUI
-        case 0x05://AUIPC
-            return disas_insn_load_imm(insn);
-        case 0x04:
-            return disas_insn_integer_imm(insn);
-        case 0x0C:
-            return disas_insn_integer_reg(insn);
-        case 0x00:
-            return disas_insn_load(insn);
-        case 0x08:
-            return disas_insn_store(insn);
-        case 0x18:
-            return disas_insn_cond_branch(insn);
-        case 0x06:
-            return disas_insn_64bit_integer(insn);
-        case 0x19://jalr
-        case 0x1b://jal
-            return disas_insn_jump(insn);
+//Blocks statically reachable from the instruction, which the translator threads translate ahead
+void riscv_vm::add_successors(const vm::decoded_insn &d){
+    const target_ulong pc = job.processing_pc.top().first;
+    switch(d.flow){
+        case vm::decoded_insn::FLOW_BRANCH:
+            job.successors.push_back(pc + d.imm);
+            job.successors.push_back(pc + d.len);
+            break;
+        case vm::decoded_insn::FLOW_JUMP:
+            job.successors.push_back(pc + d.imm);
+            if(d.rd != 0) job.successors.push_back(pc + d.len); //returned to if it is a call
+            break;
+        case vm::decoded_insn::FLOW_INDIRECT:
+            job.successors.push_back(pc + d.len); //returned to if it is a call
+            break;
         default:
-            builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"));
-            dump_regs();
-            std::cout << "INSN:" << std::hex << insn << std::endl;
-            jcpu_assert(!"Not supported insn");
+            break;
     }
+}
 
-#if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 2
-    builder->CreateCall(mod->getFunction("jcpu_vm_dump_regs"));
-#endif
-    jcpu_assert(!"Never comes here");
-    return false;//suppress warning
+//Speculative translation reads only RAM, as the guessed address may be I/O whose reads have side effects
+uint16_t riscv_vm::fetch_parcel(phys_addr_t addr){
+    if(!job.speculative) return static_cast<uint16_t>(ext_ifs.mem_read(addr, 2));
+    const uint8_t *const host = ext_ifs.get_dmi_read_ptr(addr);
+    if(!host) throw vm::speculation_failed();
+    uint16_t parcel;
+    std::memcpy(&parcel, host, sizeof(parcel)); //little endian host
+    return parcel;
+}
+
+vm::decoded_insn riscv_vm::fetch_insn(phys_addr_t pc){
+    vm::decoded_insn &slot = get_decoded(pc);
+    if(slot.is_decoded()) return slot;
+    vm::decoded_insn d;
+    d.raw = fetch_parcel(pc);
+    d.len = 2;
+    if((d.raw & 3) == 3){
+        d.raw |= static_cast<uint32_t>(fetch_parcel(pc + phys_addr_t(2))) << 16;
+        d.len = 4;
+    }
+    else if(const uint32_t expanded = expand_rvc(d.raw)){
+        d.raw = expanded;
+    }
+    else{
+        d.id = vm::decoded_insn::illegal;
+    }
+    if(d.id != vm::decoded_insn::illegal){
+        const vm::insn_desc<disas_func_t> *const desc = decoder.decode(d.raw);
+        d.id = desc ? static_cast<uint16_t>(desc - insn_table) : vm::decoded_insn::illegal;
+        if(desc){
+            desc->operands(d.raw, d);
+            d.flow = desc->flow;
+        }
+    }
+    if((pc & (sparse_memory::page_size - 1)) + d.len <= sparse_memory::page_size){//ones across pages are fetched every time
+        slot = d;
+    }
+    mark_code(pc, d.len);
+    return d;
 }
 
-bool riscv_vm::disas_insn_load_imm(target_ulong insn)
+bool riscv_vm::disas_insn_load_imm(const vm::decoded_insn &d, insn_op_e op)
 {
-    const target_ulong kind = bit_sub<2, 5>(insn);
-    const riscv_arch::reg_e dest = get_reg_id<7>(insn);
-    llvm::Value *const imm = gen_const(bit_sub<12, 20>(insn));
-    switch(kind)
+    const riscv_arch::reg_e dest = get_reg_id(d.rd);
+    llvm::Value *const imm = gen_const(d.imm); //already shifted by 12
+    switch(op)
     {
-        case 0x0D://LUI
-            {
-                static const char *mn = "lui";
-                gen_set_reg(dest, builder->CreateShl(imm, gen_const(12), mn));
-            }
+        case OP_LUI:
+            gen_set_reg(dest, imm);
             break;
-        case 0x05://AUIPC
+        case OP_AUIPC:
             {
                 static const char *mn = "auipc";
-                llvm::Value *const shifted = builder->CreateShl(imm, gen_const(12), mn);
-                llvm::Value *const added = builder->CreateAdd(shifted, gen_get_pc(), mn);
+                llvm::Value *const added = builder->CreateAdd(imm, gen_get_pc(), mn);
                 gen_set_reg(dest, added);
             }
             break;
+        default:
+            jcpu_assert(!"Never comes here");
     }
     return false;
 }
 
-bool riscv_vm::disas_insn_integer_imm(target_ulong insn) {
-    llvm::ConstantInt *const i12 = llvm::ConstantInt::get(*context, llvm::APInt(12, bit_sub<20, 12>(insn)));
-    llvm::Value *const imm = gen_const(bit_sub<20, 12>(insn));
-    const riscv_arch::reg_e dest = get_reg_id<7>(insn);
-    llvm::Value *const src = gen_get_reg(get_reg_id<15>(insn));
-    switch(bit_sub<12, 3>(insn))
+bool riscv_vm::disas_insn_integer_imm(const vm::decoded_insn &d, insn_op_e op) {
+    llvm::Value *const imm = gen_const(d.imm);
+    llvm::Value *const shamt = gen_const(d.imm & 0x3F); //6 bit on RV64
+    const riscv_arch::reg_e dest = get_reg_id(d.rd);
+    llvm::Value *const src = gen_get_reg(get_reg_id(d.rs1));
+    const char *const mn = insn_table[op].name;
+    switch(op)
     {
-        case 0://ADDI
-            {//add immediate value after sign extension
-                static const char *const mn = "addi";
-                llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type());
-                llvm::Value *const added = builder->CreateAdd(extended, src, mn);
-                gen_set_reg(dest, added);
-            }
+        case OP_ADDI://add immediate value after sign extension
+            gen_set_reg(dest, builder->CreateAdd(imm, src, mn));
             break;
-        case 1://SLLI
-            {//shift left logical
-                const target_ulong zero = bit_sub<25, 7>(insn);
-                jcpu_assert(zero == 0);
-                static const char *const mn = "slli";
-                llvm::Value *const shifted = builder->CreateShl(src, imm, mn);
-                gen_set_reg(dest, shifted);
-            }
+        case OP_SLLI://shift left logical
+            gen_set_reg(dest, builder->CreateShl(src, shamt, mn));
             break;
-        case 2://SLTI
-            {//set 1 if less than immediate (signed)
-                static const char *const mn = "slti";
-                gen_set_reg(dest, builder->CreateICmpSLT(src, imm, mn));
-            }
+        case OP_SLTI://set 1 if less than immediate (signed)
+            gen_set_reg(dest, builder->CreateICmpSLT(src, imm, mn));
             break;
-        case 3://SLTIU
-            {//set 1 if less than immediate (unsigned)
-                static const char *const mn = "sltiu";
-                gen_set_reg(dest, builder->CreateICmpULT(src, imm, mn));
-            }
+        case OP_SLTIU://set 1 if less than immediate (unsigned)
+            gen_set_reg(dest, builder->CreateICmpULT(src, imm, mn));
             break;
-        case 4://XORI
-            {//XOR sign extended immediate
-                static const char *const mn = "xori";
-                llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type(), mn);
-                gen_set_reg(dest, builder->CreateXor(extended, src, mn));
-            }
+        case OP_XORI://XOR sign extended immediate
+            gen_set_reg(dest, builder->CreateXor(imm, src, mn));
             break;
-        case 5://SRLI, SRAI
-            {//shift right logical or arithmetric
-                const target_ulong logical_or_arithmetric = bit_sub<25, 7>(insn);
-                jcpu_assert(logical_or_arithmetric == 0 || logical_or_arithmetric == 0x20);
-                const bool logical = logical_or_arithmetric == 0;
-                static const char *const mn[2]  = {"srli", "srai"};
-                llvm::Value *const shifted = logical ?
-                    builder->CreateLShr(src, imm, mn[0]) : builder->CreateAShr(src, imm, mn[1]);
-                gen_set_reg(dest, shifted);
-            }
+        case OP_SRLI://shift right logical
+            gen_set_reg(dest, builder->CreateLShr(src, shamt, mn));
             break;
-        case 6://ORI
-            {//OR sign extended immediate
-                static const char *const mn = "ori";
-                llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type(), mn);
-                gen_set_reg(dest, builder->CreateOr(extended, src, mn));
-            }
+        case OP_SRAI://shift right arithmetic
+            gen_set_reg(dest, builder->CreateAShr(src, shamt, mn));
             break;
-        case 7://ANDI
-            {//AND sign extended immediate
-                static const char *const mn = "andi";
-                llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type(), mn);
-                gen_set_reg(dest, builder->CreateAnd(extended, src, mn));
-            }
+        case OP_ORI://OR sign extended immediate
+            gen_set_reg(dest, builder->CreateOr(imm, src, mn));
+            break;
+        case OP_ANDI://AND sign extended immediate
+            gen_set_reg(dest, builder->CreateAnd(imm, src, mn));
             break;
         default:
             jcpu_assert(!"Never comes here");
@@ -306,264 +868,1288 @@ bool riscv_vm::disas_insn_integer_imm(target_ulong insn) {
 } 
 
 
-bool riscv_vm::disas_insn_integer_reg(target_ulong insn) {
+bool riscv_vm::disas_insn_integer_reg(const vm::decoded_insn &d, insn_op_e op) {
     llvm::Value *const src[2] = {
-        gen_get_reg(get_reg_id<15>(insn)),
-        gen_get_reg(get_reg_id<20>(insn))
+        gen_get_reg(get_reg_id(d.rs1)),
+        gen_get_reg(get_reg_id(d.rs2))
     };
-    const target_ulong funct3 = bit_sub<12, 3>(insn);
-    const target_ulong funct7 = bit_sub<25, 7>(insn);
+    const char *const mn = insn_table[op].name;
     llvm::Value *result = NULL;
-    switch(funct3)
+    switch(op)
     {
-        case 0://add, sub
-            jcpu_assert(funct7 == 0 || funct7 == 32);
-            result = funct7 == 0 ?
-                builder->CreateAdd(src[0], src[1], "add") : builder->CreateSub(src[0], src[1], "sub");
+        case OP_ADD:
+            result = builder->CreateAdd(src[0], src[1], mn);
             break;
-        case 1://sll
-            jcpu_assert(funct7 == 0);
-            result = builder->CreateShl(src[0], src[1], "sll");
+        case OP_SUB:
+            result = builder->CreateSub(src[0], src[1], mn);
             break;
-        case 2://slt
-            jcpu_assert(funct7 == 0);
-            result = builder->CreateICmpSLT(src[0], src[1], "slt");
+        case OP_SLL:
+            result = builder->CreateShl(src[0], src[1], mn);
             break;
-        case 3://sltu
-            jcpu_assert(funct7 == 0);
-            result = builder->CreateICmpULT(src[0], src[1], "sltu");
+        case OP_SLT:
+            result = builder->CreateICmpSLT(src[0], src[1], mn);
             break;
-        case 4://xor
-            jcpu_assert(funct7 == 0);
-            result = builder->CreateXor(src[0], src[1], "xor");
+        case OP_SLTU:
+            result = builder->CreateICmpULT(src[0], src[1], mn);
             break;
-        case 5://srl, sra
-            jcpu_assert(funct7 == 0 || funct7 == 32);
-            result = funct7 == 0 ?
-                builder->CreateLShr(src[0], src[1], "srl") : builder->CreateAShr(src[0], src[1], "sra");
+        case OP_XOR:
+            result = builder->CreateXor(src[0], src[1], mn);
             break;
-        case 6://or
-            jcpu_assert(funct7 == 0);
-            result = builder->CreateOr(src[0], src[1], "or");
+        case OP_SRL:
+            result = builder->CreateLShr(src[0], src[1], mn);
             break;
-        case 7://and
-            jcpu_assert(funct7 == 0);
-            result = builder->CreateAnd(src[0], src[1], "and");
+        case OP_SRA:
+            result = builder->CreateAShr(src[0], src[1], mn);
+            break;
+        case OP_OR:
+            result = builder->CreateOr(src[0], src[1], mn);
+            break;
+        case OP_AND:
+            result = builder->CreateAnd(src[0], src[1], mn);
+            break;
+        default://M extension
+            result = gen_muldiv(op, src[0], src[1], mn);
             break;
-        default:jcpu_assert(!"Never comes here");
     }
-    const riscv_arch::reg_e dest = get_reg_id<7>(insn);
-    gen_set_reg(dest, result);
+    gen_set_reg(get_reg_id(d.rd), result);
 
     return false; 
 } 
 
 
-bool riscv_vm::disas_insn_load(target_ulong insn) {
-    llvm::ConstantInt *const i12 = llvm::ConstantInt::get(*context, llvm::APInt(12, bit_sub<20, 12>(insn)));
-    const riscv_arch::reg_e dest = get_reg_id<7>(insn);
-    llvm::Value *const base = gen_get_reg(get_reg_id<15>(insn));
-    llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type());
-    llvm::Value *const addr = builder->CreateAdd(extended, base, "load");
-    const target_ulong opc = bit_sub<12, 3>(insn);
-    switch(opc)
+bool riscv_vm::disas_insn_load(const vm::decoded_insn &d, insn_op_e op) {
+    const riscv_arch::reg_e dest = get_reg_id(d.rd);
+    llvm::Value *const base = gen_get_reg(get_reg_id(d.rs1));
+    llvm::Value *const addr = builder->CreateAdd(gen_const(d.imm), base, "load");
+    const char *const mn = insn_table[op].name;
+    unsigned int len = 0;
+    bool is_signed = true;
+    switch(op)
     {
-        case 0://lb
-        case 4://lbu
-            {
-                static const char *const mn[2] = {"lb", "lbu"};
-                llvm::Value *const dat = gen_lw(addr, 1);
-                llvm::Value *const dat_ext = opc == 0 ? 
-                    builder->CreateSExt(dat, get_reg_type(), mn[0]) : builder->CreateZExt(dat, get_reg_type(), mn[1]);
-                gen_set_reg(dest, dat_ext);
-            }
-            break;
-        case 1://lh
-        case 5://lbu
-            {
-                static const char *const mn[2] = {"lh", "lhu"};
-                llvm::Value *const dat = gen_lw(addr, 2);
-                llvm::Value *const dat_ext = opc == 1 ? 
-                    builder->CreateSExt(dat, get_reg_type(), mn[0]) : builder->CreateZExt(dat, get_reg_type(), mn[1]);
-                gen_set_reg(dest, dat_ext);
-            }
-            break;
-        case 2://lw
-        case 6://lwu
-            {
-                static const char *const mn[2] = {"lw", "lwu"};
-                llvm::Value *const dat = gen_lw(addr, 4);
-                llvm::Value *const dat_ext = opc == 2 ? 
-                    builder->CreateSExt(dat, get_reg_type(), mn[0]) : builder->CreateZExt(dat, get_reg_type(), mn[1]);
-                gen_set_reg(dest, dat_ext);
-            }
-            break;
-        case 3://ld
-            {
-                jcpu_assert(riscv_arch::reg_bit_width == 64);
-                //static const char *const mn = {"ld"};
-                llvm::Value *const dat = gen_lw(addr, 8);
-                gen_set_reg(dest, dat);
-            }
-            break;
+        case OP_LB: len = 1; break;
+        case OP_LH: len = 2; break;
+        case OP_LW: len = 4; break;
+        case OP_LD: len = 8; break;
+        case OP_LBU: len = 1; is_signed = false; break;
+        case OP_LHU: len = 2; is_signed = false; break;
+        case OP_LWU: len = 4; is_signed = false; break;
         default:
             jcpu_assert(!"Never comes here");
     }
+    llvm::Value *const dat = gen_lw(addr, len, mn);
+    if(len == 8){
+        gen_set_reg(dest, dat);
+    }
+    else{
+        gen_set_reg(dest, is_signed ? builder->CreateSExt(dat, get_reg_type(), mn) : builder->CreateZExt(dat, get_reg_type(), mn));
+    }
     return false; 
 } 
 
-bool riscv_vm::disas_insn_store(target_ulong insn) {
-    const target_ulong opc = bit_sub<12, 3>(insn);
-    jcpu_assert(0 <= opc && opc <= 3);
-    static const char *const mn[4] = {"sb", "sh", "sw", "sd"};
-
-    const target_ulong offset_tmp = (bit_sub<25, 7>(insn) << 5) | bit_sub<7, 5>(insn);
-    llvm::ConstantInt *const i12 = llvm::ConstantInt::get(*context, llvm::APInt(12, offset_tmp));
-    llvm::Value *const val = gen_get_reg(get_reg_id<20>(insn));
-    llvm::Value *const base = gen_get_reg(get_reg_id<15>(insn));
-    llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type(), mn[opc]);
-    llvm::Value *const addr = builder->CreateAdd(extended, base, mn[opc]);
+bool riscv_vm::disas_insn_store(const vm::decoded_insn &d, insn_op_e op) {
+    const char *const mn = insn_table[op].name;
+    const unsigned int len = op == OP_SB ? 1 : op == OP_SH ? 2 : op == OP_SW ? 4 : 8;
 
-    gen_sw(addr, 1U << opc, val);
+    llvm::Value *const val = gen_get_reg(get_reg_id(d.rs2));
+    llvm::Value *const base = gen_get_reg(get_reg_id(d.rs1));
+    llvm::Value *const addr = builder->CreateAdd(gen_const(d.imm), base, mn);
 
+    if(!tohost || len < 4){
+        gen_sw(addr, len, val);
+        return false;
+    }
+    //sw and sd to tohost go to exec_htif(), which is a compare for the other stores
+    using namespace llvm;
+    BasicBlock *const htif = BasicBlock::Create(*context, "htif", cur_func);
+    BasicBlock *const store = BasicBlock::Create(*context, "store", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "store_end", cur_func);
+    builder->CreateCondBr(builder->CreateICmpEQ(addr, gen_const(tohost), mn), htif, store);
+
+    builder->SetInsertPoint(htif);
+    std::vector<Type *> types;
+    types.push_back(PointerType::getUnqual(builder->getInt8Ty()));
+    types.push_back(builder->getInt64Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(len == 4 ? builder->CreateAnd(val, gen_const(0xFFFFFFFF), mn) : val);
+    builder->CreateCall(declare_host_func("jcpu_riscv_htif", Type::getVoidTy(*context), types,
+                reinterpret_cast<void *>(&jcpu_riscv_htif)), args);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(store);
+    gen_sw(addr, len, val);
+    builder->CreateBr(join);
+
+    //values cached in job.reg_cache are made before the branch, so they still dominate
+    builder->SetInsertPoint(join);
+    cur_bb = join;
     return false; 
 } 
 
-bool riscv_vm::disas_insn_cond_branch(target_ulong insn) {
-    const target_ulong offset_imm = 
-        (bit_sub<31, 1>(insn) << 12) |
-        (bit_sub<7, 1>(insn) << 11) |
-        (bit_sub<25, 6>(insn) << 5) |
-        (bit_sub<8, 4>(insn) << 1);
-    llvm::ConstantInt *const i13 = llvm::ConstantInt::get(*context, llvm::APInt(13, offset_imm));
-
-    const target_ulong opc = bit_sub<12, 3>(insn);
-    jcpu_assert(0 <= opc && opc <= 7 && opc != 2 && opc != 3);
-    static const char *const mn_table[8] = {"beq", "bne", "", "", "blt", "bge", "bltu", "bgeu"};
-    const char *const mn = mn_table[opc];
-
-    llvm::Value *const extended = builder->CreateSExt(i13, get_reg_type(), mn);
-    llvm::Value *const just_4 = gen_const(4);
+bool riscv_vm::disas_insn_cond_branch(const vm::decoded_insn &d, insn_op_e op) {
+    const char *const mn = insn_table[op].name;
+    llvm::Value *const insn_len = gen_const(cur_insn_len);
 
     llvm::Value *const val[2] = {
-        gen_get_reg(get_reg_id<15>(insn)),
-        gen_get_reg(get_reg_id<20>(insn))
+        gen_get_reg(get_reg_id(d.rs1)),
+        gen_get_reg(get_reg_id(d.rs2))
     };
 
     llvm::Value * flag = NULL;
-    switch(opc)
+    switch(op)
     {
-        case 0:
+        case OP_BEQ:
             flag = builder->CreateICmpEQ(val[0], val[1], mn);
             break;
-        case 1:
+        case OP_BNE:
             flag = builder->CreateICmpNE(val[0], val[1], mn);
             break;
-        case 4:
+        case OP_BLT:
             flag = builder->CreateICmpSLT(val[0], val[1], mn);
             break;
-        case 5:
+        case OP_BGE:
             flag = builder->CreateICmpSGE(val[0], val[1], mn);
             break;
-        case 6:
+        case OP_BLTU:
             flag = builder->CreateICmpULT(val[0], val[1], mn);
             break;
-        case 7:
+        case OP_BGEU:
             flag = builder->CreateICmpUGE(val[0], val[1], mn);
             break;
         default:jcpu_assert(!"Never comes here");
     }
-    llvm::Value *const offset = builder->CreateSelect(flag, extended, just_4, mn);
+    llvm::Value *const offset = builder->CreateSelect(flag, gen_const(d.imm), insn_len, mn);
     llvm::Value *const next_pc = builder->CreateAdd(gen_get_pc(), offset, mn);
     gen_set_reg(riscv_arch::REG_PNEXT_PC, next_pc);
 
     return true; 
 } 
 
-bool riscv_vm::disas_insn_jump(target_ulong insn) {
-    const unsigned int kind = bit_sub<2, 5>(insn);
-    jcpu_assert(kind == 0x19 || kind == 0x1b);
-
-    if(kind == 0x19){//jalr
-        {
-            const target_ulong zero = bit_sub<12, 3>(insn);
-            jcpu_assert(zero == 0);
-        }
-        static const char *const mn = "jalr";
-        llvm::ConstantInt *const i12 = llvm::ConstantInt::get(*context, llvm::APInt(12, bit_sub<20, 12>(insn)));
-        llvm::Value *const extended = builder->CreateSExt(i12, get_reg_type(), mn);
-        llvm::Value *const base = gen_get_reg(get_reg_id<15>(insn));
-        llvm::Value *const next_pc = builder->CreateAdd(base, extended, mn);
-        llvm::Value *const return_pc = builder->CreateAdd(gen_get_pc(), gen_const(4), mn);
-        gen_set_reg(get_reg_id<7>(insn), return_pc);
-        gen_set_reg(riscv_arch::REG_PNEXT_PC, next_pc);
-    }
-    else {//jal
-        jcpu_assert(kind == 0x1b);
-        static const char *const mn = "jal";
-        const target_ulong offset_raw =
-            (bit_sub<31, 1>(insn) << 20) |
-            (bit_sub<12, 8>(insn) << 12) |
-            (bit_sub<20, 1>(insn) << 11) |
-            (bit_sub<21, 10>(insn) << 1);
-        llvm::ConstantInt *const i21 = llvm::ConstantInt::get(*context, llvm::APInt(21, offset_raw));
-        llvm::Value *const extended = builder->CreateSExt(i21, get_reg_type(), mn);
-        llvm::Value *const cur_pc = gen_get_pc();
-        llvm::Value *const next_pc = builder->CreateAdd(cur_pc, extended, mn);
-        llvm::Value *const return_pc = builder->CreateAdd(cur_pc, gen_const(4), mn);
-        gen_set_reg(get_reg_id<7>(insn), return_pc);
-        gen_set_reg(riscv_arch::REG_PNEXT_PC, next_pc);
-    }
+bool riscv_vm::disas_insn_jalr(const vm::decoded_insn &d, insn_op_e) {
+    static const char *const mn = "jalr";
+    llvm::Value *const base = gen_get_reg(get_reg_id(d.rs1));
+    llvm::Value *const next_pc = builder->CreateAdd(base, gen_const(d.imm), mn);
+    llvm::Value *const return_pc = builder->CreateAdd(gen_get_pc(), gen_const(cur_insn_len), mn);
+    gen_set_reg(get_reg_id(d.rd), return_pc);
+    gen_set_reg(riscv_arch::REG_PNEXT_PC, next_pc);
     return true; 
 }
 
-bool riscv_vm::disas_insn_64bit_integer(target_ulong insn)
+bool riscv_vm::disas_insn_jal(const vm::decoded_insn &d, insn_op_e) {
+    static const char *const mn = "jal";
+    llvm::Value *const cur_pc = gen_get_pc();
+    llvm::Value *const next_pc = builder->CreateAdd(cur_pc, gen_const(d.imm), mn);
+    llvm::Value *const return_pc = builder->CreateAdd(cur_pc, gen_const(cur_insn_len), mn);
+    gen_set_reg(get_reg_id(d.rd), return_pc);
+    gen_set_reg(riscv_arch::REG_PNEXT_PC, next_pc);
+    return true; 
+}
+
+bool riscv_vm::disas_insn_addiw(const vm::decoded_insn &d, insn_op_e)
 {
     jcpu_assert(riscv_arch::reg_bit_width == 64);
-    const unsigned int opc = bit_sub<12, 3>(insn);
     llvm::Type *const int_32_type = builder->getInt32Ty();
+    static const char *const mn = "addiw";
+    llvm::Value *const imm_trunc = builder->CreateTrunc(gen_const(d.imm), int_32_type);
+    llvm::Value *const src = gen_get_reg(get_reg_id(d.rs1), mn);
+    llvm::Value *const trunc = builder->CreateTrunc(src, int_32_type, mn);
+    llvm::Value *const sum = builder->CreateAdd(imm_trunc, trunc, mn);
+    gen_set_reg(get_reg_id(d.rd), builder->CreateSExt(sum, get_reg_type(), mn));
+    return false;
+}
 
-    switch(opc) {
-        case 0://addiw
+bool riscv_vm::disas_insn_64bit_integer_reg(const vm::decoded_insn &d, insn_op_e op)
+{//OP-32, the results are sign extended from 32 bit
+    jcpu_assert(riscv_arch::reg_bit_width == 64);
+    llvm::Type *const int_32_type = builder->getInt32Ty();
+    llvm::Value *const src[2] = {
+        builder->CreateTrunc(gen_get_reg(get_reg_id(d.rs1)), int_32_type),
+        builder->CreateTrunc(gen_get_reg(get_reg_id(d.rs2)), int_32_type)
+    };
+    const char *const mn = insn_table[op].name;
+    llvm::Value *const shamt = builder->CreateAnd(src[1], 0x1F);
+    llvm::Value *result = NULL;
+    switch(op){
+        case OP_ADDW:
+            result = builder->CreateAdd(src[0], src[1], mn);
+            break;
+        case OP_SUBW:
+            result = builder->CreateSub(src[0], src[1], mn);
+            break;
+        case OP_SLLW:
+            result = builder->CreateShl(src[0], shamt, mn);
+            break;
+        case OP_SRLW:
+            result = builder->CreateLShr(src[0], shamt, mn);
+            break;
+        case OP_SRAW:
+            result = builder->CreateAShr(src[0], shamt, mn);
+            break;
+        default://M extension
+            result = gen_muldiv(op, src[0], src[1], mn);
+            break;
+    }
+    gen_set_reg(get_reg_id(d.rd), builder->CreateSExt(result, get_reg_type()));
+    return false;
+}
+
+//Operands are either full width or 32 bit for the W variants.
+//Division by zero and signed overflow are handled with selects, so no branch is made.
+llvm::Value *riscv_vm::gen_muldiv(insn_op_e op, llvm::Value *lhs, llvm::Value *rhs, const char *mn)
+{
+    using namespace llvm;
+    Type *const type = lhs->getType();
+    const unsigned int width = cast<IntegerType>(type)->getBitWidth();
+    Type *const wide_type = IntegerType::get(*context, width * 2);
+    Value *const zero = ConstantInt::get(type, 0);
+    Value *const all_one = ConstantInt::get(type, -1, true);
+    Value *const div_by_zero = builder->CreateICmpEQ(rhs, zero, mn);
+    switch(op){
+        case OP_MUL:
+        case OP_MULW:
+            return builder->CreateMul(lhs, rhs, mn);
+        case OP_MULH:
+        case OP_MULHSU:
+        case OP_MULHU:
+            {
+                Value *const wide_lhs = op == OP_MULHU ? builder->CreateZExt(lhs, wide_type, mn) : builder->CreateSExt(lhs, wide_type, mn);
+                Value *const wide_rhs = op == OP_MULH ? builder->CreateSExt(rhs, wide_type, mn) : builder->CreateZExt(rhs, wide_type, mn);
+                Value *const product = builder->CreateMul(wide_lhs, wide_rhs, mn);
+                return builder->CreateTrunc(builder->CreateLShr(product, width, mn), type, mn);
+            }
+        case OP_DIV:
+        case OP_DIVW:
+        case OP_REM:
+        case OP_REMW:
+            {
+                Value *const min = ConstantInt::get(type, APInt::getSignedMinValue(width));
+                Value *const overflow = builder->CreateAnd(builder->CreateICmpEQ(lhs, min, mn), builder->CreateICmpEQ(rhs, all_one, mn), mn);
+                //min / 1 = min and min % 1 = 0 are the results required for the overflow
+                Value *const divisor = builder->CreateSelect(builder->CreateOr(div_by_zero, overflow, mn), ConstantInt::get(type, 1), rhs, mn);
+                if(op == OP_DIV || op == OP_DIVW){
+                    return builder->CreateSelect(div_by_zero, all_one, builder->CreateSDiv(lhs, divisor, mn), mn);
+                }
+                return builder->CreateSelect(div_by_zero, lhs, builder->CreateSRem(lhs, divisor, mn), mn);
+            }
+        case OP_DIVU:
+        case OP_DIVUW:
+        case OP_REMU:
+        case OP_REMUW:
             {
-                static const char *const mn = "addiw";
-                llvm::Value *const imm = gen_const(bit_sub<20, 12>(insn));
-                llvm::Value *const imm_trunc = builder->CreateTrunc(imm, int_32_type);
-                llvm::Value *const src = gen_get_reg(get_reg_id<15>(insn), mn);
-                llvm::Value *const trunc = builder->CreateTrunc(src, int_32_type, mn);
-                llvm::Value *const sum = builder->CreateAdd(imm_trunc, trunc, mn);
-                gen_set_reg(get_reg_id<7>(insn), builder->CreateSExt(sum, get_reg_type(), mn));
+                Value *const divisor = builder->CreateSelect(div_by_zero, ConstantInt::get(type, 1), rhs, mn);
+                if(op == OP_DIVU || op == OP_DIVUW){
+                    return builder->CreateSelect(div_by_zero, all_one, builder->CreateUDiv(lhs, divisor, mn), mn);
+                }
+                return builder->CreateSelect(div_by_zero, lhs, builder->CreateURem(lhs, divisor, mn), mn);
             }
+        default:
+            jcpu_assert(!"Never comes here");
+    }
+    return NULL;
+}
+
+bool riscv_vm::disas_insn_system(const vm::decoded_insn &d, insn_op_e)
+{//ecall, ebreak, xret, wfi and sfence.vma depend on the privilege
+    return gen_system_exec(d.raw);
+}
+
+bool riscv_vm::disas_insn_csr(const vm::decoded_insn &d, insn_op_e op)
+{
+    const unsigned int csr = static_cast<unsigned int>(d.imm & 0xFFF);
+    const unsigned int src = d.rs1; //rs1 or zimm
+    const bool is_imm = op == OP_CSRRWI || op == OP_CSRRSI || op == OP_CSRRCI;
+    const bool is_swap = op == OP_CSRRW || op == OP_CSRRWI;
+    const bool is_set = op == OP_CSRRS || op == OP_CSRRSI;
+    const bool is_read = !is_swap && src == 0;
+    if(!((csr == 0xF14 && is_read) || (0x001 <= csr && csr <= 0x003))){
+        return gen_system_exec(d.raw); //the CSRs which depend on the privilege
+    }
+    if(csr == 0xF14){//mhartid is read from the register file because the same block is executed by all harts
+        gen_set_reg(get_reg_id(d.rd), gen_get_reg(riscv_arch::REG_MHARTID, "csrr"));
+        return false;
+    }
+    static const char *const mn = "csr";
+    gen_fold_fp_flags();
+    const target_ulong mask = csr == 0x001 ? riscv_arch::FCSR_FFLAGS : csr == 0x002 ? riscv_arch::FCSR_FRM : riscv_arch::FCSR_FFLAGS | riscv_arch::FCSR_FRM;
+    const unsigned int shift = csr == 0x002 ? riscv_arch::FCSR_FRM_SHIFT : 0;
+    llvm::Value *const fcsr = gen_get_reg(riscv_arch::REG_FCSR, mn);
+    llvm::Value *const old = builder->CreateLShr(builder->CreateAnd(fcsr, gen_const(mask), mn), gen_const(shift), mn);
+    llvm::Value *const operand = is_imm ? gen_const(src) : gen_get_reg(get_reg_id(src), mn);
+    llvm::Value *new_fcsr = fcsr;
+    if(is_swap || src != 0){//csrrs and csrrc do not write if the operand is x0 or 0
+        llvm::Value *const val = is_swap ? operand : is_set ? builder->CreateOr(old, operand, mn) :
+            builder->CreateAnd(old, builder->CreateXor(operand, gen_const(~static_cast<target_ulong>(0)), mn), mn);
+        new_fcsr = builder->CreateOr(builder->CreateAnd(fcsr, gen_const(~mask), mn),
+                builder->CreateAnd(builder->CreateShl(val, gen_const(shift), mn), gen_const(mask), mn), mn);
+    }
+    gen_set_reg(riscv_arch::REG_FCSR, new_fcsr);
+    gen_set_reg(get_reg_id(d.rd), old);
+    return false;
+}
+
+bool riscv_vm::gen_system_exec(target_ulong insn){
+    using namespace llvm;
+    gen_fold_fp_flags(); //the helper may read fcsr
+    gen_flush_regs(riscv_arch::REG_GR00, riscv_arch::NUM_REGS); //the helper works on the state
+    std::vector<Type *> types;
+    types.push_back(PointerType::getUnqual(builder->getInt8Ty()));
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt32Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), insn));
+    args.push_back(gen_get_pc());
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), cur_insn_len));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), job.insn_offset));
+    Value *const next_pc = builder->CreateCall(declare_host_func("jcpu_riscv_system", builder->getInt64Ty(), types,
+                reinterpret_cast<void *>(&jcpu_riscv_system)), args, "system");
+    gen_set_reg(riscv_arch::REG_PNEXT_PC, next_pc);
+    return true;
+}
+
+//insn_offset is the index of the instruction in the block, total_icount is updated after the block
+extern "C" uint64_t jcpu_riscv_system(void *state, uint32_t insn, uint64_t pc, uint32_t insn_len, uint32_t insn_offset){
+    riscv_vm *const vm = static_cast<riscv_vm *>(static_cast<vm::cpu_state_header *>(state)->vm);
+    return vm->exec_system(insn, pc, insn_len, vm->get_total_insn_count() + insn_offset);
+}
+
+target_ulong riscv_vm::exec_system(uint32_t insn, target_ulong pc, unsigned int insn_len, uint64_t icount){
+    const target_ulong priv = get_reg_func(riscv_arch::REG_PRIV);
+    const target_ulong next_pc = pc + insn_len;
+    const unsigned int funct3 = bit_sub<12, 3>(insn);
+    if(bit_sub<0, 7>(insn) != 0x73 || funct3 == 4) return take_trap(riscv_arch::EXC_ILLEGAL_INSN, pc, insn);
+    if(funct3 == 0){
+        const target_ulong mstatus = get_reg_func(riscv_arch::REG_MSTATUS);
+        if(insn == 0x00000073) return process ? exec_syscall(next_pc) : take_trap(riscv_arch::EXC_ECALL_U + priv, pc, 0); //ecall
+        if(insn == 0x00100073) return take_trap(riscv_arch::EXC_BREAKPOINT, pc, pc); //ebreak
+        if(insn == 0x10500073) return next_pc; //wfi, interrupts are checked at the end of the block
+        if(bit_sub<25, 7>(insn) == 0x09 && bit_sub<7, 5>(insn) == 0){//sfence.vma, there is no TLB
+            return priv >= riscv_arch::PRIV_S ? next_pc : take_trap(riscv_arch::EXC_ILLEGAL_INSN, pc, insn);
+        }
+        if(insn == 0x30200073 && priv == riscv_arch::PRIV_M){//mret
+            const target_ulong mpp = bit_sub<riscv_arch::MSTATUS_MPP_SHIFT, 2>(mstatus);
+            target_ulong new_mstatus = mstatus & ~((1U << riscv_arch::MSTATUS_MIE) | (3U << riscv_arch::MSTATUS_MPP_SHIFT));
+            new_mstatus |= (bit_sub<riscv_arch::MSTATUS_MPIE, 1>(mstatus) << riscv_arch::MSTATUS_MIE) | (1U << riscv_arch::MSTATUS_MPIE);
+            set_reg_func(riscv_arch::REG_MSTATUS, new_mstatus);
+            set_reg_func(riscv_arch::REG_PRIV, mpp);
+            return get_reg_func(riscv_arch::REG_MEPC);
+        }
+        if(insn == 0x10200073 && priv >= riscv_arch::PRIV_S){//sret
+            const target_ulong spp = bit_sub<riscv_arch::MSTATUS_SPP, 1>(mstatus);
+            target_ulong new_mstatus = mstatus & ~((1U << riscv_arch::MSTATUS_SIE) | (1U << riscv_arch::MSTATUS_SPP));
+            new_mstatus |= (bit_sub<riscv_arch::MSTATUS_SPIE, 1>(mstatus) << riscv_arch::MSTATUS_SIE) | (1U << riscv_arch::MSTATUS_SPIE);
+            set_reg_func(riscv_arch::REG_MSTATUS, new_mstatus);
+            set_reg_func(riscv_arch::REG_PRIV, spp);
+            return get_reg_func(riscv_arch::REG_SEPC);
+        }
+        return take_trap(riscv_arch::EXC_ILLEGAL_INSN, pc, insn);
+    }
+    //Zicsr
+    const unsigned int csr = bit_sub<20, 12>(insn);
+    const unsigned int rd = bit_sub<7, 5>(insn), src = bit_sub<15, 5>(insn);
+    const bool writes = (funct3 & 3) == 1 || src != 0;
+    target_ulong old;
+    if(priv < bit_sub<8, 2>(csr) || (writes && bit_sub<10, 2>(csr) == 3) || !read_csr(csr, icount, old)){
+        return take_trap(riscv_arch::EXC_ILLEGAL_INSN, pc, insn);
+    }
+    if(writes){
+        const target_ulong operand = (funct3 & 4) ? src : get_reg_func(src);
+        write_csr(csr, (funct3 & 3) == 1 ? operand : (funct3 & 3) == 2 ? old | operand : old & ~operand);
+    }
+    if(rd != 0) set_reg_func(rd, old);
+    return next_pc;
+}
+
+//a7 is the number, a0 to a5 are the arguments and a0 is the result
+target_ulong riscv_vm::exec_syscall(target_ulong next_pc){
+    uint64_t args[6];
+    for(unsigned int i = 0; i < 6; ++i){
+        args[i] = get_reg_func(riscv_arch::REG_GR10 + i);
+    }
+    set_reg_func(riscv_arch::REG_GR10, process->syscall(get_reg_func(riscv_arch::REG_GR17), args));
+    if(process->has_exited()) request_exit(process->get_exit_code());
+    return next_pc;
+}
+
+extern "C" void jcpu_riscv_htif(void *state, uint64_t val){
+    static_cast<riscv_vm *>(static_cast<vm::cpu_state_header *>(state)->vm)->exec_htif(val);
+}
+
+//HTIF of riscv-tests. The device is in bits 63:56 and the command in bits 55:48 of val.
+//The proxy kernel device 0 exits by (code << 1) | 1, otherwise the payload points to the system call number and its arguments,
+//and the result is written to the number. The console device 1 writes a character by the command 1.
+void riscv_vm::exec_htif(uint64_t val){
+    const unsigned int device = static_cast<unsigned int>(val >> 56);
+    const unsigned int cmd = static_cast<unsigned int>(val >> 48) & 0xFF;
+    const uint64_t payload = val & ((static_cast<uint64_t>(1) << 48) - 1);
+    if(device == 0 && cmd == 0 && (payload & 1)){
+        request_exit(static_cast<int>(payload >> 1));
+        return;
+    }
+    if(device == 0 && cmd == 0){
+        uint64_t args[4];
+        for(unsigned int i = 0; i < 4; ++i){
+            args[i] = ext_ifs.mem_read(payload + i * 8, 8);
+        }
+        int64_t result = -ENOSYS;
+        if(args[0] == 64){//write(fd, buf, len)
+            std::vector<char> buf(args[3]);
+            if(!buf.empty()) ext_ifs.mem_read_block_dbg(args[2], &buf[0], buf.size());
+            std::cout << std::flush;
+            result = buf.empty() ? 0 : ::write(static_cast<int>(args[1]), &buf[0], buf.size());
+            if(result < 0) result = -errno;
+        }
+        else if(args[0] == 93){//exit(code)
+            request_exit(static_cast<int>(args[1]));
+            return;
+        }
+        ext_ifs.mem_write(payload, 8, static_cast<uint64_t>(result));
+    }
+    else if(device == 1 && cmd == 1){
+        std::cout << static_cast<char>(payload) << std::flush;
+    }
+    if(fromhost) ext_ifs.mem_write(fromhost, 8, (val & ~payload) | 1); //acknowledged
+}
+
+bool riscv_vm::read_csr(unsigned int csr, uint64_t icount, target_ulong &val)const{
+    static const target_ulong sstatus_mask = (1U << riscv_arch::MSTATUS_SIE) | (1U << riscv_arch::MSTATUS_SPIE) | (1U << riscv_arch::MSTATUS_SPP) |
+        (3U << riscv_arch::MSTATUS_FS_SHIFT) | (1U << riscv_arch::MSTATUS_SUM) | (1U << riscv_arch::MSTATUS_MXR) | (static_cast<target_ulong>(3) << riscv_arch::MSTATUS_UXL_SHIFT);
+    const target_ulong mip = __atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_ACQUIRE);
+    switch(csr){
+        case 0x100: val = get_reg_func(riscv_arch::REG_MSTATUS) & sstatus_mask; break; //sstatus
+        case 0x104: val = get_reg_func(riscv_arch::REG_MIE) & get_reg_func(riscv_arch::REG_MIDELEG); break; //sie
+        case 0x105: val = get_reg_func(riscv_arch::REG_STVEC); break;
+        case 0x140: val = get_reg_func(riscv_arch::REG_SSCRATCH); break;
+        case 0x141: val = get_reg_func(riscv_arch::REG_SEPC); break;
+        case 0x142: val = get_reg_func(riscv_arch::REG_SCAUSE); break;
+        case 0x143: val = get_reg_func(riscv_arch::REG_STVAL); break;
+        case 0x144: val = mip & get_reg_func(riscv_arch::REG_MIDELEG); break; //sip
+        case 0x106: //scounteren
+        case 0x306: //mcounteren, the counters are always accessible
+        case 0x180: //satp, only Bare is supported
+        case 0xF11: //mvendorid
+        case 0xF12: //marchid
+        case 0xF13: //mimpid
+            val = 0;
             break;
-            /*
-        case 1://slliw
+        case 0x300: val = get_reg_func(riscv_arch::REG_MSTATUS); break;
+        case 0x301: //misa, RV64IMAFDCSUV
+            val = (static_cast<target_ulong>(2) << 62) | (1U << ('A' - 'A')) | (1U << ('C' - 'A')) | (1U << ('D' - 'A')) | (1U << ('F' - 'A')) |
+                (1U << ('I' - 'A')) | (1U << ('M' - 'A')) | (1U << ('S' - 'A')) | (1U << ('U' - 'A')) | (1U << ('V' - 'A'));
             break;
-        case 2://slrliw
+        case 0x302: val = get_reg_func(riscv_arch::REG_MEDELEG); break;
+        case 0x303: val = get_reg_func(riscv_arch::REG_MIDELEG); break;
+        case 0x304: val = get_reg_func(riscv_arch::REG_MIE); break;
+        case 0x305: val = get_reg_func(riscv_arch::REG_MTVEC); break;
+        case 0x340: val = get_reg_func(riscv_arch::REG_MSCRATCH); break;
+        case 0x341: val = get_reg_func(riscv_arch::REG_MEPC); break;
+        case 0x342: val = get_reg_func(riscv_arch::REG_MCAUSE); break;
+        case 0x343: val = get_reg_func(riscv_arch::REG_MTVAL); break;
+        case 0x344: val = mip; break;
+        case 0xB00: //mcycle
+        case 0xB02: //minstret
+        case 0xC00: //cycle
+        case 0xC02: //instret, one instruction per cycle
+            val = icount;
             break;
-        case 3://sraiw
+        case 0xC01: //time, the same as mtime of the CLINT
+            val = timer ? timer->read_mtime(icount) : icount;
             break;
-            */
+        case 0xF14: val = get_reg_func(riscv_arch::REG_MHARTID); break;
         default:
-            jcpu_assert(!"Not supported insn");
+            return false;
+    }
+    return true;
+}
+
+void riscv_vm::write_csr(unsigned int csr, target_ulong val){
+    static const target_ulong mstatus_mask = (1U << riscv_arch::MSTATUS_SIE) | (1U << riscv_arch::MSTATUS_MIE) | (1U << riscv_arch::MSTATUS_SPIE) |
+        (1U << riscv_arch::MSTATUS_MPIE) | (1U << riscv_arch::MSTATUS_SPP) | (3U << riscv_arch::MSTATUS_MPP_SHIFT) |
+        (3U << riscv_arch::MSTATUS_FS_SHIFT) | (1U << riscv_arch::MSTATUS_SUM) | (1U << riscv_arch::MSTATUS_MXR);
+    static const target_ulong sstatus_mask = (1U << riscv_arch::MSTATUS_SIE) | (1U << riscv_arch::MSTATUS_SPIE) | (1U << riscv_arch::MSTATUS_SPP) |
+        (3U << riscv_arch::MSTATUS_FS_SHIFT) | (1U << riscv_arch::MSTATUS_SUM) | (1U << riscv_arch::MSTATUS_MXR);
+    static const target_ulong s_irqs = (1U << riscv_arch::IRQ_SSI) | (1U << riscv_arch::IRQ_STI) | (1U << riscv_arch::IRQ_SEI);
+    static const target_ulong m_irqs = s_irqs | (1U << riscv_arch::IRQ_MSI) | (1U << riscv_arch::IRQ_MTI) | (1U << riscv_arch::IRQ_MEI);
+    const target_ulong mstatus = get_reg_func(riscv_arch::REG_MSTATUS);
+    const target_ulong mideleg = get_reg_func(riscv_arch::REG_MIDELEG);
+    switch(csr){
+        case 0x100: set_reg_func(riscv_arch::REG_MSTATUS, (mstatus & ~sstatus_mask) | (val & sstatus_mask)); break;
+        case 0x104: set_reg_func(riscv_arch::REG_MIE, (get_reg_func(riscv_arch::REG_MIE) & ~mideleg) | (val & mideleg)); break;
+        case 0x105: set_reg_func(riscv_arch::REG_STVEC, val & ~static_cast<target_ulong>(2)); break; //direct or vectored
+        case 0x140: set_reg_func(riscv_arch::REG_SSCRATCH, val); break;
+        case 0x141: set_reg_func(riscv_arch::REG_SEPC, val & ~static_cast<target_ulong>(1)); break;
+        case 0x142: set_reg_func(riscv_arch::REG_SCAUSE, val); break;
+        case 0x143: set_reg_func(riscv_arch::REG_STVAL, val); break;
+        case 0x144: //sip, only SSIP is writable
+            {
+                const uint64_t mask = mideleg & (1U << riscv_arch::IRQ_SSI);
+                __atomic_fetch_and(&state.hdr.pending_irqs, ~mask, __ATOMIC_ACQ_REL);
+                __atomic_fetch_or(&state.hdr.pending_irqs, val & mask, __ATOMIC_ACQ_REL);
+            }
+            break;
+        case 0x300:
+            {
+                target_ulong new_mstatus = (mstatus & ~mstatus_mask) | (val & mstatus_mask);
+                if(bit_sub<riscv_arch::MSTATUS_MPP_SHIFT, 2>(new_mstatus) == 2){//reserved, keeps the previous one
+                    new_mstatus = (new_mstatus & ~(3U << riscv_arch::MSTATUS_MPP_SHIFT)) | (mstatus & (3U << riscv_arch::MSTATUS_MPP_SHIFT));
+                }
+                set_reg_func(riscv_arch::REG_MSTATUS, new_mstatus);
+            }
+            break;
+        case 0x302: set_reg_func(riscv_arch::REG_MEDELEG, val & ~(1U << riscv_arch::EXC_ECALL_M) & 0xFFFF); break;
+        case 0x303: set_reg_func(riscv_arch::REG_MIDELEG, val & s_irqs); break;
+        case 0x304: set_reg_func(riscv_arch::REG_MIE, val & m_irqs); break;
+        case 0x305: set_reg_func(riscv_arch::REG_MTVEC, val & ~static_cast<target_ulong>(2)); break;
+        case 0x340: set_reg_func(riscv_arch::REG_MSCRATCH, val); break;
+        case 0x341: set_reg_func(riscv_arch::REG_MEPC, val & ~static_cast<target_ulong>(1)); break;
+        case 0x342: set_reg_func(riscv_arch::REG_MCAUSE, val); break;
+        case 0x343: set_reg_func(riscv_arch::REG_MTVAL, val); break;
+        case 0x344: //mip, the supervisor bits are writable
+            __atomic_fetch_and(&state.hdr.pending_irqs, ~static_cast<uint64_t>(s_irqs), __ATOMIC_ACQ_REL);
+            __atomic_fetch_or(&state.hdr.pending_irqs, val & s_irqs, __ATOMIC_ACQ_REL);
+            break;
+        default: //the others are read only or ignore writes
+            break;
+    }
+}
+
+target_ulong riscv_vm::take_trap(target_ulong cause, target_ulong epc, target_ulong tval){
+    const target_ulong priv = get_reg_func(riscv_arch::REG_PRIV);
+    const target_ulong mstatus = get_reg_func(riscv_arch::REG_MSTATUS);
+    const bool is_interrupt = (cause & riscv_arch::cause_interrupt) != 0;
+    const unsigned int code = static_cast<unsigned int>(cause & 63);
+    const target_ulong deleg = get_reg_func(is_interrupt ? riscv_arch::REG_MIDELEG : riscv_arch::REG_MEDELEG);
+    target_ulong tvec;
+    if(priv <= riscv_arch::PRIV_S && ((deleg >> code) & 1)){
+        set_reg_func(riscv_arch::REG_SEPC, epc);
+        set_reg_func(riscv_arch::REG_SCAUSE, cause);
+        set_reg_func(riscv_arch::REG_STVAL, tval);
+        target_ulong new_mstatus = mstatus & ~((1U << riscv_arch::MSTATUS_SIE) | (1U << riscv_arch::MSTATUS_SPIE) | (1U << riscv_arch::MSTATUS_SPP));
+        new_mstatus |= (bit_sub<riscv_arch::MSTATUS_SIE, 1>(mstatus) << riscv_arch::MSTATUS_SPIE) | (priv << riscv_arch::MSTATUS_SPP);
+        set_reg_func(riscv_arch::REG_MSTATUS, new_mstatus);
+        set_reg_func(riscv_arch::REG_PRIV, riscv_arch::PRIV_S);
+        tvec = get_reg_func(riscv_arch::REG_STVEC);
     }
+    else{
+        set_reg_func(riscv_arch::REG_MEPC, epc);
+        set_reg_func(riscv_arch::REG_MCAUSE, cause);
+        set_reg_func(riscv_arch::REG_MTVAL, tval);
+        target_ulong new_mstatus = mstatus & ~((1U << riscv_arch::MSTATUS_MIE) | (1U << riscv_arch::MSTATUS_MPIE) | (3U << riscv_arch::MSTATUS_MPP_SHIFT));
+        new_mstatus |= (bit_sub<riscv_arch::MSTATUS_MIE, 1>(mstatus) << riscv_arch::MSTATUS_MPIE) | (priv << riscv_arch::MSTATUS_MPP_SHIFT);
+        set_reg_func(riscv_arch::REG_MSTATUS, new_mstatus);
+        set_reg_func(riscv_arch::REG_PRIV, riscv_arch::PRIV_M);
+        tvec = get_reg_func(riscv_arch::REG_MTVEC);
+    }
+    set_reg_func(riscv_arch::REG_RESERVE_ADDR, ~static_cast<target_ulong>(0));
+    const target_ulong base = tvec & ~static_cast<target_ulong>(3);
+    return (is_interrupt && (tvec & 1)) ? base + 4 * code : base;
+}
+
+//Called at block boundaries when an enabled interrupt is pending, pc is where the interrupted context resumes
+virt_addr_t riscv_vm::check_interrupts(virt_addr_t pc){
+    static const unsigned int priority[] = {
+        riscv_arch::IRQ_MEI, riscv_arch::IRQ_MSI, riscv_arch::IRQ_MTI, riscv_arch::IRQ_SEI, riscv_arch::IRQ_SSI, riscv_arch::IRQ_STI
+    };
+    const target_ulong pending = __atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_ACQUIRE) & get_reg_func(riscv_arch::REG_MIE);
+    const target_ulong priv = get_reg_func(riscv_arch::REG_PRIV);
+    const target_ulong mstatus = get_reg_func(riscv_arch::REG_MSTATUS);
+    const target_ulong mideleg = get_reg_func(riscv_arch::REG_MIDELEG);
+    const bool m_enabled = priv < riscv_arch::PRIV_M || bit_sub<riscv_arch::MSTATUS_MIE, 1>(mstatus);
+    const bool s_enabled = priv < riscv_arch::PRIV_S || (priv == riscv_arch::PRIV_S && bit_sub<riscv_arch::MSTATUS_SIE, 1>(mstatus));
+    for(unsigned int i = 0; i < sizeof(priority) / sizeof(priority[0]); ++i){
+        const target_ulong bit = static_cast<target_ulong>(1) << priority[i];
+        if(!(pending & bit)) continue;
+        if((mideleg & bit) ? s_enabled : m_enabled){
+            const target_ulong vec = take_trap(riscv_arch::cause_interrupt | priority[i], pc, 0);
+            set_reg_func(riscv_arch::REG_PC, vec);
+            set_reg_func(riscv_arch::REG_PNEXT_PC, vec);
+            return virt_addr_t(vec);
+        }
+    }
+    return pc;
+}
+
+bool riscv_vm::disas_insn_atomic(const vm::decoded_insn &d, insn_op_e op)
+{//aq and rl are ignored as all of them are sequentially consistent
+    using llvm::AtomicRMWInst;
+    const unsigned int len = op >= OP_LR_D ? 8 : 4; //the .d rows follow the .w ones
+    const riscv_arch::reg_e dest = get_reg_id(d.rd);
+    llvm::Value *const addr = gen_get_reg(get_reg_id(d.rs1), "amo");
+    llvm::Value *const src = gen_get_reg(get_reg_id(d.rs2), "amo");
+    llvm::Value *old = NULL;
+    switch(op){
+        case OP_LR_W:
+        case OP_LR_D:
+            {
+                old = gen_lw(addr, len, "lr");
+                gen_set_reg(riscv_arch::REG_RESERVE_ADDR, addr);
+                gen_set_reg(riscv_arch::REG_RESERVE_VAL, builder->CreateZExt(old, get_reg_type()));
+            }
+            break;
+        case OP_SC_W:
+        case OP_SC_D:
+            {//succeeds if the reservation is for this address, and in parallel mode if the memory still holds the loaded value
+                static const char *const mn = "sc";
+                llvm::Value *const reserve_val = gen_get_reg(riscv_arch::REG_RESERVE_VAL, mn);
+                llvm::Value *const valid = builder->CreateICmpEQ(gen_get_reg(riscv_arch::REG_RESERVE_ADDR, mn), addr, mn);
+                llvm::BasicBlock *const entry = cur_bb;
+                llvm::BasicBlock *const do_store = llvm::BasicBlock::Create(*context, "sc_store", cur_func);
+                llvm::BasicBlock *const join = llvm::BasicBlock::Create(*context, "sc_end", cur_func);
+                builder->CreateCondBr(valid, do_store, join);
+                builder->SetInsertPoint(do_store);
+                cur_bb = do_store;
+                llvm::Value *stored = NULL;
+                if(parallel){
+                    llvm::Value *const prev = gen_atomic_cmpxchg(addr, len, reserve_val, src);
+                    stored = builder->CreateICmpEQ(builder->CreateZExt(prev, get_reg_type()), reserve_val, mn);
+                }
+                else{//only this hart writes the memory
+                    gen_sw(addr, len, src);
+                    stored = llvm::ConstantInt::getTrue(*context);
+                }
+                llvm::BasicBlock *const stored_bb = cur_bb;
+                builder->CreateBr(join);
+                builder->SetInsertPoint(join);
+                cur_bb = join;
+                llvm::PHINode *const success = builder->CreatePHI(llvm::Type::getInt1Ty(*context), 2, mn);
+                success->addIncoming(llvm::ConstantInt::getFalse(*context), entry);
+                success->addIncoming(stored, stored_bb);
+                gen_set_reg(dest, builder->CreateSelect(success, gen_const(0), gen_const(1), mn));
+                gen_set_reg(riscv_arch::REG_RESERVE_ADDR, gen_const(~static_cast<target_ulong>(0)));
+            }
+            return false;
+        case OP_AMOSWAP_W: case OP_AMOSWAP_D: old = gen_atomic_rmw(AtomicRMWInst::Xchg, addr, len, src); break;
+        case OP_AMOADD_W: case OP_AMOADD_D: old = gen_atomic_rmw(AtomicRMWInst::Add, addr, len, src); break;
+        case OP_AMOXOR_W: case OP_AMOXOR_D: old = gen_atomic_rmw(AtomicRMWInst::Xor, addr, len, src); break;
+        case OP_AMOAND_W: case OP_AMOAND_D: old = gen_atomic_rmw(AtomicRMWInst::And, addr, len, src); break;
+        case OP_AMOOR_W: case OP_AMOOR_D: old = gen_atomic_rmw(AtomicRMWInst::Or, addr, len, src); break;
+        case OP_AMOMIN_W: case OP_AMOMIN_D: old = gen_atomic_rmw(AtomicRMWInst::Min, addr, len, src); break;
+        case OP_AMOMAX_W: case OP_AMOMAX_D: old = gen_atomic_rmw(AtomicRMWInst::Max, addr, len, src); break;
+        case OP_AMOMINU_W: case OP_AMOMINU_D: old = gen_atomic_rmw(AtomicRMWInst::UMin, addr, len, src); break;
+        case OP_AMOMAXU_W: case OP_AMOMAXU_D: old = gen_atomic_rmw(AtomicRMWInst::UMax, addr, len, src); break;
+        default:
+            jcpu_assert(!"Never comes here");
+    }
+    gen_set_reg(dest, builder->CreateSExt(old, get_reg_type(), "amo"));
     return false;
 }
 
+bool riscv_vm::disas_insn_fence(const vm::decoded_insn &, insn_op_e)
+{
+    gen_fence();
+    return false;
+}
+
+//Stores to translated code are seen only from the next block, and the other harts may still run blocks of the old code.
+//fence.i ends the block and drops the blocks and the decoded instructions of all harts.
+bool riscv_vm::disas_insn_fence_i(const vm::decoded_insn &, insn_op_e)
+{
+    std::vector<llvm::Type *> types;
+    types.push_back(llvm::PointerType::getUnqual(builder->getInt8Ty()));
+    builder->CreateCall(declare_host_func("jcpu_riscv_fence_i", llvm::Type::getVoidTy(*context), types,
+                reinterpret_cast<void *>(&jcpu_riscv_fence_i)), cur_state);
+    gen_set_reg(riscv_arch::REG_PNEXT_PC, gen_const(job.processing_pc.top().first + cur_insn_len));
+    return true;
+}
+
+extern "C" void jcpu_riscv_fence_i(void *state){
+    static_cast<riscv_vm *>(static_cast<vm::cpu_state_header *>(state)->vm)->exec_fence_i();
+}
+
+llvm::Value *riscv_vm::gen_get_freg(riscv_arch::reg_e reg, bool is_double, const char *mn){
+    llvm::Value *const raw = gen_get_reg(reg, mn);
+    if(is_double) return raw;
+    //single values which are not NaN boxed are read as the canonical NaN
+    llvm::Value *const boxed = builder->CreateICmpEQ(builder->CreateLShr(raw, gen_const(32), mn), gen_const(0xFFFFFFFF), mn);
+    return builder->CreateSelect(boxed, builder->CreateAnd(raw, gen_const(0xFFFFFFFF), mn), gen_const(0x7FC00000), mn);
+}
+
+void riscv_vm::gen_set_freg(riscv_arch::reg_e reg, llvm::Value *val, bool is_double){
+    if(is_double){
+        gen_set_reg(reg, val);
+    }
+    else{
+        static const char *const mn = "nan_box";
+        llvm::Value *const low = builder->CreateZExt(builder->CreateTrunc(val, builder->getInt32Ty(), mn), get_reg_type(), mn);
+        gen_set_reg(reg, builder->CreateOr(low, gen_const(0xFFFFFFFF00000000ULL), mn));
+    }
+}
+
+//Operations run natively if the rounding mode is the one of the host instruction.
+//Their flags are the sticky flags of the host, which are cleared before the first of them and folded into fcsr by gen_fold_fp_flags()
+//before fcsr is accessed and at the end of the block. Flags the host does not raise as RISC-V does are added here.
+//Otherwise jcpu_fp_exact() is called, which takes the rounding mode into account and accumulates the flags into fcsr.
+llvm::Value *riscv_vm::gen_fp_op(vm::fp_op_e op, bool is_double, unsigned int rm, llvm::Value *a, llvm::Value *b, llvm::Value *c){
+    using namespace llvm;
+    static const char *const mn = "fp";
+    const bool rm_independent = op == vm::FP_MIN || op == vm::FP_MAX || op == vm::FP_EQ || op == vm::FP_LT || op == vm::FP_LE ||
+        (op == vm::FP_TO_OTHER && !is_double);
+    const unsigned int native_rm = (vm::FP_TO_I32 <= op && op <= vm::FP_TO_U64) ? vm::FP_RM_RTZ : vm::FP_RM_RNE;
+    //an operation on constants would be folded when translated, so it would raise no flag
+    const bool constant = isa<Constant>(a) && (!b || isa<Constant>(b)) && (!c || isa<Constant>(c));
+    riscv_insn_assert(rm_independent || rm <= vm::FP_RM_RMM || rm == 7);
+    Value *const fcsr = gen_get_reg(riscv_arch::REG_FCSR, mn);
+    Value *const rm_val = builder->CreateTrunc(rm == 7 && !rm_independent ?
+            builder->CreateLShr(builder->CreateAnd(fcsr, gen_const(riscv_arch::FCSR_FRM), mn), gen_const(riscv_arch::FCSR_FRM_SHIFT), mn) :
+            gen_const(rm), builder->getInt32Ty(), mn);
+    if(constant || (!rm_independent && rm != 7 && rm != native_rm)){
+        Value *flags = JCPU_NULLPTR;
+        Value *const result = gen_fp_exact(op, is_double, a, b, c, rm_val, &flags);
+        gen_set_reg(riscv_arch::REG_FCSR, builder->CreateOr(fcsr, builder->CreateZExt(flags, get_reg_type(), mn), mn));
+        return result;
+    }
+    if(!fp_keep){
+        gen_fp_clear_host_flags();
+        fp_keep = ConstantInt::get(builder->getInt64Ty(), 0);
+    }
+    if(rm_independent || rm != 7){
+        Value *invalid = JCPU_NULLPTR;
+        Value *const result = gen_fp_native(op, is_double, a, b, c, &invalid);
+        if(invalid){
+            gen_set_reg(riscv_arch::REG_FCSR, builder->CreateOr(fcsr, builder->CreateSelect(invalid, gen_const(vm::FP_FLAG_NV), gen_const(0), mn), mn));
+        }
+        fp_keep = builder->CreateXor(fp_keep, result, mn);
+        return result;
+    }
+    //dynamic rounding mode
+    BasicBlock *const fast = BasicBlock::Create(*context, "fp_native", cur_func);
+    BasicBlock *const slow = BasicBlock::Create(*context, "fp_exact", cur_func);
+    BasicBlock *const join = BasicBlock::Create(*context, "fp_end", cur_func);
+    builder->CreateCondBr(builder->CreateICmpEQ(builder->CreateAnd(fcsr, gen_const(riscv_arch::FCSR_FRM), mn),
+                gen_const(native_rm << riscv_arch::FCSR_FRM_SHIFT), mn), fast, slow);
+
+    builder->SetInsertPoint(fast);
+    Value *invalid = JCPU_NULLPTR;
+    Value *const fast_result = gen_fp_native(op, is_double, a, b, c, &invalid);
+    Value *const fast_fcsr = invalid ? builder->CreateOr(fcsr, builder->CreateSelect(invalid, gen_const(vm::FP_FLAG_NV), gen_const(0), mn), mn) : fcsr;
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(slow);
+    Value *flags = JCPU_NULLPTR;
+    Value *const slow_result = gen_fp_exact(op, is_double, a, b, c, rm_val, &flags);
+    Value *const slow_fcsr = builder->CreateOr(fcsr, builder->CreateZExt(flags, get_reg_type(), mn), mn);
+    builder->CreateBr(join);
+
+    builder->SetInsertPoint(join);
+    cur_bb = join;
+    PHINode *const result = builder->CreatePHI(builder->getInt64Ty(), 2, mn);
+    result->addIncoming(fast_result, fast);
+    result->addIncoming(slow_result, slow);
+    PHINode *const new_fcsr = builder->CreatePHI(get_reg_type(), 2, mn);
+    new_fcsr->addIncoming(fast_fcsr, fast);
+    new_fcsr->addIncoming(slow_fcsr, slow);
+    gen_set_reg(riscv_arch::REG_FCSR, new_fcsr);
+    fp_keep = builder->CreateXor(fp_keep, result, mn);
+    return result;
+}
+
+void riscv_vm::gen_fold_fp_flags(){
+    if(!fp_keep) return;
+    static const char *const mn = "fp_flags";
+    llvm::Value *const flags = builder->CreateZExt(gen_fp_host_flags(fp_keep), get_reg_type(), mn);
+    gen_set_reg(riscv_arch::REG_FCSR, builder->CreateOr(gen_get_reg(riscv_arch::REG_FCSR, mn), flags, mn));
+    fp_keep = JCPU_NULLPTR;
+}
+
+llvm::Value *riscv_vm::gen_fclass(llvm::Value *val, bool is_double){
+    static const char *const mn = "fclass";
+    const unsigned int mant_bits = is_double ? 52 : 23;
+    const target_ulong exp_max = is_double ? 0x7FF : 0xFF;
+    llvm::Value *const negative = builder->CreateICmpNE(builder->CreateLShr(val, gen_const(is_double ? 63 : 31), mn), gen_const(0), mn);
+    llvm::Value *const exp = builder->CreateAnd(builder->CreateLShr(val, gen_const(mant_bits), mn), gen_const(exp_max), mn);
+    llvm::Value *const mant = builder->CreateAnd(val, gen_const((static_cast<target_ulong>(1) << mant_bits) - 1), mn);
+    llvm::Value *const exp_is_max = builder->CreateICmpEQ(exp, gen_const(exp_max), mn);
+    llvm::Value *const exp_is_zero = builder->CreateICmpEQ(exp, gen_const(0), mn);
+    llvm::Value *const mant_is_zero = builder->CreateICmpEQ(mant, gen_const(0), mn);
+    llvm::Value *const quiet = builder->CreateICmpNE(builder->CreateLShr(mant, gen_const(mant_bits - 1), mn), gen_const(0), mn);
+    llvm::Value *const is_inf = builder->CreateAnd(exp_is_max, mant_is_zero, mn);
+    llvm::Value *const is_nan = builder->CreateAnd(exp_is_max, builder->CreateICmpNE(mant, gen_const(0), mn), mn);
+    llvm::Value *const is_zero = builder->CreateAnd(exp_is_zero, mant_is_zero, mn);
+    llvm::Value *const is_subnormal = builder->CreateAnd(exp_is_zero, builder->CreateICmpNE(mant, gen_const(0), mn), mn);
+    //the class of a NaN does not depend on the sign, others are (negative, positive) pairs
+    llvm::Value *const cls = builder->CreateSelect(is_nan, builder->CreateSelect(quiet, gen_const(9), gen_const(8), mn),
+            builder->CreateSelect(is_inf, gen_const(0), builder->CreateSelect(is_zero, gen_const(3),
+                    builder->CreateSelect(is_subnormal, gen_const(2), gen_const(1), mn), mn), mn), mn);
+    llvm::Value *const signed_cls = builder->CreateSelect(is_nan, cls,
+            builder->CreateSelect(negative, cls, builder->CreateSub(gen_const(7), cls, mn), mn), mn);
+    return builder->CreateShl(gen_const(1), signed_cls, mn);
+}
+
+bool riscv_vm::disas_insn_fp_load(const vm::decoded_insn &d, insn_op_e op)
+{
+    const char *const mn = insn_table[op].name;
+    const bool is_double = op == OP_FLD;
+    llvm::Value *const base = gen_get_reg(get_reg_id(d.rs1));
+    llvm::Value *const addr = builder->CreateAdd(gen_const(d.imm), base, mn);
+    llvm::Value *const dat = gen_lw(addr, is_double ? 8 : 4, mn);
+    gen_set_freg(get_freg_id(d.rd), builder->CreateZExt(dat, get_reg_type(), mn), is_double);
+    return false;
+}
+
+bool riscv_vm::disas_insn_fp_store(const vm::decoded_insn &d, insn_op_e op)
+{
+    const char *const mn = insn_table[op].name;
+    const bool is_double = op == OP_FSD;
+    llvm::Value *const val = gen_get_reg(get_freg_id(d.rs2)); //stored without unboxing
+    llvm::Value *const base = gen_get_reg(get_reg_id(d.rs1));
+    llvm::Value *const addr = builder->CreateAdd(gen_const(d.imm), base, mn);
+    gen_sw(addr, is_double ? 8 : 4, is_double ? val : builder->CreateTrunc(val, builder->getInt32Ty(), mn));
+    return false;
+}
+
+bool riscv_vm::disas_insn_fp_fma(const vm::decoded_insn &d, insn_op_e op)
+{
+    const bool is_double = op >= OP_FMADD_D; //the D rows follow the F ones
+    vm::fp_op_e fp_op = vm::FP_MADD;
+    switch(op){
+        case OP_FMADD_S: case OP_FMADD_D: fp_op = vm::FP_MADD; break;
+        case OP_FMSUB_S: case OP_FMSUB_D: fp_op = vm::FP_MSUB; break;
+        case OP_FNMSUB_S: case OP_FNMSUB_D: fp_op = vm::FP_NMSUB; break;
+        case OP_FNMADD_S: case OP_FNMADD_D: fp_op = vm::FP_NMADD; break;
+        default: jcpu_assert(!"Never comes here");
+    }
+    llvm::Value *const a = gen_get_freg(get_freg_id(d.rs1), is_double, "fma");
+    llvm::Value *const b = gen_get_freg(get_freg_id(d.rs2), is_double, "fma");
+    llvm::Value *const c = gen_get_freg(get_freg_id(d.rs3), is_double, "fma");
+    gen_set_freg(get_freg_id(d.rd), gen_fp_op(fp_op, is_double, bit_sub<12, 3>(d.raw), a, b, c), is_double);
+    return false;
+}
+
+bool riscv_vm::disas_insn_fp(const vm::decoded_insn &d, insn_op_e op)
+{
+    const unsigned int rm = bit_sub<12, 3>(d.raw); //rounding mode for most of them
+    const bool is_double = op >= OP_FMADD_D; //the D rows follow the F ones
+    const riscv_arch::reg_e fd = get_freg_id(d.rd);
+    const riscv_arch::reg_e rd = get_reg_id(d.rd);
+    const char *const mn = insn_table[op].name;
+    switch(op){
+        case OP_FADD_S: case OP_FADD_D:
+        case OP_FSUB_S: case OP_FSUB_D:
+        case OP_FMUL_S: case OP_FMUL_D:
+        case OP_FDIV_S: case OP_FDIV_D:
+            {
+                const vm::fp_op_e fp_op = (op == OP_FADD_S || op == OP_FADD_D) ? vm::FP_ADD : (op == OP_FSUB_S || op == OP_FSUB_D) ? vm::FP_SUB :
+                    (op == OP_FMUL_S || op == OP_FMUL_D) ? vm::FP_MUL : vm::FP_DIV;
+                llvm::Value *const a = gen_get_freg(get_freg_id(d.rs1), is_double, mn);
+                llvm::Value *const b = gen_get_freg(get_freg_id(d.rs2), is_double, mn);
+                gen_set_freg(fd, gen_fp_op(fp_op, is_double, rm, a, b), is_double);
+            }
+            break;
+        case OP_FSQRT_S: case OP_FSQRT_D:
+            gen_set_freg(fd, gen_fp_op(vm::FP_SQRT, is_double, rm, gen_get_freg(get_freg_id(d.rs1), is_double, mn)), is_double);
+            break;
+        case OP_FSGNJ_S: case OP_FSGNJ_D:
+        case OP_FSGNJN_S: case OP_FSGNJN_D:
+        case OP_FSGNJX_S: case OP_FSGNJX_D:
+            {
+                const target_ulong sign = static_cast<target_ulong>(1) << (is_double ? 63 : 31);
+                llvm::Value *const a = gen_get_freg(get_freg_id(d.rs1), is_double, mn);
+                llvm::Value *const b = gen_get_freg(get_freg_id(d.rs2), is_double, mn);
+                llvm::Value *const b_sign = builder->CreateAnd(b, gen_const(sign), mn);
+                llvm::Value *r = NULL;
+                if(op == OP_FSGNJX_S || op == OP_FSGNJX_D){
+                    r = builder->CreateXor(a, b_sign, mn);
+                }
+                else{
+                    llvm::Value *const new_sign = (op == OP_FSGNJ_S || op == OP_FSGNJ_D) ? b_sign : builder->CreateXor(b_sign, gen_const(sign), mn);
+                    r = builder->CreateOr(builder->CreateAnd(a, gen_const(~sign), mn), new_sign, mn);
+                }
+                gen_set_freg(fd, r, is_double);
+            }
+            break;
+        case OP_FMIN_S: case OP_FMIN_D:
+        case OP_FMAX_S: case OP_FMAX_D:
+            {
+                const vm::fp_op_e fp_op = (op == OP_FMIN_S || op == OP_FMIN_D) ? vm::FP_MIN : vm::FP_MAX;
+                llvm::Value *const a = gen_get_freg(get_freg_id(d.rs1), is_double, mn);
+                llvm::Value *const b = gen_get_freg(get_freg_id(d.rs2), is_double, mn);
+                gen_set_freg(fd, gen_fp_op(fp_op, is_double, rm, a, b), is_double);
+            }
+            break;
+        case OP_FCVT_S_D:
+        case OP_FCVT_D_S:
+            {
+                const bool from_double = op == OP_FCVT_S_D;
+                llvm::Value *const a = gen_get_freg(get_freg_id(d.rs1), from_double, mn);
+                gen_set_freg(fd, gen_fp_op(vm::FP_TO_OTHER, from_double, rm, a), is_double);
+            }
+            break;
+        case OP_FEQ_S: case OP_FEQ_D:
+        case OP_FLT_S: case OP_FLT_D:
+        case OP_FLE_S: case OP_FLE_D:
+            {
+                const vm::fp_op_e fp_op = (op == OP_FEQ_S || op == OP_FEQ_D) ? vm::FP_EQ : (op == OP_FLT_S || op == OP_FLT_D) ? vm::FP_LT : vm::FP_LE;
+                llvm::Value *const a = gen_get_freg(get_freg_id(d.rs1), is_double, mn);
+                llvm::Value *const b = gen_get_freg(get_freg_id(d.rs2), is_double, mn);
+                gen_set_reg(rd, gen_fp_op(fp_op, is_double, rm, a, b));
+            }
+            break;
+        case OP_FCVT_W_S: case OP_FCVT_W_D:
+        case OP_FCVT_WU_S: case OP_FCVT_WU_D:
+        case OP_FCVT_L_S: case OP_FCVT_L_D:
+        case OP_FCVT_LU_S: case OP_FCVT_LU_D:
+            {
+                const vm::fp_op_e fp_op = (op == OP_FCVT_W_S || op == OP_FCVT_W_D) ? vm::FP_TO_I32 : (op == OP_FCVT_WU_S || op == OP_FCVT_WU_D) ? vm::FP_TO_U32 :
+                    (op == OP_FCVT_L_S || op == OP_FCVT_L_D) ? vm::FP_TO_I64 : vm::FP_TO_U64;
+                gen_set_reg(rd, gen_fp_op(fp_op, is_double, rm, gen_get_freg(get_freg_id(d.rs1), is_double, mn)));
+            }
+            break;
+        case OP_FCVT_S_W: case OP_FCVT_D_W:
+        case OP_FCVT_S_WU: case OP_FCVT_D_WU:
+        case OP_FCVT_S_L: case OP_FCVT_D_L:
+        case OP_FCVT_S_LU: case OP_FCVT_D_LU:
+            {
+                const vm::fp_op_e fp_op = (op == OP_FCVT_S_W || op == OP_FCVT_D_W) ? vm::FP_FROM_I32 : (op == OP_FCVT_S_WU || op == OP_FCVT_D_WU) ? vm::FP_FROM_U32 :
+                    (op == OP_FCVT_S_L || op == OP_FCVT_D_L) ? vm::FP_FROM_I64 : vm::FP_FROM_U64;
+                gen_set_freg(fd, gen_fp_op(fp_op, is_double, rm, gen_get_reg(get_reg_id(d.rs1), mn)), is_double);
+            }
+            break;
+        case OP_FMV_X_W:
+        case OP_FMV_X_D:
+            {
+                llvm::Value *const raw = gen_get_reg(get_freg_id(d.rs1), mn);
+                gen_set_reg(rd, is_double ? raw : builder->CreateSExt(builder->CreateTrunc(raw, builder->getInt32Ty(), mn), get_reg_type(), mn));
+            }
+            break;
+        case OP_FCLASS_S: case OP_FCLASS_D:
+            gen_set_reg(rd, gen_fclass(gen_get_freg(get_freg_id(d.rs1), is_double, mn), is_double));
+            break;
+        case OP_FMV_W_X:
+        case OP_FMV_D_X:
+            gen_set_freg(fd, gen_get_reg(get_reg_id(d.rs1), mn), is_double);
+            break;
+        default:
+            jcpu_assert(!"Never comes here");
+    }
+    return false;
+}
+
+bool riscv_vm::disas_insn_vsetvl(const vm::decoded_insn &d, insn_op_e op)
+{
+    static const char *const mn = "vsetvl";
+    const riscv_arch::reg_e rd = get_reg_id(d.rd), rs1 = get_reg_id(d.rs1);
+    llvm::Value *vtype, *vlmax, *avl = JCPU_NULLPTR;
+    if(op != OP_VSETVL){
+        const bool is_imm = op == OP_VSETIVLI;
+        cur_vtype = valid_vtype(d.imm & (is_imm ? 0x3FF : 0x7FF)); //zimm
+        vtype = gen_const(cur_vtype);
+        vlmax = gen_const(cur_vtype == riscv_arch::vtype_vill ? 0 : get_vlmax(cur_vtype));
+        if(is_imm) avl = gen_const(d.rs1); //uimm
+    }
+    else{
+        cur_vtype = riscv_arch::vtype_unknown;
+        llvm::Value *const req = gen_get_reg(get_reg_id(d.rs2), mn);
+        llvm::Value *const lmul = builder->CreateAnd(req, 7, mn);
+        llvm::Value *const sew = builder->CreateAnd(builder->CreateLShr(req, 3, mn), 7, mn);
+        llvm::Value *const valid = builder->CreateAnd(builder->CreateICmpEQ(builder->CreateLShr(req, 8, mn), gen_const(0), mn),
+                builder->CreateAnd(builder->CreateICmpULE(lmul, gen_const(3), mn), builder->CreateICmpULE(sew, gen_const(3), mn), mn), mn);
+        vtype = builder->CreateSelect(valid, req, gen_const(riscv_arch::vtype_vill), mn);
+        vlmax = builder->CreateSelect(valid, builder->CreateLShr(builder->CreateShl(gen_const(riscv_arch::vlen_bits / 8), lmul, mn), sew, mn), gen_const(0), mn);
+    }
+    if(!avl){
+        if(rs1 != riscv_arch::REG_ZERO) avl = gen_get_reg(rs1, mn);
+        else if(rd != riscv_arch::REG_ZERO) avl = vlmax;
+        else avl = gen_get_reg(riscv_arch::REG_VL, mn); //keeps vl
+    }
+    llvm::Value *const vl = builder->CreateSelect(builder->CreateICmpULT(avl, vlmax, mn), avl, vlmax, mn);
+    gen_set_reg(riscv_arch::REG_VTYPE, vtype);
+    gen_set_reg(riscv_arch::REG_VL, vl);
+    gen_set_reg(rd, vl);
+    return false;
+}
+
+bool riscv_vm::disas_insn_vector(const vm::decoded_insn &d, insn_op_e insn_op)
+{
+    using namespace llvm;
+    const char *const mn = insn_table[insn_op].name;
+    vector_src_e src_kind;
+    const vector_op_e op = get_vector_op(insn_op, src_kind);
+    const unsigned int vd = d.rd, vs1 = d.rs1, vs2 = d.rs2;
+    if(cur_vtype == riscv_arch::vtype_unknown){
+        gen_vector_exec(d, insn_op, op == V_MV_X_S);
+        return false;
+    }
+    riscv_insn_assert(cur_vtype != riscv_arch::vtype_vill);
+    const unsigned int sew = 8 << bit_sub<3, 3>(cur_vtype);
+    const unsigned int lmul = 1 << bit_sub<0, 3>(cur_vtype);
+    const unsigned int num = get_vlmax(cur_vtype);
+    Type *const elem_type = IntegerType::get(*context, sew);
+    Value *const lane0 = ConstantInt::get(builder->getInt32Ty(), 0);
+    switch(op){
+        case V_MV_X_S:
+            gen_set_reg(get_reg_id(d.rd), builder->CreateSExt(builder->CreateExtractElement(gen_get_vreg(vs2, 1, sew), lane0, mn), get_reg_type(), mn));
+            break;
+        case V_MV_S_X:
+            {
+                Value *const vl_is_zero = builder->CreateICmpEQ(gen_get_reg(riscv_arch::REG_VL, mn), gen_const(0), mn);
+                Value *const old = gen_get_vreg(vd, 1, sew);
+                Value *const val = builder->CreateTrunc(gen_get_reg(get_reg_id(d.rs1), mn), elem_type, mn);
+                gen_set_vreg(vd, 1, builder->CreateSelect(vl_is_zero, old, builder->CreateInsertElement(old, val, lane0, mn), mn));
+            }
+            break;
+        case V_REDSUM:
+        case V_REDAND:
+        case V_REDOR:
+        case V_REDXOR:
+            {
+                //elements after vl are replaced by the identity, then halves are combined
+                Constant *const identity = op == V_REDAND ? Constant::getAllOnesValue(elem_type) : Constant::getNullValue(elem_type);
+                Value *v = builder->CreateSelect(gen_vl_mask(num), gen_get_vreg(vs2, lmul, sew), gen_splat(identity, num), mn);
+                for(unsigned int half = num / 2; half > 0; half /= 2){
+                    std::vector<Constant *> upper;
+                    for(unsigned int i = 0; i < num; ++i){
+                        upper.push_back(ConstantInt::get(builder->getInt32Ty(), i < half ? i + half : 0));
+                    }
+                    v = gen_vector_op(op, v, builder->CreateShuffleVector(v, UndefValue::get(v->getType()), ConstantVector::get(upper), mn), JCPU_NULLPTR);
+                }
+                Value *const acc = builder->CreateExtractElement(gen_get_vreg(vs1, 1, sew), lane0, mn);
+                Value *const result = gen_vector_op(op, builder->CreateExtractElement(v, lane0, mn), acc, JCPU_NULLPTR);
+                Value *const vl_is_zero = builder->CreateICmpEQ(gen_get_reg(riscv_arch::REG_VL, mn), gen_const(0), mn);
+                Value *const old = gen_get_vreg(vd, 1, sew);
+                gen_set_vreg(vd, 1, builder->CreateSelect(vl_is_zero, old, builder->CreateInsertElement(old, result, lane0, mn), mn));
+            }
+            break;
+        default:
+            {
+                Value *const src = op == V_MV ? JCPU_NULLPTR : gen_get_vreg(vs2, lmul, sew);
+                Value *op1;
+                if(src_kind == VSRC_V){
+                    op1 = gen_get_vreg(vs1, lmul, sew);
+                }
+                else if(src_kind == VSRC_I){
+                    op1 = gen_splat(ConstantInt::get(elem_type, d.imm, true), num);
+                }
+                else{
+                    op1 = gen_splat(builder->CreateTrunc(gen_get_reg(get_reg_id(d.rs1), mn), elem_type, mn), num);
+                }
+                Value *const old = gen_get_vreg(vd, lmul, sew);
+                gen_set_vreg(vd, lmul, builder->CreateSelect(gen_vl_mask(num), gen_vector_op(op, src, op1, old), old, mn));
+            }
+            break;
+    }
+    return false;
+}
+
+bool riscv_vm::disas_insn_vector_mem(const vm::decoded_insn &d, insn_op_e op)
+{
+    using namespace llvm;
+    const char *const mn = insn_table[op].name;
+    if(cur_vtype == riscv_arch::vtype_unknown){
+        gen_vector_exec(d, op, false);
+        return false;
+    }
+    unsigned int eew;
+    bool is_load, is_strided;
+    get_vector_mem(op, eew, is_load, is_strided);
+    eew *= 8;
+    const unsigned int sew = 8 << bit_sub<3, 3>(cur_vtype);
+    const unsigned int lmul = 1 << bit_sub<0, 3>(cur_vtype);
+    const unsigned int num = get_vlmax(cur_vtype);
+    riscv_insn_assert(cur_vtype != riscv_arch::vtype_vill && eew == sew); //EEW other than SEW is not supported
+    const unsigned int vd = d.rd;
+    Value *const addr = gen_get_reg(get_reg_id(d.rs1), mn);
+    Value *const stride = is_strided ? gen_get_reg(get_reg_id(d.rs2), mn) : JCPU_NULLPTR;
+    Value *const vl = gen_get_reg(riscv_arch::REG_VL, mn);
+    if(is_load){
+        Value *const old = gen_get_vreg(vd, lmul, sew);
+        Value *const val = gen_vector_load(addr, stride, VectorType::get(IntegerType::get(*context, sew), num), vl);
+        gen_set_vreg(vd, lmul, builder->CreateSelect(gen_vl_mask(num), val, old, mn));
+    }
+    else{
+        gen_vector_store(addr, stride, gen_get_vreg(vd, lmul, sew), vl);
+    }
+    return false;
+}
+
+llvm::Value *riscv_vm::gen_get_vreg(unsigned int vreg, unsigned int lmul, unsigned int sew){
+    using namespace llvm;
+    static const char *const mn = "vreg";
+    const unsigned int words = riscv_arch::vlen_bits / 64;
+    riscv_insn_assert(vreg % lmul == 0); //register groups must be aligned
+    Value *v = UndefValue::get(VectorType::get(builder->getInt64Ty(), words * lmul));
+    for(unsigned int i = 0; i < words * lmul; ++i){
+        const riscv_arch::reg_e reg = static_cast<riscv_arch::reg_e>(riscv_arch::REG_VR + vreg * words + i);
+        v = builder->CreateInsertElement(v, gen_get_reg(reg, mn), ConstantInt::get(builder->getInt32Ty(), i), mn);
+    }
+    return builder->CreateBitCast(v, VectorType::get(IntegerType::get(*context, sew), riscv_arch::vlen_bits * lmul / sew), mn);
+}
+
+void riscv_vm::gen_set_vreg(unsigned int vreg, unsigned int lmul, llvm::Value *val){
+    using namespace llvm;
+    static const char *const mn = "vreg";
+    const unsigned int words = riscv_arch::vlen_bits / 64;
+    riscv_insn_assert(vreg % lmul == 0);
+    Value *const v = builder->CreateBitCast(val, VectorType::get(builder->getInt64Ty(), words * lmul), mn);
+    for(unsigned int i = 0; i < words * lmul; ++i){
+        const riscv_arch::reg_e reg = static_cast<riscv_arch::reg_e>(riscv_arch::REG_VR + vreg * words + i);
+        gen_set_reg(reg, builder->CreateExtractElement(v, ConstantInt::get(builder->getInt32Ty(), i), mn));
+    }
+}
+
+llvm::Value *riscv_vm::gen_vl_mask(unsigned int num){
+    using namespace llvm;
+    std::vector<Constant *> lanes;
+    for(unsigned int i = 0; i < num; ++i){
+        lanes.push_back(ConstantInt::get(builder->getInt32Ty(), i));
+    }
+    Value *const vl = builder->CreateTrunc(gen_get_reg(riscv_arch::REG_VL, "vl"), builder->getInt32Ty(), "vl"); //never exceeds num
+    return builder->CreateICmpULT(ConstantVector::get(lanes), gen_splat(vl, num), "vl");
+}
+
+llvm::Value *riscv_vm::gen_splat(llvm::Value *val, unsigned int num){
+    using namespace llvm;
+    VectorType *const type = VectorType::get(val->getType(), num);
+    Value *const v = builder->CreateInsertElement(UndefValue::get(type), val, ConstantInt::get(builder->getInt32Ty(), 0), "splat");
+    return builder->CreateShuffleVector(v, UndefValue::get(type), ConstantAggregateZero::get(VectorType::get(builder->getInt32Ty(), num)), "splat");
+}
+
+llvm::Value *riscv_vm::gen_vector_op(vector_op_e op, llvm::Value *vs2, llvm::Value *op1, llvm::Value *vd){
+    static const char *const mn = "vop";
+    switch(op){
+        case V_ADD:
+        case V_REDSUM: return builder->CreateAdd(vs2, op1, mn);
+        case V_SUB: return builder->CreateSub(vs2, op1, mn);
+        case V_RSUB: return builder->CreateSub(op1, vs2, mn);
+        case V_AND:
+        case V_REDAND: return builder->CreateAnd(vs2, op1, mn);
+        case V_OR:
+        case V_REDOR: return builder->CreateOr(vs2, op1, mn);
+        case V_XOR:
+        case V_REDXOR: return builder->CreateXor(vs2, op1, mn);
+        case V_MV: return op1;
+        case V_MUL: return builder->CreateMul(vs2, op1, mn);
+        case V_MACC: return builder->CreateAdd(builder->CreateMul(op1, vs2, mn), vd, mn);
+        default: jcpu_assert(!"Never comes here");
+    }
+    return JCPU_NULLPTR;
+}
+
+void riscv_vm::gen_vector_exec(const vm::decoded_insn &d, insn_op_e op, bool writes_rd){
+    using namespace llvm;
+    static const char *const mn = "vexec";
+    Value *const rs1 = gen_get_reg(get_reg_id(d.rs1), mn);
+    Value *const rs2 = gen_get_reg(get_reg_id(d.rs2), mn);
+    gen_flush_regs(riscv_arch::REG_VL, riscv_arch::NUM_REGS); //the helper works on the state
+    std::vector<Type *> types;
+    types.push_back(PointerType::getUnqual(builder->getInt8Ty()));
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt32Ty());
+    types.push_back(builder->getInt64Ty());
+    types.push_back(builder->getInt64Ty());
+    std::vector<Value *> args;
+    args.push_back(cur_state);
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), d.raw));
+    args.push_back(ConstantInt::get(builder->getInt32Ty(), op));
+    args.push_back(rs1);
+    args.push_back(rs2);
+    Value *const ret = builder->CreateCall(declare_host_func("jcpu_riscv_vector_exec", builder->getInt64Ty(), types,
+                reinterpret_cast<void *>(&jcpu_riscv_vector_exec)), args, mn);
+    if(writes_rd) gen_set_reg(get_reg_id(d.rd), ret);
+}
+
+//Interprets a vector instruction element by element on the state. Used when vtype is not known at translation time.
+//Returns the value for x[rd].
+extern "C" uint64_t jcpu_riscv_vector_exec(void *state, uint32_t insn, uint32_t insn_op, uint64_t rs1_val, uint64_t rs2_val){
+    target_ulong *const regs = static_cast<vm::cpu_state<riscv_arch> *>(state)->regs;
+    const target_ulong vtype = regs[riscv_arch::REG_VTYPE];
+    jcpu_assert(vtype != riscv_arch::vtype_vill);
+    const unsigned int sew = 1U << bit_sub<3, 3>(vtype); //in bytes
+    const unsigned int lmul = 1U << bit_sub<0, 3>(vtype);
+    const uint64_t vl = regs[riscv_arch::REG_VL];
+    const unsigned int vd = bit_sub<7, 5>(insn), vs1 = bit_sub<15, 5>(insn), vs2 = bit_sub<20, 5>(insn);
+    uint8_t *const vregs = reinterpret_cast<uint8_t *>(&regs[riscv_arch::REG_VR]);
+    const unsigned int vreg_bytes = riscv_arch::vlen_bits / 8;
+    if(insn_op >= OP_VLE8_V && insn_op <= OP_VSSE64_V){//the load and store rows are contiguous in the .def
+        unsigned int eew;
+        bool is_load, is_strided;
+        get_vector_mem(static_cast<insn_op_e>(insn_op), eew, is_load, is_strided);
+        jcpu_assert(eew == sew && vd % lmul == 0);
+        const uint64_t stride = is_strided ? rs2_val : sew;
+        if(is_load) vm::jcpu_vector_load_slow(state, rs1_val, stride, sew, vl, vregs + vd * vreg_bytes, 0, 0);
+        else vm::jcpu_vector_store_slow(state, rs1_val, stride, sew, vl, vregs + vd * vreg_bytes, 0, 0);
+        return 0;
+    }
+    struct elem{
+        uint8_t *const base;
+        const unsigned int sew;
+        uint64_t get(unsigned int vreg, uint64_t i)const{
+            uint64_t v = 0;
+            std::memcpy(&v, base + vreg * (riscv_arch::vlen_bits / 8) + i * sew, sew);
+            return v;
+        }
+        void set(unsigned int vreg, uint64_t i, uint64_t v)const{
+            std::memcpy(base + vreg * (riscv_arch::vlen_bits / 8) + i * sew, &v, sew);
+        }
+    } const e = {vregs, sew};
+    vector_src_e src_kind;
+    const vector_op_e op = get_vector_op(static_cast<insn_op_e>(insn_op), src_kind);
+    switch(op){
+        case V_MV_X_S:
+            {
+                const unsigned int shift = 64 - sew * 8;
+                return static_cast<uint64_t>(static_cast<int64_t>(e.get(vs2, 0) << shift) >> shift);
+            }
+        case V_MV_S_X:
+            if(vl) e.set(vd, 0, rs1_val);
+            return 0;
+        case V_REDSUM:
+        case V_REDAND:
+        case V_REDOR:
+        case V_REDXOR:
+            jcpu_assert(vs2 % lmul == 0);
+            if(vl){
+                uint64_t acc = e.get(vs1, 0);
+                for(uint64_t i = 0; i < vl; ++i){
+                    const uint64_t v = e.get(vs2, i);
+                    acc = op == V_REDSUM ? acc + v : op == V_REDAND ? acc & v : op == V_REDOR ? acc | v : acc ^ v;
+                }
+                e.set(vd, 0, acc);
+            }
+            return 0;
+        default:
+            break;
+    }
+    const bool is_vv = src_kind == VSRC_V;
+    jcpu_assert(vd % lmul == 0 && vs2 % lmul == 0 && (!is_vv || vs1 % lmul == 0));
+    const uint64_t scalar = src_kind == VSRC_I ? sign_extend<5>(static_cast<uint64_t>(vs1)) : rs1_val;
+    for(uint64_t i = 0; i < vl; ++i){
+        const uint64_t a = e.get(vs2, i), b = is_vv ? e.get(vs1, i) : scalar, d = e.get(vd, i);
+        uint64_t r = 0;
+        switch(op){
+            case V_ADD: r = a + b; break;
+            case V_SUB: r = a - b; break;
+            case V_RSUB: r = b - a; break;
+            case V_AND: r = a & b; break;
+            case V_OR: r = a | b; break;
+            case V_XOR: r = a ^ b; break;
+            case V_MV: r = b; break;
+            case V_MUL: r = a * b; break;
+            case V_MACC: r = b * a + d; break;
+            default: jcpu_assert(!"Never comes here");
+        }
+        e.set(vd, i, r);
+    }
+    return 0;
+}
 
 
 const basic_block *riscv_vm::disas(virt_addr_t start_pc_, int max_insn, const break_point *const bp){
     const phys_addr_t start_pc(start_pc_);
     start_func(start_pc);
-    target_ulong pc;
+    target_ulong pc, last_pc = start_pc; //instructions are 2 or 4 bytes
     unsigned int num_insn = 0;
     if(max_insn < 0){
         bool done = false;
-        for(pc = start_pc; !done; pc += 4){
+        for(pc = start_pc; !done; pc += cur_insn_len){
             if(bp && bp->get_pc() == pc){
                 gen_set_reg(riscv_arch::REG_PNEXT_PC, gen_const(pc));
                 break;
             }
+            if(job.speculative && num_insn >= max_speculative_insn) throw vm::speculation_failed();
             int insn_depth = 0;
+            last_pc = pc;
             done = disas_insn(virt_addr_t(pc), &insn_depth);
             num_insn += insn_depth;
         }
@@ -573,7 +2159,7 @@ const basic_block *riscv_vm::disas(virt_addr_t start_pc_, int max_insn, const br
         int insn_depth = 0;
         const bool done = disas_insn(start_pc_, &insn_depth);
         num_insn += insn_depth;
-        pc = start_pc + (done ? 8 : 4);
+        pc = start_pc + cur_insn_len;
         if(done){
             gen_set_reg(riscv_arch::REG_PC, gen_get_reg(riscv_arch::REG_PNEXT_PC));
         }
@@ -582,36 +2168,45 @@ const basic_block *riscv_vm::disas(virt_addr_t start_pc_, int max_insn, const br
             gen_set_reg(riscv_arch::REG_PNEXT_PC, gen_const(pc));
         }
     }
+    gen_fold_fp_flags();
     llvm::Function *const f = end_func();
-    const phys_addr_t end_pc(pc - 4);
+    const phys_addr_t end_pc(last_pc);
     jcpu_assert(start_pc <= end_pc);
-    basic_block *const bb = new basic_block(start_pc, end_pc, f, ee, num_insn);
-    bb_man.add(bb);
+    const basic_block *const bb = bb_man.add(new basic_block(start_pc, end_pc, f, ee, num_insn));
 #if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 2
     dump_ir();
 #endif
+    if(pool && !job.speculative) pool->submit(job.successors);
     return bb;
 }
 
+void riscv_vm::translate_ahead(uint64_t pc, std::vector<uint64_t> &successors){
+    const virt_addr_t pc_v(pc);
+    bb_man.quiescent(bb_reader_id);
+    const bool cached = bb_man.find(code_v2p(pc_v)) != JCPU_NULLPTR;
+    bb_man.offline(bb_reader_id);
+    if(cached) return;
+    job.speculative = true;
+    try{
+        disas(pc_v, -1, JCPU_NULLPTR);
+        successors.swap(job.successors);
+    }
+    catch(const vm::speculation_failed &){
+        abort_func();
+    }
+    job.speculative = false;
+}
+
 void riscv_vm::start_func(phys_addr_t pc_p){
     char func_name[17];
     std::snprintf(func_name, sizeof(func_name), "%16llx", static_cast<unsigned long long>(pc_p));
-    std::vector<llvm::Type*> mainFuncTyArgs;
-    llvm::FunctionType* const mainFuncTy = llvm::FunctionType::get(
-            /* 戻り値の型 */ get_reg_type(),
-            /* 関数の引数 */ mainFuncTyArgs,
-            /* 可変引数か? */ false
-            );
-    llvm::Function *const func_main = llvm::Function::Create(
-            /* 関数の型 */ mainFuncTy,
-            /* Likage */ llvm::GlobalValue::ExternalLinkage,
-            /* 関数名 */ func_name, mod
-            );
-    func_main->setCallingConv(llvm::CallingConv::C);
+    llvm::Function *const func_main = create_bb_func(func_name);
     llvm::BasicBlock* bb = llvm::BasicBlock::Create(mod->getContext(), "",func_main,0);
     builder->SetInsertPoint(bb);
     cur_func = func_main;
     cur_bb = bb;
+    cur_vtype = riscv_arch::vtype_unknown;
+    fp_keep = JCPU_NULLPTR;
     gen_set_reg(riscv_arch::REG_PC, gen_get_reg(riscv_arch::REG_PNEXT_PC, "prologue"));
 #if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 1
     gen_set_reg(riscv_arch::REG_PNEXT_PC, gen_const(0xFFFFFFFF)); //poison value
@@ -620,19 +2215,37 @@ void riscv_vm::start_func(phys_addr_t pc_p){
 
 gdb::gdb_target_if::run_state_e riscv_vm::run(){
     virt_addr_t pc(get_reg_func(riscv_arch::REG_PC));
+    running = true;
     for(;;){
+        bb_man.quiescent(bb_reader_id); //no block of the previous iteration is used after this
+        bb_man.invalidate_written();
         const break_point *const nearest = bp_man.find_nearest(pc);
         if(nearest && nearest->get_pc() == pc){
+            running = false;
+            bb_man.offline(bb_reader_id);
             return RUN_STAT_BREAK;
         }
         const phys_addr_t pc_p = code_v2p(pc);
-        const basic_block *const bb = bb_man.exists_by_start_addr(pc_p) ? bb_man.find_by_start_addr(pc_p) : disas(pc, -1, nearest);
-        pc = bb->exec();
+        const basic_block *bb = bb_man.find(pc_p);
+        if(!bb) bb = disas(pc, -1, nearest);
+        pc = bb->exec(state);
 
 #if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 1
         dump_regs();
 #endif
         total_icount += bb->get_icount();
+        if(total_icount >= __atomic_load_n(&timer_deadline, __ATOMIC_ACQUIRE)) timer->update(get_hart_id());
+        if(__atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_RELAXED) & get_reg_func(riscv_arch::REG_MIE)) pc = check_interrupts(pc);
+        if(pending_requests){
+            set_reg_func(riscv_arch::REG_PC, pc);
+            service_requests();
+            pc = virt_addr_t(get_reg_func(riscv_arch::REG_PC));
+        }
+        if(total_icount >= icount_limit || exited){
+            running = false;
+            bb_man.offline(bb_reader_id);
+            return RUN_STAT_NORMAL;
+        }
     }
     jcpu_assert(!"Never comes here");
     return RUN_STAT_NORMAL;
@@ -640,17 +2253,21 @@ gdb::gdb_target_if::run_state_e riscv_vm::run(){
 
 gdb::gdb_target_if::run_state_e riscv_vm::step_exec(){
     virt_addr_t pc(get_reg_func(riscv_arch::REG_PC));
+    bb_man.invalidate_written();
+    if(total_icount >= __atomic_load_n(&timer_deadline, __ATOMIC_ACQUIRE)) timer->update(get_hart_id());
+    if(__atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_RELAXED) & get_reg_func(riscv_arch::REG_MIE)) pc = check_interrupts(pc);
 
     const break_point *const nearest = bp_man.find_nearest(pc);
     if(nearest && nearest->get_pc() == pc) return RUN_STAT_BREAK;
     const phys_addr_t pc_p = code_v2p(pc);
-    bb_man.invalidate(pc_p, pc_p + phys_addr_t(4));
+    bb_man.remove_blocks(pc_p, pc_p + phys_addr_t(4));
     const basic_block *const bb = bb_man.exists_by_start_addr(pc_p) ? bb_man.find_by_start_addr(pc_p) : disas(pc, 1, nearest);
-    pc = bb->exec();
+    pc = bb->exec(state);
 #if defined(JCPU_RISCV_DEBUG) && JCPU_RISCV_DEBUG > 1
     dump_regs();
 #endif
     total_icount += bb->get_icount();
+    if(pending_requests) service_requests(); //fence.i
     return RUN_STAT_NORMAL;
 }
 
@@ -665,6 +2282,38 @@ void riscv_vm::dump_regs()const{
         else if(i == riscv_arch::REG_PNEXT_PC){
             std::cout << "jump_to:";
         }
+        else if(i == riscv_arch::REG_MHARTID){
+            std::cout << "mhartid:";
+        }
+        else if(i == riscv_arch::REG_RESERVE_ADDR){
+            std::cout << "reserve_addr:";
+        }
+        else if(i == riscv_arch::REG_RESERVE_VAL){
+            std::cout << "reserve_val:";
+        }
+        else if(riscv_arch::REG_F00 <= i && i <= riscv_arch::REG_F31){
+            std::cout << "f[" << std::dec << std::setw(2) << std::setfill('0') << i - riscv_arch::REG_F00 << "]:";
+        }
+        else if(i == riscv_arch::REG_FCSR){
+            std::cout << "fcsr:";
+        }
+        else if(riscv_arch::REG_PRIV <= i && i <= riscv_arch::REG_STVAL){
+            static const char *const names[] = {
+                "priv", "mstatus", "medeleg", "mideleg", "mie", "mtvec", "mscratch", "mepc", "mcause", "mtval",
+                "stvec", "sscratch", "sepc", "scause", "stval"
+            };
+            std::cout << names[i - riscv_arch::REG_PRIV] << ':';
+        }
+        else if(i == riscv_arch::REG_VL){
+            std::cout << "vl:";
+        }
+        else if(i == riscv_arch::REG_VTYPE){
+            std::cout << "vtype:";
+        }
+        else if(i >= riscv_arch::REG_VR){
+            const unsigned int words = riscv_arch::vlen_bits / 64;
+            std::cout << "v[" << std::dec << std::setw(2) << std::setfill('0') << (i - riscv_arch::REG_VR) / words << "]." << (i - riscv_arch::REG_VR) % words << ":";
+        }
         else{assert(!"Unknown register");}
         std::cout << std::hex << std::setw(8) << std::setfill('0') << get_reg_func(i);
         if((i & 3) != 3) std::cout << "  ";
@@ -673,37 +2322,176 @@ void riscv_vm::dump_regs()const{
     std::cout << std::endl;
 }
 
+//irq_id is the bit of mip, 0 is the machine external interrupt for compatibility.
+//Can be called from any thread, the interrupt is taken at the end of the current block.
 void riscv_vm::interrupt(int irq_id, bool enable){
-    jcpu_assert(irq_id == 0);
-    irq_status = enable;
+    jcpu_assert(0 <= irq_id && irq_id < 64);
+    const uint64_t bit = static_cast<uint64_t>(1) << (irq_id == 0 ? riscv_arch::IRQ_MEI : irq_id);
+    if(enable) __atomic_fetch_or(&state.hdr.pending_irqs, bit, __ATOMIC_ACQ_REL);
+    else __atomic_fetch_and(&state.hdr.pending_irqs, ~bit, __ATOMIC_ACQ_REL);
+}
+
+void riscv_vm::advance_time(uint64_t icount){
+    if(timer) timer->advance(get_hart_id(), icount);
+}
+
+void riscv_vm::start_process(user_process *p){
+    process = p;
+    set_reg_func(riscv_arch::REG_PC, p->get_entry());
+    set_reg_func(riscv_arch::REG_PNEXT_PC, p->get_entry());
+    set_reg_func(riscv_arch::REG_SP, p->get_stack_ptr());
+    set_reg_func(riscv_arch::REG_PRIV, riscv_arch::PRIV_U);
 }
 
 void riscv_vm::reset(){
-    irq_status = false;
+    __atomic_store_n(&state.hdr.pending_irqs, 0, __ATOMIC_RELEASE);
 }
 
+void riscv_vm::take_snapshot(){
+    vm::jcpu_vm_base<riscv_arch>::take_snapshot();
+    snap_pending_irqs = __atomic_load_n(&state.hdr.pending_irqs, __ATOMIC_ACQUIRE);
+    snap_timer_deadline = __atomic_load_n(&timer_deadline, __ATOMIC_ACQUIRE);
+    if(timer) timer->take_snapshot();
+}
 
-riscv::riscv(const char *model) : jcpu(), vm(JCPU_NULLPTR){
+void riscv_vm::restore_snapshot(){
+    vm::jcpu_vm_base<riscv_arch>::restore_snapshot();
+    __atomic_store_n(&state.hdr.pending_irqs, snap_pending_irqs, __ATOMIC_RELEASE);
+    set_timer_deadline(snap_timer_deadline);
+    if(timer){
+        timer->restore_snapshot();
+        timer->update(get_hart_id()); //the deadline is the instruction count when mtip changes, which depends on mtime
+    }
+}
+
+
+riscv::riscv(const char *model) : jcpu(), vm(JCPU_NULLPTR), clint_dev(JCPU_NULLPTR), process(JCPU_NULLPTR), pool(JCPU_NULLPTR){
 }
 
 riscv::~riscv(){
-    delete vm;
+    delete pool;
+    for(std::vector<riscv_vm *>::iterator it = translators.begin(), it_end = translators.end(); it != it_end; ++it){
+        delete *it;
+    }
+    for(std::vector<riscv_vm *>::reverse_iterator it = harts.rbegin(), it_end = harts.rend(); it != it_end; ++it){
+        delete *it; //hart 0 owns the shared translation cache
+    }
+    delete clint_dev;
+    delete process;
 }
 
+//The machine software interrupt of hart 0 goes through msip of the CLINT, so that the guest sees and clears it there
 void riscv::interrupt(int irq_id, bool enable){
-    if(vm) vm->interrupt(irq_id, enable);
+    if(clint_dev && irq_id == riscv_arch::IRQ_MSI) clint_dev->set_msip(0, enable);
+    else if(vm) vm->interrupt(irq_id, enable);
 }
 
 void riscv::reset(bool reset_on){
-    if(vm) vm->reset();
+    for(std::vector<riscv_vm *>::iterator it = harts.begin(), it_end = harts.end(); it != it_end; ++it){
+        (*it)->reset();
+    }
 }
 
-void riscv::run(run_option_e opt){
+riscv_vm &riscv::get_vm(){
     if(!vm){
-        vm = new riscv_vm(*ext_ifs);
+        jcpu_ext_if *ifs = ext_ifs;
+        if(!process){//user programs see no device, and their heap may be where the CLINT is
+            clint_dev = new clint(*ext_ifs, harts, num_cores, timer_frequency);
+            ifs = clint_dev;
+        }
+        vm = new riscv_vm(*ifs, ram);
+        vm->set_clint(clint_dev);
+        vm->set_htif(htif_tohost, htif_fromhost);
+        if(reset_pc != ~static_cast<uint64_t>(0)) vm->set_pc(reset_pc);
         vm->reset();
+        harts.push_back(vm);
+        if(num_cores > 1 || num_translators > 0){
+            vm->get_bb_manager().set_shared();
+        }
+        if(num_cores > 1){
+            vm->set_parallel();
+        }
+        for(unsigned int i = 1; i < num_cores; ++i){
+            riscv_vm *const hart = new riscv_vm(*ifs, ram, i, &vm->get_bb_manager());
+            hart->set_clint(clint_dev);
+            hart->set_htif(htif_tohost, htif_fromhost);
+            if(reset_pc != ~static_cast<uint64_t>(0)) hart->set_pc(reset_pc);
+            hart->set_parallel();
+            hart->reset();
+            harts.push_back(hart);
+        }
+        if(num_translators > 0){
+            for(unsigned int i = 0; i < num_translators; ++i){
+                translators.push_back(new riscv_vm(*ifs, ram, 0, &vm->get_bb_manager()));
+                translators.back()->set_htif(htif_tohost, htif_fromhost); //the stores they translate depend on it
+                if(num_cores > 1) translators.back()->set_parallel();
+            }
+            pool = new vm::translator_pool<riscv_vm>(translators);
+            for(std::vector<riscv_vm *>::iterator it = harts.begin(), it_end = harts.end(); it != it_end; ++it){
+                (*it)->set_translator_pool(pool);
+            }
+        }
+    }
+    return *vm;
+}
+
+namespace {
+struct hart_runner{
+    riscv_vm *vm;
+    const std::vector<riscv_vm *> *harts;
+    pthread_barrier_t *barrier;
+    uint64_t quantum;
+    void run(){
+        for(uint64_t limit = quantum; ; limit += quantum){
+            vm->set_icount_limit(limit);
+            vm->run();
+            pthread_barrier_wait(barrier);
+            vm->advance_time(limit);
+            //all of the harts see the same state here, so they return together
+            for(size_t i = 0; i < harts->size(); ++i){
+                if((*harts)[i]->has_exited()) return;
+            }
+        }
+    }
+    static void *thread_main(void *arg){
+        static_cast<hart_runner *>(arg)->run();
+        return JCPU_NULLPTR;
     }
-    if(opt == RUN_OPTION_NORMAL){
+};
+} //end of unnamed namespace
+
+//hart 0 runs on the calling thread. They return when one of them exits, whose exit code is returned.
+int riscv::run_harts(){
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, JCPU_NULLPTR, harts.size());
+    std::vector<hart_runner> runners(harts.size());
+    for(size_t i = 0; i < harts.size(); ++i){
+        runners[i].vm = harts[i];
+        runners[i].harts = &harts;
+        runners[i].barrier = &barrier;
+        runners[i].quantum = sync_quantum;
+    }
+    for(size_t i = 1; i < harts.size(); ++i){
+        pthread_t thread;
+        const int result = pthread_create(&thread, JCPU_NULLPTR, &hart_runner::thread_main, &runners[i]);
+        jcpu_assert(result == 0);
+        pthread_detach(thread);
+    }
+    runners[0].run();
+    for(size_t i = 0; i < harts.size(); ++i){
+        if(harts[i]->has_exited()) return harts[i]->get_exit_code();
+    }
+    jcpu_assert(!"Never comes here");
+    return 0;
+}
+
+int riscv::run(run_option_e opt){
+    get_vm();
+    if(harts.size() > 1 || pool){
+        jcpu_assert(opt == RUN_OPTION_NORMAL); //gdbserver handles only one hart and no translator
+        return run_harts();
+    }
+    else if(opt == RUN_OPTION_NORMAL){
         vm->run();
     }
     else if(opt == RUN_OPTION_WATI_GDB){
@@ -713,10 +2501,45 @@ void riscv::run(run_option_e opt){
     else{
         jcpu_assert(!"Not supported option");
     }
+    return vm->get_exit_code();
+}
+
+int riscv::run_user(int argc, const char *const *argv, const char *const *envp){
+    jcpu_assert(!vm && num_cores == 1); //threads of the guest are not supported
+    process = new user_process(*ext_ifs);
+    process->load(argc, argv, envp);
+    get_vm().start_process(process);
+    while(!vm->has_exited()){
+        vm->run();
+    }
+    return vm->get_exit_code();
 }
 
 uint64_t riscv::get_total_insn_count()const{
-    return vm->get_total_insn_count();
+    uint64_t count = 0;
+    for(std::vector<riscv_vm *>::const_iterator it = harts.begin(), it_end = harts.end(); it != it_end; ++it){
+        count += (*it)->get_total_insn_count();
+    }
+    return count;
+}
+
+void riscv::snapshot(){
+    jcpu_assert(num_cores == 1);
+    get_vm().snapshot();
+}
+
+void riscv::restore(){
+    jcpu_assert(num_cores == 1);
+    get_vm().restore();
+}
+
+void riscv::start_mem_trace(const char *file_name){
+    jcpu_assert(num_cores == 1 && num_translators == 0);
+    get_vm().start_mem_trace(file_name);
+}
+
+void riscv::stop_mem_trace(){
+    if(vm) vm->stop_mem_trace();
 }
 
 
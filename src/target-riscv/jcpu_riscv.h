@@ -2,24 +2,40 @@
 #define JCPU_RISCV_H
 
 #include <stdint.h>
+#include <vector>
 #include "jcpu.h"
 #include "jcpu_internal.h"
 #include "jcpu_vm.h"
+#include "jcpu_translator_pool.h"
 
 namespace jcpu{
 namespace riscv{
 
 class riscv_vm;
+class clint;
+class user_process;
 
 class riscv : public jcpu{
-    riscv_vm *vm;
+    riscv_vm *vm; //hart 0
+    clint *clint_dev; //decorates ext_ifs for the harts, NULL in user mode
+    user_process *process; //user mode if not NULL
+    std::vector<riscv_vm *> harts; //harts[0] is vm
+    std::vector<riscv_vm *> translators; //used only to translate ahead
+    vm::translator_pool<riscv_vm> *pool;
+    riscv_vm &get_vm();
+    int run_harts();
     public:
     explicit riscv(const char *);
     ~riscv();
     virtual void interrupt(int, bool) JCPU_OVERRIDE;
     virtual void reset(bool)JCPU_OVERRIDE;
-    virtual void run(run_option_e)JCPU_OVERRIDE;
+    virtual int run(run_option_e)JCPU_OVERRIDE;
+    virtual int run_user(int argc, const char *const *argv, const char *const *envp) JCPU_OVERRIDE;
     virtual uint64_t get_total_insn_count()const JCPU_OVERRIDE;
+    virtual void snapshot() JCPU_OVERRIDE;
+    virtual void restore() JCPU_OVERRIDE;
+    virtual void start_mem_trace(const char *) JCPU_OVERRIDE;
+    virtual void stop_mem_trace() JCPU_OVERRIDE;
 };
 
 } //end of namespace riscv
@@ -0,0 +1,451 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <algorithm>
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "jcpu_memory.h"
+#include "jcpu_internal.h"
+#include "jcpu_riscv_user.h"
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+namespace jcpu{
+namespace riscv{
+
+namespace {
+
+//The generic numbers, which RISC-V Linux uses
+enum syscall_e{
+    SYSCALL_GETCWD = 17, SYSCALL_IOCTL = 29, SYSCALL_FACCESSAT = 48, SYSCALL_OPENAT = 56, SYSCALL_CLOSE = 57,
+    SYSCALL_LSEEK = 62, SYSCALL_READ = 63, SYSCALL_WRITE = 64, SYSCALL_READV = 65, SYSCALL_WRITEV = 66,
+    SYSCALL_PREAD64 = 67, SYSCALL_PWRITE64 = 68, SYSCALL_NEWFSTATAT = 79, SYSCALL_FSTAT = 80,
+    SYSCALL_EXIT = 93, SYSCALL_EXIT_GROUP = 94, SYSCALL_SET_TID_ADDRESS = 96, SYSCALL_SET_ROBUST_LIST = 99,
+    SYSCALL_CLOCK_GETTIME = 113, SYSCALL_RT_SIGACTION = 134, SYSCALL_RT_SIGPROCMASK = 135, SYSCALL_UNAME = 160,
+    SYSCALL_GETTIMEOFDAY = 169, SYSCALL_GETPID = 172, SYSCALL_GETUID = 174, SYSCALL_GETEUID = 175,
+    SYSCALL_GETGID = 176, SYSCALL_GETEGID = 177, SYSCALL_GETTID = 178, SYSCALL_BRK = 214, SYSCALL_MUNMAP = 215,
+    SYSCALL_MMAP = 222, SYSCALL_MPROTECT = 226, SYSCALL_MADVISE = 233, SYSCALL_PRLIMIT64 = 261, SYSCALL_GETRANDOM = 278
+};
+
+enum guest_mmap_flag_e{
+    GUEST_MAP_FIXED = 0x10, GUEST_MAP_ANONYMOUS = 0x20
+};
+
+const uint64_t page_size = sparse_memory::page_size;
+
+uint64_t page_round(uint64_t v){
+    return (v + page_size - 1) & ~(page_size - 1);
+}
+
+int64_t host_result(int64_t result){
+    return result < 0 ? -static_cast<int64_t>(errno) : result;
+}
+
+//The guest is little endian whatever the host is
+void put_le(uint8_t *buf, size_t offset, uint64_t val, unsigned int size){
+    for(unsigned int i = 0; i < size; ++i) buf[offset + i] = static_cast<uint8_t>(val >> (i * 8));
+}
+
+uint64_t get_le(const uint8_t *buf, size_t offset){
+    uint64_t val = 0;
+    for(unsigned int i = 0; i < 8; ++i) val |= static_cast<uint64_t>(buf[offset + i]) << (i * 8);
+    return val;
+}
+
+} //end of unnamed namespace
+
+const uint64_t user_process::stack_top;
+const uint64_t user_process::stack_size;
+
+user_process::user_process(jcpu_ext_if &mem) : mem(mem), entry(0), stack_ptr(0), brk_start(0), brk_cur(0), brk_high(0),
+    mmap_top(stack_top - stack_size - page_size), random_state(0x2545F4914F6CDD1DULL), exited(false), exit_code(0)
+{
+}
+
+bool user_process::host_iovecs(uint64_t addr, uint64_t len, std::vector<iovec> &iov)const{
+    while(len > 0){
+        const uint64_t n = std::min(len, page_size - (addr & (page_size - 1)));
+        uint8_t *const host = mem.get_dmi_ptr(addr);
+        if(!host) return false;
+        if(!iov.empty() && static_cast<uint8_t *>(iov.back().iov_base) + iov.back().iov_len == host){
+            iov.back().iov_len += n; //pages which happen to be contiguous on the host
+        }
+        else{
+            iovec v;
+            v.iov_base = host;
+            v.iov_len = n;
+            iov.push_back(v);
+        }
+        addr += n;
+        len -= n;
+    }
+    return true;
+}
+
+void user_process::copy_to_guest(uint64_t addr, const void *src, uint64_t len){
+    const uint8_t *p = static_cast<const uint8_t *>(src);
+    while(len > 0){
+        const uint64_t n = std::min(len, page_size - (addr & (page_size - 1)));
+        if(uint8_t *const host = mem.get_dmi_ptr(addr)) std::memcpy(host, p, n);
+        else mem.mem_write_block_dbg(addr, p, n);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void user_process::copy_from_guest(uint64_t addr, void *dst, uint64_t len){
+    uint8_t *p = static_cast<uint8_t *>(dst);
+    while(len > 0){
+        const uint64_t n = std::min(len, page_size - (addr & (page_size - 1)));
+        if(const uint8_t *const host = mem.get_dmi_ptr(addr)) std::memcpy(p, host, n);
+        else mem.mem_read_block_dbg(addr, p, n);
+        addr += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void user_process::zero_guest(uint64_t addr, uint64_t len){
+    static const uint8_t zeros[page_size] = {0};
+    while(len > 0){
+        const uint64_t n = std::min(len, page_size - (addr & (page_size - 1)));
+        if(uint8_t *const host = mem.get_dmi_ptr(addr)) std::memset(host, 0, n);
+        else mem.mem_write_block_dbg(addr, zeros, n);
+        addr += n;
+        len -= n;
+    }
+}
+
+std::string user_process::read_string(uint64_t addr){
+    std::string str;
+    while(str.size() < PATH_MAX){
+        char chunk[64];
+        const uint64_t n = std::min<uint64_t>(sizeof(chunk), page_size - (addr & (page_size - 1)));
+        copy_from_guest(addr, chunk, n);
+        if(const void *const end = std::memchr(chunk, 0, n)){
+            str.append(chunk, static_cast<const char *>(end) - chunk);
+            break;
+        }
+        str.append(chunk, n);
+        addr += n;
+    }
+    return str;
+}
+
+void user_process::write_u64(uint64_t addr, uint64_t val){
+    uint8_t buf[8];
+    put_le(buf, 0, val, 8);
+    copy_to_guest(addr, buf, sizeof(buf));
+}
+
+void user_process::fill_random(uint64_t addr, uint64_t len){
+    std::vector<uint8_t> buf(len);
+    for(uint64_t i = 0; i < len; ++i){//xorshift64
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        buf[i] = static_cast<uint8_t>(random_state);
+    }
+    if(len > 0) copy_to_guest(addr, &buf[0], len);
+}
+
+int64_t user_process::transfer(int fd, uint64_t addr, uint64_t len, bool is_read, int64_t offset){
+    if(len == 0) return 0;
+    std::vector<iovec> iov;
+    if(!host_iovecs(addr, len, iov)){
+        std::vector<uint8_t> buf(len);
+        if(!is_read) copy_from_guest(addr, &buf[0], len);
+        const ssize_t result = offset < 0 ? (is_read ? ::read(fd, &buf[0], len) : ::write(fd, &buf[0], len)) :
+            (is_read ? ::pread(fd, &buf[0], len, offset) : ::pwrite(fd, &buf[0], len, offset));
+        if(is_read && result > 0) copy_to_guest(addr, &buf[0], result);
+        return host_result(result);
+    }
+    int64_t total = 0;
+    for(size_t i = 0; i < iov.size(); i += IOV_MAX){
+        const int n = static_cast<int>(std::min<size_t>(iov.size() - i, IOV_MAX));
+        size_t requested = 0;
+        for(int j = 0; j < n; ++j) requested += iov[i + j].iov_len;
+        const ssize_t result = offset < 0 ? (is_read ? ::readv(fd, &iov[i], n) : ::writev(fd, &iov[i], n)) :
+            (is_read ? ::preadv(fd, &iov[i], n, offset + total) : ::pwritev(fd, &iov[i], n, offset + total));
+        if(result < 0) return total > 0 ? total : host_result(result);
+        total += result;
+        if(static_cast<size_t>(result) < requested) break;
+    }
+    return total;
+}
+
+//readv and writev with struct iovec of the guest
+int64_t user_process::transfer_vec(int fd, uint64_t guest_iov, uint64_t count, bool is_read){
+    if(count > IOV_MAX) return -EINVAL;
+    int64_t total = 0;
+    for(uint64_t i = 0; i < count; ++i){
+        uint8_t entry_buf[16];
+        copy_from_guest(guest_iov + i * 16, entry_buf, sizeof(entry_buf));
+        const uint64_t len = get_le(entry_buf, 8);
+        const int64_t result = transfer(fd, get_le(entry_buf, 0), len, is_read);
+        if(result < 0) return total > 0 ? total : result;
+        total += result;
+        if(static_cast<uint64_t>(result) < len) break;
+    }
+    return total;
+}
+
+//struct stat of the generic Linux ABI
+void user_process::put_stat(uint64_t addr, const struct stat &st){
+    uint8_t buf[128] = {0};
+    put_le(buf, 0, st.st_dev, 8);
+    put_le(buf, 8, st.st_ino, 8);
+    put_le(buf, 16, st.st_mode, 4);
+    put_le(buf, 20, st.st_nlink, 4);
+    put_le(buf, 24, st.st_uid, 4);
+    put_le(buf, 28, st.st_gid, 4);
+    put_le(buf, 32, st.st_rdev, 8);
+    put_le(buf, 48, st.st_size, 8);
+    put_le(buf, 56, st.st_blksize, 4);
+    put_le(buf, 64, st.st_blocks, 8);
+    put_le(buf, 72, st.st_atim.tv_sec, 8);
+    put_le(buf, 80, st.st_atim.tv_nsec, 8);
+    put_le(buf, 88, st.st_mtim.tv_sec, 8);
+    put_le(buf, 96, st.st_mtim.tv_nsec, 8);
+    put_le(buf, 104, st.st_ctim.tv_sec, 8);
+    put_le(buf, 112, st.st_ctim.tv_nsec, 8);
+    copy_to_guest(addr, buf, sizeof(buf));
+}
+
+int64_t user_process::sys_brk(uint64_t addr){
+    if(brk_start <= addr && addr <= mmap_top){
+        if(addr > brk_cur && brk_cur < brk_high) zero_guest(brk_cur, std::min(addr, brk_high) - brk_cur);
+        brk_cur = addr;
+        brk_high = std::max(brk_high, addr);
+    }
+    return brk_cur; //the old one if it fails
+}
+
+//munmap does not give the memory back, so the pages below mmap_top were never used and are still zero
+int64_t user_process::sys_mmap(uint64_t addr, uint64_t len, int flags, int fd, int64_t offset){
+    const uint64_t size = page_round(len);
+    uint64_t start;
+    if(flags & GUEST_MAP_FIXED){
+        start = addr;
+        zero_guest(start, size);
+    }
+    else{
+        if(len == 0 || size > mmap_top - brk_high) return -ENOMEM;
+        mmap_top -= size;
+        start = mmap_top;
+    }
+    if(!(flags & GUEST_MAP_ANONYMOUS)){
+        const int64_t result = transfer(fd, start, len, true, offset);
+        if(result < 0) return result;
+    }
+    return static_cast<int64_t>(start);
+}
+
+void user_process::load(int argc, const char *const *argv, const char *const *envp){
+    jcpu_assert(argc > 0);
+    std::FILE *const fp = std::fopen(argv[0], "rb");
+    if(!fp){
+        std::cerr << "Failed to open " << argv[0] << std::endl;
+        jcpu_assert(fp);
+    }
+    std::vector<uint8_t> image;
+    uint8_t chunk[65536];
+    for(size_t n; (n = std::fread(chunk, 1, sizeof(chunk), fp)) > 0; ) image.insert(image.end(), chunk, chunk + n);
+    std::fclose(fp);
+
+    Elf64_Ehdr ehdr;
+    const bool is_riscv64 = image.size() >= sizeof(ehdr) && std::memcmp(&image[0], ELFMAG, SELFMAG) == 0 &&
+        image[EI_CLASS] == ELFCLASS64 && image[EI_DATA] == ELFDATA2LSB;
+    if(is_riscv64) std::memcpy(&ehdr, &image[0], sizeof(ehdr));
+    if(!is_riscv64 || ehdr.e_machine != EM_RISCV){
+        std::cerr << argv[0] << " is not a 64 bit RISC-V ELF file" << std::endl;
+        jcpu_assert(!"Not a 64 bit RISC-V ELF file");
+    }
+    jcpu_assert(ehdr.e_type == ET_EXEC); //static PIE is not supported
+    uint64_t phdr_addr = 0, end = 0;
+    for(unsigned int i = 0; i < ehdr.e_phnum; ++i){
+        Elf64_Phdr phdr;
+        const uint64_t phdr_offset = ehdr.e_phoff + static_cast<uint64_t>(i) * ehdr.e_phentsize;
+        jcpu_assert(phdr_offset + sizeof(phdr) <= image.size());
+        std::memcpy(&phdr, &image[phdr_offset], sizeof(phdr));
+        jcpu_assert(phdr.p_type != PT_INTERP); //dynamically linked
+        if(phdr.p_type != PT_LOAD) continue;
+        jcpu_assert(phdr.p_offset + phdr.p_filesz <= image.size() && phdr.p_filesz <= phdr.p_memsz);
+        if(phdr.p_filesz > 0) copy_to_guest(phdr.p_vaddr, &image[phdr.p_offset], phdr.p_filesz);
+        zero_guest(phdr.p_vaddr + phdr.p_filesz, phdr.p_memsz - phdr.p_filesz);
+        if(phdr.p_offset <= ehdr.e_phoff && ehdr.e_phoff < phdr.p_offset + phdr.p_filesz){
+            phdr_addr = phdr.p_vaddr + ehdr.e_phoff - phdr.p_offset; //for the TLS of static glibc
+        }
+        end = std::max(end, phdr.p_vaddr + phdr.p_memsz);
+    }
+    entry = ehdr.e_entry;
+    brk_start = brk_cur = brk_high = page_round(end);
+
+    //Strings are at the top of the stack, then argc, argv, envp and the auxiliary vector from sp
+    uint64_t sp = stack_top;
+    std::vector<uint64_t> words;
+    words.push_back(argc);
+    for(int i = 0; i < argc; ++i){
+        const size_t len = std::strlen(argv[i]) + 1;
+        sp -= len;
+        copy_to_guest(sp, argv[i], len);
+        words.push_back(sp);
+    }
+    words.push_back(0);
+    for(const char *const *env = envp; env && *env; ++env){
+        const size_t len = std::strlen(*env) + 1;
+        sp -= len;
+        copy_to_guest(sp, *env, len);
+        words.push_back(sp);
+    }
+    words.push_back(0);
+    sp -= 16;
+    fill_random(sp, 16);
+    const uint64_t hwcap = (1U << ('I' - 'A')) | (1U << ('M' - 'A')) | (1U << ('A' - 'A')) | (1U << ('F' - 'A')) |
+        (1U << ('D' - 'A')) | (1U << ('C' - 'A')) | (1U << ('V' - 'A'));
+    const uint64_t auxv[][2] = {
+        {AT_PHDR, phdr_addr}, {AT_PHENT, sizeof(Elf64_Phdr)}, {AT_PHNUM, ehdr.e_phnum}, {AT_PAGESZ, page_size},
+        {AT_ENTRY, entry}, {AT_UID, ::getuid()}, {AT_EUID, ::geteuid()}, {AT_GID, ::getgid()}, {AT_EGID, ::getegid()},
+        {AT_HWCAP, hwcap}, {AT_CLKTCK, 100}, {AT_SECURE, 0}, {AT_RANDOM, sp}, {AT_NULL, 0}
+    };
+    for(size_t i = 0; i < sizeof(auxv) / sizeof(auxv[0]); ++i){
+        words.push_back(auxv[i][0]);
+        words.push_back(auxv[i][1]);
+    }
+    sp = (sp - words.size() * 8) & ~static_cast<uint64_t>(15);
+    std::vector<uint8_t> buf(words.size() * 8);
+    for(size_t i = 0; i < words.size(); ++i) put_le(&buf[0], i * 8, words[i], 8);
+    copy_to_guest(sp, &buf[0], buf.size());
+    stack_ptr = sp;
+}
+
+uint64_t user_process::syscall(uint64_t num, const uint64_t args[6]){
+    const int fd = static_cast<int>(args[0]);
+    int64_t result = 0;
+    switch(num){
+        case SYSCALL_READ: result = transfer(fd, args[1], args[2], true); break;
+        case SYSCALL_WRITE: result = transfer(fd, args[1], args[2], false); break;
+        case SYSCALL_PREAD64: result = transfer(fd, args[1], args[2], true, static_cast<int64_t>(args[3])); break;
+        case SYSCALL_PWRITE64: result = transfer(fd, args[1], args[2], false, static_cast<int64_t>(args[3])); break;
+        case SYSCALL_READV: result = transfer_vec(fd, args[1], args[2], true); break;
+        case SYSCALL_WRITEV: result = transfer_vec(fd, args[1], args[2], false); break;
+        //open flags and AT_ constants of the generic ABI are those of the host
+        case SYSCALL_OPENAT:
+            result = host_result(::openat(fd, read_string(args[1]).c_str(), static_cast<int>(args[2]), static_cast<mode_t>(args[3])));
+            break;
+        case SYSCALL_CLOSE: result = fd <= 2 ? 0 : host_result(::close(fd)); break; //the standard streams stay open for the host
+        case SYSCALL_LSEEK: result = host_result(::lseek(fd, static_cast<off_t>(args[1]), static_cast<int>(args[2]))); break;
+        case SYSCALL_FACCESSAT: result = host_result(::faccessat(fd, read_string(args[1]).c_str(), static_cast<int>(args[2]), 0)); break;
+        case SYSCALL_FSTAT:
+        case SYSCALL_NEWFSTATAT:
+            {
+                struct stat st;
+                const int r = num == SYSCALL_FSTAT ? ::fstat(fd, &st) : ::fstatat(fd, read_string(args[1]).c_str(), &st, static_cast<int>(args[3]));
+                result = host_result(r);
+                if(r == 0) put_stat(num == SYSCALL_FSTAT ? args[1] : args[2], st);
+            }
+            break;
+        case SYSCALL_GETCWD:
+            {
+                char buf[PATH_MAX];
+                if(!::getcwd(buf, sizeof(buf))){
+                    result = -errno;
+                    break;
+                }
+                const size_t len = std::strlen(buf) + 1;
+                if(len > args[1]){
+                    result = -ERANGE;
+                    break;
+                }
+                copy_to_guest(args[0], buf, len);
+                result = len;
+            }
+            break;
+        case SYSCALL_IOCTL: result = -ENOTTY; break; //no terminal for the guest, so its stdout is fully buffered
+        case SYSCALL_CLOCK_GETTIME:
+            {
+                timespec ts;
+                result = host_result(::clock_gettime(static_cast<clockid_t>(args[0]), &ts));
+                if(result == 0){
+                    write_u64(args[1], ts.tv_sec);
+                    write_u64(args[1] + 8, ts.tv_nsec);
+                }
+            }
+            break;
+        case SYSCALL_GETTIMEOFDAY:
+            if(args[0]){
+                timeval tv;
+                ::gettimeofday(&tv, JCPU_NULLPTR);
+                write_u64(args[0], tv.tv_sec);
+                write_u64(args[0] + 8, tv.tv_usec);
+            }
+            break;
+        case SYSCALL_UNAME:
+            {
+                static const char *const fields[] = {"Linux", "jcpu", "5.15.0", "#1", "riscv64", ""};
+                char buf[6 * 65] = {0};
+                for(unsigned int i = 0; i < 6; ++i) std::strcpy(buf + i * 65, fields[i]);
+                copy_to_guest(args[0], buf, sizeof(buf));
+            }
+            break;
+        case SYSCALL_BRK: result = sys_brk(args[0]); break;
+        case SYSCALL_MMAP: result = sys_mmap(args[0], args[1], static_cast<int>(args[3]), static_cast<int>(args[4]), static_cast<int64_t>(args[5])); break;
+        case SYSCALL_MUNMAP:
+        case SYSCALL_MPROTECT: //every page is readable, writable and executable
+        case SYSCALL_MADVISE:
+        case SYSCALL_SET_ROBUST_LIST:
+            break;
+        case SYSCALL_RT_SIGACTION: //signals are never delivered
+            if(args[2]) zero_guest(args[2], 24);
+            break;
+        case SYSCALL_RT_SIGPROCMASK:
+            if(args[2]) zero_guest(args[2], std::min<uint64_t>(args[3], 128));
+            break;
+        case SYSCALL_PRLIMIT64:
+            if(args[3]){
+                rlimit rl;
+                result = host_result(::getrlimit(static_cast<int>(args[1]), &rl));
+                if(args[1] == RLIMIT_STACK) rl.rlim_cur = stack_size;
+                if(result == 0){
+                    write_u64(args[3], rl.rlim_cur);
+                    write_u64(args[3] + 8, rl.rlim_max);
+                }
+            }
+            break;
+        case SYSCALL_GETRANDOM:
+            fill_random(args[0], args[1]);
+            result = args[1];
+            break;
+        case SYSCALL_SET_TID_ADDRESS:
+        case SYSCALL_GETPID:
+        case SYSCALL_GETTID:
+            result = ::getpid();
+            break;
+        case SYSCALL_GETUID: result = ::getuid(); break;
+        case SYSCALL_GETEUID: result = ::geteuid(); break;
+        case SYSCALL_GETGID: result = ::getgid(); break;
+        case SYSCALL_GETEGID: result = ::getegid(); break;
+        case SYSCALL_EXIT:
+        case SYSCALL_EXIT_GROUP:
+            exited = true;
+            exit_code = static_cast<int>(args[0] & 0xFF);
+            break;
+        default:
+            std::cerr << "Unsupported system call " << std::dec << num << std::endl;
+            result = -ENOSYS;
+    }
+    return static_cast<uint64_t>(result);
+}
+
+} //end of namespace riscv
+} //end of namespace jcpu
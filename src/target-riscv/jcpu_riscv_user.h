@@ -0,0 +1,55 @@
+#ifndef JCPU_RISCV_USER_H
+#define JCPU_RISCV_USER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "jcpu.h"
+
+namespace jcpu{
+namespace riscv{
+
+//A statically linked RISC-V Linux program, whose system calls are done by the host.
+//Guest buffers are given to the host in place when jcpu_ext_if::get_dmi_ptr() returns them, otherwise they are copied.
+//File descriptors of the guest are those of the host.
+class user_process{
+    jcpu_ext_if &mem;
+    uint64_t entry, stack_ptr;
+    uint64_t brk_start, brk_cur;
+    uint64_t brk_high; //memory above the highest brk so far is still zero
+    uint64_t mmap_top; //mappings are allocated downward from here
+    uint64_t random_state; //for AT_RANDOM and getrandom, fixed so that runs are deterministic
+    bool exited;
+    int exit_code;
+    bool host_iovecs(uint64_t addr, uint64_t len, std::vector<iovec> &iov)const; //false if a page is not plain RAM
+    void copy_to_guest(uint64_t addr, const void *src, uint64_t len);
+    void copy_from_guest(uint64_t addr, void *dst, uint64_t len);
+    void zero_guest(uint64_t addr, uint64_t len);
+    std::string read_string(uint64_t addr);
+    void write_u64(uint64_t addr, uint64_t val);
+    void fill_random(uint64_t addr, uint64_t len);
+    //read, write, pread (offset >= 0) between fd and [addr, addr + len). Returns the byte count or -errno.
+    int64_t transfer(int fd, uint64_t addr, uint64_t len, bool is_read, int64_t offset = -1);
+    int64_t transfer_vec(int fd, uint64_t guest_iov, uint64_t count, bool is_read);
+    void put_stat(uint64_t addr, const struct stat &st);
+    int64_t sys_brk(uint64_t addr);
+    int64_t sys_mmap(uint64_t addr, uint64_t len, int flags, int fd, int64_t offset);
+    public:
+    static const uint64_t stack_top = 0x3FFFFFF000ULL;
+    static const uint64_t stack_size = 8 << 20;
+    explicit user_process(jcpu_ext_if &mem);
+    //argv[0] is the file to load. The stack has argv, envp and the auxiliary vector as Linux makes it.
+    void load(int argc, const char *const *argv, const char *const *envp);
+    uint64_t get_entry()const{return entry;}
+    uint64_t get_stack_ptr()const{return stack_ptr;}
+    uint64_t syscall(uint64_t num, const uint64_t args[6]); //returns a0, negative errno if it fails
+    bool has_exited()const{return exited;}
+    int get_exit_code()const{return exit_code;}
+};
+
+} //end of namespace riscv
+} //end of namespace jcpu
+
+#endif
@@ -7,6 +7,7 @@
 #include <llvm/Support/Signals.h>// llvm::sys::PrintStackTraceOnErrorSignal()
 
 #include "jcpu.h"
+#include "jcpu_memory.h"
 #include "elfio/elfio_dump.hpp"
 
 #if __cplusplus >= 201103L
@@ -17,22 +18,20 @@
 #define RISCV_NULLPTR  NULL
 #endif
 
-uint32_t
-swap_endian(uint32_t v)
+uint64_t
+swap_endian(uint64_t v, unsigned int size)
 {
-    union {
-        uint8_t u[4];
-        uint32_t v;
-    } uni;
-    uni.v = v;
-    std::swap(uni.u[0], uni.u[3]);
-    std::swap(uni.u[1], uni.u[2]);
-    return uni.v;
+    uint64_t swapped = 0;
+    for(unsigned int i = 0; i < size; ++i){
+        swapped = (swapped << 8) | (v & 0xFF);
+        v >>= 8;
+    }
+    return swapped;
 }
 
 class dummy_mem : public jcpu::jcpu_ext_if{
-    const jcpu::jcpu &jcpu_if;
-    std::vector<uint32_t> tmp_mem;
+    jcpu::jcpu &jcpu_if;
+    jcpu::sparse_memory tmp_mem;
     bool prefix_need_to_show;
 
     virtual uint64_t mem_read(uint64_t addr, unsigned int size)RISCV_OVERRIDE;
@@ -43,8 +42,15 @@ class dummy_mem : public jcpu::jcpu_ext_if{
     virtual void mem_write_dbg(uint64_t addr, unsigned int size, uint64_t val)RISCV_OVERRIDE {
         mem_write(addr, size, val);
     }
+    virtual void mem_read_block_dbg(uint64_t addr, void *dst, size_t len)RISCV_OVERRIDE {
+        tmp_mem.read_block(addr, dst, len);
+    }
+    virtual void mem_write_block_dbg(uint64_t addr, const void *src, size_t len)RISCV_OVERRIDE {
+        tmp_mem.write_block(addr, src, len);
+    }
     public:
     dummy_mem(const char *fn, jcpu::jcpu &ifs);
+    jcpu::sparse_memory &get_ram(){return tmp_mem;}
 };
 
 dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
@@ -56,7 +62,6 @@ dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
         std::cout << "File " << fn << " is not found or it is not an ELF file\n" << std::endl;
         abort();
     }
-    tmp_mem.resize(0x20000 / sizeof(tmp_mem.front()));
 
     //for( auto s : reader.sections ) {
     for(std::vector<ELFIO::section*>::const_iterator it = reader.sections.begin(), it_end = reader.sections.end(); it != it_end; ++it){
@@ -68,15 +73,13 @@ dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
                 s->get_name().substr(0, 5) != ".data"
                 ) continue;
 
-        if(s->get_address() + s->get_size() >= tmp_mem.size())
-            tmp_mem.resize(s->get_address() + s->get_size());
         if(s->get_data()) {
             std::cout << "Loading " << s->get_name() << " from " << s->get_address() << " len:" << s->get_size() << std::endl;
-            std::memcpy(reinterpret_cast<char *>(tmp_mem.data()) + s->get_address(), s->get_data(), s->get_size());
+            tmp_mem.write_block(s->get_address(), s->get_data(), s->get_size());
         }
         else {
             std::cout << "Clearing " << s->get_name() << " from " << s->get_address() << " len:" << s->get_size() << std::endl;
-            std::memset(reinterpret_cast<char *>(tmp_mem.data()) + s->get_address(), s->get_size(), 0);
+            tmp_mem.fill(s->get_address(), 0, s->get_size());
         }
     }
     
@@ -94,65 +97,12 @@ dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
 }
 
 uint64_t dummy_mem::mem_read(uint64_t addr, unsigned int size){
-    if(addr >= tmp_mem.size() * sizeof(tmp_mem[0])){
-        std::cerr << "Address " << std::hex << addr << " is out of bound" << std::endl;
-        if(addr == 0xFFFFFFFF){//GDB?
-            return 0;
-        }
-        else{
-            abort();
-        }
-    }
-    uint64_t v = tmp_mem[addr / 4];
-    if(size == 1){
-        switch(addr % 4){
-            case 3: v >>= 24; break;
-            case 2: v >>= 16; break;
-            case 1: v >>=  8; break;
-            case 0: v >>=  0; break;
-        }
-        v &= 0xFF;
-        //std::cout << "Load 1byte from "<< addr << " " << std::hex << v << " ('" << (char)v << ")" << std::endl;
-    }
-    else if(size == 2){
-        if(addr % 2){std::cerr << "Not aligned" << std::endl; abort();}
-        switch(addr / 2){
-            case 0: v >>= 16; break;
-            case 2: v >>=  0; break;
-            default:abort();
-        }
-        v &= 0xFFFF;
-    }
-    else if(size == 4)
-    {
-        v = swap_endian(v);
-    }
-    else if(size == 8){
-        v = 0;
-        for(int i = 0; i < 8; ++i){
-            v <<= 8;
-            v |= mem_read(addr + i, 1);
-        }
-    }
-    return v;
+    return swap_endian(tmp_mem.read(addr, size), size);
 }
 
 void dummy_mem::mem_write(uint64_t addr, unsigned int size, uint64_t val){
-    if(addr < tmp_mem.size() * sizeof(tmp_mem[0])){
-        if(size == 4){
-            tmp_mem[addr / 4] = swap_endian(val);
-        }
-        else if(size == 1){
-            val <<= ((addr % 4)) * 8;
-            tmp_mem[addr / 4] &= 0xFFFFFFFF ^ (0xFF << ((addr % 4) * 8));
-            tmp_mem[addr / 4] |= val;
-        }
-        //else if(size == 2){
-        //}
-        else{
-            std::cerr << "Write for Address " << std::hex << addr << " with size:" << size << " is not supported" << std::endl;
-            abort();
-        }
+    if(addr < 0x60000000 || 0x60000010 <= addr){
+        tmp_mem.write(addr, size, swap_endian(val, size));
     }
     else if(addr == 0x60000004){
         //assert(be == 0x8);
@@ -167,6 +117,7 @@ void dummy_mem::mem_write(uint64_t addr, unsigned int size, uint64_t val){
         //assert(be == 0xF);
         //throw finish_ex();
         std::cerr << "Simulation done after " << std::dec << jcpu_if.get_total_insn_count() << " instruction" << std::endl;
+        jcpu_if.stop_mem_trace();
         exit(0);
     }
     else{
@@ -198,10 +149,15 @@ int main( int argc, char** argv )
 #endif
     dummy_mem mem(argv[1], *riscv);
     riscv->set_ext_interface(&mem);
+    riscv->set_ram(&mem.get_ram());
+    if(const char *trace_file = getenv("JCPU_MEM_TRACE")){
+        riscv->start_mem_trace(trace_file);
+    }
     riscv->reset(true);
     riscv->reset(false);
-    riscv->run(riscv->RUN_OPTION_NORMAL);
+    const int exit_code = riscv->run(riscv->RUN_OPTION_NORMAL); //by l.nop 1
     //riscv->run(riscv->RUN_OPTION_WATI_GDB);
+    riscv->stop_mem_trace();
 
-    return 0;
+    return exit_code;
 }
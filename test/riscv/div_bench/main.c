@@ -0,0 +1,42 @@
+//Integer division heavy kernel, to compare the time with and without the M extension.
+void my_putc(char c) {
+    *(volatile unsigned char *)(0x60000004) = c;
+}
+
+void my_puts(const char *s) {
+    for( ; *s != '\0'; ++s) my_putc(*s);
+}
+
+void my_put_hex(unsigned long v) {
+    int i;
+    for(i = 60; i >= 0; i -= 4) my_putc("0123456789abcdef"[(v >> i) & 0xF]);
+    my_putc('\n');
+}
+
+static unsigned long gcd(unsigned long a, unsigned long b) {
+    while(b != 0) {
+        const unsigned long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+int main(int argc, char*argv[])
+{
+    unsigned long sum = 0;
+    long s_sum = 0;
+    unsigned long i, j;
+    (void) argc;
+    (void) argv;
+    for(i = 1; i < 300; ++i) {
+        for(j = 1; j < 300; ++j) {
+            sum += gcd(i * 7919, j * 104729);
+            s_sum += (long)(i * j) / -(long)(j + 3) + (int)(i * 31) % (int)j;
+        }
+    }
+    my_puts("div_bench:");
+    my_put_hex(sum);
+    my_put_hex((unsigned long)s_sum);
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include <iostream>
+#include <string>
 #include <memory> //unique_ptr
+#include <sys/time.h>
 #include <llvm/Support/Debug.h> //EnableDebugBuffering
 #include <llvm/Support/raw_ostream.h> //outs()
 #include <llvm/Support/TargetSelect.h>
@@ -7,6 +9,7 @@
 #include <llvm/Support/Signals.h>// llvm::sys::PrintStackTraceOnErrorSignal()
 
 #include "jcpu.h"
+#include "jcpu_memory.h"
 #include "elfio/elfio_dump.hpp"
 
 #if __cplusplus >= 201103L
@@ -20,9 +23,11 @@
 
 
 class dummy_mem : public jcpu::jcpu_ext_if{
-    const jcpu::jcpu &jcpu_if;
-    std::vector<uint32_t> tmp_mem;
+    jcpu::jcpu &jcpu_if;
+    jcpu::sparse_memory tmp_mem;
     bool prefix_need_to_show;
+    timeval start_time;
+    uint64_t entry, tohost, fromhost; //tohost and fromhost are 0 if the program does not use the HTIF
 
     virtual uint64_t mem_read(uint64_t addr, unsigned int size)RISCV_OVERRIDE;
     virtual void mem_write(uint64_t addr, unsigned int size, uint64_t val)RISCV_OVERRIDE;
@@ -32,12 +37,38 @@ class dummy_mem : public jcpu::jcpu_ext_if{
     virtual void mem_write_dbg(uint64_t addr, unsigned int size, uint64_t val)RISCV_OVERRIDE {
         mem_write(addr, size, val);
     }
+    virtual void mem_read_block_dbg(uint64_t addr, void *dst, size_t len)RISCV_OVERRIDE {
+        tmp_mem.read_block(addr, dst, len);
+    }
+    virtual void mem_write_block_dbg(uint64_t addr, const void *src, size_t len)RISCV_OVERRIDE {
+        tmp_mem.write_block(addr, src, len);
+    }
+    virtual uint8_t *get_dmi_ptr(uint64_t addr)RISCV_OVERRIDE {
+        if(0x60000000 <= addr && addr < 0x60000010) return RISCV_NULLPTR; //I/O
+        return tmp_mem.get_page(addr) + (addr & (jcpu::sparse_memory::page_size - 1));
+    }
+    virtual const uint8_t *get_dmi_read_ptr(uint64_t addr)RISCV_OVERRIDE {
+        if(0x60000000 <= addr && addr < 0x60000010) return RISCV_NULLPTR; //I/O
+        const uint8_t *const page = tmp_mem.find_page(addr); //NULL if never written, then read through mem_read()
+        return page ? page + (addr & (jcpu::sparse_memory::page_size - 1)) : RISCV_NULLPTR;
+    }
     public:
     dummy_mem(const char *fn, jcpu::jcpu &ifs);
+    jcpu::sparse_memory &get_ram(){return tmp_mem;}
+    void start_timer(){gettimeofday(&start_time, RISCV_NULLPTR);}
+    double get_elapsed()const{
+        timeval now;
+        gettimeofday(&now, RISCV_NULLPTR);
+        return (now.tv_sec - start_time.tv_sec) + (now.tv_usec - start_time.tv_usec) * 1e-6;
+    }
+    uint64_t get_entry()const{return entry;}
+    uint64_t get_tohost()const{return tohost;}
+    uint64_t get_fromhost()const{return fromhost;}
 };
 
-dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
+dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs), entry(0), tohost(0), fromhost(0) {
     prefix_need_to_show = true;
+    if(!fn) return; //loaded by jcpu::run_user()
 
     ELFIO::elfio reader;
 
@@ -45,7 +76,6 @@ dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
         std::cout << "File " << fn << " is not found or it is not an ELF file\n" << std::endl;
         abort();
     }
-    tmp_mem.resize(0x20000 / sizeof(tmp_mem.front()));
 
     //for( auto s : reader.sections ) {
     for(std::vector<ELFIO::section*>::const_iterator it = reader.sections.begin(), it_end = reader.sections.end(); it != it_end; ++it){
@@ -60,18 +90,36 @@ dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
                 s->get_name() != ".jcr" &&
                 s->get_name() != ".sbss" &&
                 s->get_name() != ".sdata" &&
+                s->get_name() != ".srodata" &&
+                s->get_name() != ".tdata" &&
+                s->get_name() != ".tbss" &&
+                s->get_name() != ".tohost" &&
                 s->get_name() != ".data") continue;
-        if(s->get_address() + s->get_size() >= tmp_mem.size())
-            tmp_mem.resize(s->get_address() + s->get_size());
         if(s->get_data()) {
             std::cout << "Loading " << s->get_name() << " from " << s->get_address() << " len:" << s->get_size() << std::endl;
-            std::memcpy(reinterpret_cast<char *>(tmp_mem.data()) + s->get_address(), s->get_data(), s->get_size());
+            tmp_mem.write_block(s->get_address(), s->get_data(), s->get_size());
         }
         else {
             std::cout << "Clearing " << s->get_name() << " from " << s->get_address() << " len:" << s->get_size() << std::endl;
-            std::memset(reinterpret_cast<char *>(tmp_mem.data()) + s->get_address(), s->get_size(), 0);
+            tmp_mem.fill(s->get_address(), 0, s->get_size());
         }
     }
+    //riscv-tests and their benchmarks talk to the host through these symbols
+    for(std::vector<ELFIO::section*>::const_iterator it = reader.sections.begin(), it_end = reader.sections.end(); it != it_end; ++it){
+        if((*it)->get_name() != ".symtab") continue;
+        const ELFIO::symbol_section_accessor symbols(reader, *it);
+        for(ELFIO::Elf_Xword i = 0; i < symbols.get_symbols_num(); ++i){
+            std::string name;
+            ELFIO::Elf64_Addr value;
+            ELFIO::Elf_Xword size;
+            unsigned char bind, type, other;
+            ELFIO::Elf_Half section_index;
+            symbols.get_symbol(i, name, value, size, bind, type, section_index, other);
+            if(name == "tohost") tohost = value;
+            else if(name == "fromhost") fromhost = value;
+        }
+    }
+    entry = reader.get_entry();
     /*
     ELFIO::dump::header         ( std::cout, reader );
     ELFIO::dump::section_headers( std::cout, reader );
@@ -87,60 +135,12 @@ dummy_mem::dummy_mem(const char *fn, jcpu::jcpu &ifs) : jcpu_if(ifs) {
 }
 
 uint64_t dummy_mem::mem_read(uint64_t addr, unsigned int size){
-    if(addr >= tmp_mem.size() * sizeof(tmp_mem[0])){
-        std::cerr << "Address " << std::hex << addr << " is out of bound" << std::endl;
-        if(addr == 0xFFFFFFFF){//GDB?
-            return 0;
-        }
-        else{
-            abort();
-        }
-    }
-    uint64_t v = tmp_mem[addr / 4];
-    if(size == 1){
-        switch(addr % 4){
-            case 3: v >>= 24; break;
-            case 2: v >>= 16; break;
-            case 1: v >>=  8; break;
-            case 0: v >>=  0; break;
-        }
-        v &= 0xFF;
-        //std::cout << "Load 1byte from "<< addr << " " << std::hex << v << " ('" << (char)v << ")" << std::endl;
-    }
-    else if(size == 2){
-        if(addr % 2){std::cerr << "Not aligned" << std::endl; abort();}
-        switch(addr / 2){
-            case 0: v >>= 16; break;
-            case 2: v >>=  0; break;
-            default:abort();
-        }
-        v &= 0xFFFF;
-    }
-    else if(size == 8){
-        v = tmp_mem[addr / 4 + 1];
-        v <<= 32;
-        v = tmp_mem[addr / 4 + 0];
-    }
-    return v;
+    return tmp_mem.read(addr, size);
 }
 
 void dummy_mem::mem_write(uint64_t addr, unsigned int size, uint64_t val){
-    if(addr < tmp_mem.size() * sizeof(tmp_mem[0])){
-        if(size == 4){
-            tmp_mem[addr / 4] = val;
-        }
-        else if(size == 1){
-            val <<= ((addr % 4)) * 8;
-            tmp_mem[addr / 4] &= 0xFFFFFFFF ^ (0xFF << ((addr % 4) * 8));
-            tmp_mem[addr / 4] |= val;
-        }
-        else if(size == 2){
-            abort();
-        }
-        else if(size == 8){
-            tmp_mem[addr / 4 + 0] = val & 0xFFFFFFFF;
-            tmp_mem[addr / 4 + 1] = val >> 32;
-        }
+    if(addr < 0x60000000 || 0x60000010 <= addr){
+        tmp_mem.write(addr, size, val);
     }
     else if(addr == 0x60000004){
         //assert(be == 0x8);
@@ -154,7 +154,8 @@ void dummy_mem::mem_write(uint64_t addr, unsigned int size, uint64_t val){
     else if(addr == 0x60000008){
         //assert(be == 0xF);
         //throw finish_ex();
-        std::cerr << "Simulation done after " << std::dec << jcpu_if.get_total_insn_count() << " instruction" << std::endl;
+        std::cerr << "Simulation done after " << std::dec << jcpu_if.get_total_insn_count() << " instruction in " << get_elapsed() << " sec" << std::endl;
+        jcpu_if.stop_mem_trace();
         exit(0);
     }
     else{
@@ -166,10 +167,12 @@ void dummy_mem::mem_write(uint64_t addr, unsigned int size, uint64_t val){
 
 
 
-int main( int argc, char** argv )
+int main( int argc, char** argv, char **envp )
 {
-    if ( argc != 2 ) {
+    const bool user_mode = argc >= 3 && std::string(argv[1]) == "--user";
+    if ( argc != 2 && !user_mode ) {
         std::cerr << "Usage: main.x <file_name>\n";
+        std::cerr << "       main.x --user <statically linked Linux program> [args...]\n";
         return 1;
     }
 
@@ -185,12 +188,40 @@ int main( int argc, char** argv )
 #else
     std::auto_ptr<jcpu::jcpu> riscv(jcpu::jcpu::create("riscv", "reiscv"));
 #endif
-    dummy_mem mem(argv[1], *riscv);
+    dummy_mem mem(user_mode ? RISCV_NULLPTR : argv[1], *riscv);
     riscv->set_ext_interface(&mem);
+    riscv->set_ram(&mem.get_ram());
+    if(const char *num_cores = getenv("JCPU_NUM_CORES")){
+        const int n = atoi(num_cores);
+        if(n > 1) mem.get_ram().set_thread_safe();
+        riscv->set_num_cores(n);
+    }
+    if(const char *num_translators = getenv("JCPU_NUM_TRANSLATORS")){//compare the time with 0, 1, 2...
+        const int n = atoi(num_translators);
+        if(n > 0) mem.get_ram().set_thread_safe();
+        riscv->set_num_translators(n);
+    }
+    if(user_mode){
+        return riscv->run_user(argc - 2, argv + 2, envp);
+    }
+    if(mem.get_tohost()){
+        riscv->set_htif(mem.get_tohost(), mem.get_fromhost());
+        riscv->set_reset_pc(mem.get_entry());
+    }
+    if(const char *trace_file = getenv("JCPU_MEM_TRACE")){
+        riscv->start_mem_trace(trace_file);
+    }
     riscv->reset(true);
     riscv->reset(false);
-    riscv->run(riscv->RUN_OPTION_NORMAL);
+    mem.start_timer();
+    const int exit_code = riscv->run(riscv->RUN_OPTION_NORMAL); //by the HTIF
     //riscv->run(riscv->RUN_OPTION_WATI_GDB);
-
-    return 0;
+    const double elapsed = mem.get_elapsed();
+    const uint64_t icount = riscv->get_total_insn_count();
+    //build/Makefile riscv-tests greps this line
+    std::cerr << "HTIF exit(" << exit_code << ") after " << icount << " instructions in " << elapsed << " sec, "
+        << (elapsed > 0 ? icount / elapsed / 1e6 : 0) << " MIPS" << std::endl;
+    riscv->stop_mem_trace();
+
+    return exit_code;
 }
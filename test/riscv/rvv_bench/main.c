@@ -0,0 +1,59 @@
+//Integer saxpy and dot product by the vector kernels in vector.S, or by scalar loops in run_scalar.x to compare the time.
+void my_putc(char c) {
+    *(volatile unsigned char *)(0x60000004) = c;
+}
+
+void my_puts(const char *s) {
+    for( ; *s != '\0'; ++s) my_putc(*s);
+}
+
+void my_put_hex(unsigned long v) {
+    int i;
+    for(i = 60; i >= 0; i -= 4) my_putc("0123456789abcdef"[(v >> i) & 0xF]);
+    my_putc('\n');
+}
+
+#define N 1024
+#define REPEAT 500
+
+static unsigned int x[N], y[N];
+
+#ifdef USE_SCALAR
+static void saxpy(long n, unsigned int a, const unsigned int *x, unsigned int *y) {
+    long i;
+    for(i = 0; i < n; ++i) y[i] += a * x[i];
+}
+
+static unsigned int dot(long n, const unsigned int *x, const unsigned int *y) {
+    unsigned int sum = 0;
+    long i;
+    for(i = 0; i < n; ++i) sum += x[i] * y[i];
+    return sum;
+}
+#else
+void saxpy_vector(long n, unsigned int a, const unsigned int *x, unsigned int *y);
+unsigned int dot_vector(long n, const unsigned int *x, const unsigned int *y);
+#define saxpy saxpy_vector
+#define dot dot_vector
+#endif
+
+int main(int argc, char*argv[])
+{
+    unsigned long sum = 0, y_sum = 0;
+    long i, r;
+    (void) argc;
+    (void) argv;
+    for(i = 0; i < N; ++i) {
+        x[i] = i * 3 + 1;
+        y[i] = i ^ 0x55;
+    }
+    for(r = 0; r < REPEAT; ++r) {
+        saxpy(N - r % 7, r + 1, x, y); //lengths which are not multiples of the vector length
+        sum += dot(N - r % 5, x, y);
+    }
+    for(i = 0; i < N; ++i) y_sum += y[i];
+    my_puts("rvv_bench:");
+    my_put_hex(sum);
+    my_put_hex(y_sum);
+    return 0;
+}
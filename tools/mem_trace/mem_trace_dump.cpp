@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "jcpu_mem_trace.h"
+
+//Prints a trace written by jcpu::start_mem_trace() as text, one access per line.
+//  icount pc R/W size addr value
+//With -s, prints only the number of loads and stores.
+int main(int argc, char **argv){
+    const bool summary = argc == 3 && std::strcmp(argv[1], "-s") == 0;
+    if(argc != 2 && !summary){
+        std::cerr << "Usage: mem_trace_dump.x [-s] <trace_file>\n";
+        return 1;
+    }
+    std::FILE *const fp = std::fopen(argv[argc - 1], "rb");
+    if(!fp){
+        std::cerr << "Failed to open " << argv[argc - 1] << std::endl;
+        return 1;
+    }
+    char magic[jcpu::vm::mem_trace_codec::magic_len];
+    if(std::fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+            std::memcmp(magic, jcpu::vm::mem_trace_codec::get_magic(), sizeof(magic)) != 0){
+        std::cerr << argv[argc - 1] << " is not a memory trace" << std::endl;
+        return 1;
+    }
+
+    jcpu::vm::mem_trace_codec codec;
+    std::vector<uint8_t> buf(1 << 20);
+    size_t filled = 0;
+    uint64_t num_loads = 0, num_stores = 0;
+    bool eof = false;
+    std::cout << std::hex << std::setfill('0');
+    while(!eof || filled > 0){
+        if(!eof){
+            const size_t n = std::fread(&buf[filled], 1, buf.size() - filled, fp);
+            eof = n == 0;
+            filled += n;
+        }
+        const uint8_t *p = &buf[0];
+        const uint8_t *const end = p + filled;
+        jcpu::vm::mem_trace_record r;
+        for(const uint8_t *next; (next = codec.decode(p, end, r)); p = next){
+            if(r.is_write) ++num_stores;
+            else ++num_loads;
+            if(summary) continue;
+            std::cout << std::dec << r.icount << std::hex
+                << " " << std::setw(8) << r.pc
+                << (r.is_write ? " W " : " R ") << r.len
+                << " " << std::setw(8) << r.addr
+                << " " << std::setw(r.len * 2) << r.val << '\n';
+        }
+        const size_t consumed = p - &buf[0];
+        if(eof && consumed == 0 && filled > 0){
+            std::cerr << "Truncated record at the end of the trace" << std::endl;
+            break;
+        }
+        std::memmove(&buf[0], &buf[consumed], filled - consumed);
+        filled -= consumed;
+    }
+    std::fclose(fp);
+    std::cout << std::dec << "loads:" << num_loads << " stores:" << num_stores << std::endl;
+    return 0;
+}